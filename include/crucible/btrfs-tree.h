@@ -57,6 +57,7 @@ namespace crucible {
 		uint64_t file_extent_generation() const;
 		uint64_t file_extent_offset() const;
 		uint64_t file_extent_bytenr() const;
+		uint64_t file_extent_disk_bytes() const;
 		uint8_t file_extent_type() const;
 		btrfs_compression_type file_extent_compression() const;
 		/// @}
@@ -65,10 +66,14 @@ namespace crucible {
 		uint64_t extent_begin() const;
 		uint64_t extent_end() const;
 		uint64_t extent_generation() const;
+		uint64_t extent_flags() const;
 		/// @}
 
 		/// @{ Root items
 		uint64_t root_flags() const;
+		/// Empty strings for root items too old to have UUIDs
+		string root_uuid() const;
+		string root_parent_uuid() const;
 		/// @}
 
 		/// @{ Root backref items.
@@ -92,6 +97,22 @@ namespace crucible {
 		uint64_t m_scale_size = 0;
 		uint8_t m_type = 0;
 
+		/// Items per search in lower_bound, adjusted to the number
+		/// of non-matching items seen before a match
+		uint32_t m_search_items = 1;
+		const static uint32_t s_max_search_items = 64;
+
+		/// Matching items from the last batched search, by logical.
+		/// Every matching item from m_batch_begin up to the last item is here.
+		vector<pair<uint64_t, BtrfsTreeItem>> m_batch;
+		size_t m_batch_size = 0;
+		uint64_t m_batch_begin = 0;
+		bool m_batch_valid = false;
+		bool m_batch_eof = false;
+
+		void batch_clear();
+		BtrfsTreeItem lower_bound_batch(uint64_t logical);
+
 		uint64_t scale_logical(uint64_t logical) const;
 		uint64_t unscale_logical(uint64_t logical) const;
 		const static uint64_t s_max_logical = numeric_limits<uint64_t>::max();
@@ -130,6 +151,11 @@ namespace crucible {
 		/// Scale size (normally block size but must be set to 1 for fs trees)
 		uint64_t scale_size() const;
 		void scale_size(uint64_t);
+
+		/// Fill a search buffer of buf_size bytes in one ioctl and answer
+		/// consecutive lower_bound calls from it (0 searches every time)
+		size_t batch_size() const;
+		void batch_size(size_t buf_size);
 	};
 
 	class BtrfsTreeObjectFetcher : public BtrfsTreeFetcher {
@@ -188,6 +188,11 @@ enum btrfs_compression_type {
 	#define BTRFS_MAX_DEDUPE_LEN    (16 * 1024 * 1024)
 #endif
 
+#ifndef BTRFS_MAX_DEDUPE_DESTS
+	// The VFS rejects FIDEDUPERANGE arguments larger than one 4K page
+	#define BTRFS_MAX_DEDUPE_DESTS	((4096 - sizeof(btrfs_ioctl_same_args)) / sizeof(btrfs_ioctl_same_extent_info))
+#endif
+
 #ifndef BTRFS_IOC_TREE_SEARCH_V2
 
 	/*
@@ -17,6 +17,23 @@ namespace crucible {
 	// vector<uint8_t> is ~160x slower
 	// so we won't bother with unique_ptr because we can't do shared copies with it
 
+	// Buffers from 4K to 1M come from per-thread free lists, so the
+	// read and ioctl buffers bees allocates on every call are reused
+	// without a trip through malloc.
+
+#ifdef CRUCIBLE_BYTEVECTOR_NO_MUTEX
+	// Build with -DCRUCIBLE_BYTEVECTOR_NO_MUTEX to drop the per-instance
+	// lock.  Then, like a std::vector, one ByteVector object must not be
+	// modified while another thread uses it.  Copies may still be shared.
+	struct ByteVectorMutex {
+		void lock() {}
+		void unlock() {}
+		bool try_lock() { return true; }
+	};
+#else
+	using ByteVectorMutex = mutex;
+#endif
+
 	class ByteVector {
 	public:
 		using Pointer = shared_ptr<uint8_t>;
@@ -41,6 +58,8 @@ namespace crucible {
 		value_type& operator[](size_t) const;
 		size_t size() const;
 		bool operator==(const ByteVector &that) const;
+		// True if every byte is zero (or the vector is empty)
+		bool is_zero() const;
 
 		// this version of erase only works at the beginning or end of the buffer, else throws exception
 		void erase(iterator first);
@@ -52,9 +71,10 @@ namespace crucible {
 		template <class T> ByteVector(const T& object, size_t min_size);
 		template <class T> T* get() const;
 	private:
+		static Pointer allocate(size_t size);
 		Pointer m_ptr;
 		size_t m_size = 0;
-		mutable mutex m_mutex;
+		mutable ByteVectorMutex m_mutex;
 	friend ostream & operator<<(ostream &os, const ByteVector &bv);
 	};
 
@@ -62,7 +82,7 @@ namespace crucible {
 	ByteVector::ByteVector(const T& object, size_t min_size)
 	{
 		const auto size = max(min_size, sizeof(T));
-		m_ptr = Pointer(static_cast<value_type*>(malloc(size)), free);
+		m_ptr = allocate(size);
 		memcpy(m_ptr.get(), &object, sizeof(T));
 		m_size = size;
 	}
@@ -6,8 +6,11 @@
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <tuple>
+#include <type_traits>
+#include <vector>
 
 namespace crucible {
 	using namespace std;
@@ -228,6 +231,408 @@ namespace crucible {
 	{
 		insert_item([&](Arguments...) -> Return { return r; }, args...);
 	}
+
+	// Same interface as LRUCache, but split into shards that each have
+	// their own mutex.  Each shard is an open-addressing hash table with
+	// CLOCK eviction, so a cache hit only sets a bit instead of splicing
+	// a list.  Keys need std::hash for each tuple element.
+	template <class Return, class... Arguments>
+	class ShardedLRUCache {
+	public:
+		using Key = tuple<Arguments...>;
+		using Func = function<Return(Arguments...)>;
+
+		struct Stats {
+			size_t hits = 0;
+			size_t misses = 0;
+			size_t evictions = 0;
+			/// Misses that waited for another thread to fill the same key
+			size_t lock_waits = 0;
+			size_t lock_spurious = 0;
+		};
+	private:
+		struct Slot {
+			Key key;
+			Return ret;
+			bool used = false;
+			bool referenced = false;
+		};
+
+		struct Shard {
+			mutable mutex	m_mutex;
+			vector<Slot>	m_slots;
+			size_t		m_size = 0;
+			size_t		m_max_size = 1;
+			size_t		m_hand = 0;
+			LockSet<Key>	m_lockset;
+			Stats		m_stats;
+
+			size_t find_slot(const Key &k, size_t h) const;
+			void erase_slot(size_t pos);
+			void evict_one();
+			void resize(size_t max_size);
+			void clear();
+		};
+
+		Func			m_fn;
+		vector<unique_ptr<Shard>>	m_shards;
+		mutable mutex		m_fn_mutex;
+
+		static size_t mix(size_t h);
+		template <size_t I = 0> static typename enable_if<(I == sizeof...(Arguments)), size_t>::type hash_key(const Key &k, size_t seed = 0);
+		template <size_t I = 0> static typename enable_if<(I < sizeof...(Arguments)), size_t>::type hash_key(const Key &k, size_t seed = 0);
+		Shard &shard_for(size_t h);
+		Return insert_item(Func fn, Arguments... args);
+	public:
+		ShardedLRUCache(Func f = Func(), size_t max_size = 100, size_t shards = 16);
+
+		void func(Func f);
+		void max_size(size_t new_max_size);
+
+		Return operator()(Arguments... args);
+		Return refresh(Arguments... args);
+		void expire(Arguments... args);
+		size_t expire_if(function<bool(const Key &)> pred);
+		void insert(const Return &r, Arguments... args);
+		void clear();
+		size_t size() const;
+
+		vector<Stats> shard_stats() const;
+		Stats stats() const;
+	};
+
+	template <class Return, class... Arguments>
+	ShardedLRUCache<Return, Arguments...>::ShardedLRUCache(Func f, size_t max_size, size_t shards) :
+		m_fn(f)
+	{
+		THROW_CHECK1(invalid_argument, shards, shards > 0);
+		for (size_t i = 0; i < shards; ++i) {
+			m_shards.push_back(unique_ptr<Shard>(new Shard));
+		}
+		this->max_size(max_size);
+	}
+
+	template <class Return, class... Arguments>
+	size_t
+	ShardedLRUCache<Return, Arguments...>::mix(size_t h)
+	{
+		// splitmix64 finalizer:  std::hash is often the identity, and
+		// our integer keys tend to be aligned
+		uint64_t z = h + 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	template <class Return, class... Arguments>
+	template <size_t I>
+	typename enable_if<(I == sizeof...(Arguments)), size_t>::type
+	ShardedLRUCache<Return, Arguments...>::hash_key(const Key &, size_t seed)
+	{
+		return seed;
+	}
+
+	template <class Return, class... Arguments>
+	template <size_t I>
+	typename enable_if<(I < sizeof...(Arguments)), size_t>::type
+	ShardedLRUCache<Return, Arguments...>::hash_key(const Key &k, size_t seed)
+	{
+		using T = typename decay<typename tuple_element<I, Key>::type>::type;
+		return hash_key<I + 1>(k, mix(seed ^ hash<T>()(get<I>(k))));
+	}
+
+	template <class Return, class... Arguments>
+	typename ShardedLRUCache<Return, Arguments...>::Shard &
+	ShardedLRUCache<Return, Arguments...>::shard_for(size_t h)
+	{
+		// High bits pick the shard, low bits pick the slot
+		return *m_shards[(h >> 32) % m_shards.size()];
+	}
+
+	template <class Return, class... Arguments>
+	size_t
+	ShardedLRUCache<Return, Arguments...>::Shard::find_slot(const Key &k, size_t h) const
+	{
+		// Returns the slot holding k, or the empty slot where k would go
+		const size_t mask = m_slots.size() - 1;
+		size_t pos = h & mask;
+		while (m_slots[pos].used && !(m_slots[pos].key == k)) {
+			pos = (pos + 1) & mask;
+		}
+		return pos;
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::Shard::erase_slot(size_t pos)
+	{
+		// Backward shift deletion so lookups never need tombstones
+		const size_t mask = m_slots.size() - 1;
+		size_t hole = pos;
+		for (size_t next = (hole + 1) & mask; m_slots[next].used; next = (next + 1) & mask) {
+			const size_t home = hash_key(m_slots[next].key) & mask;
+			// Move next into hole unless its home lies cyclically in (hole, next]
+			const bool stays = hole <= next
+				? (hole < home && home <= next)
+				: (hole < home || home <= next);
+			if (!stays) {
+				m_slots[hole] = std::move(m_slots[next]);
+				hole = next;
+			}
+		}
+		m_slots[hole] = Slot();
+		--m_size;
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::Shard::evict_one()
+	{
+		// CLOCK:  clear referenced bits until an unreferenced entry turns up.
+		// Two sweeps always find one.
+		const size_t mask = m_slots.size() - 1;
+		for (size_t n = 0; n < 2 * m_slots.size(); ++n) {
+			auto &slot = m_slots[m_hand];
+			if (slot.used) {
+				if (!slot.referenced) {
+					erase_slot(m_hand);
+					++m_stats.evictions;
+					return;
+				}
+				slot.referenced = false;
+			}
+			m_hand = (m_hand + 1) & mask;
+		}
+		THROW_ERROR(runtime_error, "no slot to evict, size " << m_size << " max " << m_max_size);
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::Shard::resize(size_t max_size)
+	{
+		m_max_size = max(size_t(1), max_size);
+		// Keep the load factor at or below 1/2
+		size_t capacity = 2;
+		while (capacity < 2 * m_max_size) {
+			capacity *= 2;
+		}
+		vector<Slot> old_slots(capacity);
+		old_slots.swap(m_slots);
+		m_size = 0;
+		m_hand = 0;
+		for (auto &slot : old_slots) {
+			if (!slot.used) {
+				continue;
+			}
+			if (m_size >= m_max_size) {
+				++m_stats.evictions;
+				continue;
+			}
+			const auto pos = find_slot(slot.key, hash_key(slot.key));
+			m_slots[pos] = std::move(slot);
+			++m_size;
+		}
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::Shard::clear()
+	{
+		// Destroy the old slots after releasing the lock
+		unique_lock<mutex> lock(m_mutex);
+		vector<Slot> new_slots(m_slots.size());
+		m_slots.swap(new_slots);
+		m_size = 0;
+		m_hand = 0;
+		lock.unlock();
+	}
+
+	template <class Return, class... Arguments>
+	Return
+	ShardedLRUCache<Return, Arguments...>::insert_item(Func fn, Arguments... args)
+	{
+		Key k(args...);
+		const size_t h = hash_key(k);
+		auto &shard = shard_for(h);
+
+		// Do we have it cached?
+		unique_lock<mutex> lock(shard.m_mutex);
+		auto pos = shard.find_slot(k, h);
+		if (shard.m_slots[pos].used) {
+			++shard.m_stats.hits;
+			shard.m_slots[pos].referenced = true;
+			return shard.m_slots[pos].ret;
+		}
+
+		// No, release shard lock and acquire key lock
+		lock.unlock();
+		auto key_lock = shard.m_lockset.make_lock(k);
+
+		// Did item appear in cache while we were waiting for key?
+		lock.lock();
+		pos = shard.find_slot(k, h);
+		if (shard.m_slots[pos].used) {
+			++shard.m_stats.hits;
+			shard.m_slots[pos].referenced = true;
+			return shard.m_slots[pos].ret;
+		}
+		++shard.m_stats.misses;
+
+		// We hold the key lock, call the function without the shard lock
+		lock.unlock();
+		Slot new_slot;
+		new_slot.ret = fn(args...);
+		new_slot.key = k;
+		new_slot.used = true;
+		lock.lock();
+
+		// Make room, which may move slots around
+		while (shard.m_size >= shard.m_max_size) {
+			shard.evict_one();
+		}
+		pos = shard.find_slot(k, h);
+
+		// We (should be) holding a lock on this key so we are the ones to insert it
+		THROW_CHECK0(runtime_error, !shard.m_slots[pos].used);
+		shard.m_slots[pos] = std::move(new_slot);
+		++shard.m_size;
+		return shard.m_slots[pos].ret;
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::func(Func func)
+	{
+		unique_lock<mutex> lock(m_fn_mutex);
+		m_fn = func;
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::max_size(size_t new_max_size)
+	{
+		const size_t per_shard = (new_max_size + m_shards.size() - 1) / m_shards.size();
+		for (auto &shard : m_shards) {
+			unique_lock<mutex> lock(shard->m_mutex);
+			shard->resize(per_shard);
+		}
+	}
+
+	template <class Return, class... Arguments>
+	Return
+	ShardedLRUCache<Return, Arguments...>::operator()(Arguments... args)
+	{
+		unique_lock<mutex> lock(m_fn_mutex);
+		const auto fn = m_fn;
+		lock.unlock();
+		return insert_item(fn, args...);
+	}
+
+	template <class Return, class... Arguments>
+	Return
+	ShardedLRUCache<Return, Arguments...>::refresh(Arguments... args)
+	{
+		expire(args...);
+		return operator()(args...);
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::expire(Arguments... args)
+	{
+		Key k(args...);
+		const size_t h = hash_key(k);
+		auto &shard = shard_for(h);
+		unique_lock<mutex> lock(shard.m_mutex);
+		const auto pos = shard.find_slot(k, h);
+		if (shard.m_slots[pos].used) {
+			shard.erase_slot(pos);
+		}
+	}
+
+	template <class Return, class... Arguments>
+	size_t
+	ShardedLRUCache<Return, Arguments...>::expire_if(function<bool(const Key &)> pred)
+	{
+		size_t rv = 0;
+		for (auto &shard : m_shards) {
+			// Destroy the expired values after releasing the lock
+			vector<Return> expired;
+			unique_lock<mutex> lock(shard->m_mutex);
+			for (size_t pos = 0; pos < shard->m_slots.size(); ) {
+				auto &slot = shard->m_slots[pos];
+				if (slot.used && pred(slot.key)) {
+					expired.push_back(std::move(slot.ret));
+					// Backward shift may move an unchecked entry into pos
+					shard->erase_slot(pos);
+				} else {
+					++pos;
+				}
+			}
+			lock.unlock();
+			rv += expired.size();
+		}
+		return rv;
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::insert(const Return &r, Arguments... args)
+	{
+		insert_item([&](Arguments...) -> Return { return r; }, args...);
+	}
+
+	template <class Return, class... Arguments>
+	void
+	ShardedLRUCache<Return, Arguments...>::clear()
+	{
+		for (auto &shard : m_shards) {
+			shard->clear();
+		}
+	}
+
+	template <class Return, class... Arguments>
+	size_t
+	ShardedLRUCache<Return, Arguments...>::size() const
+	{
+		size_t rv = 0;
+		for (const auto &shard : m_shards) {
+			unique_lock<mutex> lock(shard->m_mutex);
+			rv += shard->m_size;
+		}
+		return rv;
+	}
+
+	template <class Return, class... Arguments>
+	vector<typename ShardedLRUCache<Return, Arguments...>::Stats>
+	ShardedLRUCache<Return, Arguments...>::shard_stats() const
+	{
+		vector<Stats> rv;
+		for (const auto &shard : m_shards) {
+			unique_lock<mutex> lock(shard->m_mutex);
+			rv.push_back(shard->m_stats);
+			lock.unlock();
+			const auto lock_stats = shard->m_lockset.stats();
+			rv.back().lock_waits = lock_stats.waits;
+			rv.back().lock_spurious = lock_stats.spurious;
+		}
+		return rv;
+	}
+
+	template <class Return, class... Arguments>
+	typename ShardedLRUCache<Return, Arguments...>::Stats
+	ShardedLRUCache<Return, Arguments...>::stats() const
+	{
+		Stats rv;
+		for (const auto &i : shard_stats()) {
+			rv.hits += i.hits;
+			rv.misses += i.misses;
+			rv.evictions += i.evictions;
+			rv.lock_waits += i.lock_waits;
+			rv.lock_spurious += i.lock_spurious;
+		}
+		return rv;
+	}
 }
 
 #endif // CRUCIBLE_CACHE_H
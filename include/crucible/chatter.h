@@ -51,6 +51,17 @@ namespace crucible {
 
 		static void enable_timestamp(bool prefix_timestamp);
 		static void enable_level(bool prefix_level);
+
+		/// Queue output for a background thread to write, instead of
+		/// writing it in the destructor.  When the queue is full, output
+		/// is dropped and counted.  Output at LOG_ERR or more severe
+		/// levels waits until it is written, so it is not lost if the
+		/// process dies.  Can only be enabled once.
+		static void enable_async(size_t queue_size);
+		/// Wait until all queued output has been written
+		static void flush_async();
+		/// Number of messages dropped because the queue was full
+		static size_t async_dropped();
 	};
 
 	template <class Argument>
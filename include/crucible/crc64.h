@@ -9,6 +9,9 @@ namespace crucible {
 	namespace Digest {
 		namespace CRC {
 			uint64_t crc64(const void *p, size_t len);
+			// Table-driven implementation without CPU dispatch.
+			// Gives the same result as crc64(); used for testing.
+			uint64_t crc64_portable(const void *p, size_t len);
 		};
 	};
 };
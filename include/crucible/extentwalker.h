@@ -94,6 +94,25 @@ namespace crucible {
 		void set_root_fd(Fd fd);
 	};
 
+	/// While a Scope is alive, BtrfsExtentWalkers in the same thread
+	/// share the EXTENT_DATA items they fetch, so walkers constructed for
+	/// the same file don't repeat the tree searches.  Entries are keyed
+	/// by device and inode and dropped when the file size changes.
+	/// Anything else that changes a file's extents while a Scope
+	/// is alive (dedupe, clone, write) must call invalidate().
+	class BtrfsExtentCache {
+	public:
+		class Scope {
+			bool m_outer;
+			Scope(const Scope &) = delete;
+			Scope& operator=(const Scope &) = delete;
+		public:
+			Scope();
+			~Scope();
+		};
+		static void invalidate(int fd);
+	};
+
 	ostream &operator<<(ostream &os, const Extent &e);
 };
 
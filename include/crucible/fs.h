@@ -65,10 +65,18 @@ namespace crucible {
 	};
 
 	struct BtrfsIoctlLogicalInoArgs {
+		// buf_size is the largest buffer used.  The buffer starts small and
+		// grows when LOGICAL_INO_V2 reports missing refs, and is kept for
+		// the next call, so reuse one object (e.g. per thread) with set_logical.
 		BtrfsIoctlLogicalInoArgs(uint64_t logical, size_t buf_size = 16 * 1024 * 1024);
 
 		uint64_t get_flags() const;
 		void set_flags(uint64_t new_flags);
+		uint64_t get_logical() const;
+		void set_logical(uint64_t new_logical);
+		size_t get_container_size() const;
+		/// Release a buffer grown by earlier calls
+		void shrink();
 
 		virtual void do_ioctl(int fd);
 		virtual bool do_ioctl_nothrow(int fd);
@@ -89,10 +97,12 @@ namespace crucible {
 		friend struct BtrfsIoctlLogicalInoArgs;
 		} m_iors;
 	private:
+		size_t m_max_container_size;
 		size_t m_container_size;
 		BtrfsDataContainer m_container;
 		uint64_t m_logical;
 		uint64_t m_flags = 0;
+		bool do_ioctl_once(int fd);
 	friend ostream & operator<<(ostream &os, const BtrfsIoctlLogicalInoArgs *p);
 	};
 
@@ -165,6 +175,10 @@ namespace crucible {
 	// Helper functions
 	void btrfs_clone_range(int src_fd, off_t src_offset, off_t src_length, int dst_fd, off_t dst_offset);
 	bool btrfs_extent_same(int src_fd, off_t src_offset, off_t src_length, int dst_fd, off_t dst_offset);
+	// Dedupe one src range into several (dst_fd, dst_offset), with one ioctl per
+	// BTRFS_MAX_DEDUPE_LEN and BTRFS_MAX_DEDUPE_DESTS.  Returns one status per dst:
+	// 0 if deduped, BTRFS_SAME_DATA_DIFFERS, or -errno.
+	vector<int> btrfs_extent_same_multi(int src_fd, off_t src_offset, off_t src_length, const vector<pair<int, off_t>> &dsts);
 
 	struct BtrfsIoctlSearchHeader : public btrfs_ioctl_search_header {
 		BtrfsIoctlSearchHeader();
@@ -195,6 +209,14 @@ namespace crucible {
 
 		size_t m_buf_size;
 		set<BtrfsIoctlSearchHeader> m_result;
+
+		// Item sizes seen so far, to size the buffer for nr_items and
+		// to tell a full buffer from the end of the search range
+		size_t m_items = 0;
+		size_t m_item_bytes = 0;
+		size_t m_max_item_size = 0;
+	private:
+		size_t item_bytes(const ByteVector &ioctl_arg, size_t count);
 	};
 
 	ostream & operator<<(ostream &os, const btrfs_ioctl_search_key &key);
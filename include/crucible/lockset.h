@@ -23,12 +23,29 @@ namespace crucible {
 		using set_type = map<T, pid_t>;
 		using key_type = typename set_type::key_type;
 
+		struct Stats {
+			/// Times lock() had to wait
+			size_t waits = 0;
+			/// Wakeups that found the key still locked or the set still full
+			size_t spurious = 0;
+		};
+
 	private:
+		/// Threads waiting for one key.  Unlocking a key wakes only
+		/// the threads waiting for that key.
+		struct Waiters {
+			condition_variable	m_condvar;
+			size_t			m_count = 0;
+		};
 
 		set_type			m_set;
 		mutex				m_mutex;
+		map<key_type, Waiters>		m_waiters;
+		/// Threads waiting for the set to be less than full
 		condition_variable		m_condvar;
+		size_t				m_full_waiters = 0;
 		size_t				m_max_size = numeric_limits<size_t>::max();
+		Stats				m_stats;
 
 		bool full();
 		bool locked(const key_type &name);
@@ -61,6 +78,7 @@ namespace crucible {
 		size_t size();
 		bool empty();
 		set_type copy();
+		Stats stats();
 
 		void max_size(size_t max);
 
@@ -114,8 +132,27 @@ namespace crucible {
 	LockSet<T>::lock(const key_type &name)
 	{
 		unique_lock<mutex> lock(m_mutex);
+		bool waited = false;
 		while (full() || locked(name)) {
-			m_condvar.wait(lock);
+			if (waited) {
+				++m_stats.spurious;
+			} else {
+				++m_stats.waits;
+				waited = true;
+			}
+			if (locked(name)) {
+				// The map node stays put while m_count is non-zero
+				auto &waiters = m_waiters[name];
+				++waiters.m_count;
+				waiters.m_condvar.wait(lock);
+				if (!--waiters.m_count) {
+					m_waiters.erase(name);
+				}
+			} else {
+				++m_full_waiters;
+				m_condvar.wait(lock);
+				--m_full_waiters;
+			}
 		}
 		auto rv = m_set.insert(make_pair(name, crucible::gettid()));
 		THROW_CHECK0(runtime_error, rv.second);
@@ -140,7 +177,15 @@ namespace crucible {
 	{
 		unique_lock<mutex> lock(m_mutex);
 		auto erase_count = m_set.erase(name);
-		m_condvar.notify_all();
+		// Wake all of this key's waiters, because the one that wins
+		// the key might still find the set full and wait for that
+		const auto found = m_waiters.find(name);
+		if (found != m_waiters.end()) {
+			found->second.m_condvar.notify_all();
+		}
+		if (m_full_waiters) {
+			m_condvar.notify_all();
+		}
 		THROW_CHECK1(invalid_argument, erase_count, erase_count == 1);
 	}
 
@@ -171,6 +216,14 @@ namespace crucible {
 		return rv;
 	}
 
+	template <class T>
+	typename LockSet<T>::Stats
+	LockSet<T>::stats()
+	{
+		unique_lock<mutex> lock(m_mutex);
+		return m_stats;
+	}
+
 	template <class T>
 	void
 	LockSet<T>::Lock::lock()
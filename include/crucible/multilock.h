@@ -14,6 +14,7 @@ namespace crucible {
 		mutex m_mutex;
 		condition_variable m_cv;
 		map<string, size_t> m_counters;
+		map<string, size_t> m_limits;
 
 		class LockHandle {
 			const string m_type;
@@ -31,8 +32,13 @@ namespace crucible {
 		bool is_lock_available(const string &type);
 		void put_lock(const string &type);
 		shared_ptr<LockHandle> get_lock_private(const string &type);
+		void set_limit_private(const string &type, size_t limit);
+		static MultiLocker &process_instance();
 	public:
 		static shared_ptr<LockHandle> get_lock(const string &type);
+
+		// Maximum number of concurrent holders of one type.  0 = no limit (default).
+		static void set_limit(const string &type, size_t limit);
 	};
 
 }
@@ -13,6 +13,9 @@ namespace crucible {
 	using namespace std;
 
 	/// A thread-safe container for RAII of shared resources with unique names.
+	///
+	/// Names are spread over c_shards maps by a hash of the name, each
+	/// with its own lock, so lookups of different names rarely contend.
 
 	template <class Return, class... Arguments>
 	class NamedPtr {
@@ -32,6 +35,7 @@ namespace crucible {
 		struct MapRep {
 			MapType		m_map;
 			mutex		m_mutex;
+			LockSet<Key>	m_lockset;
 		};
 		using MapPtr = shared_ptr<MapRep>;
 		/// Container for Return pointers.  Destructor removes entry from map.
@@ -43,11 +47,16 @@ namespace crucible {
 			Value(Ptr&& ret_ptr, const Key &key, const MapPtr &map_rep);
 		};
 
+		static const size_t c_shard_bits = 6;
+		static const size_t c_shards = 1 << c_shard_bits;
+
 		Func		m_fn;
-		MapPtr		m_map_rep = make_shared<MapRep>();
-		LockSet<Key>	m_lockset;
+		MapPtr		m_map_reps[c_shards];
 
-		Ptr lookup_item(const Key &k);
+		static uint64_t hash_args(uint64_t h);
+		template <class T, class... Rest> static uint64_t hash_args(uint64_t h, const T &first, const Rest&... rest);
+		const MapPtr &map_rep(Arguments... args) const;
+		static Ptr lookup_item(const MapPtr &map_rep, const Key &k);
 		Ptr insert_item(Func fn, Arguments... args);
 
 	public:
@@ -65,6 +74,34 @@ namespace crucible {
 	NamedPtr<Return, Arguments...>::NamedPtr(Func f) :
 		m_fn(f)
 	{
+		for (auto &i : m_map_reps) {
+			i = make_shared<MapRep>();
+		}
+	}
+
+	template <class Return, class... Arguments>
+	uint64_t
+	NamedPtr<Return, Arguments...>::hash_args(uint64_t h)
+	{
+		return h;
+	}
+
+	template <class Return, class... Arguments>
+	template <class T, class... Rest>
+	uint64_t
+	NamedPtr<Return, Arguments...>::hash_args(uint64_t h, const T &first, const Rest&... rest)
+	{
+		return hash_args((h ^ hash<T>()(first)) * 0x9e3779b97f4a7c15ULL, rest...);
+	}
+
+	/// Select the shard for a name.  std::hash of an integer is the
+	/// integer itself, and names like extent bytenrs are multiples of
+	/// 4096, so the shard comes from the top bits of a multiplicative hash.
+	template <class Return, class... Arguments>
+	const typename NamedPtr<Return, Arguments...>::MapPtr &
+	NamedPtr<Return, Arguments...>::map_rep(Arguments... args) const
+	{
+		return m_map_reps[hash_args(0, args...) >> (64 - c_shard_bits)];
 	}
 
 	/// Construct a Value wrapper: the value to store, the argument key to store the value under,
@@ -106,11 +143,11 @@ namespace crucible {
 	/// Ignore Keys that have expired weak pointers.
 	template <class Return, class... Arguments>
 	typename NamedPtr<Return, Arguments...>::Ptr
-	NamedPtr<Return, Arguments...>::lookup_item(const Key &k)
+	NamedPtr<Return, Arguments...>::lookup_item(const MapPtr &map_rep, const Key &k)
 	{
 		// Must be called with lock held
-		const auto found = m_map_rep->m_map.find(k);
-		if (found != m_map_rep->m_map.end()) {
+		const auto found = map_rep->m_map.find(k);
+		if (found != map_rep->m_map.end()) {
 			// Get the strong pointer back
 			const auto rv = found->second.lock();
 			if (rv) {
@@ -135,21 +172,22 @@ namespace crucible {
 	NamedPtr<Return, Arguments...>::insert_item(Func fn, Arguments... args)
 	{
 		Key k(args...);
+		const auto &rep = map_rep(args...);
 
 		// Is it already in the map?
-		unique_lock<mutex> lock_lookup(m_map_rep->m_mutex);
-		auto rv = lookup_item(k);
+		unique_lock<mutex> lock_lookup(rep->m_mutex);
+		auto rv = lookup_item(rep, k);
 		if (rv) {
 			return rv;
 		}
 
 		// Release map lock and acquire key lock
 		lock_lookup.unlock();
-		const auto key_lock = m_lockset.make_lock(k);
+		const auto key_lock = rep->m_lockset.make_lock(k);
 
 		// Did item appear in map while we were waiting for key?
 		lock_lookup.lock();
-		rv = lookup_item(k);
+		rv = lookup_item(rep, k);
 		if (rv) {
 			return rv;
 		}
@@ -159,18 +197,18 @@ namespace crucible {
 		lock_lookup.unlock();
 
 		// Call the function and create a new Value outside of the map
-		const auto new_value_ptr = make_shared<Value>(fn(args...), k, m_map_rep);
+		const auto new_value_ptr = make_shared<Value>(fn(args...), k, rep);
 
 		// Function must return a non-null pointer
 		THROW_CHECK0(runtime_error, new_value_ptr->m_ret_ptr);
 
 		// Reacquire index lock for map insertion.  We still hold the key lock.
 		// Use a different lock object to make exceptions unlock in the right order
-		unique_lock<mutex> lock_insert(m_map_rep->m_mutex);
+		unique_lock<mutex> lock_insert(rep->m_mutex);
 
 		// Insert return value in map or overwrite existing
 		// empty or expired weak_ptr value.
-		WeakPtr &new_item_ref = m_map_rep->m_map[k];
+		WeakPtr &new_item_ref = rep->m_map[k];
 
 		// We searched the map while holding both locks and
 		// found no entry or an expired weak_ptr; therefore, no
@@ -195,7 +233,8 @@ namespace crucible {
 	void
 	NamedPtr<Return, Arguments...>::func(Func func)
 	{
-		unique_lock<mutex> lock(m_map_rep->m_mutex);
+		// The function is set before the NamedPtr is shared between threads
+		unique_lock<mutex> lock(m_map_reps[0]->m_mutex);
 		m_fn = func;
 	}
 
@@ -78,6 +78,28 @@ namespace crucible {
 	double getloadavg5();
 	double getloadavg15();
 
+	/// cgroup v2 directory of this process under /sys/fs/cgroup, or
+	/// empty if there is none (no cgroup v2, or the root cgroup)
+	string cgroup_path();
+
+	/// PSI file for resource ("cpu", "io" or "memory"):  this process's
+	/// cgroup v2 file if there is one, else the system-wide file in
+	/// /proc/pressure.  Empty if the kernel has neither.
+	string pressure_path(const string &resource);
+
+	/// Cumulative "some" stall time in microseconds from a PSI file
+	uint64_t pressure_some_total(const string &path);
+
+	/// fd passed by the service manager with FDNAME name (see
+	/// sd_listen_fds_with_names(3)), or -1 if there is none
+	int listen_fd(const string &name);
+
+	/// Send a state message to the service manager, with fd attached if
+	/// fd >= 0 (see sd_pid_notify_with_fds(3)), e.g. "FDSTORE=1\nFDNAME=x"
+	/// to have fd passed back by listen_fd on the next start.  Returns
+	/// false if there is no service manager.
+	bool service_notify(const string &message, int fd = -1);
+
 	string signal_ntoa(int sig);
 }
 #endif // CRUCIBLE_PROCESS_H
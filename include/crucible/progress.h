@@ -3,10 +3,12 @@
 
 #include "crucible/error.h"
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <tuple>
 
 namespace crucible {
 	using namespace std;
@@ -28,17 +30,24 @@ namespace crucible {
 	friend class ProgressHolderState;
 
 	private:
+		/// Holders are kept in order of value.  A holder only marks its
+		/// entry done when it is released, without taking the lock.
+		/// Done entries at the front are erased, and m_begin advanced,
+		/// by the next hold() or begin() call.
 		struct ProgressTrackerState {
-			using key_type = pair<value_type, ProgressHolderState *>;
-			mutex			m_mutex;
-			map<key_type, bool>	m_in_progress;
-			value_type		m_begin;
-			value_type		m_end;
+			using key_type = pair<value_type, uint64_t>;
+			mutex				m_mutex;
+			map<key_type, atomic<bool>>	m_in_progress;
+			uint64_t			m_next_seq = 0;
+			value_type			m_begin;
+			value_type			m_end;
+			void advance_begin();
 		};
 
 		class ProgressHolderState {
 			shared_ptr<ProgressTrackerState>	m_state;
 			const value_type			m_value;
+			atomic<bool>				*m_done;
 		public:
 			ProgressHolderState(shared_ptr<ProgressTrackerState> state, const value_type &v);
 			~ProgressHolderState();
@@ -49,11 +58,26 @@ namespace crucible {
 		shared_ptr<ProgressTrackerState>	m_state;
 	};
 
+	template <class T>
+	void
+	ProgressTracker<T>::ProgressTrackerState::advance_begin()
+	{
+		// Must be called with lock held
+		auto p = m_in_progress.begin();
+		while (p != m_in_progress.end() && p->second.load(memory_order_acquire)) {
+			if (m_begin < p->first.first) {
+				m_begin = p->first.first;
+			}
+			p = m_in_progress.erase(p);
+		}
+	}
+
 	template <class T>
 	typename ProgressTracker<T>::value_type
 	ProgressTracker<T>::begin() const
 	{
 		unique_lock<mutex> lock(m_state->m_mutex);
+		m_state->advance_begin();
 		return m_state->m_begin;
 	}
 
@@ -86,7 +110,16 @@ namespace crucible {
 		m_value(v)
 	{
 		unique_lock<mutex> lock(m_state->m_mutex);
-		m_state->m_in_progress[make_pair(m_value, this)] = true;
+		m_state->advance_begin();
+		auto &in_progress = m_state->m_in_progress;
+		const auto key = make_pair(m_value, m_state->m_next_seq++);
+		// Holds usually arrive in order, so the hint makes insertion constant time
+		auto hint = in_progress.end();
+		if (!in_progress.empty() && key < prev(hint)->first) {
+			hint = in_progress.lower_bound(key);
+		}
+		const auto inserted = in_progress.emplace_hint(hint, piecewise_construct, forward_as_tuple(key), forward_as_tuple(false));
+		m_done = &inserted->second;
 		if (m_state->m_end < m_value) {
 			m_state->m_end = m_value;
 		}
@@ -95,19 +128,8 @@ namespace crucible {
 	template <class T>
 	ProgressTracker<T>::ProgressHolderState::~ProgressHolderState()
 	{
-		unique_lock<mutex> lock(m_state->m_mutex);
-		m_state->m_in_progress[make_pair(m_value, this)] = false;
-		auto p = m_state->m_in_progress.begin();
-		while (p != m_state->m_in_progress.end()) {
-			if (p->second) {
-				break;
-			}
-			if (m_state->m_begin < p->first.first) {
-				m_state->m_begin = p->first.first;
-			}
-			m_state->m_in_progress.erase(p);
-			p = m_state->m_in_progress.begin();
-		}
+		// The map entry can't be erased until this is set
+		m_done->store(true, memory_order_release);
 	}
 
 	template <class T>
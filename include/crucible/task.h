@@ -31,7 +31,10 @@ namespace crucible {
 		/// Schedule Task for at most one future execution.
 		/// May run Task in current thread or in other thread.
 		/// May run Task before or after returning.
-		/// Schedules Task at the end of the global execution queue.
+		/// Schedules Task at the end of the current worker's
+		/// execution queue, or the global execution queue if
+		/// not called from a worker.  Idle workers steal Tasks
+		/// from other workers' queues.
 		///
 		/// Only one instance of a Task may execute at a time.
 		/// If a Task is already scheduled, run() does nothing.
@@ -72,7 +75,7 @@ namespace crucible {
 		/// Blocks until the running thread count reaches this number
 		static void set_thread_count(size_t threads);
 
-		/// Sets minimum thread count when load average tracking enabled
+		/// Sets minimum thread count when load average or pressure tracking enabled
 		static void set_thread_min_count(size_t min_threads);
 
 		/// Calls set_thread_count with default
@@ -81,6 +84,12 @@ namespace crucible {
 		/// Creates thread to track load average and adjust thread count dynamically
 		static void set_loadavg_target(double target);
 
+		/// Creates thread to track PSI stalls and adjust thread count
+		/// dynamically.  Targets are percentages of time with some
+		/// tasks stalled on CPU or on IO (including memory), 0 disables.
+		/// Uses this process's cgroup v2 pressure files if available.
+		static void set_pressure_target(double cpu, double io);
+
 		/// Writes the current non-executing Task queue
 		static ostream & print_queue(ostream &);
 
@@ -101,6 +110,10 @@ namespace crucible {
 			double thread_target;
 			/// Load average for last 60 seconds
 			double loadavg;
+			/// Percent of time stalled on CPU, IO or memory since the previous sample
+			double cpu_pressure;
+			double io_pressure;
+			double memory_pressure;
 		};
 		static LoadStats get_current_load();
 
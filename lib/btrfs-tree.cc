@@ -29,6 +29,13 @@ namespace crucible {
 		return btrfs_get_member(&btrfs_extent_item::generation, m_data);
 	}
 
+	uint64_t
+	BtrfsTreeItem::extent_flags() const
+	{
+		THROW_CHECK1(invalid_argument, btrfs_search_type_ntoa(m_type), m_type == BTRFS_EXTENT_ITEM_KEY);
+		return btrfs_get_member(&btrfs_extent_item::flags, m_data);
+	}
+
 	uint64_t
 	BtrfsTreeItem::root_ref_dirid() const
 	{
@@ -61,6 +68,28 @@ namespace crucible {
 		return btrfs_get_member(&btrfs_root_item::flags, m_data);
 	}
 
+	string
+	BtrfsTreeItem::root_uuid() const
+	{
+		THROW_CHECK1(invalid_argument, btrfs_search_type_ntoa(m_type), m_type == BTRFS_ROOT_ITEM_KEY);
+		const auto offset = offsetof(btrfs_root_item, uuid);
+		if (m_data.size() < offset + BTRFS_UUID_SIZE) {
+			return string();
+		}
+		return string(reinterpret_cast<const char *>(m_data.data()) + offset, BTRFS_UUID_SIZE);
+	}
+
+	string
+	BtrfsTreeItem::root_parent_uuid() const
+	{
+		THROW_CHECK1(invalid_argument, btrfs_search_type_ntoa(m_type), m_type == BTRFS_ROOT_ITEM_KEY);
+		const auto offset = offsetof(btrfs_root_item, parent_uuid);
+		if (m_data.size() < offset + BTRFS_UUID_SIZE) {
+			return string();
+		}
+		return string(reinterpret_cast<const char *>(m_data.data()) + offset, BTRFS_UUID_SIZE);
+	}
+
 	ostream &
 	operator<<(ostream &os, const BtrfsTreeItem &bti)
 	{
@@ -192,6 +221,22 @@ namespace crucible {
 		}
 	}
 
+	uint64_t
+	BtrfsTreeItem::file_extent_disk_bytes() const
+	{
+		THROW_CHECK1(invalid_argument, btrfs_search_type_ntoa(m_type), m_type == BTRFS_EXTENT_DATA_KEY);
+		auto file_extent_item_type = btrfs_get_member(&btrfs_file_extent_item::type, m_data);
+		switch (file_extent_item_type) {
+			case BTRFS_FILE_EXTENT_INLINE:
+				THROW_ERROR(invalid_argument, "extent is inline " << *this);
+			case BTRFS_FILE_EXTENT_PREALLOC:
+			case BTRFS_FILE_EXTENT_REG:
+				return btrfs_get_member(&btrfs_file_extent_item::disk_num_bytes, m_data);
+			default:
+				THROW_ERROR(runtime_error, "unknown btrfs_file_extent_item type " << file_extent_item_type << " in " << *this);
+		}
+	}
+
 	uint8_t
 	BtrfsTreeItem::file_extent_type() const
 	{
@@ -261,18 +306,21 @@ namespace crucible {
 	BtrfsTreeFetcher::fd(Fd fd)
 	{
 		m_fd = fd;
+		batch_clear();
 	}
 
 	void
 	BtrfsTreeFetcher::type(uint8_t type)
 	{
 		m_type = type;
+		batch_clear();
 	}
 
 	void
 	BtrfsTreeFetcher::tree(uint64_t tree)
 	{
 		m_tree = tree;
+		batch_clear();
 	}
 
 	void
@@ -280,6 +328,7 @@ namespace crucible {
 	{
 		m_min_transid = min_transid;
 		m_max_transid = max_transid;
+		batch_clear();
 	}
 
 	uint64_t
@@ -306,6 +355,28 @@ namespace crucible {
 		m_scale_size = scale_size;
 	}
 
+	size_t
+	BtrfsTreeFetcher::batch_size() const
+	{
+		return m_batch_size;
+	}
+
+	void
+	BtrfsTreeFetcher::batch_size(size_t buf_size)
+	{
+		m_batch_size = buf_size;
+		m_sk.m_buf_size = max(m_sk.m_buf_size, buf_size);
+		batch_clear();
+	}
+
+	void
+	BtrfsTreeFetcher::batch_clear()
+	{
+		m_batch.clear();
+		m_batch_valid = false;
+		m_batch_eof = false;
+	}
+
 	void
 	BtrfsTreeFetcher::fill_sk(BtrfsIoctlSearchKey &sk, uint64_t object)
 	{
@@ -424,24 +495,85 @@ namespace crucible {
 	#undef BTFRLB_DEBUG
 	}
 
+	BtrfsTreeItem
+	BtrfsTreeFetcher::lower_bound_batch(uint64_t logical)
+	{
+		if (m_batch_valid && logical >= m_batch_begin) {
+			const auto found = std::lower_bound(m_batch.begin(), m_batch.end(), logical,
+				[](const pair<uint64_t, BtrfsTreeItem> &item, uint64_t l) {
+					return item.first < l;
+				});
+			if (found != m_batch.end()) {
+				return found->second;
+			}
+			if (m_batch_eof) {
+				return BtrfsTreeItem();
+			}
+		}
+
+		batch_clear();
+		m_batch_begin = logical;
+		BtrfsIoctlSearchKey &sk = m_sk;
+		fill_sk(sk, logical);
+		do {
+			assert(sk.max_offset == s_max_logical);
+			// The buffer size limits the number of items
+			sk.nr_items = numeric_limits<decltype(sk.nr_items)>::max();
+			sk.do_ioctl(fd());
+			if (sk.m_result.empty()) {
+				m_batch_eof = true;
+			}
+			for (const auto &i : sk.m_result) {
+				if (hdr_match(i)) {
+					m_batch.push_back(make_pair(hdr_logical(i), BtrfsTreeItem(i)));
+				} else if (hdr_stop(i)) {
+					m_batch_eof = true;
+					break;
+				}
+				next_sk(sk, i);
+			}
+		} while (m_batch.empty() && !m_batch_eof);
+		m_batch_valid = true;
+		return m_batch.empty() ? BtrfsTreeItem() : m_batch.front().second;
+	}
+
 	BtrfsTreeItem
 	BtrfsTreeFetcher::lower_bound(uint64_t logical)
 	{
+		if (m_batch_size) {
+			return lower_bound_batch(logical);
+		}
 		BtrfsIoctlSearchKey &sk = m_sk;
 		fill_sk(sk, logical);
+		// Count the items examined before the match.  If the key range is
+		// sparse in matching items, fetch more at once next time.
+		// If matches are dense, go back to fetching fewer.
+		size_t examined = 0;
+		const auto adjust = [&]() {
+			if (examined > m_search_items) {
+				m_search_items = min(s_max_search_items, m_search_items * 2);
+			} else if (examined * 4 <= m_search_items) {
+				m_search_items = max(uint32_t(1), m_search_items / 2);
+			}
+		};
 		do {
 			assert(sk.max_offset == s_max_logical);
+			sk.nr_items = m_search_items;
 			sk.do_ioctl(fd());
 			for (const auto &i : sk.m_result) {
+				++examined;
 				if (hdr_match(i)) {
+					adjust();
 					return i;
 				}
 				if (hdr_stop(i)) {
+					adjust();
 					return BtrfsTreeItem();
 				}
 				next_sk(sk, i);
 			}
 		} while (!sk.m_result.empty());
+		adjust();
 		return BtrfsTreeItem();
 	}
 
@@ -520,6 +652,7 @@ namespace crucible {
 	BtrfsTreeOffsetFetcher::objectid(uint64_t objectid)
 	{
 		m_objectid = objectid;
+		batch_clear();
 	}
 
 	uint64_t
@@ -6,20 +6,25 @@
 
 #include <cassert>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BYTEVECTOR_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
 namespace crucible {
 	using namespace std;
 
 	ByteVector::iterator
 	ByteVector::begin() const
 	{
-		unique_lock<mutex> lock(m_mutex);
+		unique_lock<ByteVectorMutex> lock(m_mutex);
 		return m_ptr.get();
 	}
 
 	ByteVector::iterator
 	ByteVector::end() const
 	{
-		unique_lock<mutex> lock(m_mutex);
+		unique_lock<ByteVectorMutex> lock(m_mutex);
 		return m_ptr.get() + m_size;
 	}
 
@@ -38,7 +43,7 @@ namespace crucible {
 	void
 	ByteVector::clear()
 	{
-		unique_lock<mutex> lock(m_mutex);
+		unique_lock<ByteVectorMutex> lock(m_mutex);
 		m_ptr.reset();
 		m_size = 0;
 	}
@@ -46,13 +51,13 @@ namespace crucible {
 	ByteVector::value_type&
 	ByteVector::operator[](size_t size) const
 	{
-		unique_lock<mutex> lock(m_mutex);
+		unique_lock<ByteVectorMutex> lock(m_mutex);
 		return m_ptr.get()[size];
 	}
 
 	ByteVector::ByteVector(const ByteVector &that)
 	{
-		unique_lock<mutex> lock(that.m_mutex);
+		unique_lock<ByteVectorMutex> lock(that.m_mutex);
 		m_ptr = that.m_ptr;
 		m_size = that.m_size;
 	}
@@ -63,8 +68,8 @@ namespace crucible {
 		// If &that == this, there's no need to do anything, but
 		// especially don't try to lock the same mutex twice.
 		if (&m_mutex != &that.m_mutex) {
-			unique_lock<mutex> lock_this(m_mutex, defer_lock);
-			unique_lock<mutex> lock_that(that.m_mutex, defer_lock);
+			unique_lock<ByteVectorMutex> lock_this(m_mutex, defer_lock);
+			unique_lock<ByteVectorMutex> lock_that(that.m_mutex, defer_lock);
 			lock(lock_this, lock_that);
 			m_ptr = that.m_ptr;
 			m_size = that.m_size;
@@ -90,29 +95,126 @@ namespace crucible {
 	ByteVector::value_type&
 	ByteVector::at(size_t size) const
 	{
-		unique_lock<mutex> lock(m_mutex);
+		unique_lock<ByteVectorMutex> lock(m_mutex);
 		THROW_CHECK0(out_of_range, m_ptr);
 		THROW_CHECK2(out_of_range, size, m_size, size < m_size);
 		return m_ptr.get()[size];
 	}
 
-	static
-	void *
-	bv_allocate(size_t size)
-	{
+	/// Per-thread free lists of buffers, one for each power of two from
+	/// 4K to 1M.  Read and ioctl buffers are allocated and freed on every
+	/// call, so they are recycled instead of returned to malloc.  Buffers
+	/// freed by a thread go on that thread's lists, wherever they were
+	/// allocated.
+	class ByteVectorPool {
+		struct FreeBlock {
+			FreeBlock *m_next;
+		};
+		static const size_t c_min_shift = 12;
+		static const size_t c_max_shift = 20;
+		// Free bytes kept per size class per thread
+		static const size_t c_max_free_bytes = 4 * 1024 * 1024;
+
+		// Trivially destructible, so they outlive the Reaper
+		static thread_local FreeBlock *tl_head[c_max_shift - c_min_shift + 1];
+		static thread_local size_t tl_count[c_max_shift - c_min_shift + 1];
+		static thread_local bool tl_dead;
+
+		struct Reaper {
+			~Reaper() {
+				tl_dead = true;
+				for (size_t i = 0; i <= c_max_shift - c_min_shift; ++i) {
+					while (tl_head[i]) {
+						const auto next = tl_head[i]->m_next;
+						free(tl_head[i]);
+						tl_head[i] = next;
+					}
+					tl_count[i] = 0;
+				}
+			}
+		};
+		static thread_local Reaper tl_reaper;
+
+	public:
+		/// Not a size class:  allocated by malloc and returned to free
+		static const size_t c_none = c_max_shift - c_min_shift + 1;
+
+		static size_t size_class(size_t size) {
+#ifdef BEES_VALGRIND
+			// Recycled buffers would hide reads of uninitialized data
+			(void)size;
+			return c_none;
+#else
+			// Smaller buffers are ioctl argument structs, malloc does those well
+			if (size <= (size_t(1) << (c_min_shift - 1)) || size > (size_t(1) << c_max_shift)) {
+				return c_none;
+			}
+			size_t shift = c_min_shift;
+			while ((size_t(1) << shift) < size) {
+				++shift;
+			}
+			return shift - c_min_shift;
+#endif
+		}
+
+		static void *allocate(size_t size, size_t sc) {
+			if (sc == c_none) {
 #ifdef BEES_VALGRIND
-		// XXX: only do this to shut up valgrind
-		return calloc(1, size);
+				// XXX: only do this to shut up valgrind
+				return calloc(1, size);
 #else
-		return malloc(size);
+				return malloc(size);
 #endif
+			}
+			if (tl_head[sc]) {
+				const auto rv = tl_head[sc];
+				tl_head[sc] = rv->m_next;
+				--tl_count[sc];
+				return rv;
+			}
+			return malloc(size_t(1) << (sc + c_min_shift));
+		}
+
+		static void deallocate(void *p, size_t sc) {
+			if (sc == c_none || tl_dead || tl_count[sc] >= (c_max_free_bytes >> (sc + c_min_shift))) {
+				free(p);
+				return;
+			}
+			// Make sure the lists are freed when this thread exits
+			(void)&tl_reaper;
+			const auto fb = static_cast<FreeBlock *>(p);
+			fb->m_next = tl_head[sc];
+			tl_head[sc] = fb;
+			++tl_count[sc];
+		}
+	};
+
+	thread_local ByteVectorPool::FreeBlock *ByteVectorPool::tl_head[ByteVectorPool::c_none];
+	thread_local size_t ByteVectorPool::tl_count[ByteVectorPool::c_none];
+	thread_local bool ByteVectorPool::tl_dead = false;
+	thread_local ByteVectorPool::Reaper ByteVectorPool::tl_reaper;
+
+	/// shared_ptr deleter which remembers the size class of the buffer
+	struct ByteVectorDeleter {
+		size_t m_size_class;
+		void operator()(ByteVector::value_type *p) const {
+			ByteVectorPool::deallocate(p, m_size_class);
+		}
+	};
+
+	ByteVector::Pointer
+	ByteVector::allocate(size_t size)
+	{
+		const auto size_class = ByteVectorPool::size_class(size);
+		const auto ptr = static_cast<value_type*>(ByteVectorPool::allocate(size, size_class));
+		// bad_alloc doesn't fit THROW_CHECK's template
+		THROW_CHECK0(runtime_error, ptr);
+		return Pointer(ptr, ByteVectorDeleter { .m_size_class = size_class });
 	}
 
 	ByteVector::ByteVector(size_t size)
 	{
-		m_ptr = Pointer(static_cast<value_type*>(bv_allocate(size)), free);
-		// bad_alloc doesn't fit THROW_CHECK's template
-		THROW_CHECK0(runtime_error, m_ptr);
+		m_ptr = allocate(size);
 		m_size = size;
 	}
 
@@ -120,8 +222,7 @@ namespace crucible {
 	{
 		const size_t size = end - begin;
 		const size_t alloc_size = max(size, min_size);
-		m_ptr = Pointer(static_cast<value_type*>(bv_allocate(alloc_size)), free);
-		THROW_CHECK0(runtime_error, m_ptr);
+		m_ptr = allocate(alloc_size);
 		m_size = alloc_size;
 		memcpy(m_ptr.get(), begin, size);
 	}
@@ -129,8 +230,8 @@ namespace crucible {
 	bool
 	ByteVector::operator==(const ByteVector &that) const
 	{
-		unique_lock<mutex> lock_this(m_mutex, defer_lock);
-		unique_lock<mutex> lock_that(that.m_mutex, defer_lock);
+		unique_lock<ByteVectorMutex> lock_this(m_mutex, defer_lock);
+		unique_lock<ByteVectorMutex> lock_that(that.m_mutex, defer_lock);
 		lock(lock_this, lock_that);
 		if (!m_ptr) {
 			return !that.m_ptr;
@@ -147,10 +248,91 @@ namespace crucible {
 		return !memcmp(m_ptr.get(), that.m_ptr.get(), m_size);
 	}
 
+	// Word-at-a-time scan, which the compiler vectorizes with the
+	// baseline SIMD of the target (SSE2 on x86_64, NEON on aarch64).
+	// Bail out every 256 bytes so nonzero data is rejected early.
+	static
+	bool
+	is_zero_words(const uint8_t *p, size_t len)
+	{
+		while (len && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+			if (*p++) {
+				return false;
+			}
+			--len;
+		}
+		const uint64_t *q = reinterpret_cast<const uint64_t *>(p);
+		while (len >= 256) {
+			uint64_t acc = 0;
+			for (size_t i = 0; i < 256 / sizeof(uint64_t); ++i) {
+				acc |= q[i];
+			}
+			if (acc) {
+				return false;
+			}
+			q += 256 / sizeof(uint64_t);
+			len -= 256;
+		}
+		p = reinterpret_cast<const uint8_t *>(q);
+		while (len--) {
+			if (*p++) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+#ifdef BYTEVECTOR_HAVE_AVX2
+	__attribute__((target("avx2")))
+	static
+	bool
+	is_zero_avx2(const uint8_t *p, size_t len)
+	{
+		while (len >= 128) {
+			const __m256i *q = reinterpret_cast<const __m256i *>(p);
+			const __m256i acc = _mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256(q), _mm256_loadu_si256(q + 1)),
+				_mm256_or_si256(_mm256_loadu_si256(q + 2), _mm256_loadu_si256(q + 3)));
+			if (!_mm256_testz_si256(acc, acc)) {
+				return false;
+			}
+			p += 128;
+			len -= 128;
+		}
+		return is_zero_words(p, len);
+	}
+#endif
+
+	using is_zero_fn = bool (*)(const uint8_t *, size_t);
+
+	static
+	is_zero_fn
+	select_is_zero()
+	{
+#ifdef BYTEVECTOR_HAVE_AVX2
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return is_zero_avx2;
+		}
+#endif
+		return is_zero_words;
+	}
+
+	bool
+	ByteVector::is_zero() const
+	{
+		static const is_zero_fn is_zero_impl = select_is_zero();
+		unique_lock<ByteVectorMutex> lock(m_mutex);
+		if (!m_ptr) {
+			return true;
+		}
+		return is_zero_impl(m_ptr.get(), m_size);
+	}
+
 	void
 	ByteVector::erase(iterator begin, iterator end)
 	{
-		unique_lock<mutex> lock(m_mutex);
+		unique_lock<ByteVectorMutex> lock(m_mutex);
 		const size_t size = end - begin;
 		if (!size) return;
 		THROW_CHECK0(out_of_range, m_ptr);
@@ -177,13 +359,13 @@ namespace crucible {
 	ByteVector::value_type*
 	ByteVector::data() const
 	{
-		unique_lock<mutex> lock(m_mutex);
+		unique_lock<ByteVectorMutex> lock(m_mutex);
 		return m_ptr.get();
 	}
 
 	ostream&
 	operator<<(ostream &os, const ByteVector &bv) {
-		unique_lock<mutex> lock(bv.m_mutex);
+		unique_lock<ByteVectorMutex> lock(bv.m_mutex);
 		hexdump(os, bv);
 		return os;
 	}
@@ -3,12 +3,17 @@
 #include "crucible/path.h"
 #include "crucible/process.h"
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <ctime>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <pthread.h>
 
@@ -20,6 +25,141 @@ namespace crucible {
 	static bool add_prefix_timestamp = true;
 	static bool add_prefix_level = true;
 
+	/// Bounded multi-producer ring of formatted output, drained by one
+	/// thread.  Each slot's sequence number says whether it is free for
+	/// the producer at that position or full for the consumer, so
+	/// producers never wait for a lock or for the consumer's writes.
+	/// Slot strings keep their capacity, so steady state has no allocation.
+	class ChatterQueue {
+		struct Slot {
+			atomic<size_t>	m_seq;
+			ostream		*m_os = nullptr;
+			string		m_text;
+		};
+
+		vector<Slot>		m_slots;
+		size_t			m_mask;
+		atomic<size_t>		m_enqueue_pos;
+		atomic<size_t>		m_dequeue_pos;
+		atomic<size_t>		m_dropped;
+
+		mutex			m_mutex;
+		condition_variable	m_work_cv;
+		condition_variable	m_done_cv;
+		bool			m_draining = false;
+
+		void drain_loop();
+	public:
+		ChatterQueue(size_t queue_size);
+		/// Returns the position of the queued text, or false if dropped
+		bool push(ostream &os, const string &text, size_t &pos);
+		void wait_for(size_t pos);
+		void flush();
+		size_t dropped() const { return m_dropped; }
+	};
+
+	// Never deleted, the drain thread may outlive static destructors
+	static ChatterQueue *chatter_queue = nullptr;
+
+	ChatterQueue::ChatterQueue(size_t queue_size) :
+		m_enqueue_pos(0),
+		m_dequeue_pos(0),
+		m_dropped(0)
+	{
+		size_t size = 2;
+		while (size < queue_size) {
+			size *= 2;
+		}
+		m_slots = vector<Slot>(size);
+		m_mask = size - 1;
+		for (size_t i = 0; i < size; ++i) {
+			m_slots[i].m_seq.store(i, memory_order_relaxed);
+		}
+		thread([this]() { drain_loop(); }).detach();
+	}
+
+	bool
+	ChatterQueue::push(ostream &os, const string &text, size_t &pos)
+	{
+		pos = m_enqueue_pos.load(memory_order_relaxed);
+		Slot *slot;
+		while (true) {
+			slot = &m_slots[pos & m_mask];
+			const auto seq = slot->m_seq.load(memory_order_acquire);
+			const auto diff = static_cast<ptrdiff_t>(seq - pos);
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// The consumer hasn't freed this slot yet, so the queue is full
+				m_dropped.fetch_add(1, memory_order_relaxed);
+				return false;
+			} else {
+				pos = m_enqueue_pos.load(memory_order_relaxed);
+			}
+		}
+		slot->m_os = &os;
+		slot->m_text.assign(text);
+		slot->m_seq.store(pos + 1, memory_order_release);
+		m_work_cv.notify_one();
+		return true;
+	}
+
+	void
+	ChatterQueue::drain_loop()
+	{
+		string text;
+		size_t dropped_reported = 0;
+		while (true) {
+			const auto pos = m_dequeue_pos.load(memory_order_relaxed);
+			Slot &slot = m_slots[pos & m_mask];
+			if (slot.m_seq.load(memory_order_acquire) != pos + 1) {
+				unique_lock<mutex> lock(m_mutex);
+				m_done_cv.notify_all();
+				// Producers don't take the lock, so poll in case a wakeup was missed
+				m_work_cv.wait_for(lock, chrono::milliseconds(100));
+				continue;
+			}
+
+			// Free the slot before writing, so producers can reuse it
+			ostream &os = *slot.m_os;
+			text.swap(slot.m_text);
+			slot.m_seq.store(pos + m_mask + 1, memory_order_release);
+
+			const auto dropped = m_dropped.load(memory_order_relaxed);
+			if (dropped != dropped_reported) {
+				os << "(" << dropped - dropped_reported << " log messages dropped)\n";
+				dropped_reported = dropped;
+			}
+			os << text << std::flush;
+			m_dequeue_pos.store(pos + 1, memory_order_release);
+		}
+	}
+
+	void
+	ChatterQueue::wait_for(size_t pos)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		while (m_dequeue_pos.load(memory_order_acquire) <= pos) {
+			m_work_cv.notify_one();
+			m_done_cv.wait_for(lock, chrono::milliseconds(10));
+		}
+	}
+
+	void
+	ChatterQueue::flush()
+	{
+		// Everything pushed before now has a position below this one
+		const auto pos = m_enqueue_pos.load(memory_order_acquire);
+		if (pos) {
+			wait_for(pos - 1);
+		}
+	}
+
+	// Each thread assembles its output here, so formatting doesn't allocate
+	static thread_local string tl_chatter_buffer;
+
 	static
 	void
 	init_chatter_names()
@@ -93,22 +233,67 @@ namespace crucible {
 
 		header_stream << ": ";
 
-		string out = m_oss.str();
-		string header = header_stream.str();
+		const string out = m_oss.str();
+		const string header = header_stream.str();
 
+		// Every line gets the header
+		string &buffer = tl_chatter_buffer;
+		buffer.clear();
 		string::size_type start = 0;
 		while (start < out.size()) {
 			size_t end_line = out.find_first_of("\n", start);
 			if (end_line != string::npos) {
 				assert(out[end_line] == '\n');
-				size_t end = end_line;
-				m_os << (header + out.substr(start, end - start) + "\n") << flush;
+				buffer.append(header).append(out, start, end_line - start).append("\n");
 				start = end_line + 1;
 			} else {
-				m_os << (header + out.substr(start) + "\n") << flush;
+				buffer.append(header).append(out, start, string::npos).append("\n");
 				start = out.size();
 			}
 		}
+		if (buffer.empty()) {
+			return;
+		}
+
+		if (chatter_queue) {
+			size_t pos;
+			if (m_loglevel > LOG_ERR) {
+				chatter_queue->push(m_os, buffer, pos);
+				return;
+			}
+			// Errors are never dropped, and are written before we return
+			while (!chatter_queue->push(m_os, buffer, pos)) {
+				chatter_queue->flush();
+			}
+			chatter_queue->wait_for(pos);
+			return;
+		}
+
+		m_os << buffer << flush;
+	}
+
+	void
+	Chatter::enable_async(size_t queue_size)
+	{
+		if (chatter_queue) {
+			return;
+		}
+		chatter_queue = new ChatterQueue(queue_size);
+		atexit(flush_async);
+	}
+
+	void
+	Chatter::flush_async()
+	{
+		if (chatter_queue) {
+			chatter_queue->flush();
+		}
+	}
+
+	size_t
+	Chatter::async_dropped()
+	{
+		return chatter_queue ? chatter_queue->dropped() : 0;
 	}
 
 	Chatter::Chatter(Chatter &&c)
@@ -0,0 +1,6 @@
+#ifndef _CONFIGURE_H
+
+#define ETC_PREFIX "/etc"
+
+#define _CONFIGURE_H
+#endif
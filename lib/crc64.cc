@@ -28,7 +28,13 @@
 
 #include "crucible/crc64.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC64_HAVE_PCLMUL 1
+#include <wmmintrin.h>
+#endif
+
 #define POLY64REV 0xd800000000000000ULL
+#define POLY64 0x000000000000001bULL
 
 namespace crucible {
 
@@ -65,12 +71,11 @@ namespace crucible {
 		}
 	}
 
+	static
 	uint64_t
-	Digest::CRC::crc64(const void *p, size_t len)
+	crc64_slice8(uint64_t crc, const void *p, size_t len)
 	{
-		init_crc64_table();
 		const unsigned char *next = static_cast<const unsigned char *>(p);
-		uint64_t crc = 0;
 
 		// Process individual bytes until we reach an 8-byte aligned pointer
 		while (len && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
@@ -102,5 +107,151 @@ namespace crucible {
 		return crc;
 	}
 
+#ifdef CRC64_HAVE_PCLMUL
+	// Folding constants for the carry-less multiply kernel.  The CRC is
+	// bit-reflected, so each constant is x^n mod P stored bit-reversed,
+	// and n is one less than the fold distance to cancel the extra factor
+	// of x that a reflected carry-less multiply introduces.
+	struct FoldConstants {
+		uint64_t	fold_512_lo, fold_512_hi;
+		uint64_t	fold_384_lo, fold_384_hi;
+		uint64_t	fold_256_lo, fold_256_hi;
+		uint64_t	fold_128_lo, fold_128_hi;
+	};
+
+	static
+	uint64_t
+	reflect64(uint64_t v)
+	{
+		uint64_t rv = 0;
+		for (int i = 0; i < 64; ++i) {
+			rv = (rv << 1) | (v & 1);
+			v >>= 1;
+		}
+		return rv;
+	}
+
+	static
+	uint64_t
+	xpow_mod_p(unsigned n)
+	{
+		uint64_t r = 1;
+		while (n--) {
+			const bool carry = r >> 63;
+			r <<= 1;
+			if (carry) {
+				r ^= POLY64;
+			}
+		}
+		return reflect64(r);
+	}
+
+	static
+	FoldConstants
+	make_fold_constants()
+	{
+		FoldConstants fc;
+		fc.fold_512_lo = xpow_mod_p(512 + 63);
+		fc.fold_512_hi = xpow_mod_p(512 - 1);
+		fc.fold_384_lo = xpow_mod_p(384 + 63);
+		fc.fold_384_hi = xpow_mod_p(384 - 1);
+		fc.fold_256_lo = xpow_mod_p(256 + 63);
+		fc.fold_256_hi = xpow_mod_p(256 - 1);
+		fc.fold_128_lo = xpow_mod_p(128 + 63);
+		fc.fold_128_hi = xpow_mod_p(128 - 1);
+		return fc;
+	}
+
+	__attribute__((target("pclmul")))
+	static inline
+	__m128i
+	fold_128(__m128i acc, __m128i k, __m128i data)
+	{
+		return _mm_xor_si128(data, _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x00), _mm_clmulepi64_si128(acc, k, 0x11)));
+	}
+
+	// Fold 64 bytes per iteration through four independent accumulators,
+	// then collapse them into one 16-byte remainder that has the same
+	// CRC as everything folded so far.  The remainder is finished with
+	// the table code, which also handles the unaligned tail, so there is
+	// no Barrett reduction to get wrong.
+	__attribute__((target("pclmul")))
+	static
+	uint64_t
+	crc64_pclmul(uint64_t crc, const void *p, size_t len)
+	{
+		static const FoldConstants fc = make_fold_constants();
+		const unsigned char *next = static_cast<const unsigned char *>(p);
+
+		if (len < 128) {
+			return crc64_slice8(crc, next, len);
+		}
+
+		const __m128i *q = reinterpret_cast<const __m128i *>(next);
+		__m128i acc0 = _mm_xor_si128(_mm_loadu_si128(q), _mm_set_epi64x(0, crc));
+		__m128i acc1 = _mm_loadu_si128(q + 1);
+		__m128i acc2 = _mm_loadu_si128(q + 2);
+		__m128i acc3 = _mm_loadu_si128(q + 3);
+		next += 64;
+		len -= 64;
+
+		const __m128i k512 = _mm_set_epi64x(fc.fold_512_hi, fc.fold_512_lo);
+		while (len >= 64) {
+			q = reinterpret_cast<const __m128i *>(next);
+			acc0 = fold_128(acc0, k512, _mm_loadu_si128(q));
+			acc1 = fold_128(acc1, k512, _mm_loadu_si128(q + 1));
+			acc2 = fold_128(acc2, k512, _mm_loadu_si128(q + 2));
+			acc3 = fold_128(acc3, k512, _mm_loadu_si128(q + 3));
+			next += 64;
+			len -= 64;
+		}
+
+		acc3 = fold_128(acc0, _mm_set_epi64x(fc.fold_384_hi, fc.fold_384_lo), acc3);
+		acc3 = fold_128(acc1, _mm_set_epi64x(fc.fold_256_hi, fc.fold_256_lo), acc3);
+		acc3 = fold_128(acc2, _mm_set_epi64x(fc.fold_128_hi, fc.fold_128_lo), acc3);
+
+		const __m128i k128 = _mm_set_epi64x(fc.fold_128_hi, fc.fold_128_lo);
+		while (len >= 16) {
+			acc3 = fold_128(acc3, k128, _mm_loadu_si128(reinterpret_cast<const __m128i *>(next)));
+			next += 16;
+			len -= 16;
+		}
+
+		uint64_t remainder[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(remainder), acc3);
+		crc = crc64_slice8(0, remainder, sizeof(remainder));
+		return crc64_slice8(crc, next, len);
+	}
+#endif
+
+	using crc64_fn = uint64_t (*)(uint64_t, const void *, size_t);
+
+	static
+	crc64_fn
+	select_crc64()
+	{
+		init_crc64_table();
+#ifdef CRC64_HAVE_PCLMUL
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("pclmul")) {
+			return crc64_pclmul;
+		}
+#endif
+		return crc64_slice8;
+	}
+
+	uint64_t
+	Digest::CRC::crc64(const void *p, size_t len)
+	{
+		static const crc64_fn crc64_impl = select_crc64();
+		return crc64_impl(0, p, len);
+	}
+
+	uint64_t
+	Digest::CRC::crc64_portable(const void *p, size_t len)
+	{
+		init_crc64_table();
+		return crc64_slice8(0, p, len);
+	}
 
 };
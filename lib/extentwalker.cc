@@ -6,6 +6,8 @@
 #include "crucible/limits.h"
 #include "crucible/string.h"
 
+#include <map>
+
 namespace crucible {
 	using namespace std;
 
@@ -27,6 +29,10 @@ namespace crucible {
 	// before the target extent, so we don't have to search backward as often.
 	static const off_t sc_back_step_size = 64 * 1024;
 
+	// Cached TREE_SEARCH results per thread before the cache is emptied.
+	// A Scope normally covers a few files.
+	static const size_t sc_extent_cache_max = 4096;
+
 #ifdef EXTENTWALKER_DEBUG
 #define EWLOG(x) do { \
 	m_log << x << endl; \
@@ -466,6 +472,44 @@ namespace crucible {
 	{
 	}
 
+	struct BtrfsExtentCacheEntry {
+		uint64_t			m_tree_id = 0;
+		off_t				m_size = 0;
+		map<off_t, ExtentWalker::Vec>	m_maps;
+	};
+
+	using BtrfsExtentCacheMap = map<pair<dev_t, ino_t>, BtrfsExtentCacheEntry>;
+
+	static thread_local BtrfsExtentCacheMap *tl_extent_cache = nullptr;
+	static thread_local size_t tl_extent_cache_count = 0;
+
+	BtrfsExtentCache::Scope::Scope() :
+		m_outer(!tl_extent_cache)
+	{
+		if (m_outer) {
+			tl_extent_cache = new BtrfsExtentCacheMap;
+			tl_extent_cache_count = 0;
+		}
+	}
+
+	BtrfsExtentCache::Scope::~Scope()
+	{
+		if (m_outer) {
+			delete tl_extent_cache;
+			tl_extent_cache = nullptr;
+		}
+	}
+
+	void
+	BtrfsExtentCache::invalidate(int fd)
+	{
+		if (!tl_extent_cache) {
+			return;
+		}
+		Stat st(fd);
+		tl_extent_cache->erase(make_pair(st.st_dev, st.st_ino));
+	}
+
 	BtrfsExtentWalker::BtrfsExtentWalker(Fd fd) :
 		ExtentWalker(fd),
 		m_tree_id(0)
@@ -496,6 +540,28 @@ namespace crucible {
 	BtrfsExtentWalker::Vec
 	BtrfsExtentWalker::get_extent_map(off_t pos)
 	{
+		BtrfsExtentCacheEntry *cached = nullptr;
+		if (tl_extent_cache) {
+			if (tl_extent_cache_count >= sc_extent_cache_max) {
+				tl_extent_cache->clear();
+				tl_extent_cache_count = 0;
+			}
+			cached = &(*tl_extent_cache)[make_pair(m_stat.st_dev, m_stat.st_ino)];
+			// run_fiemap refreshed m_stat just before calling us
+			if (cached->m_size != m_stat.st_size) {
+				cached->m_maps.clear();
+				cached->m_size = m_stat.st_size;
+			}
+			const auto found = cached->m_maps.find(pos);
+			if (found != cached->m_maps.end()) {
+				EWTRACE("cached extent map at " << to_hex(pos));
+				return found->second;
+			}
+			if (!m_tree_id) {
+				m_tree_id = cached->m_tree_id;
+			}
+		}
+
 		BtrfsIoctlSearchKey sk;
 		if (!m_root_fd) {
 			m_root_fd = m_fd;
@@ -633,6 +699,12 @@ namespace crucible {
 			rv.rbegin()->m_flags |= FIEMAP_EXTENT_LAST;
 		}
 
+		if (cached) {
+			cached->m_tree_id = m_tree_id;
+			cached->m_maps[pos] = rv;
+			++tl_extent_cache_count;
+		}
+
 		return rv;
 	}
 
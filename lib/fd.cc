@@ -399,6 +399,7 @@ namespace crucible {
 				THROW_ERROR(runtime_error, "read: somehow read more bytes (" << rv << ") than requested (" << size << ")");
 			}
 			if (rv == 0) break;
+			buf = static_cast<uint8_t *>(buf) + rv;
 			size_read += rv;
 			size -= rv;
 			// CHATTER("read " << rv << " bytes from fd " << fd);
@@ -182,6 +182,43 @@ namespace crucible {
 		return true;
 	}
 
+	vector<int>
+	btrfs_extent_same_multi(int src_fd, off_t src_offset, off_t src_length, const vector<pair<int, off_t>> &dsts)
+	{
+		THROW_CHECK1(invalid_argument, src_length, src_length > 0);
+		vector<int> statuses(dsts.size(), 0);
+		for (off_t done = 0; done < src_length; ) {
+			const off_t length = min(off_t(BTRFS_MAX_DEDUPE_LEN), src_length - done);
+			// Only the dsts that matched so far get the next chunk
+			vector<size_t> active;
+			for (size_t i = 0; i < dsts.size(); ++i) {
+				if (!statuses[i]) {
+					active.push_back(i);
+				}
+			}
+			if (active.empty()) {
+				break;
+			}
+			for (size_t first = 0; first < active.size(); first += BTRFS_MAX_DEDUPE_DESTS) {
+				const size_t last = min(active.size(), first + BTRFS_MAX_DEDUPE_DESTS);
+				BtrfsExtentSame bes(src_fd, src_offset + done, length);
+				for (size_t i = first; i < last; ++i) {
+					bes.add(dsts[active[i]].first, dsts[active[i]].second + done);
+				}
+				bes.do_ioctl();
+				for (size_t i = first; i < last; ++i) {
+					const auto status = bes.m_info.at(i - first).status;
+					if (status > 0 && status != BTRFS_SAME_DATA_DIFFERS) {
+						THROW_ERROR(runtime_error, "btrfs-extent-same unknown status " << status << ": " << bes);
+					}
+					statuses[active[i]] = status;
+				}
+			}
+			done += length;
+		}
+		return statuses;
+	}
+
 	BtrfsDataContainer::BtrfsDataContainer(size_t buf_size) :
 		m_data(buf_size)
 	{
@@ -253,9 +290,13 @@ namespace crucible {
 		return os;
 	}
 
+	// Big enough for LOGICAL_INO v1, and for most extents with v2
+	static const size_t s_logical_ino_initial_size = 64 * 1024;
+
 	BtrfsIoctlLogicalInoArgs::BtrfsIoctlLogicalInoArgs(uint64_t new_logical, size_t new_size) :
-		m_container_size(new_size),
-		m_container(new_size),
+		m_max_container_size(new_size),
+		m_container_size(min(new_size, s_logical_ino_initial_size)),
+		m_container(m_container_size),
 		m_logical(new_logical)
 	{
 	}
@@ -315,8 +356,51 @@ namespace crucible {
 		return m_flags;
 	}
 
+	void
+	BtrfsIoctlLogicalInoArgs::set_logical(uint64_t new_logical)
+	{
+		m_logical = new_logical;
+		m_iors.clear();
+	}
+
+	uint64_t
+	BtrfsIoctlLogicalInoArgs::get_logical() const
+	{
+		return m_logical;
+	}
+
+	size_t
+	BtrfsIoctlLogicalInoArgs::get_container_size() const
+	{
+		return m_container_size;
+	}
+
+	void
+	BtrfsIoctlLogicalInoArgs::shrink()
+	{
+		m_container_size = min(m_max_container_size, s_logical_ino_initial_size);
+		m_container = BtrfsDataContainer(m_container_size);
+	}
+
+	static unsigned long bili_version = 0;
+
 	bool
 	BtrfsIoctlLogicalInoArgs::do_ioctl_nothrow(int fd)
+	{
+		while (do_ioctl_once(fd)) {
+			// v1 is limited to 64K no matter how big the buffer is
+			const auto missing = m_container.get_bytes_missing();
+			if (!missing || bili_version != BTRFS_IOC_LOGICAL_INO_V2 || m_container_size >= m_max_container_size) {
+				return true;
+			}
+			// Grow to fit, at least doubling so there are few retries
+			m_container_size = min(m_max_container_size, max(m_container_size * 2, m_container_size + size_t(missing)));
+		}
+		return false;
+	}
+
+	bool
+	BtrfsIoctlLogicalInoArgs::do_ioctl_once(int fd)
 	{
 		btrfs_ioctl_logical_ino_args args = (btrfs_ioctl_logical_ino_args) {
 			.logical = m_logical,
@@ -330,8 +414,6 @@ namespace crucible {
 
 		m_iors.clear();
 
-		static unsigned long bili_version = 0;
-
 		if (get_flags() == 0) {
 			// Could use either V1 or V2
 			if (bili_version) {
@@ -749,8 +831,15 @@ namespace crucible {
 		// was; instead, we have to guess.
 
 		m_result.clear();
+		const size_t hdr_size = sizeof(btrfs_ioctl_search_header);
+		size_t buf_size = m_buf_size;
+		// Size the buffer for nr_items items of the average size seen so far
+		if (m_items) {
+			const size_t typical_size = hdr_size + m_item_bytes / m_items;
+			buf_size = max(buf_size, min(size_t(65536), typical_size * nr_items));
+		}
 		// Make sure there is space for at least the search key and one (empty) header
-		size_t buf_size = max(m_buf_size, sizeof(btrfs_ioctl_search_args_v2) + sizeof(btrfs_ioctl_search_header));
+		buf_size = max(buf_size, sizeof(btrfs_ioctl_search_args_v2) + hdr_size);
 		ByteVector ioctl_arg;
 		btrfs_ioctl_search_args_v2 *ioctl_ptr;
 		do {
@@ -769,6 +858,12 @@ namespace crucible {
 				m_buf_size = max(m_buf_size, buf_size);
 				break;
 			}
+			if (rv == 0 && buf_size - item_bytes(ioctl_arg, ioctl_ptr->key.nr_items) >= hdr_size + m_max_item_size) {
+				// There was room for another item as big as any we have
+				// seen, so we ran out of items, not buffer.  A bigger
+				// buffer would only repeat the same search.
+				break;
+			}
 			// Didn't get all the items we wanted.  Increase the buf size and try again.
 			// These sizes are very common on default-formatted btrfs, so use these
 			// instead of naive doubling.
@@ -791,11 +886,29 @@ namespace crucible {
 		for (decltype(nr_items) i = 0; i < nr_items; ++i) {
 			BtrfsIoctlSearchHeader item;
 			offset = item.set_data(ioctl_arg, offset);
+			++m_items;
+			m_item_bytes += item.len;
+			m_max_item_size = max(m_max_item_size, size_t(item.len));
 			m_result.insert(item);
 		}
 		return true;
 	}
 
+	size_t
+	BtrfsIoctlSearchKey::item_bytes(const ByteVector &ioctl_arg, size_t count)
+	{
+		const size_t base = sizeof(btrfs_ioctl_search_args_v2);
+		size_t used = 0;
+		for (size_t i = 0; i < count; ++i) {
+			btrfs_ioctl_search_header hdr;
+			THROW_CHECK2(out_of_range, base + used, ioctl_arg.size(), base + used + sizeof(hdr) <= ioctl_arg.size());
+			memcpy(&hdr, &ioctl_arg[base + used], sizeof(hdr));
+			used += sizeof(hdr) + hdr.len;
+			m_max_item_size = max(m_max_item_size, size_t(hdr.len));
+		}
+		return used;
+	}
+
 	void
 	BtrfsIoctlSearchKey::do_ioctl(int fd)
 	{
@@ -33,6 +33,10 @@ namespace crucible {
 				return false;
 			}
 		}
+		const auto found = m_limits.find(type);
+		if (found != m_limits.end() && found->second != 0 && m_counters[type] >= found->second) {
+			return false;
+		}
 		return true;
 	}
 
@@ -43,7 +47,8 @@ namespace crucible {
 		auto &counter = m_counters[type];
 		THROW_CHECK2(runtime_error, type, counter, counter > 0);
 		--counter;
-		if (counter == 0) {
+		const auto found = m_limits.find(type);
+		if (counter == 0 || (found != m_limits.end() && found->second != 0)) {
 			m_cv.notify_all();
 		}
 	}
@@ -62,11 +67,35 @@ namespace crucible {
 		return rv;
 	}
 
+	void
+	MultiLocker::set_limit_private(const string &type, size_t limit)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		auto &old_limit = m_limits[type];
+		const bool wider = limit == 0 || (old_limit != 0 && limit > old_limit);
+		old_limit = limit;
+		if (wider) {
+			m_cv.notify_all();
+		}
+	}
+
+	MultiLocker &
+	MultiLocker::process_instance()
+	{
+		static MultiLocker s_process_instance;
+		return s_process_instance;
+	}
+
 	shared_ptr<MultiLocker::LockHandle>
 	MultiLocker::get_lock(const string &type)
 	{
-		static MultiLocker s_process_instance;
-		return s_process_instance.get_lock_private(type);
+		return process_instance().get_lock_private(type);
+	}
+
+	void
+	MultiLocker::set_limit(const string &type, size_t limit)
+	{
+		process_instance().set_limit_private(type, limit);
 	}
 
 }
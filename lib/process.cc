@@ -2,9 +2,12 @@
 
 #include "crucible/chatter.h"
 #include "crucible/error.h"
+#include "crucible/fd.h"
 #include "crucible/ntoa.h"
 
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <utility>
 
 // for gettid()
@@ -12,7 +15,9 @@
 #define _GNU_SOURCE
 #endif
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
 
 namespace crucible {
 	using namespace std;
@@ -150,6 +155,148 @@ namespace crucible {
 		return loadavg[2];
 	}
 
+	static
+	bool
+	pressure_readable(const string &path)
+	{
+		// Kernels booted with psi=0 have the files, but reads fail
+		const Fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+		char buf[1];
+		return fd && read(fd, buf, sizeof(buf)) > 0;
+	}
+
+	string
+	cgroup_path()
+	{
+		// The cgroup v2 entry of /proc/self/cgroup is "0::/path"
+		const Fd fd(open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC));
+		if (!fd) {
+			return string();
+		}
+		const string cgroups = read_string(fd, 4096);
+		const string tag = "0::";
+		auto pos = cgroups.find(tag);
+		if (pos != 0 && (pos == string::npos || cgroups[pos - 1] != '\n')) {
+			return string();
+		}
+		pos += tag.size();
+		const auto end = cgroups.find('\n', pos);
+		const string path = "/sys/fs/cgroup" + cgroups.substr(pos, end - pos);
+		// The root cgroup has none of the interface files
+		if (path == "/sys/fs/cgroup/") {
+			return string();
+		}
+		return path;
+	}
+
+	string
+	pressure_path(const string &resource)
+	{
+		const string cgroup = cgroup_path();
+		if (!cgroup.empty()) {
+			const string cgroup_pressure = cgroup + "/" + resource + ".pressure";
+			if (pressure_readable(cgroup_pressure)) {
+				return cgroup_pressure;
+			}
+		}
+		const string proc_path = "/proc/pressure/" + resource;
+		if (pressure_readable(proc_path)) {
+			return proc_path;
+		}
+		return string();
+	}
+
+	uint64_t
+	pressure_some_total(const string &path)
+	{
+		const Fd fd(open_or_die(path, O_RDONLY | O_CLOEXEC));
+		const string pressure = read_string(fd, 4096);
+		// "some avg10=0.00 avg60=0.00 avg300=0.00 total=12345"
+		THROW_CHECK1(runtime_error, path, pressure.compare(0, 5, "some ") == 0);
+		const string tag = " total=";
+		const auto pos = pressure.find(tag);
+		THROW_CHECK1(runtime_error, path, pos != string::npos);
+		return stoull(pressure.substr(pos + tag.size()));
+	}
+
+	int
+	listen_fd(const string &name)
+	{
+		// Same protocol as sd_listen_fds_with_names, without libsystemd
+		const char *const pid_env = getenv("LISTEN_PID");
+		const char *const fds_env = getenv("LISTEN_FDS");
+		const char *const names_env = getenv("LISTEN_FDNAMES");
+		if (!pid_env || !fds_env || !names_env || stoll(pid_env) != getpid()) {
+			return -1;
+		}
+		const int first_fd = 3;
+		const int fd_count = stoi(fds_env);
+		const string names = names_env;
+		size_t pos = 0;
+		for (int fd = first_fd; fd < first_fd + fd_count && pos <= names.size(); ++fd) {
+			auto end = names.find(':', pos);
+			if (end == string::npos) {
+				end = names.size();
+			}
+			if (names.substr(pos, end - pos) == name) {
+				return fd;
+			}
+			pos = end + 1;
+		}
+		return -1;
+	}
+
+	bool
+	service_notify(const string &message_in, int fd)
+	{
+		const char *const socket_env = getenv("NOTIFY_SOCKET");
+		if (!socket_env || !*socket_env) {
+			return false;
+		}
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		const string socket_path = socket_env;
+		THROW_CHECK1(invalid_argument, socket_path, socket_path.size() < sizeof(addr.sun_path));
+		memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+		// Abstract socket names start with '@' in the environment, NUL in the address
+		if (addr.sun_path[0] == '@') {
+			addr.sun_path[0] = 0;
+		}
+
+		const Fd sock(socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+		if (!sock) {
+			THROW_ERRNO("socket(AF_UNIX, SOCK_DGRAM)");
+		}
+
+		string message = message_in;
+		iovec iov;
+		iov.iov_base = &message[0];
+		iov.iov_len = message.size();
+		union {
+			cmsghdr	align;
+			char	buf[CMSG_SPACE(sizeof(int))];
+		} control;
+		memset(&control, 0, sizeof(control));
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &addr;
+		msg.msg_namelen = offsetof(sockaddr_un, sun_path) + socket_path.size();
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (fd >= 0) {
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+			cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+		DIE_IF_MINUS_ONE(sendmsg(sock, &msg, MSG_NOSIGNAL));
+		return true;
+	}
+
 	static const struct bits_ntoa_table signals_table[] = {
 
 		// POSIX.1-1990
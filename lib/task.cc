@@ -6,6 +6,7 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <list>
 #include <map>
 #include <mutex>
@@ -47,7 +48,97 @@ namespace crucible {
 	using TaskConsumerPtr = shared_ptr<TaskConsumer>;
 	using TaskConsumerWeak = weak_ptr<TaskConsumer>;
 
-	using TaskQueue = list<TaskStatePtr>;
+	/// Per-thread free list of fixed-size blocks.  Every Task needs a
+	/// TaskState and usually a queue node or two, and their lifetimes
+	/// are short, so blocks are recycled instead of returned to malloc.
+	/// Blocks freed by a thread go on that thread's list, wherever they
+	/// were allocated.
+	template <size_t Size>
+	class TaskSlab {
+		struct FreeBlock {
+			FreeBlock *m_next;
+		};
+		static const size_t c_block_size = Size < sizeof(FreeBlock) ? sizeof(FreeBlock) : Size;
+		static const size_t c_max_free = 4096;
+
+		// Trivially destructible, so they outlive the Reaper
+		static thread_local FreeBlock *tl_head;
+		static thread_local size_t tl_count;
+		static thread_local bool tl_dead;
+
+		struct Reaper {
+			~Reaper() {
+				tl_dead = true;
+				while (tl_head) {
+					const auto next = tl_head->m_next;
+					::operator delete(tl_head);
+					tl_head = next;
+				}
+				tl_count = 0;
+			}
+		};
+		static thread_local Reaper tl_reaper;
+
+	public:
+		static void *allocate() {
+			if (tl_head) {
+				const auto rv = tl_head;
+				tl_head = rv->m_next;
+				--tl_count;
+				return rv;
+			}
+			return ::operator new(c_block_size);
+		}
+
+		static void deallocate(void *p) {
+			if (tl_dead || tl_count >= c_max_free) {
+				::operator delete(p);
+				return;
+			}
+			// Make sure the list is freed when this thread exits
+			(void)&tl_reaper;
+			const auto fb = static_cast<FreeBlock *>(p);
+			fb->m_next = tl_head;
+			tl_head = fb;
+			++tl_count;
+		}
+	};
+
+	template <size_t Size> thread_local typename TaskSlab<Size>::FreeBlock *TaskSlab<Size>::tl_head = nullptr;
+	template <size_t Size> thread_local size_t TaskSlab<Size>::tl_count = 0;
+	template <size_t Size> thread_local bool TaskSlab<Size>::tl_dead = false;
+	template <size_t Size> thread_local typename TaskSlab<Size>::Reaper TaskSlab<Size>::tl_reaper;
+
+	/// Allocator for TaskState (with its shared_ptr control block) and
+	/// TaskQueue nodes.
+	template <class T>
+	struct TaskAllocator {
+		using value_type = T;
+
+		TaskAllocator() = default;
+		template <class U> TaskAllocator(const TaskAllocator<U> &) {}
+
+		T *allocate(size_t n) {
+			if (n != 1) {
+				return static_cast<T *>(::operator new(n * sizeof(T)));
+			}
+			return static_cast<T *>(TaskSlab<sizeof(T)>::allocate());
+		}
+
+		void deallocate(T *p, size_t n) {
+			if (n != 1) {
+				::operator delete(p);
+				return;
+			}
+			TaskSlab<sizeof(T)>::deallocate(p);
+		}
+
+		template <class U> bool operator==(const TaskAllocator<U> &) const { return true; }
+		template <class U> bool operator!=(const TaskAllocator<U> &) const { return false; }
+	};
+
+	using TaskQueue = list<TaskStatePtr, TaskAllocator<TaskStatePtr>>;
+	using TaskRunQueue = deque<TaskStatePtr>;
 
 	static thread_local TaskStatePtr tl_current_task;
 
@@ -74,7 +165,7 @@ namespace crucible {
 		const string				m_title;
 
 		/// Tasks to be executed after the current task is executed
-		list<TaskStatePtr>			m_post_exec_queue;
+		TaskQueue				m_post_exec_queue;
 
 		/// Set by run() and append().  Cleared by exec().
 		bool					m_run_now = false;
@@ -121,7 +212,8 @@ namespace crucible {
 		/// already started running, a new instance is scheduled.
 		/// If an instance is already scheduled by run() or
 		/// append(), does nothing.  Otherwise, schedules a new
-		/// instance at the end of TaskMaster's global queue.
+		/// instance at the end of the current worker's run queue,
+		/// or TaskMaster's global queue if not called from a worker.
 		void run();
 
 		/// Execute task immediately in current thread if it is not already
@@ -146,20 +238,73 @@ namespace crucible {
 	atomic<TaskId> TaskState::s_next_id;
 	atomic<size_t> TaskState::s_instance_count;
 
+	/// Workers try their own run queue first, then the global queue,
+	/// then steal from other workers.  Every c_global_queue_interval
+	/// tasks the global queue is tried first, so a worker that keeps
+	/// rescheduling its own tasks can't starve the global queue.
+	static const size_t c_global_queue_interval = 61;
+
+	/// Stall time of one PSI resource, and the percentage of the
+	/// time since the previous sample that was stalled
+	struct PressureSource {
+		string		m_resource;
+		string		m_path;
+		uint64_t	m_prev_total = 0;
+		double		m_percent = 0;
+		PressureSource(const string &resource) : m_resource(resource) {}
+		bool open();
+		void sample(double seconds);
+	};
+
+	bool
+	PressureSource::open()
+	{
+		if (m_path.empty()) {
+			m_path = pressure_path(m_resource);
+		}
+		return !m_path.empty();
+	}
+
+	void
+	PressureSource::sample(double seconds)
+	{
+		if (m_path.empty()) {
+			return;
+		}
+		catch_all([&]() {
+			const auto total = pressure_some_total(m_path);
+			if (m_prev_total && seconds > 0 && total >= m_prev_total) {
+				// total is in microseconds
+				m_percent = (total - m_prev_total) / (seconds * 10000.0);
+			}
+			m_prev_total = total;
+		});
+	}
+
 	class TaskMasterState : public enable_shared_from_this<TaskMasterState> {
 		mutex 					m_mutex;
 		condition_variable 			m_condvar;
-		TaskQueue				m_queue;
-		size_t					m_thread_max;
+		condition_variable 			m_idle_condvar;
+		TaskRunQueue				m_queue;
+		atomic<size_t>				m_thread_max;
 		size_t					m_thread_min = 0;
 		set<TaskConsumerPtr>			m_threads;
+		atomic<size_t>				m_thread_count;
+		atomic<size_t>				m_idle_count;
 		shared_ptr<thread>			m_load_tracking_thread;
 		double					m_load_target = 0;
 		double					m_prev_loadavg;
+		Timer					m_load_timer;
+		double					m_cpu_pressure_target = 0;
+		double					m_io_pressure_target = 0;
+		PressureSource				m_cpu_pressure { "cpu" };
+		PressureSource				m_io_pressure { "io" };
+		PressureSource				m_memory_pressure { "memory" };
+		Timer					m_pressure_timer;
 		size_t					m_configured_thread_max;
 		double					m_thread_target;
-		bool					m_cancelled = false;
-		bool					m_paused = false;
+		atomic<bool>				m_cancelled;
+		atomic<bool>				m_paused;
 		TaskMaster::LoadStats			m_load_stats;
 
 	friend class TaskConsumer;
@@ -172,9 +317,17 @@ namespace crucible {
 		void adjust_thread_count();
 		size_t calculate_thread_count_nolock();
 		void set_loadavg_target(double target);
+		void set_pressure_target(double cpu, double io);
+		void start_load_tracking_nolock();
+		bool pressure_tracking_nolock() const;
+		void update_pressure_nolock();
+		void update_loadavg_nolock();
 		void loadavg_thread_fn();
 		void cancel();
 		void pause(bool paused = true);
+		void wake_idle_consumer();
+		TaskStatePtr pop_global_nolock();
+		TaskStatePtr steal_nolock(const TaskConsumer *thief);
 
 		TaskMasterState &operator=(const TaskMasterState &) = delete;
 		TaskMasterState(const TaskMasterState &) = delete;
@@ -192,12 +345,24 @@ namespace crucible {
 
 	class TaskConsumer : public enable_shared_from_this<TaskConsumer> {
 		shared_ptr<TaskMasterState>	m_master;
+
+		/// Protects m_current_task and m_run_queue.  Other threads
+		/// take this lock to steal tasks or report status.
+		mutex				m_mutex;
 		TaskStatePtr			m_current_task;
 
+		/// Tasks scheduled with run() by tasks executing on this worker
+		TaskRunQueue			m_run_queue;
+
 	friend class TaskState;
 		TaskQueue			m_local_queue;
 
+		/// Tasks executed by this worker, for global queue fairness
+		size_t				m_exec_count = 0;
+
 		void consumer_thread();
+		TaskStatePtr next_task();
+		void push_back(const TaskStatePtr &task);
 		shared_ptr<TaskState> current_task_locked();
 	friend class TaskMaster;
 	friend class TaskMasterState;
@@ -232,7 +397,7 @@ namespace crucible {
 			} else {
 				// If there are multiple tasks, create a new task to wrap our post-exec queue,
 				// then push it to the front of the global queue using normal locking methods.
-				TaskStatePtr rescue_task(make_shared<TaskState>("rescue_task", [](){}));
+				TaskStatePtr rescue_task(allocate_shared<TaskState>(TaskAllocator<TaskState>(), "rescue_task", [](){}));
 				swap(rescue_task->m_post_exec_queue, queue);
 				TaskQueue tq_one { rescue_task };
 				TaskMasterState::push_front(tq_one);
@@ -250,8 +415,8 @@ namespace crucible {
 	}
 
 	TaskState::TaskState(string title, function<void()> exec_fn) :
-		m_exec_fn(exec_fn),
-		m_title(title),
+		m_exec_fn(move(exec_fn)),
+		m_title(move(title)),
 		m_id(++s_next_id)
 	{
 		THROW_CHECK0(invalid_argument, !m_title.empty());
@@ -369,8 +534,12 @@ namespace crucible {
 
 	TaskMasterState::TaskMasterState(size_t thread_max) :
 		m_thread_max(thread_max),
+		m_thread_count(0),
+		m_idle_count(0),
 		m_configured_thread_max(thread_max),
 		m_thread_target(thread_max),
+		m_cancelled(false),
+		m_paused(false),
 		m_load_stats(TaskMaster::LoadStats { 0 })
 	{
 	}
@@ -380,6 +549,7 @@ namespace crucible {
 	{
 		while (m_threads.size() < m_thread_max && !m_paused) {
 			m_threads.insert(make_shared<TaskConsumer>(shared_from_this()));
+			m_thread_count = m_threads.size();
 		}
 	}
 
@@ -390,26 +560,89 @@ namespace crucible {
 		while (m_threads.size() != m_thread_max) {
 			if (m_threads.size() < m_thread_max) {
 				m_threads.insert(make_shared<TaskConsumer>(shared_from_this()));
+				m_thread_count = m_threads.size();
 			} else if (m_threads.size() > m_thread_max) {
 				m_condvar.wait(lock);
 			}
 		}
 	}
 
+	void
+	TaskMasterState::wake_idle_consumer()
+	{
+		// Idle consumers increment m_idle_count with m_mutex held
+		// before their last look at the queues, so either they see
+		// the new task or we see them and wake one.
+		if (m_idle_count) {
+			unique_lock<mutex> lock(m_mutex);
+			m_idle_condvar.notify_one();
+		}
+	}
+
 	void
 	TaskMasterState::push_back(const TaskStatePtr &task)
 	{
 		THROW_CHECK0(runtime_error, task);
+		if (s_tms->m_cancelled) {
+			task->clear();
+			return;
+		}
+		const auto tlcc = tl_current_consumer;
+		if (tlcc && tlcc->m_master == s_tms) {
+			// Running on a worker, queue locally so other workers
+			// don't have to take the global lock to dequeue it
+			tlcc->push_back(task);
+			s_tms->wake_idle_consumer();
+			return;
+		}
 		unique_lock<mutex> lock(s_tms->m_mutex);
 		if (s_tms->m_cancelled) {
 			task->clear();
 			return;
 		}
 		s_tms->m_queue.push_back(task);
-		s_tms->m_condvar.notify_all();
+		s_tms->m_idle_condvar.notify_one();
 		s_tms->start_threads_nolock();
 	}
 
+	TaskStatePtr
+	TaskMasterState::pop_global_nolock()
+	{
+		TaskStatePtr rv;
+		if (!m_queue.empty()) {
+			rv = m_queue.front();
+			m_queue.pop_front();
+		}
+		return rv;
+	}
+
+	TaskStatePtr
+	TaskMasterState::steal_nolock(const TaskConsumer *thief)
+	{
+		// Take the oldest task from the worker with the longest queue
+		TaskConsumerPtr victim;
+		size_t victim_size = 0;
+		for (const auto &i : m_threads) {
+			if (i.get() == thief) {
+				continue;
+			}
+			unique_lock<mutex> lock(i->m_mutex);
+			if (i->m_run_queue.size() > victim_size) {
+				victim_size = i->m_run_queue.size();
+				victim = i;
+			}
+		}
+		TaskStatePtr rv;
+		if (victim) {
+			unique_lock<mutex> lock(victim->m_mutex);
+			if (!victim->m_run_queue.empty()) {
+				rv = victim->m_run_queue.front();
+				victim->m_run_queue.pop_front();
+			}
+		}
+		return rv;
+	}
+
 	void
 	TaskMasterState::push_front(TaskQueue &queue)
 	{
@@ -421,8 +654,9 @@ namespace crucible {
 			TaskState::clear_queue(queue);
 			return;
 		}
-		s_tms->m_queue.splice(s_tms->m_queue.begin(), queue);
-		s_tms->m_condvar.notify_all();
+		s_tms->m_queue.insert(s_tms->m_queue.begin(), queue.begin(), queue.end());
+		queue.clear();
+		s_tms->m_idle_condvar.notify_all();
 		s_tms->start_threads_nolock();
 	}
 
@@ -435,7 +669,12 @@ namespace crucible {
 	TaskMaster::get_queue_count()
 	{
 		unique_lock<mutex> lock(s_tms->m_mutex);
-		return s_tms->m_queue.size();
+		size_t rv = s_tms->m_queue.size();
+		for (const auto &i : s_tms->m_threads) {
+			unique_lock<mutex> consumer_lock(i->m_mutex);
+			rv += i->m_run_queue.size();
+		}
+		return rv;
 	}
 
 	size_t
@@ -461,6 +700,14 @@ namespace crucible {
 		for (auto i : s_tms->m_queue) {
 			os << "Queue #" << ++counter << " Task ID " << i->id() << " " << i->title() << endl;
 		}
+		size_t worker = 0;
+		for (const auto &consumer : s_tms->m_threads) {
+			++worker;
+			unique_lock<mutex> consumer_lock(consumer->m_mutex);
+			for (auto i : consumer->m_run_queue) {
+				os << "Queue #" << ++counter << " Worker #" << worker << " Task ID " << i->id() << " " << i->title() << endl;
+			}
+		}
 		return os << "Queue End" << endl;
 	}
 
@@ -472,7 +719,9 @@ namespace crucible {
 		size_t counter = 0;
 		for (auto i : s_tms->m_threads) {
 			os << "Worker #" << ++counter << " ";
+			unique_lock<mutex> consumer_lock(i->m_mutex);
 			auto task = i->current_task_locked();
+			consumer_lock.unlock();
 			if (task) {
 				os << "Task ID " << task->id() << " " << task->title();
 			} else {
@@ -491,7 +740,7 @@ namespace crucible {
 			return 0;
 		}
 
-		if (m_load_target == 0) {
+		if (m_load_target == 0 && !pressure_tracking_nolock()) {
 			// No limits, no stats, use configured thread count
 			return m_configured_thread_max;
 		}
@@ -501,6 +750,29 @@ namespace crucible {
 			return 0;
 		}
 
+		if (m_load_target != 0 && m_load_timer.age() >= 5.0) {
+			m_load_timer.reset();
+			update_loadavg_nolock();
+		}
+
+		if (pressure_tracking_nolock()) {
+			update_pressure_nolock();
+		}
+
+		m_load_stats.thread_target = m_thread_target;
+
+		// Cannot exceed configured maximum thread count or less than zero
+		m_thread_target = min(max(0.0, m_thread_target), double(m_configured_thread_max));
+
+		// Convert to integer but keep within range
+		const size_t rv = max(m_thread_min, min(size_t(ceil(m_thread_target)), m_configured_thread_max));
+
+		return rv;
+	}
+
+	void
+	TaskMasterState::update_loadavg_nolock()
+	{
 		const double loadavg = getloadavg1();
 
 		static const double load_exp = exp(-5.0 / 60.0);
@@ -528,19 +800,50 @@ namespace crucible {
 			m_thread_target += load_deficit;
 		}
 
-		m_load_stats = TaskMaster::LoadStats {
-			.current_load = current_load,
-			.thread_target = m_thread_target,
-			.loadavg = loadavg,
-		};
+		m_load_stats.current_load = current_load;
+		m_load_stats.loadavg = loadavg;
+	}
 
-		// Cannot exceed configured maximum thread count or less than zero
-		m_thread_target = min(max(0.0, m_thread_target), double(m_configured_thread_max));
+	bool
+	TaskMasterState::pressure_tracking_nolock() const
+	{
+		return m_cpu_pressure_target != 0 || m_io_pressure_target != 0;
+	}
 
-		// Convert to integer but keep within range
-		const size_t rv = max(m_thread_min, min(size_t(ceil(m_thread_target)), m_configured_thread_max));
+	void
+	TaskMasterState::update_pressure_nolock()
+	{
+		// Called from set_thread_count too, don't sample too often
+		const double seconds = m_pressure_timer.age();
+		if (seconds < 0.5) {
+			return;
+		}
+		m_pressure_timer.reset();
+		m_cpu_pressure.sample(seconds);
+		m_io_pressure.sample(seconds);
+		m_memory_pressure.sample(seconds);
+		m_load_stats.cpu_pressure = m_cpu_pressure.m_percent;
+		m_load_stats.io_pressure = m_io_pressure.m_percent;
+		m_load_stats.memory_pressure = m_memory_pressure.m_percent;
+
+		// Ratio of pressure to target of the most stalled resource.
+		// Memory stalls are mostly reclaim and refaults, i.e. IO.
+		double excess = 0;
+		if (m_cpu_pressure_target != 0) {
+			excess = max(excess, m_cpu_pressure.m_percent / m_cpu_pressure_target);
+		}
+		if (m_io_pressure_target != 0) {
+			excess = max(excess, max(m_io_pressure.m_percent, m_memory_pressure.m_percent) / m_io_pressure_target);
+		}
 
-		return rv;
+		if (excess > 1) {
+			// Over target, back off in proportion right away
+			m_thread_target = min(m_thread_target, m_thread_max / excess);
+		} else if (m_load_target == 0) {
+			// Under target, add workers slowly:  one per 5 seconds with no stalls.
+			// When there is a load average target too, that adds workers instead.
+			m_thread_target += (1 - excess) * seconds / 5;
+		}
 	}
 
 	void
@@ -555,6 +858,7 @@ namespace crucible {
 		// If we are increasing the number of threads we have to notify start_stop_threads it can stop waiting for threads to stop
 		if (new_thread_max != old_thread_max) {
 			m_condvar.notify_all();
+			m_idle_condvar.notify_all();
 			start_threads_nolock();
 		}
 	}
@@ -581,9 +885,15 @@ namespace crucible {
 		unique_lock<mutex> lock(m_mutex);
 		m_paused = true;
 		m_cancelled = true;
-		decltype(m_queue) empty_queue;
-		m_queue.swap(empty_queue);
+		TaskQueue empty_queue(m_queue.begin(), m_queue.end());
+		m_queue.clear();
+		for (const auto &i : m_threads) {
+			unique_lock<mutex> consumer_lock(i->m_mutex);
+			empty_queue.insert(empty_queue.end(), i->m_run_queue.begin(), i->m_run_queue.end());
+			i->m_run_queue.clear();
+		}
 		m_condvar.notify_all();
+		m_idle_condvar.notify_all();
 		lock.unlock();
 		TaskState::clear_queue(empty_queue);
 	}
@@ -600,6 +910,7 @@ namespace crucible {
 		unique_lock<mutex> lock(m_mutex);
 		m_paused = paused;
 		m_condvar.notify_all();
+		m_idle_condvar.notify_all();
 		lock.unlock();
 	}
 
@@ -631,7 +942,20 @@ namespace crucible {
 		pthread_setname("load_tracker");
 		while (!m_cancelled) {
 			adjust_thread_count();
-			nanosleep(5.0);
+			unique_lock<mutex> lock(m_mutex);
+			// Pressure reacts within seconds, load average over a minute
+			const double interval = pressure_tracking_nolock() ? 1.0 : 5.0;
+			lock.unlock();
+			nanosleep(interval);
+		}
+	}
+
+	void
+	TaskMasterState::start_load_tracking_nolock()
+	{
+		if (!m_load_tracking_thread) {
+			m_load_tracking_thread = make_shared<thread>([=] () { loadavg_thread_fn(); });
+			m_load_tracking_thread->detach();
 		}
 	}
 
@@ -646,10 +970,10 @@ namespace crucible {
 		}
 		m_load_target = target;
 		m_prev_loadavg = getloadavg1();
+		m_load_timer.reset();
 
-		if (target && !m_load_tracking_thread) {
-			m_load_tracking_thread = make_shared<thread>([=] () { loadavg_thread_fn(); });
-			m_load_tracking_thread->detach();
+		if (target) {
+			start_load_tracking_nolock();
 		}
 	}
 
@@ -659,6 +983,43 @@ namespace crucible {
 		s_tms->set_loadavg_target(target);
 	}
 
+	void
+	TaskMasterState::set_pressure_target(double cpu, double io)
+	{
+		THROW_CHECK1(out_of_range, cpu, cpu >= 0 && cpu <= 100);
+		THROW_CHECK1(out_of_range, io, io >= 0 && io <= 100);
+
+		unique_lock<mutex> lock(m_mutex);
+		if (m_cancelled) {
+			return;
+		}
+		if (cpu && !m_cpu_pressure.open()) {
+			THROW_ERROR(runtime_error, "CPU pressure target " << cpu << " needs PSI (CONFIG_PSI) in the kernel");
+		}
+		if (io && !m_io_pressure.open()) {
+			THROW_ERROR(runtime_error, "IO pressure target " << io << " needs PSI (CONFIG_PSI) in the kernel");
+		}
+		m_memory_pressure.open();
+		m_cpu_pressure_target = cpu;
+		m_io_pressure_target = io;
+
+		// Start from the current totals, not zero
+		m_pressure_timer.reset();
+		m_cpu_pressure.sample(0);
+		m_io_pressure.sample(0);
+		m_memory_pressure.sample(0);
+
+		if (pressure_tracking_nolock()) {
+			start_load_tracking_nolock();
+		}
+	}
+
+	void
+	TaskMaster::set_pressure_target(double cpu, double io)
+	{
+		s_tms->set_pressure_target(cpu, io);
+	}
+
 	void
 	TaskMaster::set_thread_count()
 	{
@@ -671,7 +1032,7 @@ namespace crucible {
 	}
 
 	Task::Task(string title, function<void()> exec_fn) :
-		m_task_state(make_shared<TaskState>(title, exec_fn))
+		m_task_state(allocate_shared<TaskState>(TaskAllocator<TaskState>(), move(title), move(exec_fn)))
 	{
 	}
 
@@ -736,10 +1097,54 @@ namespace crucible {
 	shared_ptr<TaskState>
 	TaskConsumer::current_task()
 	{
-		unique_lock<mutex> lock(m_master->m_mutex);
+		unique_lock<mutex> lock(m_mutex);
 		return current_task_locked();
 	}
 
+	void
+	TaskConsumer::push_back(const TaskStatePtr &task)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_run_queue.push_back(task);
+	}
+
+	TaskStatePtr
+	TaskConsumer::next_task()
+	{
+		TaskStatePtr rv;
+		if (!m_local_queue.empty()) {
+			rv = m_local_queue.front();
+			m_local_queue.pop_front();
+			return rv;
+		}
+
+		const bool global_first = (++m_exec_count % c_global_queue_interval) == 0;
+		if (global_first) {
+			unique_lock<mutex> lock(m_master->m_mutex);
+			rv = m_master->pop_global_nolock();
+			if (rv) {
+				return rv;
+			}
+		}
+
+		unique_lock<mutex> lock(m_mutex);
+		if (!m_run_queue.empty()) {
+			rv = m_run_queue.front();
+			m_run_queue.pop_front();
+			return rv;
+		}
+		lock.unlock();
+
+		unique_lock<mutex> master_lock(m_master->m_mutex);
+		if (!global_first) {
+			rv = m_master->pop_global_nolock();
+			if (rv) {
+				return rv;
+			}
+		}
+		return m_master->steal_nolock(this);
+	}
+
 	void
 	TaskConsumer::consumer_thread()
 	{
@@ -760,40 +1165,52 @@ namespace crucible {
 		TaskConsumerPtr this_consumer = shared_from_this();
 		swap(this_consumer, tl_current_consumer);
 
+		lock.unlock();
+
 		while (!master_copy->m_paused) {
-			if (master_copy->m_thread_max < master_copy->m_threads.size()) {
+			if (master_copy->m_thread_max < master_copy->m_thread_count) {
 				// We are one of too many threads, exit now
 				break;
 			}
 
-			if (!m_local_queue.empty()) {
-				m_current_task = *m_local_queue.begin();
-				m_local_queue.pop_front();
-			} else if (!master_copy->m_queue.empty()) {
-				m_current_task = *master_copy->m_queue.begin();
-				master_copy->m_queue.pop_front();
-			} else {
-				master_copy->m_condvar.wait(lock);
-				continue;
+			TaskStatePtr next = next_task();
+			if (!next) {
+				// Nothing found.  Announce we are idle, then look once more
+				// before sleeping, so a concurrent push can't be missed.
+				lock.lock();
+				++master_copy->m_idle_count;
+				next = master_copy->pop_global_nolock();
+				if (!next) {
+					next = master_copy->steal_nolock(this);
+				}
+				if (!next && !master_copy->m_paused && master_copy->m_thread_max >= master_copy->m_thread_count) {
+					master_copy->m_idle_condvar.wait(lock);
+				}
+				--master_copy->m_idle_count;
+				lock.unlock();
+				if (!next) {
+					continue;
+				}
 			}
 
+			unique_lock<mutex> consumer_lock(m_mutex);
+			m_current_task = next;
+			consumer_lock.unlock();
+			next.reset();
+
 			// Execute task without lock
-			lock.unlock();
 			catch_all([&]() {
 				m_current_task->exec();
 			});
 
 			// Update m_current_task with lock
 			TaskStatePtr hold_task;
-			lock.lock();
+			consumer_lock.lock();
 			swap(hold_task, m_current_task);
 
 			// Destroy hold_task without lock
-			lock.unlock();
+			consumer_lock.unlock();
 			hold_task.reset();
-
-			// Invariant: lock held
-			lock.lock();
 		}
 
 		// There is no longer a current consumer, but hold our own shared
@@ -801,18 +1218,35 @@ namespace crucible {
 		swap(this_consumer, tl_current_consumer);
 		assert(!tl_current_consumer);
 
-		// Release lock to rescue queue (may attempt to queue a new task at TaskMaster).
+		// Rescue queue (may attempt to queue a new task at TaskMaster).
 		// rescue_queue normally sends tasks to the local queue of the current TaskConsumer thread,
 		// but we just disconnected ourselves from that.
-		lock.unlock();
 		TaskState::rescue_queue(m_local_queue);
 
-		// Hold lock so we can erase ourselves
+		// Hold lock so we can erase ourselves, and hand our run queue
+		// to the global queue so other workers (or future workers) run it
 		lock.lock();
+		unique_lock<mutex> consumer_lock(m_mutex);
+		TaskRunQueue run_queue;
+		swap(run_queue, m_run_queue);
+		consumer_lock.unlock();
+		if (master_copy->m_cancelled) {
+			TaskQueue cancel_queue(run_queue.begin(), run_queue.end());
+			run_queue.clear();
+			lock.unlock();
+			TaskState::clear_queue(cancel_queue);
+			lock.lock();
+		} else {
+			master_copy->m_queue.insert(master_copy->m_queue.begin(), run_queue.begin(), run_queue.end());
+		}
 
 		// Fun fact:  shared_from_this() isn't usable until the constructor returns...
 		master_copy->m_threads.erase(shared_from_this());
+		master_copy->m_thread_count = master_copy->m_threads.size();
 		master_copy->m_condvar.notify_all();
+
+		// Several workers may have seen the same excess and exited together
+		master_copy->start_threads_nolock();
 	}
 
 	TaskConsumer::TaskConsumer(const shared_ptr<TaskMasterState> &tms) :
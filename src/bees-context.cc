@@ -2,6 +2,7 @@
 
 #include "crucible/cleanup.h"
 #include "crucible/limits.h"
+#include "crucible/process.h"
 #include "crucible/string.h"
 #include "crucible/task.h"
 
@@ -17,10 +18,30 @@
 // struct sigset
 #include <signal.h>
 
+// metrics socket
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 using namespace crucible;
 using namespace std;
 
 
+template <class Cache>
+static
+void
+print_cache_stats(ostream &os, const string &name, Cache &cache)
+{
+	const auto total = cache.stats();
+	os << "\t" << name << ": size " << cache.size() << " hit " << total.hits << " miss " << total.misses << " evict " << total.evictions
+		<< " wait " << total.lock_waits << " spurious " << total.lock_spurious << "\n";
+	os << "\t\tshards (hit/miss/evict):";
+	for (const auto &i : cache.shard_stats()) {
+		os << " " << i.hits << "/" << i.misses << "/" << i.evictions;
+	}
+	os << "\n";
+}
+
 BeesFdCache::BeesFdCache(shared_ptr<BeesContext> ctx) :
 	m_ctx(ctx)
 {
@@ -51,9 +72,56 @@ BeesFdCache::clear()
 	BEESLOGDEBUG("Clearing open FD cache with size " << m_file_cache.size() << " to enable file delete");
 	BEESNOTE("Clearing open FD cache with size " << m_file_cache.size());
 	m_file_cache.clear();
+	m_file_cache_timer.reset();
 	BEESCOUNT(open_clear);
 }
 
+void
+BeesFdCache::clear_roots(const set<uint64_t> &roots)
+{
+	// Root FDs keep deleted subvols from being cleaned up, and there are
+	// few of them, so they are always closed.  File FDs are only closed
+	// in subvols with writes, unless they have been open too long.
+	if (m_file_cache_timer.age() > BEES_FILE_FD_CACHE_MAX_AGE) {
+		clear();
+		return;
+	}
+
+	BEESLOGDEBUG("Clearing root FD cache with size " << m_root_cache.size() << " to enable subvol delete");
+	BEESNOTE("Clearing root FD cache with size " << m_root_cache.size());
+	m_root_cache.clear();
+	BEESCOUNT(root_clear);
+
+	BEESNOTE("Clearing open FD cache in " << roots.size() << " written subvols");
+	if (!roots.empty()) {
+		const auto expired = m_file_cache.expire_if([&](const tuple<uint64_t, uint64_t> &key) {
+			return roots.count(get<0>(key));
+		});
+		BEESLOGDEBUG("Cleared " << expired << " open FDs in " << roots.size() << " written subvols");
+		BEESCOUNTADD(open_clear_written, expired);
+	}
+}
+
+void
+BeesFdCache::print_stats(ostream &os)
+{
+	print_cache_stats(os, "root", m_root_cache);
+	print_cache_stats(os, "file", m_file_cache);
+}
+
+size_t
+BeesFdCache::size() const
+{
+	return m_root_cache.size() + m_file_cache.size();
+}
+
+void
+BeesFdCache::set_scale(double scale)
+{
+	m_root_cache.max_size(max(size_t(1), static_cast<size_t>(BEES_ROOT_FD_CACHE_SIZE * scale)));
+	m_file_cache.max_size(max(size_t(1), static_cast<size_t>(BEES_FILE_FD_CACHE_SIZE * scale)));
+}
+
 Fd
 BeesFdCache::open_root(uint64_t root)
 {
@@ -78,15 +146,40 @@ BeesContext::dump_status()
 		BEESNOTE("writing status to file '" << status_file << "'");
 		ofstream ofs(status_file + ".tmp");
 
-		auto thisStats = BeesStats::s_global;
+		BeesStats thisStats = BeesStats::s_global;
 		ofs << "TOTAL:\n";
 		ofs << "\t" << thisStats << "\n";
 		auto avg_rates = thisStats / total_timer.age();
 		ofs << "RATES:\n";
 		ofs << "\t" << avg_rates << "\n";
 
+		ofs << "LATENCY:\n";
+		BeesHistogram::print_all(ofs);
+
+		ofs << "PHASES:\n";
+		BeesPhase::print_all(ofs);
+
+		ofs << "CACHES:\n";
+		if (m_fd_cache) {
+			m_fd_cache->print_stats(ofs);
+		}
+		print_cache_stats(ofs, "resolve", m_resolve_cache);
+
+		BeesMemory::print(ofs);
+
+		const auto shares = BeesShare::all();
+		if (shares.size() > 1) {
+			ofs << "FILESYSTEMS:\n";
+			for (const auto &i : shares) {
+				const auto ctx = i->ctx();
+				if (ctx) {
+					ofs << "\t" << ctx->root_path() << ": weight " << i->weight() << " workers " << i->running() << " waiting " << i->waiting() << "\n";
+				}
+			}
+		}
+
 		const auto load_stats = TaskMaster::get_current_load();
-		ofs << "THREADS (work queue " << TaskMaster::get_queue_count() << " of " << Task::instance_count() << " tasks, " << TaskMaster::get_thread_count() << " workers, load: current " << load_stats.current_load << " target " << load_stats.thread_target << " average " << load_stats.loadavg << "):\n";
+		ofs << "THREADS (work queue " << TaskMaster::get_queue_count() << " of " << Task::instance_count() << " tasks, " << TaskMaster::get_thread_count() << " workers, load: current " << load_stats.current_load << " target " << load_stats.thread_target << " average " << load_stats.loadavg << ", pressure: cpu " << load_stats.cpu_pressure << " io " << load_stats.io_pressure << " memory " << load_stats.memory_pressure << ", limits: logical_ino " << s_logical_ino_limit.limit() << " dedupe " << s_dedupe_limit.limit() << "):\n";
 		for (auto t : BeesNote::get_status()) {
 			ofs << "\ttid " << t.first << ": " << t.second << "\n";
 		}
@@ -112,10 +205,236 @@ BeesContext::dump_status()
 	}
 }
 
+void
+BeesContext::govern_memory()
+{
+	while (!m_stop_status) {
+		BEESNOTE("sampling memory use");
+		catch_all([&]() {
+			BeesMemory::sample();
+		});
+
+		BEESNOTE("idle " << BEES_MEMORY_INTERVAL);
+		unique_lock<mutex> lock(m_stop_mutex);
+		if (m_stop_status) {
+			return;
+		}
+		m_stop_condvar.wait_for(lock, chrono::duration<double>(BEES_MEMORY_INTERVAL));
+	}
+}
+
+void
+BeesContext::sample_profile()
+{
+	auto profile_charp = getenv("BEESPROFILE");
+	if (!profile_charp) return;
+	const string profile_file(profile_charp);
+	auto rate_charp = getenv("BEESPROFILERATE");
+	const double rate = rate_charp ? stod(rate_charp) : BEES_PROFILE_RATE;
+	THROW_CHECK1(invalid_argument, rate, rate > 0);
+	BEESLOGINFO("Sampling thread notes " << rate << " times per second to file '" << profile_file << "'");
+
+	// Folded stack format, for flamegraph.pl and similar tools
+	map<string, uint64_t> counts;
+	const auto write_profile = [&]() {
+		BEESNOTE("writing profile to file '" << profile_file << "'");
+		ofstream ofs(profile_file + ".tmp");
+		for (const auto &i : counts) {
+			ofs << i.first << " " << i.second << "\n";
+		}
+		ofs.close();
+		rename((profile_file + ".tmp").c_str(), profile_file.c_str());
+	};
+
+	Timer write_timer;
+	const auto period = chrono::duration<double>(1.0 / rate);
+	auto next_sample = chrono::steady_clock::now();
+	while (true) {
+		{
+			unique_lock<mutex> lock(m_stop_mutex);
+			if (m_stop_status) {
+				break;
+			}
+			// Skip the samples missed while the host was too busy
+			next_sample = max(next_sample + chrono::duration_cast<chrono::steady_clock::duration>(period), chrono::steady_clock::now());
+			m_stop_condvar.wait_until(lock, next_sample);
+		}
+		for (const auto &stack : BeesNote::get_folded_stacks()) {
+			++counts[stack];
+		}
+		if (write_timer.age() > BEES_PROFILE_WRITE_INTERVAL) {
+			write_profile();
+			write_timer.reset();
+		}
+	}
+	write_profile();
+}
+
+void
+BeesContext::write_metrics(ostream &os)
+{
+	// Prometheus text exposition format.  Rates are left to the scraper,
+	// which can divide counter deltas by its own scrape interval.
+	os << "# TYPE bees_uptime_seconds gauge\n";
+	os << "bees_uptime_seconds " << m_total_timer.age() << "\n";
+
+	os << "# TYPE bees_events_total counter\n";
+	for (const auto &i : BeesStats(BeesStats::s_global).stats_map()) {
+		os << "bees_events_total{event=\"" << i.first << "\"} " << i.second << "\n";
+	}
+
+	os << "# TYPE bees_latency_seconds summary\n";
+	BeesHistogram::for_each([&](const string &name, const BeesHistogram &bh) {
+		for (const auto q : { 0.5, 0.9, 0.99 }) {
+			os << "bees_latency_seconds{op=\"" << name << "\",quantile=\"" << q << "\"} " << bh.quantile_usec(q) / 1000000.0 << "\n";
+		}
+		os << "bees_latency_seconds_sum{op=\"" << name << "\"} " << bh.sum_usec() / 1000000.0 << "\n";
+		os << "bees_latency_seconds_count{op=\"" << name << "\"} " << bh.count() << "\n";
+	});
+	os << "# TYPE bees_latency_max_seconds gauge\n";
+	BeesHistogram::for_each([&](const string &name, const BeesHistogram &bh) {
+		os << "bees_latency_max_seconds{op=\"" << name << "\"} " << bh.max_usec() / 1000000.0 << "\n";
+	});
+
+	os << "# TYPE bees_phase_count_total counter\n";
+	BeesPhase::for_each([&](const string &name, const BeesPhase::Totals &totals) {
+		os << "bees_phase_count_total{phase=\"" << name << "\"} " << totals.m_count << "\n";
+	});
+	os << "# TYPE bees_phase_seconds_total counter\n";
+	BeesPhase::for_each([&](const string &name, const BeesPhase::Totals &totals) {
+		os << "bees_phase_seconds_total{phase=\"" << name << "\",clock=\"wall\"} " << totals.m_wall_ns / 1000000000.0 << "\n";
+		os << "bees_phase_seconds_total{phase=\"" << name << "\",clock=\"cpu\"} " << totals.m_cpu_ns / 1000000000.0 << "\n";
+	});
+	os << "# TYPE bees_phase_read_bytes_total counter\n";
+	BeesPhase::for_each([&](const string &name, const BeesPhase::Totals &totals) {
+		os << "bees_phase_read_bytes_total{phase=\"" << name << "\"} " << totals.m_read_bytes << "\n";
+	});
+
+	const auto load_stats = TaskMaster::get_current_load();
+	os << "# TYPE bees_task_load gauge\n";
+	os << "bees_task_load{value=\"current\"} " << load_stats.current_load << "\n";
+	os << "bees_task_load{value=\"target\"} " << load_stats.thread_target << "\n";
+	os << "bees_task_load{value=\"average\"} " << load_stats.loadavg << "\n";
+	const auto shares = BeesShare::all();
+	if (shares.size() > 1) {
+		os << "# TYPE bees_fs_workers gauge\n";
+		for (const auto &i : shares) {
+			const auto ctx = i->ctx();
+			if (!ctx) {
+				continue;
+			}
+			string fs;
+			for (const auto c : ctx->root_path()) {
+				if (c == '"' || c == '\\') {
+					fs += '\\';
+				}
+				fs += c;
+			}
+			os << "bees_fs_workers{fs=\"" << fs << "\",state=\"running\"} " << i->running() << "\n";
+			os << "bees_fs_workers{fs=\"" << fs << "\",state=\"waiting\"} " << i->waiting() << "\n";
+		}
+	}
+	BeesMemory::write_metrics(os);
+	os << "# TYPE bees_task_pressure gauge\n";
+	os << "bees_task_pressure{resource=\"cpu\"} " << load_stats.cpu_pressure << "\n";
+	os << "bees_task_pressure{resource=\"io\"} " << load_stats.io_pressure << "\n";
+	os << "bees_task_pressure{resource=\"memory\"} " << load_stats.memory_pressure << "\n";
+	os << "# TYPE bees_task_workers gauge\n";
+	os << "bees_task_workers " << TaskMaster::get_thread_count() << "\n";
+	os << "# TYPE bees_task_queued gauge\n";
+	os << "bees_task_queued " << TaskMaster::get_queue_count() << "\n";
+	os << "# TYPE bees_task_instances gauge\n";
+	os << "bees_task_instances " << Task::instance_count() << "\n";
+
+	// Don't create the hash table here if start() hasn't yet
+	unique_lock<mutex> lock(m_stop_mutex);
+	const auto hash_table_ptr = m_hash_table;
+	lock.unlock();
+	if (hash_table_ptr) {
+		os << "# TYPE bees_hash_table_cells gauge\n";
+		os << "bees_hash_table_cells " << hash_table_ptr->total_cells() << "\n";
+		os << "# TYPE bees_hash_table_occupied_cells gauge\n";
+		os << "bees_hash_table_occupied_cells " << hash_table_ptr->occupied_cells() << "\n";
+	}
+}
+
+void
+BeesContext::serve_metrics()
+{
+	auto metrics_charp = getenv("BEESMETRICS");
+	if (!metrics_charp) return;
+	const string metrics_path(metrics_charp);
+
+	sockaddr_un addr = { };
+	addr.sun_family = AF_UNIX;
+	THROW_CHECK1(invalid_argument, metrics_path, metrics_path.size() < sizeof(addr.sun_path));
+	memcpy(addr.sun_path, metrics_path.c_str(), metrics_path.size());
+
+	// Remove the socket left behind by a previous run
+	unlink(metrics_path.c_str());
+
+	Fd listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	DIE_IF_MINUS_ONE(listen_fd);
+	DIE_IF_MINUS_ONE(::bind(listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)));
+	DIE_IF_MINUS_ONE(listen(listen_fd, 16));
+	BEESLOGINFO("Serving metrics on socket '" << metrics_path << "'");
+
+	while (!stop_requested()) {
+		BEESNOTE("waiting for metrics request on '" << metrics_path << "'");
+		pollfd pfd = { .fd = listen_fd, .events = POLLIN, .revents = 0 };
+		// Wake up once per second to check for stop
+		if (poll(&pfd, 1, 1000) < 1) {
+			continue;
+		}
+		Fd conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (int(conn_fd) < 0) {
+			continue;
+		}
+		catch_all([&]() {
+			BEESNOTE("serving metrics on '" << metrics_path << "'");
+			BEESCOUNT(metrics_request);
+
+			// Plain stream clients send nothing, HTTP clients send a request
+			// which is answered with an HTTP response.  Don't wait long for it.
+			char request[4096];
+			ssize_t request_size = 0;
+			pollfd conn_pfd = { .fd = conn_fd, .events = POLLIN, .revents = 0 };
+			if (poll(&conn_pfd, 1, 100) > 0) {
+				request_size = recv(conn_fd, request, sizeof(request), MSG_DONTWAIT);
+			}
+			const bool http = request_size >= 4 && !memcmp(request, "GET ", 4);
+
+			ostringstream body;
+			write_metrics(body);
+
+			ostringstream reply;
+			if (http) {
+				reply << "HTTP/1.0 200 OK\r\n"
+					<< "Content-Type: text/plain; version=0.0.4\r\n"
+					<< "Content-Length: " << body.str().size() << "\r\n"
+					<< "\r\n";
+			}
+			reply << body.str();
+
+			const auto reply_str = reply.str();
+			size_t sent = 0;
+			while (sent < reply_str.size()) {
+				const auto rv = send(conn_fd, reply_str.data() + sent, reply_str.size() - sent, MSG_NOSIGNAL);
+				if (rv < 1) {
+					BEESCOUNT(metrics_fail);
+					break;
+				}
+				sent += rv;
+			}
+		});
+	}
+	unlink(metrics_path.c_str());
+}
+
 void
 BeesContext::show_progress()
 {
-	auto lastStats = BeesStats::s_global;
+	BeesStats lastStats = BeesStats::s_global;
 	Timer stats_timer;
 	Timer all_timer;
 	while (!stop_requested()) {
@@ -128,7 +447,7 @@ BeesContext::show_progress()
 		m_stop_condvar.wait_for(lock, chrono::duration<double>(BEES_PROGRESS_INTERVAL));
 
 		// Snapshot stats and timer state
-		auto thisStats = BeesStats::s_global;
+		BeesStats thisStats = BeesStats::s_global;
 		auto stats_age = stats_timer.age();
 		auto all_age = all_timer.age();
 		stats_timer.lap();
@@ -154,7 +473,7 @@ BeesContext::show_progress()
 
 		BEESNOTE("logging current thread status");
 		const auto load_stats = TaskMaster::get_current_load();
-		BEESLOGINFO("THREADS (work queue " << TaskMaster::get_queue_count() << " of " << Task::instance_count() << " tasks, " << TaskMaster::get_thread_count() << " workers, load: current " << load_stats.current_load << " target " << load_stats.thread_target << " average " << load_stats.loadavg << "):");
+		BEESLOGINFO("THREADS (work queue " << TaskMaster::get_queue_count() << " of " << Task::instance_count() << " tasks, " << TaskMaster::get_thread_count() << " workers, load: current " << load_stats.current_load << " target " << load_stats.thread_target << " average " << load_stats.loadavg << ", pressure: cpu " << load_stats.cpu_pressure << " io " << load_stats.io_pressure << " memory " << load_stats.memory_pressure << "):");
 		for (auto t : BeesNote::get_status()) {
 			BEESLOGINFO("\ttid " << t.first << ": " << t.second);
 		}
@@ -187,6 +506,18 @@ BeesContext::is_root_ro(uint64_t root)
 	return roots()->is_root_ro(root);
 }
 
+void
+BeesContext::sample_dedupe_time(double seconds)
+{
+	// Dedupe joins the running transaction, so this includes commit latency
+	const auto limit_change = s_dedupe_limit.sample(seconds);
+	if (limit_change > 0) {
+		BEESCOUNT(dedup_limit_inc);
+	} else if (limit_change < 0) {
+		BEESCOUNT(dedup_limit_dec);
+	}
+}
+
 bool
 BeesContext::dedup(const BeesRangePair &brp_in)
 {
@@ -218,6 +549,7 @@ BeesContext::dedup(const BeesRangePair &brp_in)
 
 	BEESCOUNT(dedup_try);
 
+	BEESPHASE(dedup);
 	BEESNOTE("waiting to dedup " << brp);
 	const auto lock = MultiLocker::get_lock("dedupe");
 
@@ -229,11 +561,15 @@ BeesContext::dedup(const BeesRangePair &brp_in)
 		 << "       dst " << pretty(brp.second.size()) << " [" << to_hex(brp.second.begin()) << ".." << to_hex(brp.second.end()) << "] {" << second_addr << "} " << name_fd(brp.second.fd()));
 
 	const bool rv = btrfs_extent_same(brp.first.fd(), brp.first.begin(), brp.first.size(), brp.second.fd(), brp.second.begin());
+	BtrfsExtentCache::invalidate(brp.second.fd());
 	BEESCOUNTADD(dedup_ms, dedup_timer.age() * 1000);
+	BEESHISTOGRAM(dedup, dedup_timer.age());
+	sample_dedupe_time(dedup_timer.age());
 
 	if (rv) {
 		BEESCOUNT(dedup_hit);
 		BEESCOUNTADD(dedup_bytes, brp.first.size());
+		roots()->crawl_hit(brp.second.fid().root(), brp.first.size());
 	} else {
 		BEESCOUNT(dedup_miss);
 		BEESLOGWARN("NO Dedup! " << brp);
@@ -242,6 +578,93 @@ BeesContext::dedup(const BeesRangePair &brp_in)
 	return rv;
 }
 
+/// Dedupe one src range into several dst ranges with as few ioctls as
+/// possible.  Every pair must have the same src range.  Returns one
+/// result per pair, like dedup(const BeesRangePair &).
+vector<bool>
+BeesContext::dedup(const vector<BeesRangePair> &brps_in)
+{
+	vector<bool> rv(brps_in.size(), false);
+	if (brps_in.empty()) {
+		return rv;
+	}
+
+	BEESNOTE("dedup " << brps_in.size() << " dst for src " << brps_in.front().first);
+
+	auto src_bfr = brps_in.front().first;
+	src_bfr.fd(shared_from_this());
+	BEESTOOLONG("dedup " << brps_in.size() << " dst for src " << src_bfr);
+	BeesAddress src_addr(src_bfr.fd(), src_bfr.begin());
+
+	vector<size_t> dst_index;
+	vector<BeesFileRange> dst_bfrs;
+	vector<pair<int, off_t>> dsts;
+	for (size_t i = 0; i < brps_in.size(); ++i) {
+		const auto &brp = brps_in[i];
+		THROW_CHECK2(invalid_argument, brp, src_bfr, brp.first.begin() == src_bfr.begin() && brp.first.end() == src_bfr.end());
+		THROW_CHECK1(invalid_argument, brp, brp.first.size() == brp.second.size());
+
+		if (is_root_ro(brp.second.fid().root())) {
+			BEESCOUNT(dedup_workaround_btrfs_send);
+			continue;
+		}
+
+		auto dst_bfr = brp.second;
+		dst_bfr.fd(shared_from_this());
+		THROW_CHECK2(invalid_argument, src_bfr, dst_bfr, !src_bfr.overlaps(dst_bfr));
+
+		BeesAddress dst_addr(dst_bfr.fd(), dst_bfr.begin());
+		if (src_addr.get_physical_or_zero() == dst_addr.get_physical_or_zero()) {
+			BEESLOGTRACE("equal physical addresses in dedup");
+			BEESCOUNT(bug_dedup_same_physical);
+		}
+
+		BEESCOUNT(dedup_try);
+		BEESLOGINFO("dedup: src " << pretty(src_bfr.size())  << " [" << to_hex(src_bfr.begin())  << ".." << to_hex(src_bfr.end())  << "] {" << src_addr  << "} " << name_fd(src_bfr.fd()) << "\n"
+			 << "       dst " << pretty(dst_bfr.size()) << " [" << to_hex(dst_bfr.begin()) << ".." << to_hex(dst_bfr.end()) << "] {" << dst_addr << "} " << name_fd(dst_bfr.fd()));
+		dst_index.push_back(i);
+		dsts.push_back(make_pair(int(dst_bfr.fd()), dst_bfr.begin()));
+		dst_bfrs.push_back(dst_bfr);
+	}
+	if (dsts.empty()) {
+		return rv;
+	}
+
+	BEESPHASE(dedup);
+	BEESNOTE("waiting to dedup " << dsts.size() << " dst for src " << src_bfr);
+	const auto lock = MultiLocker::get_lock("dedupe");
+
+	BEESNOTE("dedup " << dsts.size() << " dst for src " << src_bfr);
+	Timer dedup_timer;
+	const auto statuses = btrfs_extent_same_multi(src_bfr.fd(), src_bfr.begin(), src_bfr.size(), dsts);
+	for (const auto &dst_bfr : dst_bfrs) {
+		BtrfsExtentCache::invalidate(dst_bfr.fd());
+	}
+	BEESCOUNTADD(dedup_ms, dedup_timer.age() * 1000);
+	BEESHISTOGRAM(dedup, dedup_timer.age());
+	sample_dedupe_time(dedup_timer.age() / dsts.size());
+	BEESCOUNT(dedup_batch);
+	BEESCOUNTADD(dedup_batch_dst, dsts.size());
+
+	for (size_t i = 0; i < statuses.size(); ++i) {
+		if (!statuses[i]) {
+			BEESCOUNT(dedup_hit);
+			BEESCOUNTADD(dedup_bytes, src_bfr.size());
+			roots()->crawl_hit(dst_bfrs[i].fid().root(), src_bfr.size());
+			rv[dst_index[i]] = true;
+		} else {
+			BEESCOUNT(dedup_miss);
+			if (statuses[i] < 0) {
+				BEESLOGWARN("NO Dedup! " << src_bfr << " -> " << dst_bfrs[i] << ": " << strerror(-statuses[i]));
+			} else {
+				BEESLOGWARN("NO Dedup! " << src_bfr << " -> " << dst_bfrs[i]);
+			}
+		}
+	}
+
+	return rv;
+}
+
 BeesRangePair
 BeesContext::dup_extent(const BeesFileRange &src, const shared_ptr<BeesTempFile> &tmpfile)
 {
@@ -251,7 +674,7 @@ BeesContext::dup_extent(const BeesFileRange &src, const shared_ptr<BeesTempFile>
 }
 
 void
-BeesContext::rewrite_file_range(const BeesFileRange &bfr)
+BeesContext::rewrite_file_range(const BeesFileRange &bfr, const map<off_t, BeesHash> &known_hashes)
 {
 	auto m_ctx = shared_from_this();
 	BEESNOTE("Rewriting bfr " << bfr);
@@ -273,24 +696,168 @@ BeesContext::rewrite_file_range(const BeesFileRange &bfr)
 	// because the blocks we rewrote are likely duplicates of blocks from this
 	// generation that we are about to scan.  Pretty ugly but effective as an
 	// interim solution while we wait for tree-2 extent scanning.
+	//
+	// In csum scan mode the copy has no csums until the next commit,
+	// so leave it for the crawler to find in a later transid.
+	if (m_csum_scan) {
+		BEESCOUNT(scan_reinsert_csum);
+		return;
+	}
+	// The copy has the same data, so hashes from the scan are still good.
+	// known_hashes only has non-zero blocks.  Only new physical addresses
+	// are needed, and the walker only moves when p leaves its extent.
 	auto hash_table = m_ctx->hash_table();
 	BtrfsExtentWalker ew(bfr.fd(), bfr.begin(), root_fd());
+	Extent e = ew.current();
 	for (off_t next_p = bfr.begin(); next_p < bfr.end(); ) {
 		off_t p = next_p;
 		next_p += BLOCK_SIZE_SUMS;
-		ew.seek(p);
-		Extent e = ew.current();
+		if (p < e.begin() || p >= e.end()) {
+			ew.seek(p);
+			e = ew.current();
+		}
 		BEESTRACE("next_p " << to_hex(next_p) << " p " << to_hex(p) << " e " << e);
-		BeesBlockData bbd(bfr.fd(), p, min(BLOCK_SIZE_SUMS, e.end() - p));
 		BeesAddress addr(e, p);
+		if (addr.is_magic()) {
+			continue;
+		}
+		const auto known = known_hashes.find(p);
+		if (known != known_hashes.end()) {
+			hash_table->push_random_hash_addr(known->second, addr);
+			BEESCOUNT(scan_reinsert);
+			BEESCOUNT(scan_reinsert_known);
+			continue;
+		}
+		BeesBlockData bbd(bfr.fd(), p, min(BLOCK_SIZE_SUMS, e.end() - p));
 		bbd.addr(addr);
-		if (!addr.is_magic() && !bbd.is_data_zero()) {
+		if (!bbd.is_data_zero()) {
 			hash_table->push_random_hash_addr(bbd.hash(), bbd.addr());
 			BEESCOUNT(scan_reinsert);
 		}
 	}
 }
 
+// First 8 bytes of the csum of a block of BLOCK_SIZE_SUMS zero bytes,
+// for each btrfs csum type.  crc32c is 4 bytes, zero-extended.
+// The short zero block at EOF is padded with zeros, so it has the same csum.
+static
+bool
+csum_zero_hash(uint32_t sum_type, BeesHash &hash)
+{
+	static const uint8_t zero_csums[][8] = {
+#if BEES_BLOCK_SIZE == 4096
+		{ 0x89, 0x41, 0xf9, 0x98, 0x00, 0x00, 0x00, 0x00 },	// crc32c
+		{ 0xdb, 0xbb, 0xd8, 0x32, 0x6f, 0x9b, 0x86, 0xac },	// xxhash64
+		{ 0xad, 0x7f, 0xac, 0xb2, 0x58, 0x6f, 0xc6, 0xe9 },	// sha256
+		{ 0x68, 0x6e, 0xde, 0x92, 0x88, 0xc3, 0x91, 0xe7 },	// blake2b-256
+#elif BEES_BLOCK_SIZE == 8192
+		{ 0x23, 0x46, 0x44, 0x90, 0x00, 0x00, 0x00, 0x00 },
+		{ 0xb4, 0x8f, 0xa4, 0x05, 0x35, 0x07, 0xb5, 0x02 },
+		{ 0x9f, 0x1d, 0xcb, 0xc3, 0x5c, 0x35, 0x0d, 0x60 },
+		{ 0xcf, 0x7d, 0xd6, 0x54, 0x5b, 0x3e, 0x87, 0xac },
+#elif BEES_BLOCK_SIZE == 16384
+		{ 0x85, 0x0b, 0x64, 0x94, 0x00, 0x00, 0x00, 0x00 },
+		{ 0xec, 0x45, 0x2c, 0x33, 0x66, 0xdc, 0x4e, 0x59 },
+		{ 0x4f, 0xe7, 0xb5, 0x9a, 0xf6, 0xde, 0x3b, 0x66 },
+		{ 0x08, 0x7e, 0x8b, 0x8b, 0xdc, 0x8b, 0x93, 0xf4 },
+#elif BEES_BLOCK_SIZE == 32768
+		{ 0xad, 0xba, 0x43, 0xbc, 0x00, 0x00, 0x00, 0x00 },
+		{ 0xf9, 0x3d, 0xc4, 0xf5, 0x0e, 0x78, 0x19, 0xea },
+		{ 0xc3, 0x50, 0x20, 0x47, 0x3a, 0xed, 0x1b, 0x46 },
+		{ 0xe9, 0x33, 0x40, 0x20, 0x34, 0x4b, 0xcb, 0x41 },
+#elif BEES_BLOCK_SIZE == 65536
+		{ 0xa4, 0xc4, 0xc0, 0x72, 0x00, 0x00, 0x00, 0x00 },
+		{ 0xa4, 0x15, 0x57, 0xf1, 0xa9, 0xdd, 0x83, 0x59 },
+		{ 0xde, 0x2f, 0x25, 0x60, 0x64, 0xa0, 0xaf, 0x79 },
+		{ 0xdf, 0x2d, 0x0b, 0x4e, 0x19, 0x3f, 0xce, 0x63 },
+#else
+#error "no zero block csums for BEES_BLOCK_SIZE"
+#endif
+	};
+	if (sum_type >= sizeof(zero_csums) / sizeof(zero_csums[0])) {
+		return false;
+	}
+	BeesHash::Type zero_hash = 0;
+	memcpy(&zero_hash, zero_csums[sum_type], sizeof(zero_hash));
+	hash = zero_hash;
+	return true;
+}
+
+map<off_t, BeesHash>
+BeesContext::get_csum_hashes(const Extent &e, set<off_t> *zero_csums)
+{
+	map<off_t, BeesHash> rv;
+	BtrfsCsumTreeFetcher fetcher(root_fd());
+	THROW_CHECK1(runtime_error, fetcher.block_size(), fetcher.block_size() == BLOCK_SIZE_SUMS);
+	const size_t sum_size = fetcher.sum_size();
+	BeesHash zero_hash;
+	const bool zero_hash_known = csum_zero_hash(fetcher.sum_type(), zero_hash);
+	const size_t block_count = (e.size() + BLOCK_MASK_SUMS) / BLOCK_SIZE_SUMS;
+	fetcher.get_sums(e.physical(), block_count, [&](uint64_t logical, const uint8_t *buf, size_t bytes) {
+		for (size_t i = 0; i + sum_size <= bytes; i += sum_size) {
+			// Use the first 64 bits of the csum.  Shorter csums
+			// (i.e. crc32c) are zero-extended.
+			BeesHash::Type hash = 0;
+			memcpy(&hash, buf + i, min(sum_size, sizeof(hash)));
+			const off_t p = e.begin() + (logical - e.physical()) + (i / sum_size) * BLOCK_SIZE_SUMS;
+			rv.insert(make_pair(p, BeesHash(hash)));
+			if (zero_csums && zero_hash_known && hash == zero_hash) {
+				zero_csums->insert(p);
+			}
+		}
+	});
+	BEESCOUNTADD(scan_csum_fetch_block, rv.size());
+	return rv;
+}
+
+void
+BeesContext::set_csum_scan(bool csum_scan)
+{
+	m_csum_scan = csum_scan;
+	BEESLOGINFO("csum scan: " << (m_csum_scan ? "enabled" : "disabled"));
+}
+
+void
+BeesContext::set_hash_algorithm(BeesHash::Algorithm algo)
+{
+	m_hash_algorithm = algo;
+	BEESLOGINFO("hash algorithm for new hash tables: " << BeesHash::algorithm_name(m_hash_algorithm));
+}
+
+void
+BeesContext::set_hash_table_size(off_t size)
+{
+	THROW_CHECK1(invalid_argument, size, size >= 0);
+	THROW_CHECK1(invalid_argument, size, (size % BLOCK_SIZE_HASHTAB_EXTENT) == 0);
+	m_hash_table_size = size;
+	if (size) {
+		BEESLOGINFO("hash table size: " << pretty(size));
+	}
+}
+
+void
+BeesContext::set_hash_table_memory(unsigned flags)
+{
+	m_hash_table_memory = flags;
+	BEESLOGINFO("hash table memory: " << BeesHashTable::memory_flags_names(flags));
+}
+
+void
+BeesContext::set_share_weight(double weight)
+{
+	THROW_CHECK1(invalid_argument, weight, weight > 0);
+	m_share_weight = weight;
+	BEESLOGINFO("worker share weight: " << weight);
+}
+
+void
+BeesContext::set_min_dedupe_size(off_t size)
+{
+	THROW_CHECK1(invalid_argument, size, size >= 0);
+	m_min_dedupe_size = size;
+	BEESLOGINFO("min dedupe size: " << pretty(size));
+}
+
 BeesFileRange
 BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 {
@@ -300,20 +867,21 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 	BEESTRACE("scan extent " << e);
 	BEESCOUNT(scan_extent);
 
-	// EXPERIMENT:  Don't bother with tiny extents unless they are the entire file.
-	// We'll take a tiny extent at BOF or EOF but not in between.
-	if (e.begin() && e.size() < 128 * 1024 && e.end() != Stat(bfr.fd()).st_size) {
-		BEESCOUNT(scan_extent_tiny);
-		// This doesn't work properly with the current architecture,
-		// so we don't do an early return here.
-		// return bfr;
-	}
-
 	// We keep moving this method around
 	auto m_ctx = shared_from_this();
 
+	// Compressed extents are read once for the scan and the resolver chases
+	BeesExtentBufferScope extent_buffers;
+
 	shared_ptr<BeesHashTable> hash_table = m_ctx->hash_table();
 
+	// Extents in read-only subvols are hashed and used as dedupe src,
+	// but nothing in them is ever replaced
+	const bool ro_source = is_root_ro(bfr.fid().root());
+	if (ro_source) {
+		BEESCOUNT(scan_ro_source);
+	}
+
 	if (e.flags() & ~(
 		FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_UNKNOWN |
 		FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_LAST |
@@ -331,6 +899,12 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		return bfr;
 	}
 
+	if (ro_source && (e.flags() & Extent::PREALLOC)) {
+		// Nothing to hash, and we can't replace it
+		BEESCOUNT(scan_ro_prealloc);
+		return bfr;
+	}
+
 	if (e.flags() & Extent::PREALLOC) {
 		// Prealloc is all zero and we replace it with a hole.
 		// No special handling is required here.  Nuke it and move on.
@@ -353,8 +927,20 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		}
 	}
 
-	// OK we need to read extent now
-	bees_readahead(bfr.fd(), bfr.begin(), bfr.size());
+	// In csum scan mode, use the data checksums btrfs already stored
+	// for the extent as hashes, so we only read blocks that have a
+	// candidate match in the hash table.  Compressed extents have csums
+	// of the compressed data, so they are read and hashed as usual.
+	// Every zero block has the same csum, so blocks with that csum are
+	// read to find the zero blocks, and are never looked up or inserted.
+	map<off_t, BeesHash> csum_map;
+	set<off_t> zero_csum_set;
+	if (m_csum_scan && !(e.flags() & FIEMAP_EXTENT_ENCODED)) {
+		catch_all([&]() {
+			BEESNOTE("fetching csums for " << pretty(e.size()) << " extent " << e);
+			csum_map = get_csum_hashes(e, &zero_csum_set);
+		});
+	}
 
 	map<off_t, pair<BeesHash, BeesAddress>> insert_map;
 	set<off_t> noinsert_set;
@@ -372,6 +958,125 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 	BEESTRACE(e << " block_count " << block_count);
 	string bar(block_count, '#');
 
+	// Record the extent and the hashes of the blocks read, for bees-replay.
+	// The records of one extent must stay together in the trace, so they
+	// are written in one piece when the scan of the extent ends.
+	vector<BeesRecorder::Record> records;
+	if (m_recorder) {
+		const auto fid = bfr.fid();
+		BeesRecorder::Record rec = { };
+		rec.r_type = BeesRecorder::REC_EXTENT;
+		rec.r_flags = e.flags();
+		rec.r_root = fid.root();
+		rec.r_ino = fid.ino();
+		rec.r_offset = e.begin();
+		rec.r_addr = e.bytenr();
+		rec.r_length = e.size();
+		records.push_back(rec);
+	}
+	Cleanup record_extent([&]() {
+		if (m_recorder) {
+			catch_all([&]() {
+				m_recorder->write(records);
+			});
+		}
+	});
+
+	// Read and hash the blocks of one window of the extent before the
+	// first lookup, so the hash table lookups for the window can be done
+	// in one batch.  Windows are at most BEES_SCAN_WINDOW_SIZE, so a large
+	// extent is not held in memory all at once.  Only the hashes are kept
+	// for the whole extent.  Stop at the first uncompressed zero block,
+	// because the scan loop will stop there too.  Blocks with a csum are
+	// not read here.
+	map<off_t, BeesBlockData> block_map;
+	map<off_t, BeesHash> hash_map;
+	set<off_t> zero_set;
+	map<off_t, vector<BeesHashTable::Cell>> found_map;
+	off_t window_end = e.begin();
+	const auto fill_window = [&](const off_t window_begin) {
+		BEESPHASE(hash);
+		// Release the buffers of the last window before reading the next
+		block_map.clear();
+		found_map.clear();
+		window_end = min(e.end(), window_begin + BEES_SCAN_WINDOW_SIZE);
+		// Read the window with one pread into one buffer,
+		// and make each block a view of its part of the buffer
+		ByteVector window_data;
+		if (csum_map.empty()) {
+			window_data = bees_read_range(bfr.fd(), window_begin, window_end - window_begin);
+			// Compressed extents are never longer than one window
+			if (window_begin == e.begin() && window_end == e.end()) {
+				BeesExtentBufferScope::keep_extent(bfr.fd(), e, window_data);
+			}
+		}
+		vector<off_t> lookup_offsets;
+		vector<BeesHashTable::HashType> lookup_hashes;
+		for (off_t p = window_begin; p < window_end; p += BLOCK_SIZE_SUMS) {
+			const off_t block_length = min(BLOCK_SIZE_SUMS, e.end() - p);
+			// Past EOF, the block is read (and fails) by itself
+			BeesBlockData bbd = ranged_cast<off_t>(window_data.size()) >= p - window_begin + block_length
+				? BeesBlockData(bfr.fd(), p, window_data.at(p - window_begin, block_length))
+				: BeesBlockData(bfr.fd(), p, block_length);
+			bbd.addr(BeesAddress(e, p));
+			const auto csum_found = csum_map.find(p);
+			BeesHash hash;
+			bool block_is_zero = false;
+			if (csum_found != csum_map.end()) {
+				BEESCOUNT(scan_csum_hash);
+				hash = csum_found->second;
+				if (zero_csum_set.count(p)) {
+					BEESCOUNT(scan_csum_zero_read);
+					BEESNOTE("scan zero csum " << bbd);
+					block_is_zero = bbd.is_data_zero();
+				}
+			} else {
+				BEESNOTE("scan hash " << bbd);
+				hash = bbd.hash();
+				block_is_zero = bbd.is_data_zero();
+			}
+			block_map.insert(make_pair(p, bbd));
+			hash_map.insert(make_pair(p, hash));
+			if (block_is_zero) {
+				zero_set.insert(p);
+			}
+			if (m_recorder) {
+				BeesRecorder::Record rec = records.front();
+				rec.r_type = BeesRecorder::REC_BLOCK;
+				rec.r_flags = 0;
+				if (block_is_zero) {
+					rec.r_flags |= BeesRecorder::BLOCK_ZERO;
+				}
+				if (csum_found != csum_map.end()) {
+					rec.r_flags |= BeesRecorder::BLOCK_CSUM;
+				}
+				rec.r_offset = p;
+				rec.r_addr = bbd.addr();
+				rec.r_length = block_length;
+				rec.r_hash = hash;
+				records.push_back(rec);
+			}
+			if (block_is_zero) {
+				if (!extent_compressed) {
+					// The next window starts after this block, if there is one
+					window_end = p + BLOCK_SIZE_SUMS;
+					break;
+				}
+				continue;
+			}
+			if (zero_csum_set.count(p)) {
+				continue;
+			}
+			lookup_offsets.push_back(p);
+			lookup_hashes.push_back(hash);
+		}
+		BEESNOTE("lookup " << lookup_hashes.size() << " hashes in " << pretty(window_end - window_begin) << " of " << pretty(e.size()) << " extent");
+		auto found_cells = hash_table->find_cells(lookup_hashes);
+		for (size_t i = 0; i < lookup_offsets.size(); ++i) {
+			found_map[lookup_offsets[i]].swap(found_cells[i]);
+		}
+	};
+
 	for (off_t next_p = e.begin(); next_p < e.end(); ) {
 
 		// Guarantee forward progress
@@ -384,8 +1089,12 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		// This extent should consist entirely of non-magic blocks
 		THROW_CHECK1(invalid_argument, addr, !addr.is_magic());
 
-		// Get block data
-		BeesBlockData bbd(bfr.fd(), p, min(BLOCK_SIZE_SUMS, e.end() - p));
+		// Get block data, already read and hashed if p is block aligned
+		if (p >= window_end) {
+			fill_window(p);
+		}
+		const auto block_found = block_map.find(p);
+		BeesBlockData bbd = block_found != block_map.end() ? block_found->second : BeesBlockData(bfr.fd(), p, min(BLOCK_SIZE_SUMS, e.end() - p));
 		bbd.addr(addr);
 		BEESCOUNT(scan_block);
 
@@ -393,20 +1102,27 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 
 		// Calculate the hash first because it lets us shortcut on is_data_zero
 		BEESNOTE("scan hash " << bbd);
-		BeesHash hash = bbd.hash();
+		const auto hash_found = hash_map.find(p);
+		BeesHash hash = hash_found != hash_map.end() ? hash_found->second : bbd.hash();
 
 		// Schedule this block for insertion if we decide to keep this extent.
 		BEESCOUNT(scan_hash_preinsert);
 		BEESTRACE("Pushing hash " << hash << " addr " << addr << " bbd " << bbd);
-		insert_map.insert(make_pair(p, make_pair(hash, addr)));
+		if (!zero_csum_set.count(p)) {
+			insert_map.insert(make_pair(p, make_pair(hash, addr)));
+		}
 		bar.at(bar_p) = 'R';
 
 		// Weed out zero blocks
 		BEESNOTE("is_data_zero " << bbd);
-		bool extent_is_zero = bbd.is_data_zero();
+		bool extent_is_zero = block_found != block_map.end() ? zero_set.count(p) : bbd.is_data_zero();
 		if (extent_is_zero) {
 			bar.at(bar_p) = '0';
-			if (extent_compressed) {
+			if (ro_source) {
+				// Can't replace it with a hole, and zero blocks are not hashed
+				insert_map.erase(p);
+				continue;
+			} else if (extent_compressed) {
 				if (!extent_contains_zero) {
 					// BEESLOG("compressed zero bbd " << bbd << "\n\tin extent " << e);
 				}
@@ -426,8 +1142,23 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 			extent_contains_nonzero = true;
 		}
 
-		BEESNOTE("lookup hash " << bbd);
-		auto found = hash_table->find_cell(hash);
+		// Data that is not zero but has the csum of a zero block
+		if (zero_csum_set.count(p)) {
+			BEESCOUNT(scan_csum_zero_nonzero);
+			continue;
+		}
+
+		// Use the batched lookup result if we have one.  It may be a little
+		// stale if an earlier block in this extent modified the hash table,
+		// but stale entries are weeded out by resolve below.
+		vector<BeesHashTable::Cell> found;
+		const auto found_it = found_map.find(p);
+		if (found_it != found_map.end()) {
+			found.swap(found_it->second);
+		} else {
+			BEESNOTE("lookup hash " << bbd);
+			found = hash_table->find_cell(hash);
+		}
 		BEESCOUNT(scan_lookup);
 
 		set<BeesResolver> resolved_addrs;
@@ -535,6 +1266,32 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 					auto it_copy = *it;
 					BEESNOTE("finding one match (out of " << it_copy.count() << ") at " << it_copy.addr() << " for " << bbd);
 					BEESTRACE("finding one match (out of " << it_copy.count() << ") at " << it_copy.addr() << " for " << bbd);
+					if (ro_source) {
+						// Replace the matching extents with this one instead,
+						// but only where they are replaced whole:  this
+						// extent can't be rewritten to finish the job
+						it_copy.replace_src(BeesFileRange(bbd), true);
+
+						// If we didn't find this hash where the hash table said it would be,
+						// correct the hash table.
+						if (it_copy.found_hash()) {
+							BEESCOUNT(scan_hash_hit);
+						} else {
+							BEESCOUNT(scan_hash_miss);
+							hash_table->erase_hash_addr(hash, it_copy.addr());
+						}
+
+						if (it_copy.found_dup()) {
+							BEESCOUNT(scan_ro_source_dup);
+							// The found copy is gone, keep this one in the hash table
+							hash_table->erase_hash_addr(hash, it_copy.addr());
+							m_ctx->invalidate_addr(it_copy.addr());
+							m_ctx->invalidate_addr(bbd.addr());
+						} else {
+							BEESCOUNT(scan_ro_source_miss);
+						}
+						continue;
+					}
 					replaced_bfr = it_copy.replace_dst(bbd);
 					BEESTRACE("next_p " << to_hex(next_p) << " -> replaced_bfr " << replaced_bfr);
 
@@ -597,7 +1354,7 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 	}
 
 	// If the extent was compressed and all zeros, nuke entire thing
-	if (!rewrite_extent && (extent_contains_zero && !extent_contains_nonzero)) {
+	if (!ro_source && !rewrite_extent && (extent_contains_zero && !extent_contains_nonzero)) {
 		rewrite_extent = true;
 		BEESCOUNT(scan_zero_compressed);
 	}
@@ -606,9 +1363,18 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 	if (!noinsert_set.empty()) {
 		rewrite_extent = true;
 	}
+	THROW_CHECK1(runtime_error, bfr, !ro_source || !rewrite_extent);
 
 	// If we need to replace part of the extent, rewrite all instances of it
 	if (rewrite_extent) {
+		// Content hashes of non-zero blocks for reinsertion after rewrite.
+		// csum hashes are not content hashes, but csum scan doesn't reinsert.
+		map<off_t, BeesHash> known_hashes;
+		for (const auto &i : hash_map) {
+			if (!zero_set.count(i.first) && !csum_map.count(i.first)) {
+				known_hashes.insert(i);
+			}
+		}
 		bool blocks_rewritten = false;
 		BEESTRACE("Rewriting extent " << e);
 		off_t last_p = e.begin();
@@ -622,7 +1388,7 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 			// BEESLOG("noinsert_set.count(" << to_hex(p) << ") " << noinsert_set.count(p));
 			if (noinsert_set.count(p)) {
 				if (p - last_p > 0) {
-					rewrite_file_range(BeesFileRange(bfr.fd(), last_p, p));
+					rewrite_file_range(BeesFileRange(bfr.fd(), last_p, p), known_hashes);
 					blocks_rewritten = true;
 				}
 				last_p = next_p;
@@ -633,7 +1399,7 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		}
 		BEESTRACE("last");
 		if (next_p - last_p > 0) {
-			rewrite_file_range(BeesFileRange(bfr.fd(), last_p, next_p));
+			rewrite_file_range(BeesFileRange(bfr.fd(), last_p, next_p), known_hashes);
 			blocks_rewritten = true;
 		}
 		if (blocks_rewritten) {
@@ -679,6 +1445,50 @@ BeesContext::get_inode_mutex(const uint64_t inode)
 	return m_inode_locks(inode);
 }
 
+/// Queue a file range to be read into page cache by the readahead
+/// thread, so a worker can do CPU work while the next extent is read.
+/// If the queue is full, the oldest request is dropped; the scan
+/// will read the data itself if it is not in cache by then.
+void
+BeesContext::readahead_async(const BeesFileRange &bfr)
+{
+	unique_lock<mutex> lock(m_readahead_mutex);
+	if (m_readahead_queue.size() >= BEES_READAHEAD_QUEUE_SIZE) {
+		m_readahead_queue.pop_front();
+		BEESCOUNT(readahead_async_drop);
+	}
+	m_readahead_queue.push_back(bfr);
+	m_readahead_condvar.notify_one();
+	BEESCOUNT(readahead_async_queue);
+}
+
+void
+BeesContext::readahead_loop()
+{
+	while (!stop_requested()) {
+		BEESNOTE("waiting for readahead requests");
+		unique_lock<mutex> lock(m_readahead_mutex);
+		if (m_readahead_queue.empty()) {
+			m_readahead_condvar.wait_for(lock, chrono::duration<double>(BEES_STATUS_INTERVAL));
+			continue;
+		}
+		auto bfr = m_readahead_queue.front();
+		m_readahead_queue.pop_front();
+		lock.unlock();
+
+		catch_all([&]() {
+			BEESNOTE("readahead open " << bfr);
+			bfr.fd(shared_from_this());
+			if (!bfr.fd()) {
+				BEESCOUNT(readahead_async_no_fd);
+				return;
+			}
+			bees_readahead(bfr.fd(), bfr.begin(), bfr.size());
+			BEESCOUNT(readahead_async_done);
+		});
+	}
+}
+
 bool
 BeesContext::scan_forward(const BeesFileRange &bfr_in)
 {
@@ -714,6 +1524,9 @@ BeesContext::scan_forward(const BeesFileRange &bfr_in)
 		return false;
 	}
 
+	// Dedupe, rewrite and BeesAddress lookups in this scan revisit the
+	// same files, so let their extent walkers share tree search results
+	BtrfsExtentCache::Scope extent_cache_scope;
 	BtrfsExtentWalker ew(bfr.fd(), bfr.begin(), root_fd());
 
 	Extent e;
@@ -753,22 +1566,643 @@ BeesContext::scan_forward(const BeesFileRange &bfr_in)
 	return start_over;
 }
 
-BeesResolveAddrResult::BeesResolveAddrResult()
+BeesLockLimit::BeesLockLimit(const string &type, double target) :
+	m_type(type),
+	m_target(target)
 {
+	MultiLocker::set_limit(m_type, m_limit);
 }
 
-BeesResolveAddrResult
-BeesContext::resolve_addr_uncached(BeesAddress addr)
+int
+BeesLockLimit::sample(double seconds)
 {
-	THROW_CHECK1(invalid_argument, addr, !addr.is_magic());
-	THROW_CHECK0(invalid_argument, !!root_fd());
-
-	// If we look at per-thread CPU usage we get a better estimate of
-	// how badly btrfs is performing without confounding factors like
-	// transaction latency, competing threads, and freeze/SIGSTOP
+	unique_lock<mutex> lock(m_mutex);
+	const size_t max_limit = max(size_t(1), TaskMaster::get_thread_count());
+	// Start from every worker, which is what no limit allows,
+	// and let slow calls cut it down from there
+	if (m_limit == 0) {
+		m_limit = max_limit;
+		m_since_cut = m_limit;
+		MultiLocker::set_limit(m_type, m_limit);
+	}
+	size_t new_limit = m_limit;
+	++m_since_cut;
+	if (seconds > m_target) {
+		// Calls already running were admitted under the old limit,
+		// so cut at most once per m_limit calls
+		m_good = 0;
+		if (m_since_cut >= m_limit) {
+			new_limit = max(size_t(1), m_limit / 2);
+			m_since_cut = 0;
+		}
+	} else if (++m_good >= m_limit) {
+		// Raise the limit once per m_limit fast calls
+		m_good = 0;
+		new_limit = m_limit + 1;
+	}
+	new_limit = min(new_limit, max_limit);
+	if (new_limit == m_limit) {
+		return 0;
+	}
+	const int rv = new_limit > m_limit ? 1 : -1;
+	BEESLOGDEBUG("Lock limit " << m_type << " " << m_limit << " -> " << new_limit << " after " << seconds << "s call");
+	m_limit = new_limit;
+	MultiLocker::set_limit(m_type, m_limit);
+	return rv;
+}
+
+size_t
+BeesLockLimit::limit() const
+{
+	unique_lock<mutex> lock(m_mutex);
+	return m_limit ? m_limit : max(size_t(1), TaskMaster::get_thread_count());
+}
+
+BeesLockLimit BeesContext::s_logical_ino_limit("logical_ino", BEES_LOGICAL_INO_TARGET_SYS);
+BeesLockLimit BeesContext::s_dedupe_limit("dedupe", BEES_DEDUPE_TARGET_TIME);
+
+mutex BeesShare::s_mutex;
+vector<shared_ptr<BeesShare>> BeesShare::s_shares;
+
+BeesShare::BeesShare(const shared_ptr<BeesContext> &ctx, double weight) :
+	m_ctx(ctx),
+	m_weight(weight)
+{
+	THROW_CHECK1(invalid_argument, weight, weight > 0);
+}
+
+shared_ptr<BeesShare>
+BeesShare::make(const shared_ptr<BeesContext> &ctx, double weight)
+{
+	const shared_ptr<BeesShare> rv(new BeesShare(ctx, weight));
+	unique_lock<mutex> lock(s_mutex);
+	s_shares.push_back(rv);
+	return rv;
+}
+
+vector<shared_ptr<BeesShare>>
+BeesShare::all()
+{
+	unique_lock<mutex> lock(s_mutex);
+	return s_shares;
+}
+
+/// Workers this filesystem may use:  its part of the worker threads,
+/// divided between the filesystems that are running or waiting to run
+/// Tasks.  Rounded up, so workers are never idle while one has work.
+size_t
+BeesShare::quota_locked() const
+{
+	double active_weight = m_weight;
+	for (const auto &i : s_shares) {
+		if (i.get() != this && (i->m_running || !i->m_waiting.empty())) {
+			active_weight += i->m_weight;
+		}
+	}
+	const size_t threads = max(size_t(1), TaskMaster::get_thread_count());
+	return max(size_t(1), size_t(ceil(threads * m_weight / active_weight)));
+}
+
+shared_ptr<Cleanup>
+BeesShare::start()
+{
+	static const auto s_unshared = make_shared<Cleanup>([](){});
+	unique_lock<mutex> lock(s_mutex);
+	if (s_shares.size() < 2) {
+		return s_unshared;
+	}
+	if (m_running >= quota_locked()) {
+		// release() will run us again
+		m_waiting.push_back(Task::current_task());
+		BEESCOUNT(share_wait);
+		return shared_ptr<Cleanup>();
+	}
+	++m_running;
+	lock.unlock();
+	const auto self = shared_from_this();
+	return make_shared<Cleanup>([self]() {
+		self->release();
+	});
+}
+
+/// Give the worker to the waiting filesystem furthest below its share,
+/// preferring this one.
+void
+BeesShare::release()
+{
+	unique_lock<mutex> lock(s_mutex);
+	THROW_CHECK0(runtime_error, m_running > 0);
+	--m_running;
+	BeesShare *next = nullptr;
+	if (!m_waiting.empty() && m_running < quota_locked()) {
+		next = this;
+	} else {
+		for (const auto &i : s_shares) {
+			if (i->m_waiting.empty() || i->m_running >= i->quota_locked()) {
+				continue;
+			}
+			if (!next || i->m_running / i->m_weight < next->m_running / next->m_weight) {
+				next = i.get();
+			}
+		}
+	}
+	if (!next) {
+		return;
+	}
+	const auto next_task = next->m_waiting.front();
+	next->m_waiting.pop_front();
+	lock.unlock();
+	BEESCOUNT(share_wake);
+	next_task.run();
+}
+
+size_t
+BeesShare::running() const
+{
+	unique_lock<mutex> lock(s_mutex);
+	return m_running;
+}
+
+size_t
+BeesShare::waiting() const
+{
+	unique_lock<mutex> lock(s_mutex);
+	return m_waiting.size();
+}
+
+mutex BeesMemory::s_mutex;
+vector<BeesMemory::Consumer> BeesMemory::s_consumers;
+uint64_t BeesMemory::s_limit = 0;
+uint64_t BeesMemory::s_total = 0;
+double BeesMemory::s_scale = 1;
+atomic<uint64_t> BeesMemory::s_generation(0);
+atomic<uint64_t> BeesMemory::s_logical_ino_bytes(0);
+string BeesMemory::s_pressure_path;
+uint64_t BeesMemory::s_pressure_total = 0;
+double BeesMemory::s_pressure = 0;
+Timer BeesMemory::s_pressure_timer;
+uint64_t BeesMemory::s_cgroup_current = 0;
+uint64_t BeesMemory::s_cgroup_high = 0;
+
+void
+BeesMemory::add(const string &name, BytesFn bytes_fn, ScaleFn scale_fn)
+{
+	unique_lock<mutex> lock(s_mutex);
+	if (scale_fn && s_scale < 1) {
+		scale_fn(s_scale);
+	}
+	Consumer consumer;
+	consumer.m_name = name;
+	consumer.m_bytes_fn = bytes_fn;
+	consumer.m_scale_fn = scale_fn;
+	s_consumers.push_back(consumer);
+}
+
+void
+BeesMemory::set_limit(uint64_t bytes)
+{
+	unique_lock<mutex> lock(s_mutex);
+	s_limit = bytes;
+}
+
+void
+BeesMemory::logical_ino_resize(size_t old_bytes, size_t new_bytes)
+{
+	s_logical_ino_bytes += new_bytes;
+	s_logical_ino_bytes -= old_bytes;
+}
+
+uint64_t
+BeesMemory::generation()
+{
+	return s_generation.load();
+}
+
+/// A value from a cgroup interface file, or 0 if the file is missing or "max"
+static uint64_t
+cgroup_memory_value(const string &cgroup, const string &name)
+{
+	if (cgroup.empty()) {
+		return 0;
+	}
+	const Fd fd(open((cgroup + "/" + name).c_str(), O_RDONLY | O_CLOEXEC));
+	if (!fd) {
+		return 0;
+	}
+	const string value = read_string(fd, 64);
+	if (value.empty() || !isdigit(value[0])) {
+		return 0;
+	}
+	return stoull(value);
+}
+
+void
+BeesMemory::sample()
+{
+	unique_lock<mutex> lock(s_mutex);
+	uint64_t total = s_logical_ino_bytes.load();
+	for (auto &i : s_consumers) {
+		i.m_bytes = i.m_bytes_fn();
+		total += i.m_bytes;
+	}
+	s_total = total;
+
+	// Memory PSI, as a percent of the time since the last sample
+	if (s_pressure_path.empty()) {
+		s_pressure_path = pressure_path("memory");
+		if (!s_pressure_path.empty()) {
+			s_pressure_total = pressure_some_total(s_pressure_path);
+			s_pressure_timer.reset();
+		}
+	} else {
+		const auto pressure_total = pressure_some_total(s_pressure_path);
+		const double seconds = s_pressure_timer.lap();
+		s_pressure = seconds > 0 ? (pressure_total - s_pressure_total) / 10000.0 / seconds : 0;
+		s_pressure_total = pressure_total;
+	}
+
+	const string cgroup = cgroup_path();
+	s_cgroup_current = cgroup_memory_value(cgroup, "memory.current");
+	s_cgroup_high = cgroup_memory_value(cgroup, "memory.high");
+
+	const bool over_limit = s_limit && total > s_limit;
+	const bool over_pressure = s_pressure > BEES_MEMORY_PRESSURE_TARGET;
+	const bool over_high = s_cgroup_high && s_cgroup_current > s_cgroup_high * BEES_MEMORY_HIGH_FRACTION;
+	const double old_scale = s_scale;
+	if (over_limit || over_pressure || over_high) {
+		s_scale = max(BEES_MEMORY_SCALE_MIN, s_scale / 2);
+		++s_generation;
+		BEESCOUNT(memory_shrink);
+		BEESLOGINFO("Shrinking caches to " << s_scale << " of normal size: used " << pretty(total)
+			<< (over_limit ? " over limit" : "")
+			<< (over_pressure ? " under memory pressure" : "")
+			<< (over_high ? " near cgroup memory.high" : ""));
+	} else if (s_scale < 1) {
+		s_scale = min(1.0, s_scale + BEES_MEMORY_SCALE_STEP);
+		BEESCOUNT(memory_grow);
+	}
+	if (s_scale != old_scale) {
+		for (const auto &i : s_consumers) {
+			if (i.m_scale_fn) {
+				i.m_scale_fn(s_scale);
+			}
+		}
+	}
+}
+
+/// Bytes of each type of consumer, summed over the filesystems
+map<string, uint64_t>
+BeesMemory::bytes_locked()
+{
+	map<string, uint64_t> rv;
+	for (const auto &i : s_consumers) {
+		rv[i.m_name] += i.m_bytes;
+	}
+	rv["logical_ino"] = s_logical_ino_bytes.load();
+	return rv;
+}
+
+void
+BeesMemory::print(ostream &os)
+{
+	unique_lock<mutex> lock(s_mutex);
+	os << "MEMORY (total " << pretty(s_total) << " limit " << (s_limit ? pretty(s_limit) : string("none"))
+		<< " scale " << s_scale << ", pressure " << s_pressure
+		<< ", cgroup current " << pretty(s_cgroup_current) << " high " << (s_cgroup_high ? pretty(s_cgroup_high) : string("none")) << "):\n";
+	for (const auto &i : bytes_locked()) {
+		os << "\t" << i.first << ": " << pretty(i.second) << "\n";
+	}
+}
+
+void
+BeesMemory::write_metrics(ostream &os)
+{
+	unique_lock<mutex> lock(s_mutex);
+	os << "# TYPE bees_memory_bytes gauge\n";
+	for (const auto &i : bytes_locked()) {
+		os << "bees_memory_bytes{consumer=\"" << i.first << "\"} " << i.second << "\n";
+	}
+	os << "# TYPE bees_memory_limit_bytes gauge\n";
+	os << "bees_memory_limit_bytes " << s_limit << "\n";
+	os << "# TYPE bees_memory_cache_scale gauge\n";
+	os << "bees_memory_cache_scale " << s_scale << "\n";
+}
+
+BeesResolveAddrResult::BeesResolveAddrResult()
+{
+	static const BeesInodeOffsetRoots s_empty = make_shared<const vector<BtrfsInodeOffsetRoot>>();
+	m_biors = s_empty;
+}
+
+BeesResolveStore::BeesResolveStore(shared_ptr<BeesContext> ctx) :
+	m_ctx(ctx),
+	m_file(ctx->home_fd(), "beesresolve.dat")
+{
+	catch_all([&]() {
+		load();
+	});
+}
+
+void
+BeesResolveStore::load()
+{
+	BEESNOTE("loading resolve store");
+	const string data = m_file.read();
+	unique_lock<mutex> lock(m_mutex);
+	for (const auto &line : split("\n", data)) {
+		map<string, uint64_t> d;
+		const auto words = split(" ", line);
+		for (auto it = words.begin(); it < words.end(); ++it) {
+			auto it1 = it;
+			++it;
+			THROW_CHECK1(out_of_range, words.size(), it < words.end());
+			d[*it1] = from_hex(*it);
+		}
+		if (d.empty()) {
+			continue;
+		}
+		Entry e;
+		e.m_end = d.at("end");
+		e.m_generation = d.at("generation");
+		e.m_toxic = d.at("toxic");
+		e.m_refs = d.at("refs");
+		m_extents[d.at("bytenr")] = e;
+	}
+	BEESLOGINFO("Loaded " << m_extents.size() << " extents from resolve store");
+}
+
+void
+BeesResolveStore::save()
+{
+	BEESNOTE("saving resolve store");
+	unique_lock<mutex> lock(m_mutex);
+	if (!m_dirty) {
+		return;
+	}
+	ostringstream oss;
+	for (const auto &i : m_extents) {
+		oss << "bytenr "     << to_hex(i.first)              << " ";
+		oss << "end "        << to_hex(i.second.m_end)       << " ";
+		oss << "generation " << i.second.m_generation        << " ";
+		oss << "toxic "      << i.second.m_toxic             << " ";
+		oss << "refs "       << i.second.m_refs              << "\n";
+	}
+	m_dirty = false;
+	lock.unlock();
+	catch_all([&]() {
+		m_file.write(oss.str());
+		BEESCOUNT(resolve_store_save);
+	});
+}
+
+size_t
+BeesResolveStore::size() const
+{
+	unique_lock<mutex> lock(m_mutex);
+	return m_extents.size();
+}
+
+BeesFileId
+BeesFileSizeIndex::find_or_insert(off_t size, uint64_t sample, const BeesFileId &fid)
+{
+	unique_lock<mutex> lock(m_mutex);
+	const Key key(size, sample);
+	const auto found = m_files.find(key);
+	if (found != m_files.end()) {
+		return found->second;
+	}
+	m_files.insert(make_pair(key, fid));
+	m_order.push_back(key);
+	while (m_order.size() > BEES_WHOLE_FILE_INDEX_SIZE) {
+		m_files.erase(m_order.front());
+		m_order.pop_front();
+	}
+	return BeesFileId();
+}
+
+void
+BeesFileSizeIndex::replace(off_t size, uint64_t sample, const BeesFileId &fid)
+{
+	unique_lock<mutex> lock(m_mutex);
+	const auto found = m_files.find(Key(size, sample));
+	if (found != m_files.end()) {
+		found->second = fid;
+	}
+}
+
+size_t
+BeesFileSizeIndex::size() const
+{
+	unique_lock<mutex> lock(m_mutex);
+	return m_files.size();
+}
+
+bool
+BeesContext::dedup_whole_file(const BeesFileId &fid)
+{
+	BEESNOTE("whole file " << fid);
+	BEESTRACE("whole file " << fid);
+
+	if (is_root_ro(fid.root())) {
+		return false;
+	}
+	Fd dst_fd = roots()->open_root_ino(fid);
+	if (!dst_fd) {
+		return false;
+	}
+	const off_t size = Stat(dst_fd).st_size;
+	if (size < BEES_WHOLE_FILE_MIN_SIZE) {
+		return false;
+	}
+
+	// Sample the first, middle, and last blocks.  Zero blocks don't
+	// identify anything, and bees doesn't dedupe them anyway.
+	uint64_t sample = 0;
+	const off_t last_block = (size - 1) & ~BLOCK_MASK_SUMS;
+	for (const off_t p : { off_t(0), (size / 2) & ~BLOCK_MASK_SUMS, last_block }) {
+		BeesBlockData bbd(dst_fd, p, min(BLOCK_SIZE_SUMS, size - p));
+		if (bbd.is_data_zero()) {
+			BEESCOUNT(whole_file_zero);
+			return false;
+		}
+		sample = (sample << 21 | sample >> 43) ^ bbd.hash();
+	}
+
+	const auto src_fid = m_file_size_index.find_or_insert(size, sample, fid);
+	if (!src_fid || src_fid == fid) {
+		BEESCOUNT(whole_file_new);
+		return false;
+	}
+
+	// The src might have been deleted, modified, or blacklisted since
+	Fd src_fd;
+	if (!is_blacklisted(src_fid)) {
+		src_fd = roots()->open_root_ino(src_fid);
+	}
+	if (!src_fd || Stat(src_fd).st_size != size) {
+		m_file_size_index.replace(size, sample, fid);
+		BEESCOUNT(whole_file_stale);
+		return false;
+	}
+
+	// Already the same extent, e.g. a reflink copy or a snapshot
+	if (BeesAddress(src_fd, 0).get_physical_or_zero() == BeesAddress(dst_fd, 0).get_physical_or_zero()) {
+		BEESCOUNT(whole_file_same);
+		return false;
+	}
+
+	// The kernel compares the data.  Dedupe no more than one max-length
+	// request at a time so other dedupes and LOGICAL_INO can get between them.
+	BEESCOUNT(whole_file_try);
+	for (off_t p = 0; p < size; p += BTRFS_MAX_DEDUPE_LEN) {
+		const off_t end = min(size, p + off_t(BTRFS_MAX_DEDUPE_LEN));
+		if (!dedup(BeesRangePair(BeesFileRange(src_fd, p, end), BeesFileRange(dst_fd, p, end)))) {
+			// The block scan will pick up whatever matches.  Files
+			// like this one may match it, but they don't match src.
+			m_file_size_index.replace(size, sample, fid);
+			BEESCOUNT(whole_file_miss);
+			return false;
+		}
+	}
+	BEESCOUNT(whole_file_hit);
+	BEESCOUNTADD(whole_file_bytes, size);
+	return true;
+}
+
+BtrfsTreeItem
+BeesResolveStore::fetch_extent(uint64_t bytenr)
+{
+	BEESNOTE("fetching extent item for " << to_hex(bytenr));
+	BtrfsExtentItemFetcher fetcher(m_ctx->root_fd());
+	const auto bti = fetcher.rlower_bound(bytenr);
+	if (!!bti && bti.extent_begin() <= bytenr && bytenr < bti.extent_end()) {
+		return bti;
+	}
+	return BtrfsTreeItem();
+}
+
+bool
+BeesResolveStore::lookup(uint64_t bytenr, BeesResolveAddrResult &rv)
+{
+	unique_lock<mutex> lock(m_mutex);
+	auto found = m_extents.upper_bound(bytenr);
+	if (found == m_extents.begin()) {
+		return false;
+	}
+	--found;
+	if (bytenr >= found->second.m_end) {
+		return false;
+	}
+	const auto begin = found->first;
+	const auto entry = found->second;
+	lock.unlock();
+
+	// The extent may have been freed and reallocated since it was stored
+	const auto bti = fetch_extent(bytenr);
+	if (!bti || bti.extent_begin() != begin || bti.extent_end() != entry.m_end || bti.extent_generation() != entry.m_generation) {
+		BEESCOUNT(resolve_store_stale);
+		lock.lock();
+		m_extents.erase(begin);
+		m_dirty = true;
+		return false;
+	}
+
+	BEESCOUNT(resolve_store_hit);
+	rv = BeesResolveAddrResult();
+	rv.m_is_toxic = entry.m_toxic;
+	return true;
+}
+
+void
+BeesResolveStore::insert(uint64_t bytenr, bool toxic, uint64_t refs)
+{
+	const auto bti = fetch_extent(bytenr);
+	if (!bti) {
+		return;
+	}
+	Entry e;
+	e.m_end = bti.extent_end();
+	e.m_generation = bti.extent_generation();
+	e.m_toxic = toxic;
+	e.m_refs = refs;
+
+	unique_lock<mutex> lock(m_mutex);
+	if (m_extents.size() >= BEES_RESOLVE_STORE_SIZE && !m_extents.count(bti.extent_begin())) {
+		// Drop the oldest extent, it's the most likely to be gone
+		auto oldest = m_extents.begin();
+		for (auto i = m_extents.begin(); i != m_extents.end(); ++i) {
+			if (i->second.m_generation < oldest->second.m_generation) {
+				oldest = i;
+			}
+		}
+		m_extents.erase(oldest);
+		BEESCOUNT(resolve_store_evict);
+	}
+	m_extents[bti.extent_begin()] = e;
+	m_dirty = true;
+	BEESCOUNT(resolve_store_insert);
+}
+
+namespace {
+
+	// A thread's LOGICAL_INO buffer, counted by BeesMemory, and
+	// shrunk back to its initial size when BeesMemory shrinks the caches
+	class BeesLogicalInoBuffer {
+		BtrfsIoctlLogicalInoArgs	m_args { 0 };
+		size_t				m_counted = 0;
+		uint64_t			m_generation = BeesMemory::generation();
+	public:
+		~BeesLogicalInoBuffer()
+		{
+			BeesMemory::logical_ino_resize(m_counted, 0);
+		}
+		BtrfsIoctlLogicalInoArgs &get()
+		{
+			const auto generation = BeesMemory::generation();
+			if (generation != m_generation) {
+				m_generation = generation;
+				m_args.shrink();
+				count();
+			}
+			return m_args;
+		}
+		void count()
+		{
+			const size_t size = m_args.get_container_size();
+			BeesMemory::logical_ino_resize(m_counted, size);
+			m_counted = size;
+		}
+	};
+
+}
+
+BeesResolveAddrResult
+BeesContext::resolve_addr_uncached(BeesAddress addr, uint64_t flags)
+{
+	THROW_CHECK1(invalid_argument, addr, !addr.is_magic());
+	THROW_CHECK0(invalid_argument, !!root_fd());
+
+	// Skip the ioctl for extents that were toxic or had too many refs last time
+	{
+		BeesResolveAddrResult stored;
+		if (resolve_store()->lookup(addr.get_physical_or_zero(), stored)) {
+			record_resolve(addr, 0, stored.is_toxic(), !stored.is_toxic());
+			return stored;
+		}
+	}
+
+	BEESPHASE(resolve);
+
+	// If we look at per-thread CPU usage we get a better estimate of
+	// how badly btrfs is performing without confounding factors like
+	// transaction latency, competing threads, and freeze/SIGSTOP
 	// pausing the bees process.
 
-        BtrfsIoctlLogicalInoArgs log_ino(addr.get_physical_or_zero());
+	// Each thread keeps its buffer, which grows to fit the biggest extent it has seen
+	static thread_local BeesLogicalInoBuffer log_ino_buffer;
+	auto &log_ino = log_ino_buffer.get();
+	log_ino.set_logical(addr.get_physical_or_zero());
+	log_ino.set_flags(flags);
 
 	// Time how long this takes
 	Timer resolve_timer;
@@ -791,7 +2225,9 @@ BeesContext::resolve_addr_uncached(BeesAddress addr)
 			BEESCOUNT(resolve_fail);
 		}
 		BEESCOUNTADD(resolve_ms, resolve_timer.age() * 1000);
+		BEESHISTOGRAM(resolve, resolve_timer.age());
 	}
+	log_ino_buffer.count();
 
 	// Again!
 	struct rusage usage_after;
@@ -807,12 +2243,21 @@ BeesContext::resolve_addr_uncached(BeesAddress addr)
 
 	const auto rt_age = resolve_timer.age();
 
+	// Backref walking cost is kernel CPU time, not wall time
+	const auto limit_change = s_logical_ino_limit.sample(sys_usage_delta);
+	if (limit_change > 0) {
+		BEESCOUNT(resolve_limit_inc);
+	} else if (limit_change < 0) {
+		BEESCOUNT(resolve_limit_dec);
+	}
+
 	BeesResolveAddrResult rv;
 
 	// Avoid performance problems - pretend resolve failed if there are too many refs
 	const size_t rv_count = log_ino.m_iors.size();
 	if (rv_count < BEES_MAX_EXTENT_REF_COUNT) {
-		rv.m_biors = vector<BtrfsInodeOffsetRoot>(log_ino.m_iors.begin(), log_ino.m_iors.end());
+		// The ioctl buffer is reused, so this is the only copy of the refs
+		rv.m_biors = make_shared<const vector<BtrfsInodeOffsetRoot>>(log_ino.m_iors.begin(), log_ino.m_iors.end());
 	} else {
 		BEESLOGINFO("addr " << addr << " refs " << rv_count << " overflows configured ref limit " << BEES_MAX_EXTENT_REF_COUNT);
 		BEESCOUNT(resolve_overflow);
@@ -839,9 +2284,33 @@ BeesContext::resolve_addr_uncached(BeesAddress addr)
 		BEESCOUNT(resolve_large);
 	}
 
+	if (rv.m_is_toxic || rv_count >= BEES_MAX_EXTENT_REF_COUNT) {
+		resolve_store()->insert(addr.get_physical_or_zero(), rv.m_is_toxic, rv_count);
+	}
+
+	record_resolve(addr, rv_count, rv.m_is_toxic, rv_count >= BEES_MAX_EXTENT_REF_COUNT);
 	return rv;
 }
 
+void
+BeesContext::record_resolve(BeesAddress addr, size_t refs, bool toxic, bool overflow)
+{
+	if (!m_recorder) {
+		return;
+	}
+	BeesRecorder::Record rec = { };
+	rec.r_type = BeesRecorder::REC_RESOLVE;
+	if (toxic) {
+		rec.r_flags |= BeesRecorder::RESOLVE_TOXIC;
+	}
+	if (overflow) {
+		rec.r_flags |= BeesRecorder::RESOLVE_OVERFLOW;
+	}
+	rec.r_addr = addr.get_physical_or_zero();
+	rec.r_length = refs;
+	m_recorder->write(vector<BeesRecorder::Record> { rec });
+}
+
 BeesResolveAddrResult
 BeesContext::resolve_addr(BeesAddress addr)
 {
@@ -849,6 +2318,14 @@ BeesContext::resolve_addr(BeesAddress addr)
 	return m_resolve_cache(addr.get_physical_or_zero());
 }
 
+BeesResolveAddrResult
+BeesContext::resolve_extent_refs(uint64_t bytenr)
+{
+	// Every ref to any part of the extent, offsets are where each ref starts in its file
+	BEESCOUNT(resolve_ignore_offset);
+	return resolve_addr_uncached(BeesAddress(bytenr), BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET);
+}
+
 void
 BeesContext::invalidate_addr(BeesAddress addr)
 {
@@ -872,11 +2349,23 @@ BeesContext::set_root_fd(Fd fd)
 	THROW_CHECK1(invalid_argument, root_fd_treeid, root_fd_treeid == BTRFS_FS_TREE_OBJECTID);
 	Stat st(fd);
 	THROW_CHECK1(invalid_argument, st.st_ino, st.st_ino == BTRFS_FIRST_FREE_OBJECTID);
+
+	// Block geometry is fixed when bees is built, so it has to match
+	BtrfsIoctlFsInfoArgs fs_info;
+	fs_info.do_ioctl(fd);
+	BEESLOGINFO("filesystem sectorsize " << fs_info.sectorsize << " clone_alignment " << fs_info.clone_alignment
+		<< ", bees block size " << BLOCK_SIZE_CLONE);
+	if (fs_info.sectorsize != BLOCK_SIZE_SUMS || fs_info.clone_alignment != BLOCK_SIZE_CLONE) {
+		THROW_ERROR(invalid_argument, "filesystem sectorsize " << fs_info.sectorsize
+			<< " clone_alignment " << fs_info.clone_alignment
+			<< " does not match bees block size " << BLOCK_SIZE_CLONE
+			<< ", rebuild bees with make BEES_BLOCK_SIZE=" << fs_info.clone_alignment);
+	}
 	m_root_fd = fd;
 
 	// 65536 is big enough for two max-sized extents.
 	// Need enough total space in the cache for the maximum number of active threads.
-	m_resolve_cache.max_size(65536);
+	m_resolve_cache.max_size(BEES_RESOLVE_CACHE_SIZE);
 	m_resolve_cache.func([&](BeesAddress addr) -> BeesResolveAddrResult {
 		return resolve_addr_uncached(addr);
 	});
@@ -896,14 +2385,35 @@ BeesContext::start()
 		return make_shared<Exclusion>();
 		(void)fid;
 	});
+	// The first filesystem in the process reports for all of them
+	m_share = BeesShare::make(shared_from_this(), m_share_weight);
+	const bool primary = BeesShare::all().front() == m_share;
+
 	m_progress_thread = make_shared<BeesThread>("progress_report");
-	m_progress_thread = make_shared<BeesThread>("progress_report");
-	m_status_thread = make_shared<BeesThread>("status_report");
 	m_progress_thread->exec([=]() {
 		show_progress();
 	});
-	m_status_thread->exec([=]() {
-		dump_status();
+	if (primary) {
+		m_status_thread = make_shared<BeesThread>("status_report");
+		m_status_thread->exec([=]() {
+			dump_status();
+		});
+		m_metrics_thread = make_shared<BeesThread>("metrics");
+		m_metrics_thread->exec([=]() {
+			serve_metrics();
+		});
+		m_profile_thread = make_shared<BeesThread>("profile");
+		m_profile_thread->exec([=]() {
+			sample_profile();
+		});
+		m_memory_thread = make_shared<BeesThread>("memory");
+		m_memory_thread->exec([=]() {
+			govern_memory();
+		});
+	}
+	m_readahead_thread = make_shared<BeesThread>("readahead");
+	m_readahead_thread->exec([=]() {
+		readahead_loop();
 	});
 
 	// Set up temporary file pool
@@ -912,15 +2422,46 @@ BeesContext::start()
 	});
 	m_tmpfile_pool.checkin([](const shared_ptr<BeesTempFile> &btf) {
 		catch_all([&](){
-			btf->reset();
+			btf->reuse();
 		});
 	});
 
+	// Record a scan trace if requested, before any scan starts.
+	// Records don't say which filesystem they came from.
+	auto record_charp = getenv("BEESRECORD");
+	if (record_charp && primary) {
+		m_recorder = make_shared<BeesRecorder>(record_charp);
+	}
+
 	// Force these to exist now so we don't have recursive locking
 	// operations trying to access them
 	fd_cache();
 	hash_table();
 
+	// Memory used by this filesystem
+	const auto hash_table_ptr = m_hash_table;
+	BeesMemory::add("hash_table", [hash_table_ptr]() -> uint64_t {
+		return hash_table_ptr->total_cells() * sizeof(BeesHashTable::Cell);
+	});
+	const auto fd_cache_ptr = m_fd_cache;
+	BeesMemory::add("fd_cache", [fd_cache_ptr]() -> uint64_t {
+		return fd_cache_ptr->size() * BEES_MEMORY_FD_ENTRY_BYTES;
+	}, [fd_cache_ptr](double scale) {
+		fd_cache_ptr->set_scale(scale);
+	});
+	const auto roots_ptr = roots();
+	BeesMemory::add("ino_path_cache", [roots_ptr]() -> uint64_t {
+		return roots_ptr->ino_path_cache_size() * BEES_MEMORY_PATH_ENTRY_BYTES;
+	}, [roots_ptr](double scale) {
+		roots_ptr->set_ino_path_cache_scale(scale);
+	});
+	const auto self = shared_from_this();
+	BeesMemory::add("resolve_cache", [self]() -> uint64_t {
+		return self->m_resolve_cache.size() * BEES_MEMORY_RESOLVE_ENTRY_BYTES;
+	}, [self](double scale) {
+		self->m_resolve_cache.max_size(max(size_t(1), static_cast<size_t>(BEES_RESOLVE_CACHE_SIZE * scale)));
+	});
+
 	// Kick off the crawlers
 	roots()->start();
 }
@@ -936,6 +2477,56 @@ BeesContext::stop()
 	BEESLOGDEBUG("Pausing work queue");
 	TaskMaster::pause();
 
+	// All filesystems in the process share the work queue, so they stop together
+	vector<shared_ptr<BeesContext>> contexts;
+	for (const auto &i : BeesShare::all()) {
+		const auto ctx = i->ctx();
+		if (ctx) {
+			contexts.push_back(ctx);
+		}
+	}
+	if (contexts.empty()) {
+		contexts.push_back(shared_from_this());
+	}
+	for (const auto &ctx : contexts) {
+		ctx->stop_request_scan();
+	}
+	for (const auto &ctx : contexts) {
+		ctx->stop_wait_scan();
+	}
+
+	// Write status once with this message...
+	BEESNOTE("stopping status thread at " << stop_timer << " sec");
+	unique_lock<mutex> lock(m_stop_mutex);
+	m_stop_condvar.notify_all();
+	lock.unlock();
+
+	// then wake the thread up one more time to exit the while loop
+	BEESLOGDEBUG("Waiting for status thread");
+	lock.lock();
+	m_stop_status = true;
+	m_stop_condvar.notify_all();
+	lock.unlock();
+	if (m_status_thread) {
+		m_status_thread->join();
+	}
+
+	// The profiler writes its last samples when it sees m_stop_status
+	BEESLOGDEBUG("Waiting for profile thread");
+	if (m_profile_thread) {
+		m_profile_thread->join();
+	}
+
+	BEESLOGNOTICE("bees stopped in " << stop_timer << " sec");
+	Chatter::flush_async();
+
+	// Skip all destructors, do not pass GO, do not collect atexit() functions
+	_exit(EXIT_SUCCESS);
+}
+
+void
+BeesContext::stop_request_scan()
+{
 	// Stop crawlers first so we get good progress persisted on disk
 	BEESNOTE("stopping crawlers and flushing crawl state");
 	BEESLOGDEBUG("Stopping crawlers and flushing crawl state");
@@ -952,7 +2543,11 @@ BeesContext::stop()
 	} else {
 		BEESLOGDEBUG("Hash table not running");
 	}
+}
 
+void
+BeesContext::stop_wait_scan()
+{
 	// Wait for crawler writeback to finish
 	BEESNOTE("waiting for crawlers to stop");
 	BEESLOGDEBUG("Waiting for crawlers to stop");
@@ -969,6 +2564,12 @@ BeesContext::stop()
 	m_stop_condvar.notify_all();
 	lock.unlock();
 
+	// Wake up the readahead thread so it notices the stop request
+	unique_lock<mutex> readahead_lock(m_readahead_mutex);
+	m_readahead_queue.clear();
+	m_readahead_condvar.notify_all();
+	readahead_lock.unlock();
+
 	// Wait for hash table flush to complete
 	BEESNOTE("waiting for hash table flush to stop");
 	BEESLOGDEBUG("waiting for hash table flush to stop");
@@ -976,24 +2577,11 @@ BeesContext::stop()
 		m_hash_table->stop_wait();
 	}
 
-	// Write status once with this message...
-	BEESNOTE("stopping status thread at " << stop_timer << " sec");
-	lock.lock();
-	m_stop_condvar.notify_all();
-	lock.unlock();
-
-	// then wake the thread up one more time to exit the while loop
-	BEESLOGDEBUG("Waiting for status thread");
-	lock.lock();
-	m_stop_status = true;
-	m_stop_condvar.notify_all();
-	lock.unlock();
-	m_status_thread->join();
-
-	BEESLOGNOTICE("bees stopped in " << stop_timer << " sec");
-
-	// Skip all destructors, do not pass GO, do not collect atexit() functions
-	_exit(EXIT_SUCCESS);
+	// No more extents will be scanned
+	if (m_recorder) {
+		BEESNOTE("flushing scan trace");
+		m_recorder->flush();
+	}
 }
 
 bool
@@ -1035,7 +2623,24 @@ BeesContext::tmpfile()
 {
 	unique_lock<mutex> lock(m_stop_mutex);
 	lock.unlock();
-	return m_tmpfile_pool();
+
+	// Each worker thread keeps a temporary file from the pool, and
+	// appends copies to it until it is big enough to truncate
+	unique_lock<mutex> worker_lock(m_worker_tmpfiles_mutex);
+	auto &worker_tmpfile = m_worker_tmpfiles[this_thread::get_id()];
+	if (!worker_tmpfile) {
+		worker_tmpfile = m_tmpfile_pool();
+	} else if (worker_tmpfile.use_count() > 1) {
+		// Still in use further up this thread's stack
+		worker_lock.unlock();
+		BEESCOUNT(tmp_pool);
+		return m_tmpfile_pool();
+	}
+	const auto rv = worker_tmpfile;
+	worker_lock.unlock();
+	rv->reuse();
+	BEESCOUNT(tmp_reuse);
+	return rv;
 }
 
 shared_ptr<BeesFdCache>
@@ -1058,12 +2663,22 @@ BeesContext::roots()
 	return m_roots;
 }
 
+shared_ptr<BeesResolveStore>
+BeesContext::resolve_store()
+{
+	unique_lock<mutex> lock(m_stop_mutex);
+	if (!m_resolve_store) {
+		m_resolve_store = make_shared<BeesResolveStore>(shared_from_this());
+	}
+	return m_resolve_store;
+}
+
 shared_ptr<BeesHashTable>
 BeesContext::hash_table()
 {
 	unique_lock<mutex> lock(m_stop_mutex);
 	if (!m_hash_table) {
-		m_hash_table = make_shared<BeesHashTable>(shared_from_this(), "beeshash.dat");
+		m_hash_table = make_shared<BeesHashTable>(shared_from_this(), "beeshash.dat", m_hash_table_size);
 	}
 	return m_hash_table;
 }
@@ -0,0 +1,312 @@
+#include "bees.h"
+
+#include "crucible/string.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include <getopt.h>
+#include <syslog.h>
+
+using namespace crucible;
+using namespace std;
+
+// Hash table micro-benchmark.  Builds a BeesHashTable in a scratch
+// BEESHOME and drives lookups, inserts and erases from several threads.
+
+namespace {
+
+	enum BenchOp {
+		OP_LOOKUP_HIT,
+		OP_LOOKUP_MISS,
+		OP_INSERT,
+		OP_ERASE,
+		OP_COUNT,
+	};
+
+	const char *const bench_op_names[OP_COUNT] = {
+		"lookup_hit",
+		"lookup_miss",
+		"insert",
+		"erase",
+	};
+
+	struct BenchConfig {
+		off_t		m_size = 64 * 1024 * 1024;
+		unsigned	m_threads = 4;
+		double		m_hit_ratio = 0.5;
+		double		m_erase_ratio = 0.01;
+		double		m_fill = 1.0;
+		double		m_duration = 5.0;
+		string		m_dir;
+	};
+
+	struct BenchThreadResult {
+		vector<uint32_t>	m_latency_ns[OP_COUNT];
+		size_t			m_found = 0;
+	};
+
+	// splitmix64, so every thread can regenerate its keys' hashes
+	uint64_t
+	bench_hash(uint64_t key)
+	{
+		uint64_t z = key + 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	uint64_t
+	bench_addr(uint64_t key)
+	{
+		// Block aligned, never magic
+		return (key + 1) << 12;
+	}
+
+	uint64_t
+	bench_key(unsigned thread, uint64_t index)
+	{
+		return (uint64_t(thread) << 40) | index;
+	}
+
+	off_t
+	parse_size(const string &s)
+	{
+		size_t end = 0;
+		off_t rv = stoull(s, &end);
+		const string suffix = s.substr(end);
+		if (suffix == "K" || suffix == "k") {
+			rv <<= 10;
+		} else if (suffix == "M" || suffix == "m") {
+			rv <<= 20;
+		} else if (suffix == "G" || suffix == "g") {
+			rv <<= 30;
+		} else if (!suffix.empty()) {
+			THROW_ERROR(invalid_argument, "unknown size suffix in '" << s << "'");
+		}
+		return rv;
+	}
+
+	double
+	percentile_us(vector<uint32_t> &v, double p)
+	{
+		if (v.empty()) {
+			return 0;
+		}
+		const size_t n = min(v.size() - 1, static_cast<size_t>(v.size() * p));
+		nth_element(v.begin(), v.begin() + n, v.end());
+		return v[n] / 1000.0;
+	}
+
+	void
+	bench_usage(const char *argv0)
+	{
+		cerr << "Usage: " << argv0 << " [options]\n"
+			<< "    -s, --size SIZE          Hash table size (K/M/G suffix, default 64M)\n"
+			<< "    -t, --threads N          Worker threads (default 4)\n"
+			<< "    -r, --hit-ratio R        Fraction of lookups for hashes already inserted (default 0.5)\n"
+			<< "    -e, --erase-ratio R      Fraction of operations that erase (default 0.01)\n"
+			<< "    -f, --fill R             Fraction of cells inserted before timing (default 1.0)\n"
+			<< "    -d, --duration SEC       Timed run length (default 5)\n"
+			<< "    -D, --dir DIR            Parent of the scratch BEESHOME (default $TMPDIR or /tmp)\n"
+			<< "    -v, --verbose LEVEL      bees log level (default " << LOG_WARNING << ")\n";
+	}
+
+	void
+	remove_scratch(const string &dir)
+	{
+		for (auto name : { "beeshash.dat", "beeshash.dat.tmp", "beeshash.algo", "beeshash.algo.tmp",
+			"beeshash.ckpt", "beeshash.ckpt.tmp", "beesstats.txt", "beesstats.txt.tmp" }) {
+			unlink((dir + "/" + name).c_str());
+		}
+		rmdir(dir.c_str());
+	}
+
+}
+
+int
+main(int argc, char *argv[])
+{
+	BeesNote::set_name("bench");
+	bees_log_level = LOG_WARNING;
+
+	BenchConfig config;
+	const char *tmpdir = getenv("TMPDIR");
+	config.m_dir = tmpdir ? tmpdir : "/tmp";
+
+	static const struct option long_options[] = {
+		{ "dir",         required_argument, NULL, 'D' },
+		{ "duration",    required_argument, NULL, 'd' },
+		{ "erase-ratio", required_argument, NULL, 'e' },
+		{ "fill",        required_argument, NULL, 'f' },
+		{ "help",        no_argument,       NULL, 'h' },
+		{ "hit-ratio",   required_argument, NULL, 'r' },
+		{ "size",        required_argument, NULL, 's' },
+		{ "threads",     required_argument, NULL, 't' },
+		{ "verbose",     required_argument, NULL, 'v' },
+		{ 0, 0, 0, 0 },
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "D:d:e:f:hr:s:t:v:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'D': config.m_dir = optarg; break;
+			case 'd': config.m_duration = stod(optarg); break;
+			case 'e': config.m_erase_ratio = stod(optarg); break;
+			case 'f': config.m_fill = stod(optarg); break;
+			case 'r': config.m_hit_ratio = stod(optarg); break;
+			case 's': config.m_size = parse_size(optarg); break;
+			case 't': config.m_threads = stoul(optarg); break;
+			case 'v': bees_log_level = stoul(optarg); break;
+			case 'h':
+			default:
+				bench_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	THROW_CHECK1(invalid_argument, config.m_size, config.m_size > 0 && (config.m_size % BLOCK_SIZE_HASHTAB_EXTENT) == 0);
+	THROW_CHECK1(invalid_argument, config.m_threads, config.m_threads > 0);
+	THROW_CHECK1(invalid_argument, config.m_hit_ratio, config.m_hit_ratio >= 0 && config.m_hit_ratio <= 1);
+	THROW_CHECK1(invalid_argument, config.m_erase_ratio, config.m_erase_ratio >= 0 && config.m_erase_ratio <= 1);
+
+	string scratch = config.m_dir + "/bees-hash-bench.XXXXXX";
+	DIE_IF_ZERO(mkdtemp(&scratch[0]));
+	setenv("BEESHOME", scratch.c_str(), 1);
+
+	int rv = EXIT_FAILURE;
+	catch_all([&]() {
+		// No root path:  BEESHOME is absolute, and the scratch dir need not be btrfs
+		auto bc = make_shared<BeesContext>();
+		bc->set_hash_table_size(config.m_size);
+		bc->set_hash_table_memory(BeesHashTable::MEM_THP);
+		auto hash_table = bc->hash_table();
+
+		const size_t cells = config.m_size / sizeof(BeesHashTable::Cell);
+		const size_t fill_per_thread = cells * config.m_fill / config.m_threads;
+		cout << "table " << pretty(config.m_size) << " (" << cells << " cells), "
+			<< config.m_threads << " threads, hit ratio " << config.m_hit_ratio
+			<< ", erase ratio " << config.m_erase_ratio
+			<< ", fill " << fill_per_thread * config.m_threads << " cells" << endl;
+
+		// Fill phase, also faults in the whole table
+		Timer fill_timer;
+		vector<BeesThread> fill_threads;
+		fill_threads.reserve(config.m_threads);
+		for (unsigned t = 0; t < config.m_threads; ++t) {
+			fill_threads.emplace_back("bench_fill_" + to_string(t));
+		}
+		for (unsigned t = 0; t < config.m_threads; ++t) {
+			fill_threads[t].exec([&, t]() {
+				for (size_t i = 0; i < fill_per_thread; ++i) {
+					const auto key = bench_key(t, i);
+					hash_table->push_random_hash_addr(bench_hash(key), bench_addr(key));
+				}
+			});
+		}
+		for (auto &th : fill_threads) {
+			th.join();
+		}
+		cout << "fill " << fill_timer << " sec" << endl;
+
+		// Timed phase
+		vector<BenchThreadResult> results(config.m_threads);
+		const uint64_t lock_wait_start = hash_table->lock_wait_ns();
+		Timer run_timer;
+		vector<BeesThread> run_threads;
+		run_threads.reserve(config.m_threads);
+		for (unsigned t = 0; t < config.m_threads; ++t) {
+			run_threads.emplace_back("bench_run_" + to_string(t));
+		}
+		for (unsigned t = 0; t < config.m_threads; ++t) {
+			run_threads[t].exec([&, t]() {
+				auto &result = results[t];
+				default_random_engine gen(t + 1);
+				uniform_real_distribution<double> ratio_dist(0, 1);
+				uint64_t next_index = fill_per_thread;
+				Timer thread_timer;
+				while (thread_timer.age() < config.m_duration) {
+					// Amortize the clock check over a batch of operations
+					for (int batch = 0; batch < 256; ++batch) {
+						BenchOp op;
+						uint64_t key;
+						if (next_index && ratio_dist(gen) < config.m_erase_ratio) {
+							op = OP_ERASE;
+							key = bench_key(t, uniform_int_distribution<uint64_t>(0, next_index - 1)(gen));
+						} else if (next_index && ratio_dist(gen) < config.m_hit_ratio) {
+							op = OP_LOOKUP_HIT;
+							key = bench_key(t, uniform_int_distribution<uint64_t>(0, next_index - 1)(gen));
+						} else {
+							op = OP_LOOKUP_MISS;
+							key = bench_key(t, next_index++);
+						}
+						const auto hash = bench_hash(key);
+						const auto addr = bench_addr(key);
+
+						auto op_start = chrono::steady_clock::now();
+						if (op == OP_ERASE) {
+							hash_table->erase_hash_addr(hash, addr);
+						} else if (!hash_table->find_cell(hash).empty()) {
+							++result.m_found;
+						}
+						auto op_end = chrono::steady_clock::now();
+						result.m_latency_ns[op].push_back(min<uint64_t>(UINT32_MAX, chrono::duration_cast<chrono::nanoseconds>(op_end - op_start).count()));
+
+						// New blocks are inserted after the lookup misses, as in scan_one_extent
+						if (op == OP_LOOKUP_MISS) {
+							op_start = op_end;
+							hash_table->push_random_hash_addr(hash, addr);
+							op_end = chrono::steady_clock::now();
+							result.m_latency_ns[OP_INSERT].push_back(min<uint64_t>(UINT32_MAX, chrono::duration_cast<chrono::nanoseconds>(op_end - op_start).count()));
+						}
+					}
+				}
+			});
+		}
+		for (auto &th : run_threads) {
+			th.join();
+		}
+		const double run_time = run_timer.age();
+		const uint64_t lock_wait = hash_table->lock_wait_ns() - lock_wait_start;
+
+		// Report
+		size_t total_ops = 0;
+		size_t total_lookups = 0;
+		size_t total_found = 0;
+		cout << setw(12) << "op" << setw(12) << "count" << setw(14) << "ops/sec" << setw(12) << "p50 us" << setw(12) << "p99 us" << endl;
+		for (int op = 0; op < OP_COUNT; ++op) {
+			vector<uint32_t> all;
+			for (auto &result : results) {
+				all.insert(all.end(), result.m_latency_ns[op].begin(), result.m_latency_ns[op].end());
+			}
+			total_ops += all.size();
+			if (op == OP_LOOKUP_HIT || op == OP_LOOKUP_MISS) {
+				total_lookups += all.size();
+			}
+			const double p50 = percentile_us(all, 0.50);
+			const double p99 = percentile_us(all, 0.99);
+			cout << setw(12) << bench_op_names[op] << setw(12) << all.size()
+				<< setw(14) << fixed << setprecision(0) << all.size() / run_time
+				<< setw(12) << setprecision(3) << p50
+				<< setw(12) << setprecision(3) << p99 << endl;
+		}
+		for (auto &result : results) {
+			total_found += result.m_found;
+		}
+		cout << "total " << total_ops << " ops in " << setprecision(3) << run_time << " sec, "
+			<< setprecision(0) << total_ops / run_time << " ops/sec" << endl;
+		cout << "lookups found " << total_found << " of " << total_lookups
+			<< " (" << setprecision(1) << (total_lookups ? 100.0 * total_found / total_lookups : 0.0) << "%)" << endl;
+		cout << "lock wait " << setprecision(3) << lock_wait / 1e6 << " ms total, "
+			<< (total_ops ? double(lock_wait) / total_ops : 0.0) << " ns/op" << endl;
+
+		hash_table->stop_request();
+		hash_table->stop_wait();
+		rv = EXIT_SUCCESS;
+	});
+
+	remove_scratch(scratch);
+	return rv;
+}
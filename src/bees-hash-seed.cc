@@ -0,0 +1,246 @@
+#include "bees.h"
+
+#include "crucible/btrfs-tree.h"
+#include "crucible/string.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include <getopt.h>
+#include <syslog.h>
+
+using namespace crucible;
+using namespace std;
+
+// Hash table export and import.  Export writes the hashes in the hash
+// table of a filesystem with the btrfs csum of each hashed block, which
+// identifies the block content without its physical address.  Import
+// reads the csum tree of another filesystem with the same data (e.g. a
+// backup target receiving the same streams), and inserts each exported
+// hash at the address of a block with the same csum.  bees then dedupes
+// received data against a useful hash table without a full scan first.
+//
+// bees reads and compares the data before each dedupe, so a block with an
+// equal csum but different data (more likely with crc32c) only wastes a
+// lookup, and its hash table entry is dropped when bees finds it.
+
+namespace {
+
+	struct SeedHeader {
+		uint64_t	h_magic;
+		uint32_t	h_version;
+		uint32_t	h_record_size;
+		uint32_t	h_algorithm;
+		uint32_t	h_sum_type;
+	} __attribute__((packed));
+
+	struct SeedRecord {
+		uint64_t	r_csum;
+		uint64_t	r_hash;
+		bool operator<(const SeedRecord &that) const { return r_csum < that.r_csum; }
+	} __attribute__((packed));
+
+	const uint64_t c_seed_magic = 0x3144454553454542ULL;	// "BEESSED1"
+	const uint32_t c_seed_version = 1;
+
+	// Calls fn with the physical address and csum of each block, in
+	// logical order.  The csum is converted to 64 bits the same way as
+	// BeesContext::get_csum_hashes.
+	void
+	walk_csums(BtrfsCsumTreeFetcher &fetcher, const function<void(uint64_t, uint64_t)> &fn)
+	{
+		THROW_CHECK1(runtime_error, fetcher.block_size(), fetcher.block_size() == BLOCK_SIZE_SUMS);
+		const size_t sum_size = fetcher.sum_size();
+		uint64_t blocks = 0;
+		fetcher.get_sums(0, numeric_limits<uint64_t>::max() / BLOCK_SIZE_SUMS, [&](uint64_t logical, const uint8_t *buf, size_t bytes) {
+			for (size_t i = 0; i + sum_size <= bytes; i += sum_size) {
+				uint64_t csum = 0;
+				memcpy(&csum, buf + i, min(sum_size, sizeof(csum)));
+				const uint64_t bytenr = logical + (i / sum_size) * BLOCK_SIZE_SUMS;
+				fn(bytenr, csum);
+				if (!(++blocks % (1 << 24))) {
+					cerr << "\t" << pretty(blocks * BLOCK_SIZE_SUMS) << " at " << to_hex(bytenr) << endl;
+				}
+			}
+		});
+	}
+
+	shared_ptr<BeesContext>
+	open_context(const string &root_path)
+	{
+		const auto ctx = make_shared<BeesContext>();
+		ctx->set_root_path(root_path);
+		return ctx;
+	}
+
+	void
+	close_context(const shared_ptr<BeesContext> &ctx)
+	{
+		const auto hash_table = ctx->hash_table();
+		hash_table->stop_request();
+		hash_table->stop_wait();
+	}
+
+	void
+	do_export(const string &root_path, const string &filename)
+	{
+		const auto ctx = open_context(root_path);
+		const auto hash_table = ctx->hash_table();
+
+		// Compressed blocks have csums of their compressed data, and EOF
+		// blocks have csums of the zero-padded block, so neither can be
+		// matched on another filesystem
+		cerr << "Reading hash table" << endl;
+		vector<pair<uint64_t, uint64_t>> cells;
+		uint64_t skipped = 0;
+		hash_table->for_each_cell([&](const BeesHashTable::Cell &cell) {
+			const BeesAddress addr(cell.e_addr);
+			if (addr.is_magic() || addr.is_compressed() || addr.is_unaligned_eof()) {
+				++skipped;
+				return;
+			}
+			cells.push_back(make_pair(addr.get_physical_or_zero(), cell.e_hash));
+		});
+		sort(cells.begin(), cells.end());
+
+		cerr << "Reading csums of " << cells.size() << " hashed blocks" << endl;
+		BtrfsCsumTreeFetcher fetcher(ctx->root_fd());
+		vector<SeedRecord> records;
+		auto next = cells.begin();
+		walk_csums(fetcher, [&](uint64_t bytenr, uint64_t csum) {
+			while (next != cells.end() && next->first < bytenr) {
+				++skipped;
+				++next;
+			}
+			for (; next != cells.end() && next->first == bytenr; ++next) {
+				records.push_back(SeedRecord { .r_csum = csum, .r_hash = next->second });
+			}
+		});
+		skipped += cells.end() - next;
+
+		const SeedHeader header {
+			.h_magic = c_seed_magic,
+			.h_version = c_seed_version,
+			.h_record_size = sizeof(SeedRecord),
+			.h_algorithm = BeesHash::algorithm(),
+			.h_sum_type = fetcher.sum_type(),
+		};
+		const string tmp_filename = filename + ".tmp";
+		const Fd fd(open_or_die(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOCTTY | O_LARGEFILE, 0600));
+		write_or_die(fd, header);
+		write_or_die(fd, string(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(SeedRecord)));
+		DIE_IF_NON_ZERO(fsync(fd));
+		DIE_IF_NON_ZERO(rename(tmp_filename.c_str(), filename.c_str()));
+		cout << "exported " << records.size() << " hashes, skipped " << skipped
+			<< " (compressed, EOF, or without csum), algorithm " << BeesHash::algorithm_name(BeesHash::algorithm()) << endl;
+
+		close_context(ctx);
+	}
+
+	void
+	do_import(const string &root_path, const string &filename, off_t hash_table_size)
+	{
+		const Fd fd(open_or_die(filename, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_LARGEFILE));
+		SeedHeader header;
+		read_or_die(fd, header);
+		THROW_CHECK1(runtime_error, filename, header.h_magic == c_seed_magic);
+		THROW_CHECK1(runtime_error, header.h_version, header.h_version == c_seed_version);
+		THROW_CHECK1(runtime_error, header.h_record_size, header.h_record_size == sizeof(SeedRecord));
+		const Stat st(fd);
+		vector<SeedRecord> records((st.st_size - sizeof(header)) / sizeof(SeedRecord));
+		pread_or_die(fd, records.data(), records.size() * sizeof(SeedRecord), sizeof(header));
+		sort(records.begin(), records.end());
+
+		const auto algo = static_cast<BeesHash::Algorithm>(header.h_algorithm);
+		const auto ctx = open_context(root_path);
+		ctx->set_hash_algorithm(algo);
+		ctx->set_hash_table_size(hash_table_size);
+		const auto hash_table = ctx->hash_table();
+		if (BeesHash::algorithm() != algo) {
+			THROW_ERROR(runtime_error, "hash table uses " << BeesHash::algorithm_name(BeesHash::algorithm())
+				<< ", export uses " << BeesHash::algorithm_name(algo));
+		}
+
+		BtrfsCsumTreeFetcher fetcher(ctx->root_fd());
+		THROW_CHECK2(runtime_error, fetcher.sum_type(), header.h_sum_type, fetcher.sum_type() == header.h_sum_type);
+
+		// Each hash goes in once, at the first block with its csum
+		cerr << "Matching " << records.size() << " hashes to csums" << endl;
+		vector<bool> inserted(records.size());
+		uint64_t inserted_count = 0;
+		walk_csums(fetcher, [&](uint64_t bytenr, uint64_t csum) {
+			const auto found = equal_range(records.begin(), records.end(), SeedRecord { .r_csum = csum, .r_hash = 0 });
+			for (auto i = found.first; i != found.second; ++i) {
+				const size_t index = i - records.begin();
+				if (!inserted[index]) {
+					inserted[index] = true;
+					++inserted_count;
+					hash_table->push_random_hash_addr(i->r_hash, BeesAddress(bytenr));
+				}
+			}
+		});
+		cout << "imported " << inserted_count << " of " << records.size() << " hashes" << endl;
+
+		close_context(ctx);
+	}
+
+	void
+	seed_usage(const char *argv0)
+	{
+		cerr << "Usage: " << argv0 << " [options] export PATH FILE\n"
+			<< "       " << argv0 << " [options] import PATH FILE\n"
+			<< "    -S, --hash-table-size SIZE  Size in bytes of a new hash table for import\n"
+			<< "    -v, --verbose LEVEL         bees log level (default " << LOG_WARNING << ")\n"
+			<< "PATH is the filesystem root.  bees must not be running on it.\n";
+	}
+
+}
+
+int
+main(int argc, char *argv[])
+{
+	BeesNote::set_name("hash_seed");
+	bees_log_level = LOG_WARNING;
+
+	static const struct option long_options[] = {
+		{ "hash-table-size", required_argument, NULL, 'S' },
+		{ "help",            no_argument,       NULL, 'h' },
+		{ "verbose",         required_argument, NULL, 'v' },
+		{ 0, 0, 0, 0 },
+	};
+
+	off_t hash_table_size = 0;
+	int c;
+	while ((c = getopt_long(argc, argv, "S:hv:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'S': hash_table_size = stoull(optarg); break;
+			case 'v': bees_log_level = stoul(optarg); break;
+			case 'h':
+			default:
+				seed_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind + 3 != argc) {
+		seed_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const string mode = argv[optind];
+	const string root_path = argv[optind + 1];
+	const string filename = argv[optind + 2];
+
+	int rv = EXIT_FAILURE;
+	catch_all([&]() {
+		if (mode == "export") {
+			do_export(root_path, filename);
+		} else if (mode == "import") {
+			do_import(root_path, filename, hash_table_size);
+		} else {
+			THROW_ERROR(invalid_argument, "unknown mode '" << mode << "'");
+		}
+		rv = EXIT_SUCCESS;
+	});
+	return rv;
+}
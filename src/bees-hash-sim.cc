@@ -0,0 +1,391 @@
+#include "bees.h"
+
+#include "crucible/btrfs-tree.h"
+#include "crucible/string.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+
+#include <getopt.h>
+#include <syslog.h>
+
+using namespace crucible;
+using namespace std;
+
+// Hash table sizing simulator.  Reads block csums from the csum tree of a
+// btrfs filesystem and feeds them, as csum scan mode would, through a
+// BeesHashTable of each candidate size.  Reports how many duplicate
+// blocks each table finds and an estimate of the space bees would free.
+//
+// Blocks are sampled by hash:  with --sample N, 1/N of the hashes go
+// through tables 1/N of each candidate size, and the results are scaled
+// up by N.  Eviction in a 1/N table of 1/N of the hashes behaves much
+// like eviction in the full table, at 1/N of the memory.
+//
+// Each distinct hash is in or out of the sample as a whole, so the
+// duplicate count of the sample scales up without bias, and its variance
+// gives a confidence interval.  A few seconds of reads from random sampled
+// blocks project how long bees would take to read all the data.
+
+namespace {
+
+	struct SimConfig {
+		vector<off_t>	m_sizes { 16 * 1024 * 1024, 64 * 1024 * 1024, 256 * 1024 * 1024, 1024 * 1024 * 1024 };
+		uint64_t	m_sample = 16;
+		string		m_dir;
+		double		m_read_time = 30;
+		bool		m_estimate = false;
+	};
+
+	// Blocks kept for the read throughput sample
+	const size_t c_read_sample_size = 4096;
+
+	struct SimTable {
+		off_t				m_size = 0;
+		string				m_scratch;
+		shared_ptr<BeesContext>		m_ctx;
+		shared_ptr<BeesHashTable>	m_hash_table;
+		uint64_t			m_hit_blocks = 0;
+		uint64_t			m_freed_blocks = 0;
+		bool				m_item_hit = false;
+	};
+
+	bool
+	sample_hash(uint64_t hash, uint64_t sample)
+	{
+		uint64_t z = hash + 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return ((z ^ (z >> 31)) % sample) == 0;
+	}
+
+	// Calls block_fn for each sampled block in logical order, and item_fn
+	// after the blocks of each csum item.  Blocks written together are
+	// usually in the same csum item, so an item stands in for an extent.
+	// Returns the number of blocks with csums.
+	uint64_t
+	walk_csums(const Fd &root_fd, uint64_t sample, const function<void(uint64_t, uint64_t)> &block_fn, const function<void()> &item_fn)
+	{
+		BtrfsCsumTreeFetcher fetcher(root_fd);
+		THROW_CHECK1(runtime_error, fetcher.block_size(), fetcher.block_size() == BLOCK_SIZE_SUMS);
+		const size_t sum_size = fetcher.sum_size();
+		uint64_t blocks = 0;
+		fetcher.get_sums(0, numeric_limits<uint64_t>::max() / BLOCK_SIZE_SUMS, [&](uint64_t logical, const uint8_t *buf, size_t bytes) {
+			for (size_t i = 0; i + sum_size <= bytes; i += sum_size) {
+				// Same conversion as BeesContext::get_csum_hashes
+				BeesHash::Type hash = 0;
+				memcpy(&hash, buf + i, min(sum_size, sizeof(hash)));
+				if (sample_hash(hash, sample)) {
+					block_fn(hash, logical + (i / sum_size) * BLOCK_SIZE_SUMS);
+				}
+				if (!(++blocks % (1 << 24))) {
+					cerr << "\t" << pretty(blocks * BLOCK_SIZE_SUMS) << " at " << to_hex(logical) << endl;
+				}
+			}
+			item_fn();
+		});
+		return blocks;
+	}
+
+	// Reads BEES_READAHEAD_SIZE at each block's first reference for up
+	// to seconds, uncached, as bees would when it scans the extent.
+	// Returns bytes read and time spent in reads.
+	pair<uint64_t, double>
+	sample_reads(const string &root_path, const string &scratch, const vector<uint64_t> &bytenrs, double seconds)
+	{
+		setenv("BEESHOME", scratch.c_str(), 1);
+		const auto ctx = make_shared<BeesContext>();
+		ctx->set_root_path(root_path);
+		BtrfsIoctlLogicalInoArgs log_ino(0);
+		vector<uint8_t> buf(BEES_READAHEAD_SIZE);
+		uint64_t bytes = 0;
+		double read_seconds = 0;
+		Timer budget_timer;
+		for (const auto bytenr : bytenrs) {
+			if (budget_timer.age() > seconds) {
+				break;
+			}
+			catch_all([&]() {
+				log_ino.set_logical(bytenr);
+				if (!log_ino.do_ioctl_nothrow(ctx->root_fd()) || !log_ino.m_iors.size()) {
+					return;
+				}
+				const auto ior = *log_ino.m_iors.begin();
+				const Fd fd = ctx->roots()->open_root_ino(ior.m_root, ior.m_inum);
+				if (!fd) {
+					return;
+				}
+				bees_unreadahead(fd, ior.m_offset, buf.size());
+				Timer read_timer;
+				const auto rv = pread(fd, buf.data(), buf.size(), ior.m_offset);
+				DIE_IF_MINUS_ONE(rv);
+				read_seconds += read_timer.age();
+				bytes += rv;
+				bees_unreadahead(fd, ior.m_offset, buf.size());
+			});
+		}
+		return make_pair(bytes, read_seconds);
+	}
+
+	off_t
+	parse_size(const string &s)
+	{
+		size_t end = 0;
+		off_t rv = stoull(s, &end);
+		const string suffix = s.substr(end);
+		if (suffix == "K" || suffix == "k") {
+			rv <<= 10;
+		} else if (suffix == "M" || suffix == "m") {
+			rv <<= 20;
+		} else if (suffix == "G" || suffix == "g") {
+			rv <<= 30;
+		} else if (!suffix.empty()) {
+			THROW_ERROR(invalid_argument, "unknown size suffix in '" << s << "'");
+		}
+		THROW_CHECK1(invalid_argument, rv, rv > 0 && (rv % BLOCK_SIZE_HASHTAB_EXTENT) == 0);
+		return rv;
+	}
+
+	vector<off_t>
+	parse_size_list(const string &s)
+	{
+		vector<off_t> rv;
+		istringstream iss(s);
+		string word;
+		while (getline(iss, word, ',')) {
+			rv.push_back(parse_size(word));
+		}
+		THROW_CHECK1(invalid_argument, s, !rv.empty());
+		return rv;
+	}
+
+	void
+	sim_usage(const char *argv0)
+	{
+		cerr << "Usage: " << argv0 << " [options] PATH\n"
+			<< "    -s, --size LIST          Comma-separated hash table sizes (K/M/G suffix, default 16M,64M,256M,1G)\n"
+			<< "    -r, --sample N           Simulate 1/N of the hashes in 1/N size tables (default 16)\n"
+			<< "    -D, --dir DIR            Parent of the scratch BEESHOMEs (default $TMPDIR or /tmp)\n"
+			<< "    -e, --estimate           Only estimate duplicate data and scan time, no tables\n"
+			<< "    -t, --read-time SECONDS  Time for sample reads to project scan time (default 30, 0 for none)\n"
+			<< "    -v, --verbose LEVEL      bees log level (default " << LOG_WARNING << ")\n";
+	}
+
+	void
+	remove_scratch(const string &dir)
+	{
+		for (auto name : { "beeshash.dat", "beeshash.dat.tmp", "beeshash.algo", "beeshash.algo.tmp",
+			"beeshash.ckpt", "beeshash.ckpt.tmp", "beesstats.txt", "beesstats.txt.tmp" }) {
+			unlink((dir + "/" + name).c_str());
+		}
+		rmdir(dir.c_str());
+	}
+
+}
+
+int
+main(int argc, char *argv[])
+{
+	BeesNote::set_name("hash_sim");
+	bees_log_level = LOG_WARNING;
+
+	SimConfig config;
+	const char *tmpdir = getenv("TMPDIR");
+	config.m_dir = tmpdir ? tmpdir : "/tmp";
+
+	static const struct option long_options[] = {
+		{ "dir",         required_argument, NULL, 'D' },
+		{ "estimate",    no_argument,       NULL, 'e' },
+		{ "help",        no_argument,       NULL, 'h' },
+		{ "read-time",   required_argument, NULL, 't' },
+		{ "sample",      required_argument, NULL, 'r' },
+		{ "size",        required_argument, NULL, 's' },
+		{ "verbose",     required_argument, NULL, 'v' },
+		{ 0, 0, 0, 0 },
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "D:ehr:s:t:v:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'D': config.m_dir = optarg; break;
+			case 'e': config.m_estimate = true; break;
+			case 'r': config.m_sample = stoull(optarg); break;
+			case 's': config.m_sizes = parse_size_list(optarg); break;
+			case 't': config.m_read_time = stod(optarg); break;
+			case 'v': bees_log_level = stoul(optarg); break;
+			case 'h':
+			default:
+				sim_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		sim_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	vector<SimTable> tables(config.m_estimate ? 0 : config.m_sizes.size());
+	string read_scratch;
+	int rv = EXIT_FAILURE;
+	catch_all([&]() {
+		THROW_CHECK1(invalid_argument, config.m_sample, config.m_sample > 0);
+		THROW_CHECK1(invalid_argument, config.m_read_time, config.m_read_time >= 0);
+		const Fd root_fd = open_or_die(argv[optind], FLAGS_OPEN_DIR);
+
+		// First pass:  which hashes occur more than once, and a
+		// reservoir of sampled blocks to read
+		cerr << "Reading csums" << endl;
+		vector<uint64_t> hashes;
+		vector<uint64_t> read_bytenrs;
+		mt19937_64 rng(random_device{}());
+		const uint64_t csum_blocks = walk_csums(root_fd, config.m_sample, [&](uint64_t hash, uint64_t bytenr) {
+			hashes.push_back(hash);
+			if (read_bytenrs.size() < c_read_sample_size) {
+				read_bytenrs.push_back(bytenr);
+			} else {
+				const auto pos = uniform_int_distribution<uint64_t>(0, hashes.size() - 1)(rng);
+				if (pos < c_read_sample_size) {
+					read_bytenrs[pos] = bytenr;
+				}
+			}
+		}, [](){});
+		sort(hashes.begin(), hashes.end());
+		const uint64_t sampled_blocks = hashes.size();
+
+		// Horvitz-Thompson variance of the scaled-up duplicate count,
+		// with each distinct hash sampled with probability 1/N
+		double dup_squares = 0;
+		for (auto i = hashes.begin(); i != hashes.end(); ) {
+			const auto next = upper_bound(i, hashes.end(), *i);
+			const double dups = next - i - 1;
+			dup_squares += dups * dups;
+			i = next;
+		}
+		hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+		const uint64_t ideal_blocks = sampled_blocks - hashes.size();
+		const double sample = config.m_sample;
+		const double data_bytes = csum_blocks * double(BLOCK_SIZE_SUMS);
+		const double dup_bytes = ideal_blocks * sample * BLOCK_SIZE_SUMS;
+		const double dup_error = 1.96 * sqrt(sample * (sample - 1) * dup_squares) * BLOCK_SIZE_SUMS;
+		cout << "estimate: data " << pretty(data_bytes) << " with csums, duplicate " << pretty(dup_bytes)
+			<< " +/- " << pretty(dup_error) << " (95%), " << fixed << setprecision(1)
+			<< (data_bytes > 0 ? 100 * dup_bytes / data_bytes : 0.0) << "% +/- "
+			<< (data_bytes > 0 ? 100 * dup_error / data_bytes : 0.0) << "%" << endl;
+
+		if (config.m_read_time > 0 && !read_bytenrs.empty()) {
+			cerr << "Reading " << read_bytenrs.size() << " sampled blocks for up to " << config.m_read_time << " sec" << endl;
+			read_scratch = config.m_dir + "/bees-hash-sim.XXXXXX";
+			DIE_IF_ZERO(mkdtemp(&read_scratch[0]));
+			shuffle(read_bytenrs.begin(), read_bytenrs.end(), rng);
+			const auto reads = sample_reads(argv[optind], read_scratch, read_bytenrs, config.m_read_time);
+			if (reads.first && reads.second > 0) {
+				const double read_rate = reads.first / reads.second;
+				cout << "estimate: read " << pretty(reads.first) << " in " << setprecision(3) << reads.second
+					<< " sec, " << pretty(read_rate) << "/sec, projected scan time "
+					<< setprecision(1) << data_bytes / read_rate / 3600 << " hours (random reads, one thread)" << endl;
+			} else {
+				cout << "estimate: no sampled blocks could be read" << endl;
+			}
+		}
+		if (config.m_estimate) {
+			rv = EXIT_SUCCESS;
+			return;
+		}
+		vector<bool> seen(hashes.size());
+
+		for (size_t t = 0; t < tables.size(); ++t) {
+			auto &table = tables[t];
+			table.m_size = config.m_sizes[t];
+			const off_t sim_size = table.m_size / config.m_sample / BLOCK_SIZE_HASHTAB_EXTENT * BLOCK_SIZE_HASHTAB_EXTENT;
+			THROW_CHECK2(invalid_argument, table.m_size, config.m_sample, sim_size > 0);
+			table.m_scratch = config.m_dir + "/bees-hash-sim.XXXXXX";
+			DIE_IF_ZERO(mkdtemp(&table.m_scratch[0]));
+			setenv("BEESHOME", table.m_scratch.c_str(), 1);
+			// No root path:  BEESHOME is absolute, and the scratch dir need not be btrfs
+			table.m_ctx = make_shared<BeesContext>();
+			table.m_ctx->set_hash_table_size(sim_size);
+			table.m_ctx->set_hash_table_memory(BeesHashTable::MEM_THP);
+			table.m_hash_table = table.m_ctx->hash_table();
+		}
+
+		// Second pass:  what each table finds.  An item with a hit is
+		// deduped as a whole, as bees extends a hash match to the
+		// adjacent matching blocks.
+		cerr << "Simulating " << tables.size() << " hash tables" << endl;
+		Timer sim_timer;
+		uint64_t item_dup_blocks = 0;
+		walk_csums(root_fd, config.m_sample, [&](uint64_t hash, uint64_t bytenr) {
+			// The filesystem may have new data since the first pass
+			const auto found = lower_bound(hashes.begin(), hashes.end(), hash);
+			if (found != hashes.end() && *found == hash) {
+				const size_t index = found - hashes.begin();
+				if (seen[index]) {
+					++item_dup_blocks;
+				}
+				seen[index] = true;
+			}
+			const BeesAddress addr(bytenr);
+			for (auto &table : tables) {
+				BeesAddress kept_addr;
+				for (const auto &i : table.m_hash_table->find_cell(hash)) {
+					if (i.e_addr != addr) {
+						kept_addr = i.e_addr;
+						break;
+					}
+				}
+				if (kept_addr) {
+					++table.m_hit_blocks;
+					table.m_item_hit = true;
+					table.m_hash_table->push_front_hash_addr(hash, kept_addr);
+				} else {
+					table.m_hash_table->push_random_hash_addr(hash, addr);
+				}
+			}
+		}, [&]() {
+			for (auto &table : tables) {
+				if (table.m_item_hit) {
+					table.m_freed_blocks += item_dup_blocks;
+					table.m_item_hit = false;
+				}
+			}
+			item_dup_blocks = 0;
+		});
+
+		const uint64_t scale = config.m_sample * BLOCK_SIZE_SUMS;
+		cout << "data " << pretty(sampled_blocks * scale) << " with csums, sampled 1/" << config.m_sample
+			<< ", duplicate " << pretty(ideal_blocks * scale)
+			<< ", simulated in " << fixed << setprecision(3) << sim_timer.age() << " sec" << endl;
+		cout << setw(10) << "size" << setw(12) << "GB/TB" << setw(12) << "hit_GB" << setw(9) << "hit%"
+			<< setw(12) << "freed_GB" << setw(9) << "freed%" << endl;
+		const double data_tb = sampled_blocks * scale / 1e12;
+		for (const auto &table : tables) {
+			cout << setw(10) << pretty(table.m_size)
+				<< setw(12) << setprecision(3) << (data_tb > 0 ? table.m_size / 1e9 / data_tb : 0.0)
+				<< setw(12) << table.m_hit_blocks * scale / 1e9
+				<< setw(9) << setprecision(1) << (ideal_blocks ? 100.0 * table.m_hit_blocks / ideal_blocks : 0.0)
+				<< setw(12) << setprecision(3) << table.m_freed_blocks * scale / 1e9
+				<< setw(9) << setprecision(1) << (ideal_blocks ? 100.0 * table.m_freed_blocks / ideal_blocks : 0.0) << endl;
+		}
+		rv = EXIT_SUCCESS;
+	});
+
+	if (!read_scratch.empty()) {
+		remove_scratch(read_scratch);
+	}
+	for (auto &table : tables) {
+		if (table.m_hash_table) {
+			table.m_hash_table->stop_request();
+			table.m_hash_table->stop_wait();
+		}
+		if (!table.m_scratch.empty()) {
+			remove_scratch(table.m_scratch);
+		}
+	}
+	return rv;
+}
@@ -2,20 +2,91 @@
 
 #include "crucible/city.h"
 #include "crucible/crc64.h"
+#include "crucible/process.h"
 #include "crucible/string.h"
 #include "crucible/uname.h"
 
 #include <algorithm>
 
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BEES_HAVE_AVX2_PROBE 1
+#include <immintrin.h>
+#endif
 
 using namespace crucible;
 using namespace std;
 
+BeesHash::Algorithm BeesHash::s_algorithm = BeesHash::ALGO_CRC64;
+bool BeesHash::s_algorithm_set = false;
+
 BeesHash::BeesHash(const uint8_t *ptr, size_t len) :
-	// m_hash(CityHash64(reinterpret_cast<const char *>(ptr), len))
-	m_hash(Digest::CRC::crc64(ptr, len))
+	m_hash(s_algorithm == ALGO_CITY64 ? CityHash64(reinterpret_cast<const char *>(ptr), len) : Digest::CRC::crc64(ptr, len))
+{
+}
+
+bool
+BeesHash::may_be_zero(size_t len) const
+{
+	// CRC64 with zero initial value maps any run of zeros to zero
+	if (s_algorithm == ALGO_CRC64) {
+		return m_hash == 0;
+	}
+	if (len == BLOCK_SIZE_SUMS) {
+		static const Type zero_block_city64 = [&]() {
+			const vector<uint8_t> zero(BLOCK_SIZE_SUMS);
+			return CityHash64(reinterpret_cast<const char *>(zero.data()), zero.size());
+		}();
+		return m_hash == zero_block_city64;
+	}
+	return true;
+}
+
+void
+BeesHash::set_algorithm(Algorithm algo)
+{
+	// Hashing threads read s_algorithm without locking, so it can be
+	// set once, before they start, and never changed after that.
+	if (s_algorithm_set) {
+		if (algo != s_algorithm) {
+			THROW_ERROR(runtime_error, "hash algorithm " << algorithm_name(algo)
+				<< " differs from " << algorithm_name(s_algorithm)
+				<< " already used by another hash table in this process");
+		}
+		return;
+	}
+	s_algorithm = algo;
+	s_algorithm_set = true;
+}
+
+BeesHash::Algorithm
+BeesHash::algorithm()
 {
+	return s_algorithm;
+}
+
+string
+BeesHash::algorithm_name(Algorithm algo)
+{
+	switch (algo) {
+		case ALGO_CRC64: return "crc64";
+		case ALGO_CITY64: return "city64";
+	}
+	return "unknown";
+}
+
+BeesHash::Algorithm
+BeesHash::algorithm_from_name(const string &name)
+{
+	for (auto algo : { ALGO_CRC64, ALGO_CITY64 }) {
+		if (name == algorithm_name(algo)) {
+			return algo;
+		}
+	}
+	THROW_ERROR(invalid_argument, "unknown hash algorithm '" << name << "'");
 }
 
 ostream &
@@ -74,6 +145,126 @@ verify_cell_range(BeesHashTable::Cell *p, BeesHashTable::Cell *q, bool clear_bug
 	return bugs_found;
 }
 
+// Bucket probes.  Return the first cell in [p, q) that matches mv (or only
+// its hash, if match_addr is false), or q if there is none.  If first_empty
+// is not null, it is also set to the first empty cell before the match
+// (or q if there is none), so one pass finds both.
+
+using Cell = BeesHashTable::Cell;
+using ProbeFn = Cell *(*)(Cell *p, Cell *q, const Cell &mv, bool match_addr, Cell **first_empty);
+
+static
+bool
+probe_cell_matches(const Cell &c, const Cell &mv, bool match_addr)
+{
+	return c.e_hash == mv.e_hash && (!match_addr || c.e_addr == mv.e_addr);
+}
+
+static
+Cell *
+probe_cells_scalar(Cell *p, Cell *q, const Cell &mv, bool match_addr, Cell **first_empty)
+{
+	const Cell empty(0, 0);
+	if (first_empty) {
+		*first_empty = q;
+	}
+	for (; p < q; ++p) {
+		if (probe_cell_matches(*p, mv, match_addr)) {
+			return p;
+		}
+		if (first_empty && *first_empty == q && *p == empty) {
+			*first_empty = p;
+		}
+	}
+	return q;
+}
+
+#ifdef BEES_HAVE_AVX2_PROBE
+// Each 256-bit lane pair holds two cells as { hash, addr, hash, addr }.
+// Compare four cells per iteration against the key and against zero,
+// and only look at individual cells when a mask bit is set.
+__attribute__((target("avx2")))
+static
+Cell *
+probe_cells_avx2(Cell *p, Cell *q, const Cell &mv, bool match_addr, Cell **first_empty)
+{
+	static_assert(sizeof(Cell) == 16, "Cell must be two 64-bit words");
+	const __m256i key = _mm256_set_epi64x(mv.e_addr, mv.e_hash, mv.e_addr, mv.e_hash);
+	const __m256i zero = _mm256_setzero_si256();
+	// movemask bit 2n is cell n's hash, bit 2n+1 is its addr
+	const unsigned want = match_addr ? 0x3 : 0x1;
+	const unsigned want_any = match_addr ? 0xff : 0x55;
+	bool need_empty = first_empty;
+	if (first_empty) {
+		*first_empty = q;
+	}
+	while (q - p >= 4) {
+		const uint8_t *bp = reinterpret_cast<const uint8_t *>(p);
+		const __m256i *vp = reinterpret_cast<const __m256i *>(bp);
+		const __m256i v0 = _mm256_loadu_si256(vp);
+		const __m256i v1 = _mm256_loadu_si256(vp + 1);
+		const unsigned m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v0, key)))
+			| (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v1, key))) << 4);
+		const unsigned z = need_empty ?
+			(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v0, zero)))
+			| (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v1, zero))) << 4)) : 0;
+		if ((m & want_any) || z) {
+			for (unsigned i = 0; i < 4; ++i) {
+				if (((m >> (2 * i)) & want) == want) {
+					return p + i;
+				}
+				if (need_empty && ((z >> (2 * i)) & 0x3) == 0x3) {
+					*first_empty = p + i;
+					need_empty = false;
+				}
+			}
+		}
+		p += 4;
+	}
+	Cell *tail_empty = q;
+	Cell *rv = probe_cells_scalar(p, q, mv, match_addr, need_empty ? &tail_empty : nullptr);
+	if (need_empty) {
+		*first_empty = tail_empty;
+	}
+	return rv;
+}
+#endif
+
+static
+ProbeFn
+select_probe_cells()
+{
+#ifdef BEES_HAVE_AVX2_PROBE
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return probe_cells_avx2;
+	}
+#endif
+	return probe_cells_scalar;
+}
+
+static
+Cell *
+probe_cells(Cell *p, Cell *q, const Cell &mv, bool match_addr, Cell **first_empty = nullptr)
+{
+	static const ProbeFn probe_impl = select_probe_cells();
+	return probe_impl(p, q, mv, match_addr, first_empty);
+}
+
+// Append all cells in [p, q) with the given hash and a plausible address
+static
+void
+probe_hash_cells(Cell *p, Cell *q, BeesHashTable::HashType hash, vector<Cell> &rv)
+{
+	const Cell mv(hash, 0);
+	for (p = probe_cells(p, q, mv, false); p < q; p = probe_cells(p + 1, q, mv, false)) {
+		// FIXME:  Weed out zero addresses in the table due to earlier bugs
+		if (p->e_addr >= 0x1000) {
+			rv.push_back(*p);
+		}
+	}
+}
+
 pair<BeesHashTable::Cell *, BeesHashTable::Cell *>
 BeesHashTable::get_cell_range(HashType hash)
 {
@@ -100,44 +291,91 @@ BeesHashTable::get_extent_range(HashType hash)
 	return make_pair(bp, ep);
 }
 
-bool
+/// Write the dirty buckets of one extent.  Adjacent dirty buckets are
+/// written with a single pwrite.  Returns the number of bytes written.
+size_t
 BeesHashTable::flush_dirty_extent(uint64_t extent_index)
 {
 	BEESNOTE("flushing extent #" << extent_index << " of " << m_extents << " extents");
 
 	auto lock = lock_extent_by_index(extent_index);
-	bool wrote_extent = false;
+	auto &metadata = m_extent_metadata.at(extent_index);
+	const uint32_t dirty_buckets = metadata.m_dirty_buckets;
+	if (!dirty_buckets) {
+		return 0;
+	}
+	size_t wrote_bytes = 0;
 
 	catch_all([&]() {
 		uint8_t *const dirty_extent      = m_extent_ptr[extent_index].p_byte;
 		uint8_t *const dirty_extent_end  = m_extent_ptr[extent_index + 1].p_byte;
-		const size_t dirty_extent_offset = dirty_extent - m_byte_ptr;
 		THROW_CHECK1(out_of_range, dirty_extent,     dirty_extent     >= m_byte_ptr);
 		THROW_CHECK1(out_of_range, dirty_extent_end, dirty_extent_end <= m_byte_ptr_end);
 		THROW_CHECK2(out_of_range, dirty_extent_end, dirty_extent, dirty_extent_end - dirty_extent == BLOCK_SIZE_HASHTAB_EXTENT);
-		BEESTOOLONG("pwrite(fd " << m_fd << " '" << name_fd(m_fd)<< "', length " << to_hex(dirty_extent_end - dirty_extent) << ", offset " << to_hex(dirty_extent - m_byte_ptr) << ")");
-		// Copy the extent because we might be stuck writing for a while
-		ByteVector extent_copy(dirty_extent, dirty_extent_end);
+
+		// Copy the dirty buckets because we might be stuck writing for a while.
+		// Each run of adjacent buckets is contiguous in the copy too.
+		struct DirtyRun {
+			size_t	m_copy_pos;
+			off_t	m_offset;
+			size_t	m_size;
+		};
+		vector<DirtyRun> runs;
+		ByteVector dirty_copy(__builtin_popcount(dirty_buckets) * BLOCK_SIZE_HASHTAB_BUCKET);
+		size_t copy_pos = 0;
+		for (uint64_t bucket = 0; bucket < c_buckets_per_extent; ++bucket) {
+			if (!(dirty_buckets & (1U << bucket))) {
+				continue;
+			}
+			const uint8_t *const bucket_ptr = m_extent_ptr[extent_index].p_buckets[bucket].p_byte;
+			const off_t bucket_offset = bucket_ptr - m_byte_ptr;
+			memcpy(dirty_copy.data() + copy_pos, bucket_ptr, BLOCK_SIZE_HASHTAB_BUCKET);
+			if (!runs.empty() && runs.back().m_offset + static_cast<off_t>(runs.back().m_size) == bucket_offset) {
+				runs.back().m_size += BLOCK_SIZE_HASHTAB_BUCKET;
+			} else {
+				runs.push_back(DirtyRun { copy_pos, bucket_offset, BLOCK_SIZE_HASHTAB_BUCKET });
+			}
+			copy_pos += BLOCK_SIZE_HASHTAB_BUCKET;
+		}
+
+		// Buckets dirtied from now on will be written next time
+		metadata.m_dirty_buckets = 0;
+
+		// The checksum of what is on disk now is computed at the next checkpoint
+		metadata.m_checksum_stale = true;
+		metadata.m_generation = m_checkpoint_generation + 1;
 
 		// Release the lock
 		lock.unlock();
 
-		// Write the extent (or not)
-		pwrite_or_die(m_fd, extent_copy, dirty_extent_offset);
-		BEESCOUNT(hash_extent_out);
+		// Write the buckets (or not)
+		bool write_ok = false;
+		Timer write_timer;
+		catch_all([&]() {
+			for (const auto &run : runs) {
+				BEESTOOLONG("pwrite(fd " << m_fd << " '" << name_fd(m_fd)<< "', length " << to_hex(run.m_size) << ", offset " << to_hex(run.m_offset) << ")");
+				pwrite_or_die(m_fd, dirty_copy.data() + run.m_copy_pos, run.m_size, run.m_offset);
+			}
+			write_ok = true;
+		});
+		BEESHISTOGRAM(hash_extent_out, write_timer.age());
 
 		// Nope, this causes a _dramatic_ loss of performance.
-		// const size_t dirty_extent_size   = dirty_extent_end - dirty_extent;
 		// bees_unreadahead(m_fd, dirty_extent_offset, dirty_extent_size);
 
-		// Mark extent clean if write was successful
-		lock.lock();
-		m_extent_metadata.at(extent_index).m_dirty = false;
+		if (!write_ok) {
+			// Keep the buckets dirty so the next pass retries them
+			lock.lock();
+			set_extent_dirty_locked(extent_index, dirty_buckets);
+			return;
+		}
 
-		wrote_extent = true;
+		BEESCOUNT(hash_extent_out);
+		BEESCOUNTADD(hash_bucket_out, __builtin_popcount(dirty_buckets));
+		wrote_bytes = dirty_copy.size();
 	});
 
-	return wrote_extent;
+	return wrote_bytes;
 }
 
 size_t
@@ -146,25 +384,33 @@ BeesHashTable::flush_dirty_extents(bool slowly)
 	THROW_CHECK1(runtime_error, m_buckets, m_buckets > 0);
 
 	uint64_t wrote_extents = 0;
-	for (size_t extent_index = 0; extent_index < m_extents; ++extent_index) {
+	uint64_t dirty_extents = 0;
+	for (const auto &i : m_dirty_extent_bits) {
+		dirty_extents += __builtin_popcountll(i.load());
+	}
+	for (size_t word = 0; word < m_dirty_extent_bits.size(); ++word) {
 		// Skip the clean ones
-		auto lock = lock_extent_by_index(extent_index);
-		if (!m_extent_metadata.at(extent_index).m_dirty) {
-			continue;
-		}
-		lock.unlock();
-
-		if (flush_dirty_extent(extent_index)) {
-			++wrote_extents;
-			if (slowly) {
-				if (m_stop_requested) {
-					slowly = false;
-					continue;
+		uint64_t dirty_bits = m_dirty_extent_bits[word].exchange(0);
+		while (dirty_bits) {
+			const size_t extent_index = word * 64 + __builtin_ctzll(dirty_bits);
+			dirty_bits &= dirty_bits - 1;
+			dirty_extents -= min(dirty_extents, uint64_t(1));
+
+			Timer write_timer;
+			const auto wrote_bytes = flush_dirty_extent(extent_index);
+			if (wrote_bytes) {
+				++wrote_extents;
+				if (slowly) {
+					if (m_stop_requested) {
+						slowly = false;
+						continue;
+					}
+					adjust_flush_rate(write_timer.age(), dirty_extents);
+					BEESNOTE("flush rate limited after extent #" << extent_index << " of " << m_extents << " extents");
+					chrono::duration<double> sleep_time(m_flush_rate_limit.sleep_time(wrote_bytes));
+					unique_lock<mutex> lock(m_stop_mutex);
+					m_stop_condvar.wait_for(lock, sleep_time);
 				}
-				BEESNOTE("flush rate limited after extent #" << extent_index << " of " << m_extents << " extents");
-				chrono::duration<double> sleep_time(m_flush_rate_limit.sleep_time(BLOCK_SIZE_HASHTAB_EXTENT));
-				unique_lock<mutex> lock(m_stop_mutex);
-				m_stop_condvar.wait_for(lock, sleep_time);
 			}
 		}
 	}
@@ -172,11 +418,35 @@ BeesHashTable::flush_dirty_extents(bool slowly)
 	return wrote_extents;
 }
 
+uint64_t
+BeesHashTable::writeback_mark()
+{
+	// Changes made now are written by the next pass to start
+	unique_lock<mutex> lock(m_dirty_mutex);
+	return m_flush_pass_started + 1;
+}
+
+bool
+BeesHashTable::written_back_locked(uint64_t mark) const
+{
+	// Must already be locked.  An idle writeback thread with nothing
+	// dirty has written everything.
+	return m_flush_pass_done >= mark || (m_writeback_idle && !m_dirty);
+}
+
+bool
+BeesHashTable::written_back(uint64_t mark)
+{
+	unique_lock<mutex> lock(m_dirty_mutex);
+	return written_back_locked(mark);
+}
+
 void
-BeesHashTable::set_extent_dirty_locked(uint64_t extent_index)
+BeesHashTable::set_extent_dirty_locked(uint64_t extent_index, uint32_t bucket_mask)
 {
 	// Must already be locked
-	m_extent_metadata.at(extent_index).m_dirty = true;
+	m_extent_metadata.at(extent_index).m_dirty_buckets |= bucket_mask;
+	m_dirty_extent_bits.at(extent_index / 64).fetch_or(1ULL << (extent_index % 64));
 
 	// Signal writeback thread
 	unique_lock<mutex> dirty_lock(m_dirty_mutex);
@@ -184,22 +454,184 @@ BeesHashTable::set_extent_dirty_locked(uint64_t extent_index)
 	m_dirty_condvar.notify_one();
 }
 
+void
+BeesHashTable::set_hash_dirty_locked(HashType hash)
+{
+	// Must already be locked
+	const uint64_t bucket_in_extent = (hash % m_buckets) % c_buckets_per_extent;
+	set_extent_dirty_locked(hash_to_extent_index(hash), 1U << bucket_in_extent);
+}
+
+/// Bloom filter word index and bit mask for a hash.  The bucket is
+/// chosen by hash % m_buckets, so use the rest of the hash for the word
+/// and bits within the bucket's filter.
+pair<uint64_t, uint64_t>
+BeesHashTable::filter_word_mask(HashType hash) const
+{
+	const uint64_t bucket = hash % m_buckets;
+	const uint64_t mix = (hash / m_buckets) * 0x9e3779b97f4a7c15ULL;
+	const uint64_t word = bucket * c_filter_words_per_bucket + (mix >> 58) % c_filter_words_per_bucket;
+	const uint64_t mask = (1ULL << (mix & 63)) | (1ULL << ((mix >> 6) & 63)) | (1ULL << ((mix >> 12) & 63));
+	return make_pair(word, mask);
+}
+
+/// False if hash is definitely not in the table.  True if it may be,
+/// or if the extent has not been read yet.
+bool
+BeesHashTable::filter_may_contain(HashType hash) const
+{
+	const uint64_t extent_index = (hash % m_buckets) / c_buckets_per_extent;
+	if (!(m_filter_ready_bits[extent_index / 64].load(memory_order_acquire) & (1ULL << (extent_index % 64)))) {
+		return true;
+	}
+	const auto wm = filter_word_mask(hash);
+	return (m_filter[wm.first].load(memory_order_relaxed) & wm.second) == wm.second;
+}
+
+/// Marks an extent's cells as changing for the lifetime of the object.
+/// Must be created while holding the extent lock.
+class BeesHashTable::ExtentWriteSeq {
+	atomic<uint64_t> &m_seq;
+public:
+	ExtentWriteSeq(BeesHashTable &table, HashType hash) :
+		m_seq(table.m_extent_seq.at(table.hash_to_extent_index(hash)))
+	{
+		m_seq.store(m_seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+	}
+	~ExtentWriteSeq()
+	{
+		m_seq.store(m_seq.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+};
+
+/// Probe for a hash without the extent lock.  Returns false if the
+/// extent has not been read yet, or writers kept changing it, and the
+/// caller has to take the lock instead.
+bool
+BeesHashTable::probe_hash_cells_unlocked(HashType hash, vector<Cell> &rv)
+{
+	const uint64_t extent_index = (hash % m_buckets) / c_buckets_per_extent;
+	// The filter becomes ready after the extent has been read
+	if (!(m_filter_ready_bits[extent_index / 64].load(memory_order_acquire) & (1ULL << (extent_index % 64)))) {
+		return false;
+	}
+	const atomic<uint64_t> &seq = m_extent_seq[extent_index];
+	const auto er = get_cell_range(hash);
+	for (size_t retry = 0; retry < BEES_HASH_PROBE_RETRIES; ++retry) {
+		const uint64_t begin_seq = seq.load(memory_order_acquire);
+		if (!(begin_seq & 1)) {
+			rv.clear();
+			probe_hash_cells(er.first, er.second, hash, rv);
+			atomic_thread_fence(memory_order_acquire);
+			if (seq.load(memory_order_relaxed) == begin_seq) {
+				return true;
+			}
+		}
+		BEESCOUNT(hash_probe_retry);
+	}
+	rv.clear();
+	return false;
+}
+
+void
+BeesHashTable::filter_insert_locked(HashType hash)
+{
+	const auto wm = filter_word_mask(hash);
+	m_filter[wm.first].fetch_or(wm.second, memory_order_relaxed);
+}
+
+/// Recompute the filter from an extent's cells, dropping bits left
+/// behind by erased or evicted cells, and mark the extent's filter valid.
+void
+BeesHashTable::filter_rebuild_extent_locked(uint64_t extent_index)
+{
+	for (uint64_t bucket = extent_index * c_buckets_per_extent; bucket < (extent_index + 1) * c_buckets_per_extent; ++bucket) {
+		uint64_t words[c_filter_words_per_bucket] = { 0 };
+		for (const Cell &cell : m_bucket_ptr[bucket].p_cells) {
+			if (cell.e_addr) {
+				const auto wm = filter_word_mask(cell.e_hash);
+				words[wm.first % c_filter_words_per_bucket] |= wm.second;
+			}
+		}
+		for (uint64_t i = 0; i < c_filter_words_per_bucket; ++i) {
+			m_filter[bucket * c_filter_words_per_bucket + i].store(words[i], memory_order_relaxed);
+		}
+	}
+	m_filter_ready_bits[extent_index / 64].fetch_or(1ULL << (extent_index % 64), memory_order_release);
+}
+
+unsigned
+BeesHashTable::cell_freq_locked(const Cell *cell) const
+{
+	const size_t index = cell - m_cell_ptr;
+	return (m_cell_freq[index / 4] >> ((index % 4) * 2)) & c_freq_max;
+}
+
+void
+BeesHashTable::set_cell_freq_locked(const Cell *cell, unsigned freq)
+{
+	const size_t index = cell - m_cell_ptr;
+	const unsigned shift = (index % 4) * 2;
+	uint8_t &byte = m_cell_freq[index / 4];
+	byte = (byte & ~(c_freq_max << shift)) | (min(freq, c_freq_max) << shift);
+}
+
+/// Move cells [first, hole) to [first + 1, hole + 1), overwriting hole,
+/// with their hit frequencies.
+void
+BeesHashTable::shift_cells_locked(Cell *first, Cell *hole)
+{
+	for (Cell *dp = hole; dp > first; --dp) {
+		*dp = *(dp - 1);
+		set_cell_freq_locked(dp, cell_freq_locked(dp - 1));
+	}
+}
+
+/// Pick a cell to evict from a full range, CLOCK style:  walk from the
+/// back, taking away one hit from each cell that has some, and evict
+/// the first cell with none left.  If every cell in the range had a hit,
+/// the last one goes.
+BeesHashTable::Cell *
+BeesHashTable::choose_victim_locked(Cell *first, Cell *last)
+{
+	THROW_CHECK0(runtime_error, first < last);
+	for (Cell *ip = last; ip > first; ) {
+		--ip;
+		const auto freq = cell_freq_locked(ip);
+		if (!freq) {
+			return ip;
+		}
+		set_cell_freq_locked(ip, freq - 1);
+		BEESCOUNT(hash_evict_spared);
+	}
+	return last - 1;
+}
+
 void
 BeesHashTable::writeback_loop()
 {
 	while (!m_stop_requested) {
+		unique_lock<mutex> pass_lock(m_dirty_mutex);
+		const auto pass = ++m_flush_pass_started;
+		pass_lock.unlock();
+
 		auto wrote_extents = flush_dirty_extents(true);
 
 		BEESNOTE("idle after writing " << wrote_extents << " of " << m_extents << " extents");
 
 		unique_lock<mutex> lock(m_dirty_mutex);
+		m_flush_pass_done = pass;
+		m_flushed_condvar.notify_all();
 		if (m_stop_requested) {
 			break;
 		}
 		if (m_dirty) {
 			m_dirty = false;
 		} else {
+			m_writeback_idle = true;
 			m_dirty_condvar.wait(lock);
+			m_writeback_idle = false;
 		}
 	}
 
@@ -210,6 +642,18 @@ BeesHashTable::writeback_loop()
 	BEESLOGDEBUG("Flushing hash table");
 	flush_dirty_extents(false);
 
+	// Leave a checkpoint that matches every extent after a clean stop
+	const bool checkpoint_failed = catch_all([&]() {
+		checkpoint(writeback_mark());
+	});
+
+	// The next process can use the table in memory only if it matches the checkpoint
+	if (!checkpoint_failed && !!m_handoff_fd) {
+		catch_all([&]() {
+			save_handoff();
+		});
+	}
+
 	// If there were any Tasks still running, they may have updated
 	// some hash table pages during the second flush.  These updates
 	// will be lost.  The Tasks will be repeated on the next run because
@@ -239,11 +683,95 @@ percent(size_t num, size_t den)
 	}
 }
 
+/// Read the whole hash table with several threads, each reading runs of
+/// BEES_HASH_PREFETCH_EXTENTS extents with one pread.  Runs are handed out
+/// in order so the disk still sees mostly sequential reads.  Scan workers
+/// that need an extent before it is prefetched read it themselves as
+/// usual, and prefetch skips extents that are no longer missing.
+void
+BeesHashTable::prefetch_parallel()
+{
+	BEESNOTE("prefetching hash table with " << BEES_HASH_PREFETCH_THREADS << " threads");
+	BEESLOGINFO("Prefetching hash table with " << BEES_HASH_PREFETCH_THREADS << " threads");
+	Timer prefetch_timer;
+	atomic<uint64_t> next_extent(0);
+	vector<shared_ptr<BeesThread>> readers;
+	for (size_t i = 0; i < BEES_HASH_PREFETCH_THREADS; ++i) {
+		readers.push_back(make_shared<BeesThread>("hash_prefetch_" + to_string(i), [&]() {
+			while (!m_stop_requested) {
+				const uint64_t first = next_extent.fetch_add(BEES_HASH_PREFETCH_EXTENTS);
+				if (first >= m_extents) {
+					break;
+				}
+				const uint64_t last = min(first + BEES_HASH_PREFETCH_EXTENTS, m_extents);
+				BEESNOTE("prefetching hash table extents #" << first << ".." << last << " of " << m_extents);
+				fetch_missing_extents(first, last);
+			}
+		}));
+	}
+	for (auto &i : readers) {
+		i->join();
+	}
+	BEESLOGINFO("Prefetched hash table in " << prefetch_timer << " sec");
+}
+
+/// Read extents [first, last) that are still missing, with one pread
+/// per contiguous run of missing extents.
+void
+BeesHashTable::fetch_missing_extents(uint64_t first, uint64_t last)
+{
+	THROW_CHECK2(out_of_range, first, last, first <= last);
+	THROW_CHECK2(out_of_range, last, m_extents, last <= m_extents);
+
+	// Ascending order, and nobody else holds more than one extent lock
+	vector<unique_lock<mutex>> locks;
+	for (uint64_t ext = first; ext < last; ++ext) {
+		locks.push_back(lock_extent_by_index(ext));
+	}
+
+	uint64_t ext = first;
+	while (ext < last) {
+		if (!m_extent_metadata.at(ext).m_missing) {
+			++ext;
+			continue;
+		}
+		const uint64_t run_begin = ext;
+		while (ext < last && m_extent_metadata.at(ext).m_missing) {
+			// If the read fails don't retry, just go with whatever data we have
+			m_extent_metadata.at(ext).m_missing = false;
+			++ext;
+		}
+		uint8_t *const run_ptr = m_extent_ptr[run_begin].p_byte;
+		const size_t run_size = m_extent_ptr[ext].p_byte - run_ptr;
+		const size_t run_offset = run_ptr - m_byte_ptr;
+		catch_all([&]() {
+			BEESTOOLONG("pread(fd " << m_fd << " '" << name_fd(m_fd)<< "', length " << to_hex(run_size) << ", offset " << to_hex(run_offset) << ")");
+			pread_or_die(m_fd, run_ptr, run_size, run_offset);
+			BEESCOUNTADD(hash_extent_in, ext - run_begin);
+			bees_unreadahead(m_fd, run_offset, run_size);
+		});
+		for (uint64_t run_ext = run_begin; run_ext < ext; ++run_ext) {
+			verify_extent_checksum_locked(run_ext);
+			filter_rebuild_extent_locked(run_ext);
+		}
+	}
+}
+
 void
 BeesHashTable::prefetch_loop()
 {
 	Uname uname;
 	bool not_locked = true;
+
+	// The first pass reads and analyzes the whole table.  After that,
+	// each pass analyzes the next BEES_HASH_TABLE_ANALYZE_EXTENTS extents
+	// and scales up the counts.  Hashes are uniformly distributed, so a
+	// contiguous sample is representative, and over many passes every
+	// extent is still verified and has its filter rebuilt.
+	uint64_t analyze_cursor = 0;
+	uint64_t analyze_extents = m_extents;
+
+	prefetch_parallel();
 	while (!m_stop_requested) {
 		size_t width = 64;
 		vector<size_t> occupancy(width, 0);
@@ -252,10 +780,13 @@ BeesHashTable::prefetch_loop()
 		size_t compressed_count = 0;
 		size_t compressed_offset_count = 0;
 		size_t toxic_count = 0;
+		vector<size_t> freq_count(c_freq_max + 1, 0);
 		size_t unaligned_eof_count = 0;
 
 		m_prefetch_running = true;
-		for (uint64_t ext = 0; ext < m_extents && !m_stop_requested; ++ext) {
+		uint64_t analyzed_extents = 0;
+		for (; analyzed_extents < analyze_extents && !m_stop_requested; ++analyzed_extents) {
+			const uint64_t ext = (analyze_cursor + analyzed_extents) % m_extents;
 			BEESNOTE("prefetching hash table extent #" << ext << " of " << m_extents);
 			catch_all([&]() {
 				fetch_missing_extent_by_index(ext);
@@ -284,6 +815,7 @@ BeesHashTable::prefetch_loop()
 							if (a.is_unaligned_eof()) {
 								++unaligned_eof_count;
 							}
+							++freq_count.at(cell_freq_locked(cell));
 						}
 						++total_count;
 					}
@@ -294,12 +826,34 @@ BeesHashTable::prefetch_loop()
 				if (duplicate_bugs_found) {
 					set_extent_dirty_locked(ext);
 				}
+				filter_rebuild_extent_locked(ext);
 			});
 		}
 		m_prefetch_running = false;
+		analyze_cursor = (analyze_cursor + analyzed_extents) % m_extents;
+		analyze_extents = min<uint64_t>(m_extents, BEES_HASH_TABLE_ANALYZE_EXTENTS);
 
 		BEESNOTE("calculating hash table statistics");
 
+		if (analyzed_extents && analyzed_extents < m_extents) {
+			const auto scale_up = [&](size_t &count) {
+				count = count * m_extents / analyzed_extents;
+			};
+			for (auto &count : occupancy) {
+				scale_up(count);
+			}
+			for (auto &count : freq_count) {
+				scale_up(count);
+			}
+			scale_up(occupied_count);
+			scale_up(total_count);
+			scale_up(compressed_count);
+			scale_up(compressed_offset_count);
+			scale_up(toxic_count);
+			scale_up(unaligned_eof_count);
+		}
+		m_occupied_cells = occupied_count;
+
 		vector<string> histogram;
 		vector<size_t> thresholds;
 		size_t threshold = 1;
@@ -339,29 +893,40 @@ BeesHashTable::prefetch_loop()
 		graph_blob << "Kernel:  " << uname.sysname << " " << uname.release << " " << uname.machine << " " << uname.version << "\n";
 
 		graph_blob
-			<< "\nHash table page occupancy histogram (" << occupied_count << "/" << total_count << " cells occupied, " << (occupied_count * 100 / total_count) << "%)\n"
+			<< "\nHash table page occupancy histogram (" << occupied_count << "/" << total_count << " cells occupied, " << (occupied_count * 100 / total_count) << "%"
+			<< (analyzed_extents < m_extents ? ", estimated from " + to_string(analyzed_extents) + " of " + to_string(m_extents) + " extents" : string()) << ")\n"
 			<< out.str() << "0%      |      25%      |      50%      |      75%      |   100% page fill\n"
 			<< "compressed " << compressed_count << " (" << percent(compressed_count, occupied_count) << ")\n"
 			<< "uncompressed " << uncompressed_count << " (" << percent(uncompressed_count, occupied_count) << ")"
 			<< " unaligned_eof " << unaligned_eof_count << " (" << percent(unaligned_eof_count, occupied_count) << ")"
-			<< " toxic " << toxic_count << " (" << percent(toxic_count, occupied_count) << ")";
+			<< " toxic " << toxic_count << " (" << percent(toxic_count, occupied_count) << ")\n"
+			<< "hit frequency";
+		for (size_t freq = 0; freq < freq_count.size(); ++freq) {
+			graph_blob << " " << freq << ": " << freq_count.at(freq) << " (" << percent(freq_count.at(freq), occupied_count) << ")";
+		}
 
 		graph_blob << "\n\n";
 
 		graph_blob << "TOTAL:\n";
-		auto thisStats = BeesStats::s_global;
+		BeesStats thisStats = BeesStats::s_global;
 		graph_blob << "\t" << thisStats << "\n";
 
 		graph_blob << "\nRATES:\n";
 		auto avg_rates = thisStats / m_ctx->total_timer().age();
 		graph_blob << "\t" << avg_rates << "\n";
 
+		graph_blob << "\nLATENCY:\n";
+		BeesHistogram::print_all(graph_blob);
+
+		graph_blob << "\nPHASES:\n";
+		BeesPhase::print_all(graph_blob);
+
 		BEESLOGINFO(graph_blob.str());
 		catch_all([&]() {
 			m_stats_file.write(graph_blob.str());
 		});
 
-		if (not_locked && !m_stop_requested) {
+		if (not_locked && !m_stop_requested && (m_ctx->hash_table_memory() & MEM_MLOCK)) {
 			// Always do the mlock, whether shared or not
 			THROW_CHECK1(runtime_error, m_size, m_size > 0);
 			BEESLOGINFO("mlock(" << pretty(m_size) << ")...");
@@ -402,7 +967,38 @@ unique_lock<mutex>
 BeesHashTable::lock_extent_by_index(uint64_t extent_index)
 {
 	THROW_CHECK2(out_of_range, extent_index, m_extents, extent_index < m_extents);
-	return unique_lock<mutex>(*m_extent_metadata.at(extent_index).m_mutex_ptr);
+	unique_lock<mutex> lock(*m_extent_metadata.at(extent_index).m_mutex_ptr, try_to_lock);
+	if (!lock.owns_lock()) {
+		BEESCOUNT(hash_lock_contended);
+		const auto wait_start = chrono::steady_clock::now();
+		lock.lock();
+		m_lock_wait_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - wait_start).count();
+	}
+	return lock;
+}
+
+uint64_t
+BeesHashTable::lock_wait_ns() const
+{
+	return m_lock_wait_ns.load();
+}
+
+void
+BeesHashTable::for_each_cell(const function<void(const Cell &)> &fn)
+{
+	for (uint64_t ext = 0; ext < m_extents && !m_stop_requested; ++ext) {
+		BEESNOTE("reading hash table extent #" << ext << " of " << m_extents);
+		fetch_missing_extent_by_index(ext);
+		// Copy the extent so fn runs without the lock
+		auto lock = lock_extent_by_index(ext);
+		const vector<Cell> cells(m_extent_ptr[ext].p_buckets[0].p_cells, m_extent_ptr[ext + 1].p_buckets[0].p_cells);
+		lock.unlock();
+		for (const auto &i : cells) {
+			if (i.e_addr) {
+				fn(i);
+			}
+		}
+	}
 }
 
 unique_lock<mutex>
@@ -417,6 +1013,13 @@ BeesHashTable::fetch_missing_extent_by_index(uint64_t extent_index)
 {
 	BEESNOTE("checking hash extent #" << extent_index << " of " << m_extents << " extents");
 	auto lock = lock_extent_by_index(extent_index);
+	fetch_missing_extent_locked(extent_index);
+}
+
+void
+BeesHashTable::fetch_missing_extent_locked(uint64_t extent_index)
+{
+	// Must already be locked
 	if (!m_extent_metadata.at(extent_index).m_missing) {
 		return;
 	}
@@ -436,7 +1039,9 @@ BeesHashTable::fetch_missing_extent_by_index(uint64_t extent_index)
 
 	catch_all([&]() {
 		BEESTOOLONG("pread(fd " << m_fd << " '" << name_fd(m_fd)<< "', length " << to_hex(dirty_extent_end - dirty_extent) << ", offset " << to_hex(dirty_extent - m_byte_ptr) << ")");
+		Timer read_timer;
 		pread_or_die(m_fd, dirty_extent, dirty_extent_size, dirty_extent_offset);
+		BEESHISTOGRAM(hash_extent_in, read_timer.age());
 
 		// Only count extents successfully read
 		BEESCOUNT(hash_extent_in);
@@ -450,6 +1055,9 @@ BeesHashTable::fetch_missing_extent_by_index(uint64_t extent_index)
 			bees_readahead(m_fd, dirty_extent_offset + dirty_extent_size, dirty_extent_size);
 		}
 	});
+
+	verify_extent_checksum_locked(extent_index);
+	filter_rebuild_extent_locked(extent_index);
 }
 
 void
@@ -464,14 +1072,63 @@ BeesHashTable::fetch_missing_extent_by_hash(HashType hash)
 vector<BeesHashTable::Cell>
 BeesHashTable::find_cell(HashType hash)
 {
+	vector<Cell> rv;
+	if (!filter_may_contain(hash)) {
+		BEESCOUNT(hash_filter_skip);
+		return rv;
+	}
+	BEESPHASE(probe);
+	BEESCOUNT(hash_lookup);
+	if (probe_hash_cells_unlocked(hash, rv)) {
+		return rv;
+	}
+	BEESCOUNT(hash_probe_locked);
 	fetch_missing_extent_by_hash(hash);
 	BEESTOOLONG("find_cell hash " << BeesHash(hash));
-	vector<Cell> rv;
 	auto lock = lock_extent_by_hash(hash);
 	auto er = get_cell_range(hash);
-	// FIXME:  Weed out zero addresses in the table due to earlier bugs
-	copy_if(er.first, er.second, back_inserter(rv), [=](const Cell &ip) { return ip.e_hash == hash && ip.e_addr >= 0x1000; });
-	BEESCOUNT(hash_lookup);
+	probe_hash_cells(er.first, er.second, hash, rv);
+	return rv;
+}
+
+/// Look up several hashes at once.  Lookups are sorted by hash table
+/// extent so that each extent is fetched and locked only once, no matter
+/// how many of the hashes land in it.  The result vector is parallel to
+/// the argument vector.
+vector<vector<BeesHashTable::Cell>>
+BeesHashTable::find_cells(const vector<HashType> &hashes)
+{
+	vector<vector<Cell>> rv(hashes.size());
+	BEESPHASE(probe);
+
+	vector<pair<uint64_t, size_t>> extent_order;
+	for (size_t i = 0; i < hashes.size(); ++i) {
+		if (!filter_may_contain(hashes[i])) {
+			BEESCOUNT(hash_filter_skip);
+			continue;
+		}
+		BEESCOUNT(hash_lookup);
+		if (probe_hash_cells_unlocked(hashes[i], rv[i])) {
+			continue;
+		}
+		BEESCOUNT(hash_probe_locked);
+		extent_order.push_back(make_pair(hash_to_extent_index(hashes[i]), i));
+	}
+	sort(extent_order.begin(), extent_order.end());
+
+	auto it = extent_order.begin();
+	while (it != extent_order.end()) {
+		const auto extent_index = it->first;
+		BEESNOTE("waiting to fetch hash extent #" << extent_index << " of " << m_extents << " extents");
+		auto lock = lock_extent_by_index(extent_index);
+		fetch_missing_extent_locked(extent_index);
+		BEESTOOLONG("find_cells extent #" << extent_index);
+		for (; it != extent_order.end() && it->first == extent_index; ++it) {
+			const auto hash = hashes[it->second];
+			auto er = get_cell_range(hash);
+			probe_hash_cells(er.first, er.second, hash, rv[it->second]);
+		}
+	}
 	return rv;
 }
 
@@ -484,13 +1141,15 @@ BeesHashTable::erase_hash_addr(HashType hash, AddrType addr)
 	fetch_missing_extent_by_hash(hash);
 	BEESTOOLONG("erase hash " << to_hex(hash) << " addr " << addr);
 	auto lock = lock_extent_by_hash(hash);
+	ExtentWriteSeq write_seq(*this, hash);
 	auto er = get_cell_range(hash);
 	Cell mv(hash, addr);
-	Cell *ip = find(er.first, er.second, mv);
+	Cell *ip = probe_cells(er.first, er.second, mv, true);
 	bool found = (ip < er.second);
 	if (found) {
 		*ip = Cell(0, 0);
-		set_extent_dirty_locked(hash_to_extent_index(hash));
+		set_cell_freq_locked(ip, 0);
+		set_hash_dirty_locked(hash);
 		BEESCOUNT(hash_erase);
 #if 0
 		if (verify_cell_range(er.first, er.second)) {
@@ -514,36 +1173,40 @@ BeesHashTable::push_front_hash_addr(HashType hash, AddrType addr)
 	fetch_missing_extent_by_hash(hash);
 	BEESTOOLONG("push_front_hash_addr hash " << BeesHash(hash) <<" addr " << BeesAddress(addr));
 	auto lock = lock_extent_by_hash(hash);
+	ExtentWriteSeq write_seq(*this, hash);
 	auto er = get_cell_range(hash);
 	Cell mv(hash, addr);
-	Cell *ip = find(er.first, er.second, mv);
+	Cell *first_empty;
+	Cell *ip = probe_cells(er.first, er.second, mv, true, &first_empty);
 	bool found = (ip < er.second);
-	if (!found) {
+	unsigned freq = 0;
+	if (found) {
+		freq = cell_freq_locked(ip);
+		switch (freq) {
+			case 0: BEESCOUNT(hash_hit_freq_0); break;
+			case 1: BEESCOUNT(hash_hit_freq_1); break;
+			case 2: BEESCOUNT(hash_hit_freq_2); break;
+			default: BEESCOUNT(hash_hit_freq_3); break;
+		}
+	} else {
 		// If no match found, get rid of an empty space instead
 		// If no empty spaces, ip will point to end
-		ip = find(er.first, er.second, Cell(0, 0));
-	}
-	if (ip > er.first) {
-		// Delete matching entry, first empty entry,
-		// or last entry whether empty or not
-		// move_backward(er.first, ip - 1, ip);
-		auto sp = ip;
-		auto dp = ip;
-		--sp;
-		// If we are deleting the last entry then don't copy it
-		if (dp == er.second) {
-			--sp;
-			--dp;
+		ip = first_empty;
+		if (ip == er.second) {
+			// Evict the least frequently hit entry
+			ip = choose_victim_locked(er.first, er.second);
 			BEESCOUNT(hash_evict);
 		}
-		while (dp > er.first) {
-			*dp-- = *sp--;
-		}
 	}
+	// Delete matching entry, first empty entry, or evicted entry
+	shift_cells_locked(er.first, ip);
+	// A hit, or a new entry that matched a duplicate block
+	set_cell_freq_locked(er.first, freq + 1);
 	// There is now a space at the front, insert there if different
 	if (er.first[0] != mv) {
 		er.first[0] = mv;
-		set_extent_dirty_locked(hash_to_extent_index(hash));
+		filter_insert_locked(hash);
+		set_hash_dirty_locked(hash);
 		BEESCOUNT(hash_front);
 	} else {
 		BEESCOUNT(hash_front_already);
@@ -570,9 +1233,10 @@ BeesHashTable::push_random_hash_addr(HashType hash, AddrType addr)
 	fetch_missing_extent_by_hash(hash);
 	BEESTOOLONG("push_random_hash_addr hash " << BeesHash(hash) << " addr " << BeesAddress(addr));
 	auto lock = lock_extent_by_hash(hash);
+	ExtentWriteSeq write_seq(*this, hash);
 	auto er = get_cell_range(hash);
 	Cell mv(hash, addr);
-	Cell *ip = find(er.first, er.second, mv);
+	Cell *ip = probe_cells(er.first, er.second, mv, true);
 	bool found = (ip < er.second);
 
 	const auto pos = tl_distribution(bees_generator);
@@ -585,15 +1249,10 @@ BeesHashTable::push_random_hash_addr(HashType hash, AddrType addr)
 	if (found) {
 		// If hash already exists after pos, swap with pos
 		if (ip > er.first + pos) {
-
-			// move_backward(er.first + pos, ip - 1, ip);
-			auto sp = ip;
-			auto dp = ip;
-			--sp;
-			while (dp > er.first + pos) {
-				*dp-- = *sp--;
-			}
-			*dp = mv;
+			const auto freq = cell_freq_locked(ip);
+			shift_cells_locked(er.first + pos, ip);
+			er.first[pos] = mv;
+			set_cell_freq_locked(er.first + pos, freq);
 			BEESCOUNT(hash_bump);
 			case_cond = 1;
 			goto ret_dirty;
@@ -605,12 +1264,12 @@ BeesHashTable::push_random_hash_addr(HashType hash, AddrType addr)
 	}
 
 	// Find an empty space to back of pos
-	for (ip = er.first + pos; ip < er.second; ++ip) {
-		if (*ip == Cell(0, 0)) {
-			*ip = mv;
-			case_cond = 3;
-			goto ret_dirty;
-		}
+	ip = probe_cells(er.first + pos, er.second, Cell(0, 0), true);
+	if (ip < er.second) {
+		*ip = mv;
+		set_cell_freq_locked(ip, 0);
+		case_cond = 3;
+		goto ret_dirty;
 	}
 
 	// Find an empty space to front of pos
@@ -619,25 +1278,24 @@ BeesHashTable::push_random_hash_addr(HashType hash, AddrType addr)
 		for (ip = er.first + pos - 1; ip >= er.first; --ip) {
 			if (*ip == Cell(0, 0)) {
 				*ip = mv;
+				set_cell_freq_locked(ip, 0);
 				case_cond = 4;
 				goto ret_dirty;
 			}
 		}
 	}
 
-	// Evict something and insert at pos
-	// move_backward(er.first + pos, er.second - 1, er.second);
-	ip = er.second - 1;
-	while (ip > er.first + pos) {
-		auto dp = ip;
-		*dp = *--ip;
-	}
+	// Evict the least frequently hit entry after pos and insert at pos
+	ip = choose_victim_locked(er.first + pos, er.second);
+	shift_cells_locked(er.first + pos, ip);
 	er.first[pos] = mv;
+	set_cell_freq_locked(er.first + pos, 0);
 	BEESCOUNT(hash_evict);
 	case_cond = 5;
 ret_dirty:
 	BEESCOUNT(hash_insert);
-	set_extent_dirty_locked(hash_to_extent_index(hash));
+	filter_insert_locked(hash);
+	set_hash_dirty_locked(hash);
 ret:
 #if 0
 	if (verify_cell_range(er.first, er.second, false)) {
@@ -665,8 +1323,221 @@ BeesHashTable::try_mmap_flags(int flags)
 			m_cell_ptr = static_cast<Cell *>(ptr);
 			void *ptr_end = static_cast<uint8_t *>(ptr) + m_size;
 			m_cell_ptr_end = static_cast<Cell *>(ptr_end);
+			m_map_size = m_size;
+		});
+	}
+}
+
+static
+string
+read_small_file(const string &filename)
+{
+	string rv;
+	catch_all([&]() {
+		Fd fd = open_or_die(filename, O_RDONLY);
+		rv = read_string(fd, 4096);
+	});
+	return rv;
+}
+
+/// Fraction of the last 10 seconds in which all non-idle tasks were
+/// stalled on IO, in percent.  0 if the kernel has no PSI.
+static
+double
+io_pressure_full_avg10()
+{
+	// Not read_small_file, which would log every second without PSI
+	const Fd fd(open("/proc/pressure/io", O_RDONLY | O_CLOEXEC));
+	if (!fd) {
+		return 0;
+	}
+	const string pressure = read_string(fd, 4096);
+	const string tag = "full avg10=";
+	const auto pos = pressure.find(tag);
+	if (pos == string::npos) {
+		return 0;
+	}
+	return stod(pressure.substr(pos + tag.size()));
+}
+
+/// AIMD control of the writeback rate between BEES_FLUSH_RATE and
+/// BEES_FLUSH_RATE_MAX.  Slow writes or a saturated device halve the
+/// rate.  Otherwise the rate rises while the dirty extents would take
+/// longer than BEES_FLUSH_BACKLOG_TIME to write, and falls back toward
+/// the minimum when they wouldn't.
+void
+BeesHashTable::adjust_flush_rate(double write_seconds, uint64_t dirty_extents)
+{
+	if (m_io_pressure_timer.age() >= 1) {
+		m_io_pressure_timer.reset();
+		catch_all([&]() {
+			m_io_pressure = io_pressure_full_avg10();
 		});
 	}
+	const double old_rate = m_flush_rate_limit.rate();
+	double new_rate = old_rate;
+	if (write_seconds > BEES_FLUSH_TARGET_TIME) {
+		BEESCOUNT(hash_flush_slow);
+		new_rate = old_rate / 2;
+	} else if (m_io_pressure > BEES_FLUSH_IO_PRESSURE) {
+		BEESCOUNT(hash_flush_pressure);
+		new_rate = old_rate / 2;
+	} else if (dirty_extents * BLOCK_SIZE_HASHTAB_EXTENT > old_rate * BEES_FLUSH_BACKLOG_TIME) {
+		new_rate = old_rate + BEES_FLUSH_RATE;
+	} else {
+		new_rate = old_rate - BEES_FLUSH_RATE;
+	}
+	new_rate = min(BEES_FLUSH_RATE_MAX, max(BEES_FLUSH_RATE, new_rate));
+	if (new_rate != old_rate) {
+		m_flush_rate_limit.rate(new_rate);
+		BEESCOUNT(hash_flush_rate_change);
+	}
+}
+
+static
+size_t
+hugetlb_page_size()
+{
+	const string meminfo = read_small_file("/proc/meminfo");
+	const auto pos = meminfo.find("Hugepagesize:");
+	if (pos == string::npos) {
+		return 0;
+	}
+	return stoull(meminfo.substr(pos + strlen("Hugepagesize:"))) * 1024;
+}
+
+unsigned
+BeesHashTable::memory_flags_from_names(const string &names)
+{
+	unsigned flags = MEM_DEFAULT;
+	for (const auto &name : split(",", names)) {
+		if (name == "default") {
+			flags = MEM_DEFAULT;
+		} else if (name == "normal") {
+			flags &= ~(MEM_THP | MEM_HUGETLB);
+		} else if (name == "thp") {
+			flags &= ~MEM_HUGETLB;
+			flags |= MEM_THP;
+		} else if (name == "hugetlb") {
+			flags |= MEM_THP | MEM_HUGETLB;
+		} else if (name == "mlock") {
+			flags |= MEM_MLOCK;
+		} else if (name == "nomlock") {
+			flags &= ~MEM_MLOCK;
+		} else if (name == "interleave") {
+			flags |= MEM_INTERLEAVE;
+		} else if (name == "handoff") {
+			flags |= MEM_HANDOFF;
+		} else {
+			THROW_ERROR(invalid_argument, "unknown hash table memory mode '" << name << "'");
+		}
+	}
+	return flags;
+}
+
+string
+BeesHashTable::memory_flags_names(unsigned flags)
+{
+	string rv = (flags & MEM_HUGETLB) ? "hugetlb" : (flags & MEM_THP) ? "thp" : "normal";
+	rv += (flags & MEM_MLOCK) ? ",mlock" : ",nomlock";
+	if (flags & MEM_INTERLEAVE) {
+		rv += ",interleave";
+	}
+	if (flags & MEM_HANDOFF) {
+		rv += ",handoff";
+	}
+	return rv;
+}
+
+/// Spread the table's pages across all online NUMA nodes.  Must be done
+/// before the pages are touched, since the policy applies at page fault.
+void
+BeesHashTable::interleave_table_memory()
+{
+	const string online = read_small_file("/sys/devices/system/node/online");
+	vector<unsigned long> node_mask;
+	const size_t bits_per_word = sizeof(unsigned long) * 8;
+	size_t node_count = 0;
+	catch_all([&]() {
+		for (const auto &range : split(",", online)) {
+			const auto dash = range.find('-');
+			const unsigned long first = stoul(range);
+			const unsigned long last = dash == string::npos ? first : stoul(range.substr(dash + 1));
+			for (auto node = first; node <= last; ++node) {
+				node_mask.resize(max(node_mask.size(), node / bits_per_word + 1));
+				node_mask[node / bits_per_word] |= 1UL << (node % bits_per_word);
+				++node_count;
+			}
+		}
+	});
+	if (node_count < 2) {
+		BEESLOGINFO("hash table NUMA interleave: " << node_count << " node(s) online, not interleaving");
+		return;
+	}
+	// maxnode counts one more than the highest bit the kernel looks at
+	if (syscall(SYS_mbind, m_void_ptr, m_size, MPOL_INTERLEAVE, node_mask.data(), node_mask.size() * bits_per_word + 1, 0)) {
+		BEESLOGWARN("mbind(MPOL_INTERLEAVE, nodes " << online.substr(0, online.find('\n')) << "): " << strerror(errno) << " (ignored)");
+	} else {
+		BEESLOGINFO("hash table NUMA interleave across " << node_count << " nodes");
+	}
+}
+
+/// Map anonymous memory for the table according to the configured
+/// memory flags, and report the page size we got.
+void
+BeesHashTable::map_table_memory()
+{
+	const unsigned mem_flags = m_ctx->hash_table_memory();
+	const size_t huge_size = hugetlb_page_size();
+	bool is_hugetlb = false;
+
+	if (mem_flags & MEM_HANDOFF) {
+		if ((mem_flags & MEM_HUGETLB) && huge_size && !(m_size % huge_size)) {
+			map_handoff_memory(true);
+			is_hugetlb = m_cell_ptr;
+		}
+		if (!m_cell_ptr) {
+			map_handoff_memory(false);
+		}
+		if (!m_cell_ptr) {
+			BEESLOGWARN("Hash table handoff memory not available, table will be read from disk after restart");
+		}
+	}
+
+	if ((mem_flags & MEM_HUGETLB) && !m_cell_ptr) {
+		// munmap of a hugetlb mapping needs a multiple of the huge page size
+		if (huge_size && !(m_size % huge_size)) {
+			try_mmap_flags(MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB);
+			is_hugetlb = m_cell_ptr;
+		} else {
+			BEESLOGWARN("hash table size " << pretty(m_size) << " is not a multiple of huge page size " << pretty(huge_size));
+		}
+		if (!is_hugetlb) {
+			BEESLOGWARN("MAP_HUGETLB failed, falling back to transparent huge pages");
+		}
+	}
+
+	// Try to mmap that much memory
+	try_mmap_flags(MAP_PRIVATE | MAP_ANONYMOUS);
+
+	if (!m_cell_ptr) {
+		THROW_ERRNO("unable to mmap " << m_filename);
+	}
+
+	if (mem_flags & MEM_INTERLEAVE) {
+		interleave_table_memory();
+	}
+
+	if (is_hugetlb) {
+		BEESLOGINFO("hash table page size " << pretty(huge_size) << " (hugetlb)");
+	} else {
+		if ((mem_flags & MEM_THP) && madvise(m_byte_ptr, m_size, MADV_HUGEPAGE)) {
+			BEESLOGWARN("madvise(..., MADV_HUGEPAGE): " << strerror(errno) << " (ignored)");
+		}
+		const string thp_enabled = read_small_file("/sys/kernel/mm/transparent_hugepage/enabled");
+		BEESLOGINFO("hash table page size " << pretty(sysconf(_SC_PAGESIZE))
+			<< ((mem_flags & MEM_THP) ? " (transparent huge pages requested, enabled: " + thp_enabled.substr(0, thp_enabled.find('\n')) + ")" : ""));
+	}
 }
 
 void
@@ -675,22 +1546,50 @@ BeesHashTable::open_file()
 	// OK open hash table
 	BEESNOTE("opening hash table '" << m_filename << "' target size " << m_size << " (" << pretty(m_size) << ")");
 
+	const off_t requested_size = m_size;
+	const off_t create_size = requested_size ? requested_size : BLOCK_SIZE_HASHTAB_EXTENT;
+	const string tmp_filename = m_filename + ".tmp";
+
 	// Try to open existing hash table
 	Fd new_fd = openat(m_ctx->home_fd(), m_filename.c_str(), FLAGS_OPEN_FILE_RW, 0700);
 
+	if (!!new_fd && requested_size) {
+		Stat st(new_fd);
+		if (st.st_size == 0) {
+			// Placeholder created by e.g. touch
+			BEESLOGINFO("Truncating empty hash table '" << m_filename << "' size " << requested_size << " (" << pretty(requested_size) << ")");
+			ftruncate_or_die(new_fd, requested_size);
+			unlinkat(m_ctx->home_fd(), "beeshash.algo", 0);
+		} else if (st.st_size != requested_size) {
+			// Keep the old table open, rehash it into a new one below
+			BEESLOGINFO("Resizing hash table '" << m_filename << "' from " << pretty(st.st_size) << " to " << pretty(requested_size));
+			THROW_CHECK1(invalid_argument, st.st_size, (st.st_size % BLOCK_SIZE_HASHTAB_EXTENT) == 0);
+			m_rehash_fd = new_fd;
+			m_rehash_size = st.st_size;
+			new_fd = Fd();
+		}
+	}
+
 	// If that doesn't work, try to make a new one
 	if (!new_fd) {
-		string tmp_filename = m_filename + ".tmp";
 		BEESNOTE("creating new hash table '" << tmp_filename << "'");
 		BEESLOGINFO("Creating new hash table '" << tmp_filename << "'");
 		unlinkat(m_ctx->home_fd(), tmp_filename.c_str(), 0);
 		new_fd = openat_or_die(m_ctx->home_fd(), tmp_filename, FLAGS_CREATE_FILE, 0700);
-		BEESNOTE("truncating new hash table '" << tmp_filename << "' size " << m_size << " (" << pretty(m_size) << ")");
-		BEESLOGINFO("Truncating new hash table '" << tmp_filename << "' size " << m_size << " (" << pretty(m_size) << ")");
-		ftruncate_or_die(new_fd, m_size);
-		BEESNOTE("truncating new hash table '" << tmp_filename << "' -> '" << m_filename << "'");
-		BEESLOGINFO("Truncating new hash table '" << tmp_filename << "' -> '" << m_filename << "'");
-		renameat_or_die(m_ctx->home_fd(), tmp_filename, m_ctx->home_fd(), m_filename);
+		BEESNOTE("truncating new hash table '" << tmp_filename << "' size " << create_size << " (" << pretty(create_size) << ")");
+		BEESLOGINFO("Truncating new hash table '" << tmp_filename << "' size " << create_size << " (" << pretty(create_size) << ")");
+		ftruncate_or_die(new_fd, create_size);
+		// A resized table is renamed after it is filled in
+		if (!m_rehash_fd) {
+			BEESNOTE("truncating new hash table '" << tmp_filename << "' -> '" << m_filename << "'");
+			BEESLOGINFO("Truncating new hash table '" << tmp_filename << "' -> '" << m_filename << "'");
+			renameat_or_die(m_ctx->home_fd(), tmp_filename, m_ctx->home_fd(), m_filename);
+			// The created file is write-only, reopen it for reading too
+			new_fd = openat_or_die(m_ctx->home_fd(), m_filename, FLAGS_OPEN_FILE_RW, 0700);
+			// A new table gets the currently requested hash algorithm
+			unlinkat(m_ctx->home_fd(), "beeshash.algo", 0);
+			unlinkat(m_ctx->home_fd(), "beeshash.ckpt", 0);
+		}
 	}
 
 	Stat st(new_fd);
@@ -702,6 +1601,470 @@ BeesHashTable::open_file()
 	m_fd = new_fd;
 }
 
+/// Insert a cell from the old table while resizing.  Cells are placed
+/// near their old position in the bucket, which is their rank (front of
+/// the bucket is most valuable).  If the bucket is full, the last cell
+/// is evicted if the new cell ranks above it.  Returns false if a cell
+/// was dropped.
+bool
+BeesHashTable::rehash_insert(const Cell &cell, size_t rank)
+{
+	Cell *const first = m_bucket_ptr[cell.e_hash % m_buckets].p_cells;
+	Cell *const last = first + c_cells_per_bucket;
+	Cell *const pos = first + rank;
+
+	// Find an empty space to back of pos
+	Cell *ip = probe_cells(pos, last, Cell(0, 0), true);
+	if (ip < last) {
+		*ip = cell;
+		return true;
+	}
+
+	// Find an empty space to front of pos
+	for (ip = pos; ip > first; ) {
+		--ip;
+		if (*ip == Cell(0, 0)) {
+			*ip = cell;
+			return true;
+		}
+	}
+
+	// Full bucket, evict the last cell if we rank above it
+	if (pos + 1 < last) {
+		for (ip = last - 1; ip > pos; --ip) {
+			*ip = *(ip - 1);
+		}
+		*pos = cell;
+	}
+	return false;
+}
+
+/// Stream the old hash table into the new one, write the new one out,
+/// and replace the old file.  Runs before any other thread uses the table.
+void
+BeesHashTable::rehash_old_table()
+{
+	const string tmp_filename = m_filename + ".tmp";
+	BEESNOTE("rehashing " << pretty(m_rehash_size) << " hash table into " << pretty(m_size));
+	BEESLOGINFO("Rehashing " << pretty(m_rehash_size) << " hash table into " << pretty(m_size));
+	Timer rehash_timer;
+
+	uint64_t copied_count = 0;
+	uint64_t dropped_count = 0;
+	ByteVector extent_buf(BLOCK_SIZE_HASHTAB_EXTENT);
+	for (off_t offset = 0; offset < m_rehash_size; offset += BLOCK_SIZE_HASHTAB_EXTENT) {
+		BEESNOTE("rehashing old hash table offset " << pretty(offset) << " of " << pretty(m_rehash_size));
+		pread_or_die(m_rehash_fd, extent_buf.data(), BLOCK_SIZE_HASHTAB_EXTENT, offset);
+		bees_unreadahead(m_rehash_fd, offset, BLOCK_SIZE_HASHTAB_EXTENT);
+		const Extent *const old_extent = reinterpret_cast<const Extent *>(extent_buf.data());
+		for (const Bucket &bucket : old_extent->p_buckets) {
+			for (size_t rank = 0; rank < c_cells_per_bucket; ++rank) {
+				const Cell &cell = bucket.p_cells[rank];
+				if (!cell.e_addr) {
+					continue;
+				}
+				if (rehash_insert(cell, rank)) {
+					++copied_count;
+				} else {
+					++dropped_count;
+				}
+			}
+		}
+	}
+	BEESLOGINFO("Rehashed " << copied_count << " cells, dropped " << dropped_count << " in " << rehash_timer << " sec");
+
+	BEESNOTE("writing rehashed hash table '" << tmp_filename << "'");
+	for (uint64_t ext = 0; ext < m_extents; ++ext) {
+		const uint8_t *const ext_ptr = m_extent_ptr[ext].p_byte;
+		pwrite_or_die(m_fd, ext_ptr, BLOCK_SIZE_HASHTAB_EXTENT, ext_ptr - m_byte_ptr);
+		m_extent_metadata.at(ext).m_missing = false;
+		m_extent_metadata.at(ext).m_checksum = Digest::CRC::crc64(ext_ptr, BLOCK_SIZE_HASHTAB_EXTENT);
+		m_extent_metadata.at(ext).m_generation = 1;
+		filter_rebuild_extent_locked(ext);
+	}
+	BEESNOTE("fsyncing rehashed hash table '" << tmp_filename << "'");
+	DIE_IF_NON_ZERO(fsync(m_fd));
+	BEESLOGINFO("Renaming rehashed hash table '" << tmp_filename << "' -> '" << m_filename << "'");
+	renameat_or_die(m_ctx->home_fd(), tmp_filename, m_ctx->home_fd(), m_filename);
+	m_rehash_fd = Fd();
+	m_rehash_size = 0;
+	BEESLOGINFO("Resized hash table in " << rehash_timer << " sec");
+}
+
+// beeshash.ckpt layout:  header, one entry per extent, crc64 of the rest of the file.
+// Integers are in host byte order, like the cells in beeshash.dat.
+
+static const char BEES_CHECKPOINT_MAGIC[8] = { 'b', 'e', 'e', 's', 'c', 'k', 'p', 't' };
+static const uint32_t BEES_CHECKPOINT_VERSION = 1;
+
+struct BeesCheckpointHeader {
+	char		h_magic[8];
+	uint32_t	h_version;
+	uint32_t	h_algorithm;
+	uint64_t	h_size;
+	uint32_t	h_cell_size;
+	uint32_t	h_bucket_size;
+	uint32_t	h_extent_size;
+	uint32_t	h_reserved;
+	uint64_t	h_generation;
+	uint64_t	h_extents;
+} __attribute__((packed));
+
+struct BeesCheckpointExtent {
+	uint64_t	e_generation;
+	uint64_t	e_checksum;
+} __attribute__((packed));
+
+/// Wait for the writeback thread to pass mark at its own rate, wait for
+/// the extents it wrote to be on disk, then record the checksum of every
+/// extent.  Called before the crawl state is saved, so crawl progress
+/// never gets ahead of the hash table.  The crawl state save takes its
+/// mark early and only calls this once written_back(mark), so normally
+/// there is no wait here.
+/// Extents written since the last checkpoint are checksummed here, once,
+/// instead of at every flush.  An extent dirtied again since its last
+/// flush is different in memory, so its checksum is recorded as unknown
+/// and it is verified when it is next read.
+void
+BeesHashTable::checkpoint(uint64_t mark)
+{
+	BEESNOTE("checkpointing hash table");
+	BEESTOOLONG("checkpointing hash table");
+	unique_lock<mutex> checkpoint_lock(m_checkpoint_mutex);
+	Timer checkpoint_timer;
+
+	unique_lock<mutex> dirty_lock(m_dirty_mutex);
+	while (!m_stop_requested && !written_back_locked(mark)) {
+		BEESNOTE("waiting for hash table writeback for checkpoint");
+		m_flushed_condvar.wait_for(dirty_lock, chrono::seconds(1));
+	}
+	dirty_lock.unlock();
+
+	// The writeback thread is stopping or gone, so write the rest here
+	if (m_stop_requested) {
+		flush_dirty_extents(false);
+	}
+
+	BEESNOTE("syncing hash table for checkpoint");
+	DIE_IF_NON_ZERO(fdatasync(m_fd));
+
+	BeesCheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.h_magic, BEES_CHECKPOINT_MAGIC, sizeof(header.h_magic));
+	header.h_version = BEES_CHECKPOINT_VERSION;
+	header.h_algorithm = BeesHash::algorithm();
+	header.h_size = m_size;
+	header.h_cell_size = sizeof(Cell);
+	header.h_bucket_size = BLOCK_SIZE_HASHTAB_BUCKET;
+	header.h_extent_size = BLOCK_SIZE_HASHTAB_EXTENT;
+	header.h_generation = m_checkpoint_generation + 1;
+	header.h_extents = m_extents;
+
+	string blob(reinterpret_cast<const char *>(&header), sizeof(header));
+	blob.reserve(sizeof(header) + m_extents * sizeof(BeesCheckpointExtent) + sizeof(uint64_t));
+	for (uint64_t ext = 0; ext < m_extents; ++ext) {
+		BeesCheckpointExtent entry;
+		auto lock = lock_extent_by_index(ext);
+		auto &metadata = m_extent_metadata.at(ext);
+		if (metadata.m_checksum_stale && !metadata.m_dirty_buckets) {
+			metadata.m_checksum = Digest::CRC::crc64(m_extent_ptr[ext].p_byte, BLOCK_SIZE_HASHTAB_EXTENT);
+			metadata.m_checksum_stale = false;
+			BEESCOUNT(hash_checkpoint_extent);
+		}
+		entry.e_generation = metadata.m_checksum_stale ? 0 : metadata.m_generation;
+		entry.e_checksum = metadata.m_checksum;
+		lock.unlock();
+		blob.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+	}
+	const uint64_t blob_crc = Digest::CRC::crc64(blob.data(), blob.size());
+	blob.append(reinterpret_cast<const char *>(&blob_crc), sizeof(blob_crc));
+
+	BEESNOTE("writing hash table checkpoint " << header.h_generation);
+	m_checkpoint_file.write(blob);
+	m_checkpoint_generation = header.h_generation;
+	BEESCOUNT(hash_checkpoint);
+	BEESLOGDEBUG("Saved hash table checkpoint " << m_checkpoint_generation << " in " << checkpoint_timer << " sec");
+}
+
+/// Read extent checksums from the last checkpoint.  If there is no usable
+/// checkpoint, every extent is verified as it is read.
+void
+BeesHashTable::load_checkpoint()
+{
+	BEESNOTE("loading hash table checkpoint");
+	string blob;
+	catch_all([&]() {
+		blob = m_checkpoint_file.read();
+	});
+	if (blob.empty()) {
+		BEESLOGINFO("No hash table checkpoint, all extents will be verified");
+		return;
+	}
+
+	BeesCheckpointHeader header;
+	const size_t expected_size = sizeof(header) + m_extents * sizeof(BeesCheckpointExtent) + sizeof(uint64_t);
+	if (blob.size() != expected_size) {
+		BEESLOGWARN("Hash table checkpoint size " << blob.size() << " does not match table (expected " << expected_size << "), ignoring it");
+		return;
+	}
+	uint64_t blob_crc;
+	memcpy(&blob_crc, blob.data() + blob.size() - sizeof(blob_crc), sizeof(blob_crc));
+	if (blob_crc != Digest::CRC::crc64(blob.data(), blob.size() - sizeof(blob_crc))) {
+		BEESLOGWARN("Hash table checkpoint checksum mismatch, ignoring it");
+		return;
+	}
+	memcpy(&header, blob.data(), sizeof(header));
+	if (memcmp(header.h_magic, BEES_CHECKPOINT_MAGIC, sizeof(header.h_magic))
+		|| header.h_version != BEES_CHECKPOINT_VERSION
+		|| header.h_algorithm != BeesHash::algorithm()
+		|| header.h_size != m_size
+		|| header.h_cell_size != sizeof(Cell)
+		|| header.h_bucket_size != BLOCK_SIZE_HASHTAB_BUCKET
+		|| header.h_extent_size != BLOCK_SIZE_HASHTAB_EXTENT
+		|| header.h_extents != m_extents) {
+		BEESLOGWARN("Hash table checkpoint header does not match hash table, ignoring it");
+		return;
+	}
+
+	const char *entry_ptr = blob.data() + sizeof(header);
+	for (uint64_t ext = 0; ext < m_extents; ++ext) {
+		BeesCheckpointExtent entry;
+		memcpy(&entry, entry_ptr, sizeof(entry));
+		entry_ptr += sizeof(entry);
+		m_extent_metadata.at(ext).m_generation = entry.e_generation;
+		m_extent_metadata.at(ext).m_checksum = entry.e_checksum;
+	}
+	m_checkpoint_generation = header.h_generation;
+	BEESLOGINFO("Loaded hash table checkpoint " << m_checkpoint_generation);
+}
+
+/// Compare a freshly read extent with its checkpoint checksum.  On a
+/// mismatch the extent was written after the last checkpoint (or torn by
+/// a crash), so check each cell is in the right bucket and the buckets
+/// have no duplicates.
+void
+BeesHashTable::verify_extent_checksum_locked(uint64_t extent_index)
+{
+	// Must already be locked
+	auto &metadata = m_extent_metadata.at(extent_index);
+	const uint64_t checksum = Digest::CRC::crc64(m_extent_ptr[extent_index].p_byte, BLOCK_SIZE_HASHTAB_EXTENT);
+	if (metadata.m_generation && metadata.m_checksum == checksum) {
+		return;
+	}
+	if (metadata.m_generation) {
+		BEESCOUNT(hash_checkpoint_mismatch);
+		BEESLOGDEBUG("Hash table extent #" << extent_index << " does not match checkpoint " << m_checkpoint_generation << ", verifying");
+	}
+
+	bool bugs_found = false;
+	for (uint64_t bucket = extent_index * c_buckets_per_extent; bucket < (extent_index + 1) * c_buckets_per_extent; ++bucket) {
+		for (Cell &cell : m_bucket_ptr[bucket].p_cells) {
+			if (cell.e_addr && cell.e_hash % m_buckets != bucket) {
+				BEESCOUNT(hash_checkpoint_bad_cell);
+				cell = Cell(0, 0);
+				bugs_found = true;
+			}
+		}
+		if (verify_cell_range(m_bucket_ptr[bucket].p_cells, m_bucket_ptr[bucket + 1].p_cells)) {
+			bugs_found = true;
+		}
+	}
+
+	if (bugs_found) {
+		// Fixed up in memory, and the next flush records the checksum
+		set_extent_dirty_locked(extent_index);
+	} else {
+		metadata.m_checksum = checksum;
+		metadata.m_checksum_stale = false;
+		metadata.m_generation = max<uint64_t>(metadata.m_generation, 1);
+	}
+}
+
+// Handoff memfd layout:  the table, then a header, then one byte per
+// extent that is 1 if the extent was in memory when the previous process
+// stopped.  The memfd is only as persistent as the service manager's fd
+// store, so host byte order is fine here too.
+
+static const char BEES_HANDOFF_MAGIC[8] = { 'b', 'e', 'e', 's', 'h', 'o', 'f', 'f' };
+
+struct BeesHandoffHeader {
+	char		h_magic[8];
+	uint32_t	h_algorithm;
+	uint32_t	h_valid;
+	uint64_t	h_size;
+	uint64_t	h_generation;
+	uint64_t	h_extents;
+} __attribute__((packed));
+
+/// Name of the handoff memfd in the service manager's fd store.  The same
+/// hash table file gets the same name after a restart.
+static
+string
+handoff_name(const Fd &fd)
+{
+	const Stat st(fd);
+	return "beeshash-" + to_hex(st.st_dev) + "-" + to_hex(st.st_ino);
+}
+
+/// Map the table from a memfd that is kept by the service manager while
+/// bees restarts.  If the previous process left one, use it.
+void
+BeesHashTable::map_handoff_memory(bool hugetlb)
+{
+	const string name = handoff_name(m_fd);
+	const size_t page_size = hugetlb ? hugetlb_page_size() : sysconf(_SC_PAGESIZE);
+	const size_t trailer_size = sizeof(BeesHandoffHeader) + m_extents;
+	const size_t map_size = (m_size + trailer_size + page_size - 1) / page_size * page_size;
+
+	Fd fd;
+	const int inherited_fd = listen_fd(name);
+	if (inherited_fd >= 0) {
+		// Passed without FD_CLOEXEC
+		fcntl(inherited_fd, F_SETFD, FD_CLOEXEC);
+		fd = inherited_fd;
+		const Stat st(fd);
+		if (st.st_size == static_cast<off_t>(map_size)) {
+			BEESLOGINFO("Hash table memory handed off from previous process in fd " << fd << " '" << name << "'");
+		} else {
+			BEESLOGWARN("Hash table handoff fd " << fd << " '" << name << "' size " << pretty(st.st_size) << " does not match " << pretty(map_size) << ", ignoring it");
+			fd = Fd();
+		}
+	}
+
+	if (!fd) {
+		// Drop any stale memfd, e.g. from before the table was resized
+		catch_all([&]() {
+			service_notify("FDSTOREREMOVE=1\nFDNAME=" + name);
+		});
+		const int new_fd = memfd_create(name.c_str(), MFD_CLOEXEC | (hugetlb ? MFD_HUGETLB : 0));
+		if (new_fd < 0) {
+			BEESLOGWARN("memfd_create(" << name << (hugetlb ? ", MFD_HUGETLB" : "") << "): " << strerror(errno));
+			return;
+		}
+		fd = new_fd;
+		if (catch_all([&]() {
+			ftruncate_or_die(fd, map_size);
+		})) {
+			return;
+		}
+	}
+
+	catch_all([&]() {
+		BEESLOGINFO("mapping hash table size " << m_size << " from memfd size " << map_size << (hugetlb ? " (hugetlb)" : ""));
+		void *const ptr = mmap_or_die(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		m_cell_ptr = static_cast<Cell *>(ptr);
+		void *const ptr_end = static_cast<uint8_t *>(ptr) + m_size;
+		m_cell_ptr_end = static_cast<Cell *>(ptr_end);
+		m_map_size = map_size;
+		m_handoff_fd = fd;
+	});
+	if (!m_handoff_fd) {
+		return;
+	}
+
+	catch_all([&]() {
+		if (!service_notify("FDSTORE=1\nFDNAME=" + name, m_handoff_fd)) {
+			BEESLOGWARN("NOTIFY_SOCKET not set, hash table memory will not be kept across restarts");
+		}
+	});
+}
+
+/// Use the extents the previous process left in the handoff memfd instead
+/// of reading them from disk.  The previous process saved a checkpoint
+/// after its last write, so the extents should match the checkpoint.
+void
+BeesHashTable::adopt_handoff()
+{
+	BEESNOTE("adopting hash table memory from previous process");
+	BeesHandoffHeader *const header = reinterpret_cast<BeesHandoffHeader *>(m_byte_ptr + m_size);
+	const uint8_t *const loaded = m_byte_ptr + m_size + sizeof(*header);
+	const bool has_magic = !memcmp(header->h_magic, BEES_HANDOFF_MAGIC, sizeof(header->h_magic));
+	const bool usable = has_magic
+		&& header->h_valid
+		&& header->h_algorithm == BeesHash::algorithm()
+		&& header->h_size == m_size
+		&& header->h_extents == m_extents
+		&& header->h_generation == m_checkpoint_generation;
+
+	// Until this process stops cleanly, the memfd may have extents newer than the checkpoint
+	header->h_valid = 0;
+
+	if (!usable) {
+		if (has_magic) {
+			BEESLOGWARN("Hash table handoff from previous process does not match checkpoint " << m_checkpoint_generation << ", reading table from disk");
+			BEESCOUNT(hash_handoff_discard);
+		}
+		return;
+	}
+
+	Timer adopt_timer;
+	uint64_t adopted = 0;
+	for (uint64_t ext = 0; ext < m_extents; ++ext) {
+		if (!loaded[ext]) {
+			continue;
+		}
+		auto lock = lock_extent_by_index(ext);
+		auto &metadata = m_extent_metadata.at(ext);
+		const uint64_t checkpoint_checksum = metadata.m_checksum;
+		metadata.m_missing = false;
+		verify_extent_checksum_locked(ext);
+		// Updated in memory after the checkpoint, so the disk copy is older
+		if (metadata.m_checksum != checkpoint_checksum) {
+			set_extent_dirty_locked(ext);
+		}
+		filter_rebuild_extent_locked(ext);
+		++adopted;
+	}
+	BEESCOUNTADD(hash_handoff_extent, adopted);
+	BEESLOGNOTICE("Adopted " << adopted << " of " << m_extents << " hash table extents from previous process in " << adopt_timer << " sec");
+}
+
+/// Record which extents are in memory for the next process.  Called after
+/// the last checkpoint, so a crash before this leaves the handoff invalid.
+void
+BeesHashTable::save_handoff()
+{
+	BEESNOTE("saving hash table handoff");
+	BeesHandoffHeader *const header = reinterpret_cast<BeesHandoffHeader *>(m_byte_ptr + m_size);
+	uint8_t *const loaded = m_byte_ptr + m_size + sizeof(*header);
+	for (uint64_t ext = 0; ext < m_extents; ++ext) {
+		auto lock = lock_extent_by_index(ext);
+		loaded[ext] = !m_extent_metadata.at(ext).m_missing;
+	}
+	memcpy(header->h_magic, BEES_HANDOFF_MAGIC, sizeof(header->h_magic));
+	header->h_algorithm = BeesHash::algorithm();
+	header->h_size = m_size;
+	header->h_generation = m_checkpoint_generation;
+	header->h_extents = m_extents;
+	header->h_valid = 1;
+	BEESLOGINFO("Hash table left in memory for the next process at checkpoint " << m_checkpoint_generation);
+}
+
+void
+BeesHashTable::open_algorithm_file()
+{
+	// Hash tables from before this file existed were built with crc64,
+	// which is also the default.  Once a table has an algorithm it keeps it.
+	BeesStringFile algo_file(m_ctx->home_fd(), "beeshash.algo");
+	auto requested = m_ctx->hash_algorithm();
+	auto algo = requested;
+	string contents = algo_file.read();
+	if (contents.empty()) {
+		BEESLOGINFO("Recording hash algorithm " << BeesHash::algorithm_name(algo) << " in beeshash.algo");
+		algo_file.write(BeesHash::algorithm_name(algo) + "\n");
+	} else {
+		auto nl = contents.find('\n');
+		algo = BeesHash::algorithm_from_name(contents.substr(0, nl));
+		if (algo != requested) {
+			BEESLOGWARN("Hash table was created with hash algorithm " << BeesHash::algorithm_name(algo)
+				<< ", ignoring requested " << BeesHash::algorithm_name(requested));
+		}
+	}
+	BEESLOGINFO("\thash algorithm " << BeesHash::algorithm_name(algo));
+	BEESTRACE("hash algorithm " << BeesHash::algorithm_name(algo) << " for " << m_ctx->root_path());
+	BeesHash::set_algorithm(algo);
+}
+
 BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t size) :
 	m_ctx(ctx),
 	m_size(0),
@@ -712,7 +2075,11 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 	m_writeback_thread("hash_writeback"),
 	m_prefetch_thread("hash_prefetch"),
 	m_flush_rate_limit(BEES_FLUSH_RATE),
-	m_stats_file(m_ctx->home_fd(), "beesstats.txt")
+	m_stats_file(m_ctx->home_fd(), "beesstats.txt"),
+	m_checkpoint_file(m_ctx->home_fd(), "beeshash.ckpt", 1024 * 1024 * 1024),
+	m_stop_requested(false),
+	m_lock_wait_ns(0),
+	m_occupied_cells(0)
 {
 	// Sanity checks to protect the implementation from its weaknesses
 	THROW_CHECK2(invalid_argument, BLOCK_SIZE_HASHTAB_BUCKET, BLOCK_SIZE_HASHTAB_EXTENT, (BLOCK_SIZE_HASHTAB_EXTENT % BLOCK_SIZE_HASHTAB_BUCKET) == 0);
@@ -723,9 +2090,13 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 	THROW_CHECK2(runtime_error, sizeof(Extent), BLOCK_SIZE_HASHTAB_EXTENT, BLOCK_SIZE_HASHTAB_EXTENT == sizeof(Extent));
 	THROW_CHECK2(runtime_error, sizeof(Extent::p_byte), BLOCK_SIZE_HASHTAB_EXTENT, BLOCK_SIZE_HASHTAB_EXTENT == sizeof(Extent::p_byte));
 
+	// Dirty buckets in an extent are tracked in a uint32_t
+	THROW_CHECK1(runtime_error, c_buckets_per_extent, c_buckets_per_extent == 32);
+
 	m_filename = filename;
 	m_size = size;
 	open_file();
+	open_algorithm_file();
 
 	// Now we know size we can compute stuff
 
@@ -739,14 +2110,9 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 	m_extents = (m_size + BLOCK_SIZE_HASHTAB_EXTENT - 1) / BLOCK_SIZE_HASHTAB_EXTENT;
 	BEESLOGINFO("\tcells " << m_cells << ", buckets " << m_buckets << ", extents " << m_extents);
 
-	BEESLOGINFO("\tflush rate limit " << BEES_FLUSH_RATE);
-
-	// Try to mmap that much memory
-	try_mmap_flags(MAP_PRIVATE | MAP_ANONYMOUS);
+	BEESLOGINFO("\tflush rate limit " << pretty(BEES_FLUSH_RATE) << " to " << pretty(BEES_FLUSH_RATE_MAX) << "/s");
 
-	if (!m_cell_ptr) {
-		THROW_ERRNO("unable to mmap " << filename);
-	}
+	map_table_memory();
 
 	// Do unions work the way we think (and rely on)?
 	THROW_CHECK2(runtime_error, m_void_ptr, m_cell_ptr, m_void_ptr == m_cell_ptr);
@@ -754,12 +2120,11 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 	THROW_CHECK2(runtime_error, m_void_ptr, m_bucket_ptr, m_void_ptr == m_bucket_ptr);
 	THROW_CHECK2(runtime_error, m_void_ptr, m_extent_ptr, m_void_ptr == m_extent_ptr);
 
-	// Give all the madvise hints that the kernel understands
+	// Give all the other madvise hints that the kernel understands
 	const struct madv_flag {
 		const char *name;
 		int value;
 	} madv_flags[] = {
-		{ .name = "MADV_HUGEPAGE", .value = MADV_HUGEPAGE },
 		{ .name = "MADV_DONTFORK", .value = MADV_DONTFORK },
 		{ .name = "MADV_DONTDUMP", .value = MADV_DONTDUMP },
 		{ .name = "", .value = 0 },
@@ -772,6 +2137,21 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 	}
 
 	m_extent_metadata.resize(m_extents);
+	decltype(m_dirty_extent_bits)((m_extents + 63) / 64).swap(m_dirty_extent_bits);
+	decltype(m_filter_ready_bits)((m_extents + 63) / 64).swap(m_filter_ready_bits);
+	decltype(m_extent_seq)(m_extents).swap(m_extent_seq);
+	decltype(m_filter)(m_buckets * c_filter_words_per_bucket).swap(m_filter);
+	m_cell_freq.resize((m_cells + 3) / 4);
+	BEESLOGINFO("\tlookup filter " << pretty(m_buckets * c_filter_words_per_bucket * sizeof(uint64_t)));
+
+	if (!!m_rehash_fd) {
+		rehash_old_table();
+	} else {
+		load_checkpoint();
+		if (!!m_handoff_fd) {
+			adopt_handoff();
+		}
+	}
 
 	m_writeback_thread.exec([&]() {
 		writeback_loop();
@@ -797,8 +2177,8 @@ BeesHashTable::~BeesHashTable()
 		// flush_dirty_extents(false);
 		catch_all([&]() {
 			// drop the memory mapping
-			BEESTOOLONG("unmap handle table size " << pretty(m_size));
-			DIE_IF_NON_ZERO(munmap(m_cell_ptr, m_size));
+			BEESTOOLONG("unmap handle table size " << pretty(m_map_size));
+			DIE_IF_NON_ZERO(munmap(m_cell_ptr, m_map_size));
 		});
 		m_cell_ptr = nullptr;
 		m_size = 0;
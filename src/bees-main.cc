@@ -0,0 +1,24 @@
+#include "bees.h"
+
+#include <iostream>
+
+using namespace crucible;
+using namespace std;
+
+int
+main(int argc, char *argv[])
+{
+	cerr << "bees version " << BEES_VERSION << endl;
+
+	if (argc < 2) {
+		do_cmd_help(argv);
+		return EXIT_FAILURE;
+	}
+
+	int rv = EXIT_FAILURE;
+	catch_all([&]() {
+		rv = bees_main(argc, argv);
+	});
+	BEESLOGNOTICE("Exiting with status " << rv << " " << (rv ? "(failure)" : "(success)"));
+	return rv;
+}
@@ -0,0 +1,99 @@
+#include "bees.h"
+
+#include "crucible/string.h"
+
+using namespace crucible;
+using namespace std;
+
+BeesRecorder::BeesRecorder(const string &filename) :
+	m_fd(open_or_die(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | O_NOCTTY | O_LARGEFILE, 0600))
+{
+	BEESNOTE("opening trace record file " << filename);
+	const Stat st(m_fd);
+	if (st.st_size == 0) {
+		const Header header {
+			.h_magic = c_magic,
+			.h_version = c_version,
+			.h_record_size = sizeof(Record),
+		};
+		write_or_die(m_fd, header);
+	} else {
+		// Appending to an earlier trace, it must be the same format
+		Header header;
+		pread_or_die(m_fd, header, 0);
+		THROW_CHECK1(runtime_error, filename, header.h_magic == c_magic);
+		THROW_CHECK1(runtime_error, header.h_version, header.h_version == c_version);
+		THROW_CHECK1(runtime_error, header.h_record_size, header.h_record_size == sizeof(Record));
+	}
+	m_buffer.reserve(BEES_RECORD_BUFFER_SIZE);
+	BEESLOGNOTICE("Recording scan trace to '" << filename << "' at offset " << st.st_size);
+}
+
+BeesRecorder::~BeesRecorder()
+{
+	catch_all([&]() {
+		flush();
+	});
+}
+
+void
+BeesRecorder::write(const vector<Record> &records)
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_buffer.append(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(Record));
+	BEESCOUNTADD(record_count, records.size());
+	if (m_buffer.size() >= BEES_RECORD_BUFFER_SIZE) {
+		flush_locked();
+	}
+}
+
+void
+BeesRecorder::flush_locked()
+{
+	if (m_buffer.empty()) {
+		return;
+	}
+	BEESNOTE("writing " << pretty(m_buffer.size()) << " of trace records");
+	BEESCOUNTADD(record_bytes, m_buffer.size());
+	write_or_die(m_fd, m_buffer);
+	m_buffer.clear();
+}
+
+void
+BeesRecorder::flush()
+{
+	unique_lock<mutex> lock(m_mutex);
+	flush_locked();
+}
+
+BeesRecordReader::BeesRecordReader(const string &filename) :
+	m_fd(open_or_die(filename, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_LARGEFILE)),
+	m_filename(filename)
+{
+	BeesRecorder::Header header;
+	read_or_die(m_fd, header);
+	THROW_CHECK1(runtime_error, filename, header.h_magic == BeesRecorder::c_magic);
+	THROW_CHECK1(runtime_error, header.h_version, header.h_version == BeesRecorder::c_version);
+	THROW_CHECK1(runtime_error, header.h_record_size, header.h_record_size == sizeof(BeesRecorder::Record));
+}
+
+bool
+BeesRecordReader::next(BeesRecorder::Record &rec)
+{
+	if (m_pos >= m_buffer.size()) {
+		m_buffer.resize(BEES_RECORD_BUFFER_SIZE / sizeof(BeesRecorder::Record));
+		size_t size_read = 0;
+		read_partial_or_die(m_fd, m_buffer.data(), m_buffer.size() * sizeof(BeesRecorder::Record), size_read);
+		if (size_read % sizeof(BeesRecorder::Record)) {
+			// bees was killed in the middle of a write
+			BEESLOGWARN("Ignoring partial record at end of '" << m_filename << "'");
+		}
+		m_buffer.resize(size_read / sizeof(BeesRecorder::Record));
+		m_pos = 0;
+		if (m_buffer.empty()) {
+			return false;
+		}
+	}
+	rec = m_buffer[m_pos++];
+	return true;
+}
@@ -0,0 +1,401 @@
+#include "bees.h"
+
+#include "crucible/string.h"
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <getopt.h>
+#include <syslog.h>
+
+using namespace crucible;
+using namespace std;
+
+// Replays a scan trace recorded through $BEESRECORD.  Each hash table size
+// gets a new BeesHashTable in a scratch BEESHOME, and the trace's extents go
+// through the hash table lookup, match and insert decisions of
+// scan_one_extent.  LOGICAL_INO is replaced by a model built from the trace:
+// the recorded toxic and overflowing extents, and the blocks removed by
+// dedupes earlier in the replay.  Nothing is read or deduped, so months of
+// scanning replay in minutes.
+
+namespace {
+
+	using Record = BeesRecorder::Record;
+
+	struct ReplayConfig {
+		vector<off_t>	m_sizes { 64 * 1024 * 1024 };
+		string		m_dir;
+		string		m_anonymize;
+	};
+
+	struct ReplayStats {
+		uint64_t	m_extents = 0;
+		uint64_t	m_blocks = 0;
+		uint64_t	m_zero_blocks = 0;
+		uint64_t	m_lookups = 0;
+		uint64_t	m_found = 0;
+		uint64_t	m_matched = 0;
+		uint64_t	m_dedupe_bytes = 0;
+		uint64_t	m_erased = 0;
+		uint64_t	m_inserted = 0;
+		uint64_t	m_toxic = 0;
+		uint64_t	m_abandoned = 0;
+	};
+
+	// Stands in for LOGICAL_INO
+	class ReplayResolver {
+		struct Recorded {
+			bool	m_toxic = false;
+			bool	m_overflow = false;
+		};
+		unordered_map<uint64_t, Recorded>	m_recorded;
+		unordered_set<uint64_t>			m_removed;
+	public:
+		enum Result {
+			RESOLVE_TOXIC,
+			RESOLVE_NONE,
+			RESOLVE_FOUND,
+		};
+		void record(const Record &rec);
+		void remove(BeesAddress addr);
+		Result resolve(BeesAddress addr) const;
+	};
+
+	void
+	ReplayResolver::record(const Record &rec)
+	{
+		auto &recorded = m_recorded[rec.r_addr];
+		recorded.m_toxic = rec.r_flags & BeesRecorder::RESOLVE_TOXIC;
+		recorded.m_overflow = rec.r_flags & BeesRecorder::RESOLVE_OVERFLOW;
+	}
+
+	void
+	ReplayResolver::remove(BeesAddress addr)
+	{
+		m_removed.insert(addr);
+	}
+
+	ReplayResolver::Result
+	ReplayResolver::resolve(BeesAddress addr) const
+	{
+		const auto found = m_recorded.find(addr.get_physical_or_zero());
+		if (found != m_recorded.end()) {
+			if (found->second.m_toxic) {
+				return RESOLVE_TOXIC;
+			}
+			if (found->second.m_overflow) {
+				return RESOLVE_NONE;
+			}
+		}
+		return m_removed.count(addr) ? RESOLVE_NONE : RESOLVE_FOUND;
+	}
+
+	// The scan_one_extent decisions for one extent and its blocks.
+	// Deduped blocks are removed, but the rest of the extent keeps its
+	// addresses instead of being rewritten.
+	void
+	replay_extent(BeesHashTable &hash_table, ReplayResolver &resolver, ReplayStats &stats, const Record &extent, const vector<Record> &blocks)
+	{
+		++stats.m_extents;
+		const bool extent_compressed = extent.r_flags & FIEMAP_EXTENT_ENCODED;
+
+		vector<BeesHashTable::HashType> lookup_hashes;
+		for (const auto &b : blocks) {
+			if (!(b.r_flags & BeesRecorder::BLOCK_ZERO)) {
+				lookup_hashes.push_back(b.r_hash);
+			}
+		}
+		auto found_cells = hash_table.find_cells(lookup_hashes);
+		auto found_it = found_cells.begin();
+
+		vector<const Record *> insert_blocks;
+		set<const Record *> noinsert_set;
+		for (const auto &b : blocks) {
+			++stats.m_blocks;
+			if (b.r_flags & BeesRecorder::BLOCK_ZERO) {
+				++stats.m_zero_blocks;
+				if (extent_compressed) {
+					continue;
+				}
+				// The extent is rewritten without its zero blocks
+				break;
+			}
+			insert_blocks.push_back(&b);
+
+			const BeesAddress addr(b.r_addr);
+			const auto &found = *found_it++;
+			++stats.m_lookups;
+			stats.m_found += found.size();
+
+			set<BeesAddress> found_addrs { addr };
+			BeesAddress kept_addr;
+			for (const auto &i : found) {
+				BeesAddress found_addr(i.e_addr);
+				if (found_addr.is_unaligned_eof() != addr.is_unaligned_eof()) {
+					continue;
+				}
+				if (!found_addrs.insert(found_addr).second) {
+					continue;
+				}
+				if (found_addr.is_toxic()) {
+					++stats.m_abandoned;
+					return;
+				}
+				switch (resolver.resolve(found_addr)) {
+					case ReplayResolver::RESOLVE_TOXIC:
+						++stats.m_toxic;
+						++stats.m_abandoned;
+						found_addr.set_toxic();
+						hash_table.push_front_hash_addr(b.r_hash, found_addr);
+						return;
+					case ReplayResolver::RESOLVE_NONE:
+						++stats.m_erased;
+						hash_table.erase_hash_addr(b.r_hash, found_addr);
+						break;
+					case ReplayResolver::RESOLVE_FOUND:
+						if (!kept_addr) {
+							kept_addr = found_addr;
+						}
+						break;
+				}
+			}
+
+			if (kept_addr) {
+				++stats.m_matched;
+				stats.m_dedupe_bytes += b.r_length;
+				noinsert_set.insert(&b);
+				resolver.remove(addr);
+				hash_table.push_front_hash_addr(b.r_hash, kept_addr);
+			}
+		}
+
+		for (const auto bp : insert_blocks) {
+			if (noinsert_set.count(bp)) {
+				hash_table.erase_hash_addr(bp->r_hash, bp->r_addr);
+			} else {
+				++stats.m_inserted;
+				hash_table.push_random_hash_addr(bp->r_hash, bp->r_addr);
+			}
+		}
+	}
+
+	ReplayStats
+	replay_trace(BeesHashTable &hash_table, const string &filename)
+	{
+		BeesRecordReader reader(filename);
+		ReplayResolver resolver;
+		ReplayStats stats;
+		Record extent = { };
+		vector<Record> blocks;
+		Record rec;
+		while (reader.next(rec)) {
+			switch (rec.r_type) {
+				case BeesRecorder::REC_EXTENT:
+					if (extent.r_type) {
+						replay_extent(hash_table, resolver, stats, extent, blocks);
+					}
+					extent = rec;
+					blocks.clear();
+					break;
+				case BeesRecorder::REC_BLOCK:
+					blocks.push_back(rec);
+					break;
+				case BeesRecorder::REC_RESOLVE:
+					resolver.record(rec);
+					break;
+				default:
+					THROW_ERROR(runtime_error, "unknown record type " << rec.r_type << " in '" << filename << "'");
+			}
+		}
+		if (extent.r_type) {
+			replay_extent(hash_table, resolver, stats, extent, blocks);
+		}
+		return stats;
+	}
+
+	// Bijective, so equal ids and hashes stay equal and distinct ones stay distinct
+	uint64_t
+	anonymize(uint64_t key, uint64_t value)
+	{
+		uint64_t z = value ^ key;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	// Replaces root, inode and hash values with keyed permutations of
+	// themselves.  Addresses, offsets, lengths and flags are kept, because
+	// the replay depends on them.
+	void
+	anonymize_trace(const string &in_filename, const string &out_filename)
+	{
+		random_device rd;
+		const uint64_t key = (uint64_t(rd()) << 32) ^ rd();
+		BeesRecordReader reader(in_filename);
+		BeesRecorder recorder(out_filename);
+		vector<Record> records;
+		Record rec;
+		while (reader.next(rec)) {
+			rec.r_root = anonymize(key, rec.r_root);
+			rec.r_ino = anonymize(key + 1, rec.r_ino);
+			if (rec.r_type == BeesRecorder::REC_BLOCK) {
+				rec.r_hash = anonymize(key + 2, rec.r_hash);
+			}
+			records.push_back(rec);
+			if (records.size() * sizeof(Record) >= BEES_RECORD_BUFFER_SIZE) {
+				recorder.write(records);
+				records.clear();
+			}
+		}
+		recorder.write(records);
+		recorder.flush();
+	}
+
+	off_t
+	parse_size(const string &s)
+	{
+		size_t end = 0;
+		off_t rv = stoull(s, &end);
+		const string suffix = s.substr(end);
+		if (suffix == "K" || suffix == "k") {
+			rv <<= 10;
+		} else if (suffix == "M" || suffix == "m") {
+			rv <<= 20;
+		} else if (suffix == "G" || suffix == "g") {
+			rv <<= 30;
+		} else if (!suffix.empty()) {
+			THROW_ERROR(invalid_argument, "unknown size suffix in '" << s << "'");
+		}
+		THROW_CHECK1(invalid_argument, rv, rv > 0 && (rv % BLOCK_SIZE_HASHTAB_EXTENT) == 0);
+		return rv;
+	}
+
+	vector<off_t>
+	parse_size_list(const string &s)
+	{
+		vector<off_t> rv;
+		istringstream iss(s);
+		string word;
+		while (getline(iss, word, ',')) {
+			rv.push_back(parse_size(word));
+		}
+		THROW_CHECK1(invalid_argument, s, !rv.empty());
+		return rv;
+	}
+
+	void
+	replay_usage(const char *argv0)
+	{
+		cerr << "Usage: " << argv0 << " [options] TRACE\n"
+			<< "    -s, --size LIST          Comma-separated hash table sizes (K/M/G suffix, default 64M)\n"
+			<< "    -A, --anonymize FILE     Write an anonymized copy of TRACE to FILE instead of replaying\n"
+			<< "    -D, --dir DIR            Parent of the scratch BEESHOME (default $TMPDIR or /tmp)\n"
+			<< "    -v, --verbose LEVEL      bees log level (default " << LOG_WARNING << ")\n";
+	}
+
+	void
+	remove_scratch(const string &dir)
+	{
+		for (auto name : { "beeshash.dat", "beeshash.dat.tmp", "beeshash.algo", "beeshash.algo.tmp",
+			"beeshash.ckpt", "beeshash.ckpt.tmp", "beesstats.txt", "beesstats.txt.tmp" }) {
+			unlink((dir + "/" + name).c_str());
+		}
+		rmdir(dir.c_str());
+	}
+
+}
+
+int
+main(int argc, char *argv[])
+{
+	BeesNote::set_name("replay");
+	bees_log_level = LOG_WARNING;
+
+	ReplayConfig config;
+	const char *tmpdir = getenv("TMPDIR");
+	config.m_dir = tmpdir ? tmpdir : "/tmp";
+
+	static const struct option long_options[] = {
+		{ "anonymize",   required_argument, NULL, 'A' },
+		{ "dir",         required_argument, NULL, 'D' },
+		{ "help",        no_argument,       NULL, 'h' },
+		{ "size",        required_argument, NULL, 's' },
+		{ "verbose",     required_argument, NULL, 'v' },
+		{ 0, 0, 0, 0 },
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "A:D:hs:v:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'A': config.m_anonymize = optarg; break;
+			case 'D': config.m_dir = optarg; break;
+			case 's': config.m_sizes = parse_size_list(optarg); break;
+			case 'v': bees_log_level = stoul(optarg); break;
+			case 'h':
+			default:
+				replay_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		replay_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const string trace = argv[optind];
+
+	int rv = EXIT_FAILURE;
+	if (!config.m_anonymize.empty()) {
+		catch_all([&]() {
+			anonymize_trace(trace, config.m_anonymize);
+			rv = EXIT_SUCCESS;
+		});
+		return rv;
+	}
+
+	cout << setw(10) << "size" << setw(10) << "extents" << setw(12) << "blocks"
+		<< setw(9) << "found%" << setw(12) << "matched" << setw(12) << "dedupe_MB"
+		<< setw(11) << "erased" << setw(12) << "inserted" << setw(8) << "toxic"
+		<< setw(9) << "sec" << setw(12) << "blocks/s" << endl;
+	for (const auto size : config.m_sizes) {
+		string scratch = config.m_dir + "/bees-replay.XXXXXX";
+		DIE_IF_ZERO(mkdtemp(&scratch[0]));
+		setenv("BEESHOME", scratch.c_str(), 1);
+
+		rv = EXIT_FAILURE;
+		catch_all([&]() {
+			// No root path:  BEESHOME is absolute, and the scratch dir need not be btrfs
+			auto bc = make_shared<BeesContext>();
+			bc->set_hash_table_size(size);
+			bc->set_hash_table_memory(BeesHashTable::MEM_THP);
+			auto hash_table = bc->hash_table();
+
+			Timer replay_timer;
+			const auto stats = replay_trace(*hash_table, trace);
+			const double replay_time = max(replay_timer.age(), 0.001);
+
+			cout << setw(10) << pretty(size) << setw(10) << stats.m_extents << setw(12) << stats.m_blocks
+				<< setw(9) << fixed << setprecision(1) << (stats.m_lookups ? 100.0 * stats.m_found / stats.m_lookups : 0.0)
+				<< setw(12) << stats.m_matched
+				<< setw(12) << setprecision(1) << stats.m_dedupe_bytes / 1048576.0
+				<< setw(11) << stats.m_erased << setw(12) << stats.m_inserted << setw(8) << stats.m_toxic
+				<< setw(9) << setprecision(3) << replay_time
+				<< setw(12) << setprecision(0) << stats.m_blocks / replay_time << endl;
+
+			hash_table->stop_request();
+			hash_table->stop_wait();
+			rv = EXIT_SUCCESS;
+		});
+
+		remove_scratch(scratch);
+		if (rv != EXIT_SUCCESS) {
+			break;
+		}
+	}
+	return rv;
+}
@@ -3,9 +3,74 @@
 #include "crucible/limits.h"
 #include "crucible/string.h"
 
+#include <algorithm>
+
 using namespace crucible;
 using namespace std;
 
+/// Opens files and reads blocks for the next few refs on other workers,
+/// so the serial chase loop finds them in the FD and page caches.
+/// Prefetches not started yet are abandoned when this is destroyed.
+class BeesRefPrefetch {
+	shared_ptr<BeesContext>		m_ctx;
+	BeesInodeOffsetRoots		m_biors;
+	size_t				m_length;
+	shared_ptr<atomic<bool>>	m_stop;
+	size_t				m_next = 0;
+public:
+	BeesRefPrefetch(const shared_ptr<BeesContext> &ctx, const BeesInodeOffsetRoots &biors, size_t length);
+	~BeesRefPrefetch();
+	void advance(size_t pos);
+};
+
+BeesRefPrefetch::BeesRefPrefetch(const shared_ptr<BeesContext> &ctx, const BeesInodeOffsetRoots &biors, size_t length) :
+	m_ctx(ctx),
+	m_biors(biors),
+	m_length(length),
+	m_stop(make_shared<atomic<bool>>(false))
+{
+	// A single ref has nothing to overlap with
+	if (m_biors->size() < 2) {
+		m_next = m_biors->size();
+	}
+}
+
+BeesRefPrefetch::~BeesRefPrefetch()
+{
+	*m_stop = true;
+}
+
+void
+BeesRefPrefetch::advance(size_t pos)
+{
+	// Ref pos is being chased now, so start on the ones after it
+	m_next = max(m_next, pos + 1);
+	while (m_next < m_biors->size() && m_next <= pos + BEES_RESOLVE_PREFETCH_REFS) {
+		const auto bior = (*m_biors)[m_next++];
+		const auto ctx = m_ctx;
+		const auto stop = m_stop;
+		const auto length = m_length;
+		Task("resolve_prefetch", [ctx, bior, stop, length]() {
+			if (*stop) {
+				BEESCOUNT(resolve_prefetch_skip);
+				return;
+			}
+			BEESNOTE("prefetching ref " << bior);
+			catch_all([&]() {
+				if (ctx->roots()->is_file_excluded(BeesFileId(bior.m_root, bior.m_inum))) {
+					return;
+				}
+				const Fd fd = ctx->roots()->open_root_ino(bior.m_root, bior.m_inum);
+				if (!fd || *stop) {
+					return;
+				}
+				bees_readahead(fd, bior.m_offset, length);
+				BEESCOUNT(resolve_prefetch);
+			});
+		}).run();
+	}
+}
+
 BeesAddress
 BeesResolver::addr(BeesAddress new_addr)
 {
@@ -15,15 +80,16 @@ BeesResolver::addr(BeesAddress new_addr)
 	m_found_dup = false;
 	m_found_hash = false;
 	m_wrong_data = false;
-	m_biors.clear();
 	m_ranges.clear();
+	m_no_fd_files.clear();
+	m_no_fd_roots.clear();
 	m_addr = new_addr;
 	m_bior_count = 0;
 
 	auto rv = m_ctx->resolve_addr(m_addr);
 	m_biors = rv.m_biors;
 	m_is_toxic = rv.m_is_toxic;
-	m_bior_count = m_biors.size();
+	m_bior_count = m_biors->size();
 
 	return m_addr;
 }
@@ -120,6 +186,8 @@ BeesResolver::adjust_offset(const BeesFileRange &haystack, const BeesBlockData &
 		}
 		haystack_offset = e.begin() + coff;
 		BEESCOUNT(adjust_offset_hit);
+		// Later blocks of the chase are likely in the same extent
+		BeesExtentBufferScope::read_extent(haystack.fd(), e);
 		is_compressed_offset = true;
 	} else {
 		BEESCOUNT(adjust_exact);
@@ -188,6 +256,10 @@ BeesResolver::chase_extent_ref(const BtrfsInodeOffsetRoot &bior, BeesBlockData &
 		// Deleted snapshots generate craptons of these
 		// BEESLOGDEBUG("No FD in chase_extent_ref " << bior);
 		BEESCOUNT(chase_no_fd);
+		m_no_fd_files.insert(BeesFileId(bior.m_root, bior.m_inum));
+		if (!m_ctx->roots()->open_root(bior.m_root)) {
+			m_no_fd_roots.insert(bior.m_root);
+		}
 		return BeesFileRange();
 	}
 
@@ -255,8 +327,22 @@ BeesResolver::chase_extent_ref(const BtrfsInodeOffsetRoot &bior, BeesBlockData &
 	return dst_bfr;
 }
 
+/// True if bfr starts at the start of an extent and ends at the end of
+/// an extent (or EOF), so a dedupe over it splits no extent in the file
+static
+bool
+covers_whole_extents(const shared_ptr<BeesContext> &ctx, const BeesFileRange &bfr)
+{
+	BtrfsExtentWalker ew(bfr.fd(), bfr.begin(), ctx->root_fd());
+	if (ew.current().begin() != bfr.begin()) {
+		return false;
+	}
+	ew.seek(bfr.end() - 1);
+	return bfr.end() >= min(ew.current().end(), bfr.file_size());
+}
+
 void
-BeesResolver::replace_src(const BeesFileRange &src_bfr)
+BeesResolver::replace_src(const BeesFileRange &src_bfr, bool whole_dst_only)
 {
 	BEESTRACE("replace_src src_bfr " << src_bfr);
 	THROW_CHECK0(runtime_error, !m_is_toxic);
@@ -270,6 +356,7 @@ BeesResolver::replace_src(const BeesFileRange &src_bfr)
 
 	BeesBlockData bbd(i_bfr);
 
+	vector<BeesRangePair> brps;
 	for_each_extent_ref(bbd, [&](const BeesFileRange &j) -> bool {
 		// Open dst
 		auto j_bfr = j;
@@ -294,37 +381,92 @@ BeesResolver::replace_src(const BeesFileRange &src_bfr)
 			BEESCOUNT(replacesrc_grown);
 		}
 
-		// Dedup
-		BEESNOTE("dedup " << brp);
-		if (m_ctx->dedup(brp)) {
-			BEESCOUNT(replacesrc_dedup_hit);
-			m_found_dup = true;
-		} else {
-			BEESCOUNT(replacesrc_dedup_miss);
+		// Nothing rewrites the rest of a dst extent that is only partly
+		// replaced, so that dedupe would free nothing
+		if (whole_dst_only) {
+			bool whole_dst = false;
+			catch_all([&]() {
+				whole_dst = covers_whole_extents(m_ctx, brp.second);
+			});
+			if (!whole_dst) {
+				BEESCOUNT(replacesrc_partial);
+				return false; // i.e. continue
+			}
 		}
+
+		// Dedup later, batched with other dst for the same src range
+		brps.push_back(brp);
 		return false; // i.e. continue
 	});
+
+	// Growing can move the src range, so group dst by the grown src range.
+	// Each group goes to the kernel as one multi-destination dedupe.
+	map<pair<off_t, off_t>, vector<BeesRangePair>> groups;
+	for (const auto &brp : brps) {
+		groups[make_pair(brp.first.begin(), brp.first.end())].push_back(brp);
+	}
+
+	for (const auto &group : groups) {
+		BEESNOTE("dedup " << group.second.size() << " dst for src " << group.second.front().first);
+		vector<bool> results;
+		if (group.second.size() == 1) {
+			results.push_back(m_ctx->dedup(group.second.front()));
+		} else {
+			results = m_ctx->dedup(group.second);
+		}
+		for (const auto result : results) {
+			if (result) {
+				BEESCOUNT(replacesrc_dedup_hit);
+				m_found_dup = true;
+			} else {
+				BEESCOUNT(replacesrc_dedup_miss);
+			}
+		}
+	}
+}
+
+bool
+BeesResolver::skip_extent_ref(const BtrfsInodeOffsetRoot &bior)
+{
+	// Silently ignore blacklisted files, e.g. BeesTempFile files
+	BeesFileId this_fid(bior.m_root, bior.m_inum);
+	if (m_ctx->is_blacklisted(this_fid)) {
+		return true;
+	}
+
+	// Files excluded by filters are never read, as dst or src
+	if (m_ctx->roots()->is_file_excluded(this_fid)) {
+		BEESCOUNT(chase_skip_filtered);
+		return true;
+	}
+
+	// A deleted snapshot or file fails the same way for all of its refs
+	if (m_no_fd_roots.count(bior.m_root) || m_no_fd_files.count(this_fid)) {
+		BEESCOUNT(chase_skip_no_fd);
+		return true;
+	}
+	return false;
 }
 
 void
 BeesResolver::find_matches(bool just_one, BeesBlockData &bbd)
 {
 	// Walk through the (ino, offset, root) tuples until we find a match.
-	BEESTRACE("finding all matches for " << bbd << " at " << m_addr << ": " << m_biors.size() << " found");
+	BEESTRACE("finding all matches for " << bbd << " at " << m_addr << ": " << m_biors->size() << " found");
 	THROW_CHECK0(runtime_error, !m_is_toxic);
 	bool stop_now = false;
-	for (auto ino_off_root : m_biors) {
+	BeesRefPrefetch prefetch(m_ctx, m_biors, bbd.size());
+	for (size_t i = 0; i < m_biors->size(); ++i) {
+		const auto &ino_off_root = (*m_biors)[i];
 		if (m_wrong_data) {
 			return;
 		}
 
 		BEESTRACE("ino_off_root " << ino_off_root);
-		BeesFileId this_fid(ino_off_root.m_root, ino_off_root.m_inum);
-
-		// Silently ignore blacklisted files, e.g. BeesTempFile files
-		if (m_ctx->is_blacklisted(this_fid)) {
+		if (skip_extent_ref(ino_off_root)) {
 			continue;
 		}
+		prefetch.advance(i);
 
 		// Look at the old data
 		catch_all([&]() {
@@ -346,17 +488,17 @@ bool
 BeesResolver::for_each_extent_ref(BeesBlockData bbd, function<bool(const BeesFileRange &bfr)> visitor)
 {
 	// Walk through the (ino, offset, root) tuples until we are told to stop
-	BEESTRACE("for_each_extent_ref " << bbd << " at " << m_addr << ": " << m_biors.size() << " found");
+	BEESTRACE("for_each_extent_ref " << bbd << " at " << m_addr << ": " << m_biors->size() << " found");
 	THROW_CHECK0(runtime_error, !m_is_toxic);
 	bool stop_now = false;
-	for (auto ino_off_root : m_biors) {
+	BeesRefPrefetch prefetch(m_ctx, m_biors, bbd.size());
+	for (size_t i = 0; i < m_biors->size(); ++i) {
+		const auto &ino_off_root = (*m_biors)[i];
 		BEESTRACE("ino_off_root " << ino_off_root);
-		BeesFileId this_fid(ino_off_root.m_root, ino_off_root.m_inum);
-
-		// Silently ignore blacklisted files, e.g. BeesTempFile files
-		if (m_ctx->is_blacklisted(this_fid)) {
+		if (skip_extent_ref(ino_off_root)) {
 			continue;
 		}
+		prefetch.advance(i);
 
 		// Look at the old data
 		// FIXME:  propagate exceptions for now.  Proper fix requires a rewrite.
@@ -384,6 +526,25 @@ BeesResolver::for_each_extent_ref(BeesBlockData bbd, function<bool(const BeesFil
 	return stop_now;
 }
 
+bool
+BeesResolver::DstScore::operator<(const DstScore &that) const
+{
+	return tie(m_whole_dst, m_size, m_whole_src) < tie(that.m_whole_dst, that.m_size, that.m_whole_src);
+}
+
+BeesResolver::DstScore
+BeesResolver::dst_score(const BeesRangePair &brp)
+{
+	BEESNOTE("scoring " << brp);
+	DstScore rv;
+	rv.m_size = brp.second.size();
+	catch_all([&]() {
+		rv.m_whole_dst = covers_whole_extents(m_ctx, brp.second);
+		rv.m_whole_src = covers_whole_extents(m_ctx, brp.first);
+	});
+	return rv;
+}
+
 BeesFileRange
 BeesResolver::replace_dst(const BeesFileRange &dst_bfr_in)
 {
@@ -401,6 +562,10 @@ BeesResolver::replace_dst(const BeesFileRange &dst_bfr_in)
 
 	BeesBlockData bbd(dst_bfr);
 
+	// Grow a few candidates first, then dedupe the one that leaves the
+	// fewest and longest extents in dst.  Refs in different files have
+	// different neighbouring data, so they grow to different lengths.
+	vector<pair<DstScore, BeesRangePair>> candidates;
 	for_each_extent_ref(bbd, [&](const BeesFileRange &src_bfr_in) -> bool {
 		// Open src
 		BEESNOTE("Opening src bfr " << src_bfr_in);
@@ -436,19 +601,42 @@ BeesResolver::replace_dst(const BeesFileRange &dst_bfr_in)
 			BEESCOUNT(replacedst_grown);
 		}
 
+		const auto score = dst_score(brp);
+		candidates.push_back(make_pair(score, brp));
+		// Nothing can do better than whole extents on both sides
+		return (score.m_whole_dst && score.m_whole_src) || candidates.size() >= BEES_DEDUPE_CANDIDATES_MAX;
+	});
+
+	// Best first
+	stable_sort(candidates.begin(), candidates.end(), [](const pair<DstScore, BeesRangePair> &a, const pair<DstScore, BeesRangePair> &b) {
+		return b.first < a.first;
+	});
+	BEESCOUNTADD(replacedst_candidate, candidates.size());
+
+	const off_t min_dedupe_size = m_ctx->min_dedupe_size();
+	for (const auto &candidate : candidates) {
+		const auto &brp = candidate.second;
+		// Short partial dedupes free little space and fragment dst.
+		// Whole extents can be replaced at any size.
+		if (candidate.first.m_size < min_dedupe_size && !candidate.first.m_whole_dst) {
+			BEESCOUNT(replacedst_short);
+			continue;
+		}
+
 		// Dedup
 		BEESNOTE("dedup " << brp);
 		if (m_ctx->dedup(brp)) {
 			BEESCOUNT(replacedst_dedup_hit);
+			if (candidate.first.m_whole_dst) {
+				BEESCOUNT(replacedst_whole_dst);
+			}
 			m_found_dup = true;
 			overlap_bfr = brp.second;
-			// FIXME:  find best range first, then dedupe that
-			return true; // i.e. break
+			break;
 		} else {
 			BEESCOUNT(replacedst_dedup_miss);
-			return false; // i.e. continue
 		}
-	});
+	}
 	// BEESLOG("overlap_bfr after " << overlap_bfr);
 	return overlap_bfr.copy_closed();
 }
@@ -2,6 +2,8 @@
 
 #include "crucible/btrfs-tree.h"
 #include "crucible/cache.h"
+#include "crucible/cleanup.h"
+#include "crucible/crc64.h"
 #include "crucible/ntoa.h"
 #include "crucible/string.h"
 #include "crucible/task.h"
@@ -10,6 +12,9 @@
 #include <fstream>
 #include <tuple>
 
+#include <poll.h>
+#include <sys/fanotify.h>
+
 using namespace crucible;
 using namespace std;
 
@@ -53,7 +58,10 @@ BeesCrawlState::operator<(const BeesCrawlState &that) const
 class BeesScanMode {
 protected:
 	shared_ptr<BeesRoots>	m_roots;
-	bool crawl_batch(const shared_ptr<BeesCrawl>& crawl);
+	bool crawl_batch(const shared_ptr<BeesCrawl>& crawl, const shared_ptr<Cleanup> &budget = shared_ptr<Cleanup>());
+	shared_ptr<BeesContext> ctx() const;
+	uint64_t transid_max();
+	void crawl_state_set_dirty();
 public:
 	virtual ~BeesScanMode() {}
 	BeesScanMode(const shared_ptr<BeesRoots>& roots) : m_roots(roots) {}
@@ -61,12 +69,35 @@ public:
 	using CrawlMap = decltype(BeesRoots::m_root_crawl_map);
 	virtual void next_transid(const CrawlMap &crawl_map) = 0;
 	virtual const char *ntoa() const = 0;
+	/// Scan modes that keep their own crawl state save and load it here
+	virtual void state_to_stream(ostream &) {}
+	virtual void state_load(const BeesCrawlState &) {}
+	/// Same state for the crawl journal, returns false if there is none
+	virtual bool state_get(BeesCrawlState &) { return false; }
 };
 
 bool
-BeesScanMode::crawl_batch(const shared_ptr<BeesCrawl>& crawl)
+BeesScanMode::crawl_batch(const shared_ptr<BeesCrawl>& crawl, const shared_ptr<Cleanup> &budget)
+{
+	return m_roots->crawl_batch(crawl, budget);
+}
+
+shared_ptr<BeesContext>
+BeesScanMode::ctx() const
+{
+	return m_roots->m_ctx;
+}
+
+uint64_t
+BeesScanMode::transid_max()
 {
-	return m_roots->crawl_batch(crawl);
+	return m_roots->transid_max();
+}
+
+void
+BeesScanMode::crawl_state_set_dirty()
+{
+	m_roots->crawl_state_set_dirty();
 }
 
 /// Scan the same inode/offset tuple in each subvol.  Good for caching and space saving,
@@ -336,6 +367,444 @@ BeesScanModeRecent::next_transid(const CrawlMap &crawl_map)
 	swap(m_sorted, new_map);
 }
 
+/// Scan each subvol with its own producer Task, so tree searches in many
+/// subvols run at the same time.  A global budget limits the number of
+/// files being crawled at once.  Good for filesystems with thousands of subvols.
+class BeesScanModeParallel : public BeesScanMode, public enable_shared_from_this<BeesScanModeParallel> {
+	mutex					m_mutex;
+	shared_ptr<CrawlMap>			m_crawl_map;
+	/// Subvols with a running or waiting producer Task
+	set<uint64_t>				m_producers;
+	/// Producers waiting for a file crawl to finish
+	deque<Task>				m_waiting;
+	size_t					m_in_flight = 0;
+
+	void produce(const shared_ptr<BeesCrawl> &crawl);
+	void release();
+public:
+	using BeesScanMode::BeesScanMode;
+	~BeesScanModeParallel() override {}
+	bool scan() override;
+	void next_transid(const CrawlMap &crawl_map) override;
+	const char *ntoa() const override;
+};
+
+const char *
+BeesScanModeParallel::ntoa() const
+{
+	return "PARALLEL";
+}
+
+void
+BeesScanModeParallel::release()
+{
+	unique_lock<mutex> lock(m_mutex);
+	THROW_CHECK0(runtime_error, m_in_flight > 0);
+	--m_in_flight;
+	if (!m_waiting.empty()) {
+		const auto next_producer = m_waiting.front();
+		m_waiting.pop_front();
+		next_producer.run();
+	}
+}
+
+void
+BeesScanModeParallel::produce(const shared_ptr<BeesCrawl> &crawl)
+{
+	const auto root = crawl->get_state_end().m_root;
+	unique_lock<mutex> lock(m_mutex);
+	if (m_in_flight >= BEES_CRAWL_PARALLEL_FILES) {
+		// release will run us again
+		m_waiting.push_back(Task::current_task());
+		BEESCOUNT(crawl_parallel_wait);
+		return;
+	}
+	++m_in_flight;
+	lock.unlock();
+
+	// The budget is returned when the file crawl is done with it, or here if there was no file
+	const auto self = shared_from_this();
+	const auto budget = make_shared<Cleanup>([self]() {
+		self->release();
+	});
+	bool more = false;
+	catch_all([&]() {
+		more = crawl_batch(crawl, budget);
+	});
+	if (more) {
+		// Queued behind the file crawl Task, so other subvols get their turn
+		Task::current_task().run();
+		return;
+	}
+
+	lock.lock();
+	m_producers.erase(root);
+	if (m_producers.empty()) {
+		BEESLOGINFO("Parallel crawl ran out of data");
+	}
+}
+
+bool
+BeesScanModeParallel::scan()
+{
+	unique_lock<mutex> lock(m_mutex);
+	const auto hold_crawl_map = m_crawl_map;
+	if (!hold_crawl_map) {
+		BEESLOGINFO("called Parallel scan without a crawl map");
+		return false;
+	}
+	m_crawl_map.reset();
+
+	// Start a producer for each subvol with new data that doesn't have one
+	const auto self = shared_from_this();
+	for (const auto &i : *hold_crawl_map) {
+		const auto this_crawl = i.second;
+		if (!this_crawl->peek_front() || m_producers.count(i.first)) {
+			continue;
+		}
+		m_producers.insert(i.first);
+		Task("crawl_more_" + to_string(i.first), [self, this_crawl]() {
+			self->produce(this_crawl);
+		}).run();
+		BEESCOUNT(crawl_parallel_start);
+	}
+
+	// The producers do the rest
+	return false;
+}
+
+void
+BeesScanModeParallel::next_transid(const CrawlMap &crawl_map)
+{
+	auto new_crawl_map = make_shared<CrawlMap>(crawl_map);
+	unique_lock<mutex> lock(m_mutex);
+	swap(m_crawl_map, new_crawl_map);
+}
+
+/// Scan the subvol whose next extent should free the most space first.
+/// Large uncompressed extents, old extents, and subvols that had many
+/// dedupe hits score higher.  Subvols still scan files in inode order.
+class BeesScanModePriority : public BeesScanMode {
+	using Map = multimap<double, CrawlMap::mapped_type, greater<double>>;
+	mutex m_mutex;
+	shared_ptr<Map> m_sorted;
+	bool score(const CrawlMap::mapped_type &crawl, double &rv);
+public:
+	using BeesScanMode::BeesScanMode;
+	~BeesScanModePriority() override {}
+	bool scan() override;
+	void next_transid(const CrawlMap &crawl_map) override;
+	const char *ntoa() const override;
+};
+
+const char *
+BeesScanModePriority::ntoa() const
+{
+	return "PRIORITY";
+}
+
+bool
+BeesScanModePriority::score(const CrawlMap::mapped_type &crawl, double &rv)
+{
+	const auto bti = crawl->peek_front_item();
+	if (!bti) {
+		return false;
+	}
+	// Space freed by a dedupe is at most the space the extent uses on disk.
+	// Holes and inline extents free nothing, but still have to be crawled past.
+	const auto type = bti.file_extent_type();
+	double bytes = 0;
+	if (type != BTRFS_FILE_EXTENT_INLINE && bti.file_extent_bytenr()) {
+		bytes = bti.file_extent_disk_bytes();
+	}
+	// Old data has survived longer, so it is less likely to be deleted soon
+	const auto gen = bti.file_extent_generation();
+	const auto max_transid = transid_max();
+	const double age = log2(2.0 + (max_transid > gen ? max_transid - gen : 0));
+	rv = bytes * age * crawl->hit_rate();
+	return true;
+}
+
+bool
+BeesScanModePriority::scan()
+{
+	unique_lock<mutex> lock(m_mutex);
+	const auto hold_sorted = m_sorted;
+	lock.unlock();
+	if (!hold_sorted) {
+		BEESLOGINFO("called Priority scan without a sorted map");
+		return false;
+	}
+	auto &sorted = *hold_sorted;
+	while (!sorted.empty()) {
+		const auto this_crawl = sorted.begin()->second;
+		sorted.erase(sorted.begin());
+		const bool rv = crawl_batch(this_crawl);
+		if (rv) {
+			// The next extent in this subvol gets a new score
+			double new_score;
+			if (score(this_crawl, new_score)) {
+				sorted.insert(make_pair(new_score, this_crawl));
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+BeesScanModePriority::next_transid(const CrawlMap &crawl_map)
+{
+	auto new_map = make_shared<Map>();
+	for (const auto &i : crawl_map) {
+		double new_score;
+		if (score(i.second, new_score)) {
+			new_map->insert(make_pair(new_score, i.second));
+		}
+	}
+	unique_lock<mutex> lock(m_mutex);
+	swap(m_sorted, new_map);
+}
+
+/// Scan the extent tree in bytenr order instead of scanning subvols.
+/// Each physical extent is scanned once through one of its references,
+/// no matter how many subvols (e.g. snapshots) refer to it.
+/// Crawl state is a single bytenr position and transid range.
+class BeesScanModeExtent : public BeesScanMode {
+	mutex					m_mutex;
+	// m_objectid is the next bytenr to fetch
+	BeesCrawlState				m_state;
+	ProgressTracker<BeesCrawlState>		m_progress;
+	BtrfsExtentItemFetcher			m_fetcher;
+	bool					m_finished = false;
+
+	void start_pass(const BeesCrawlState &bcs);
+	static void scan_one_extent(const shared_ptr<BeesContext> &ctx, uint64_t bytenr, uint64_t length, uint64_t gen);
+public:
+	BeesScanModeExtent(const shared_ptr<BeesRoots> &roots);
+	~BeesScanModeExtent() override {}
+	bool scan() override;
+	void next_transid(const CrawlMap &crawl_map) override;
+	const char *ntoa() const override;
+	void state_to_stream(ostream &os) override;
+	void state_load(const BeesCrawlState &bcs) override;
+	bool state_get(BeesCrawlState &bcs) override;
+};
+
+BeesScanModeExtent::BeesScanModeExtent(const shared_ptr<BeesRoots> &roots) :
+	BeesScanMode(roots),
+	m_progress(BeesCrawlState()),
+	m_fetcher(ctx()->root_fd())
+{
+	m_state.m_root = BTRFS_EXTENT_TREE_OBJECTID;
+	// Don't fetch anything until we have a transid range
+	m_finished = true;
+}
+
+const char *
+BeesScanModeExtent::ntoa() const
+{
+	return "EXTENT";
+}
+
+void
+BeesScanModeExtent::start_pass(const BeesCrawlState &bcs)
+{
+	// Must be called with m_mutex held
+	m_state = bcs;
+	m_state.m_root = BTRFS_EXTENT_TREE_OBJECTID;
+	m_progress = ProgressTracker<BeesCrawlState>(m_state);
+	m_fetcher.transid(m_state.m_min_transid);
+	m_finished = false;
+	BEESLOGINFO("Extent scan starting at " << to_hex(m_state.m_objectid) << " transid " << m_state.m_min_transid << ".." << m_state.m_max_transid);
+}
+
+void
+BeesScanModeExtent::state_load(const BeesCrawlState &bcs)
+{
+	unique_lock<mutex> lock(m_mutex);
+	start_pass(bcs);
+}
+
+void
+BeesScanModeExtent::state_to_stream(ostream &ofs)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (!m_state.m_max_transid) {
+		return;
+	}
+	const auto bcs = m_progress.begin();
+	ofs << "extent_bytenr " << bcs.m_objectid          << " ";
+	ofs << "min_transid "   << bcs.m_min_transid       << " ";
+	ofs << "max_transid "   << bcs.m_max_transid       << " ";
+	ofs << "started "       << bcs.m_started           << " ";
+	ofs << "start_ts "      << format_time(bcs.m_started) << "\n";
+}
+
+bool
+BeesScanModeExtent::state_get(BeesCrawlState &bcs)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (!m_state.m_max_transid) {
+		return false;
+	}
+	bcs = m_progress.begin();
+	return true;
+}
+
+void
+BeesScanModeExtent::next_transid(const CrawlMap &)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (!m_finished) {
+		return;
+	}
+	BeesCrawlState new_bcs;
+	// Start the next pass where the last one ended, or from the beginning
+	new_bcs.m_min_transid = m_state.m_max_transid;
+	new_bcs.m_max_transid = transid_max();
+	if (new_bcs.m_max_transid <= new_bcs.m_min_transid) {
+		return;
+	}
+	start_pass(new_bcs);
+	lock.unlock();
+	crawl_state_set_dirty();
+}
+
+bool
+BeesScanModeExtent::scan()
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (m_finished) {
+		return false;
+	}
+
+	BEESNOTE("fetching extent item at " << to_hex(m_state.m_objectid));
+	BtrfsTreeItem bti;
+	{
+		BEESPHASE(search);
+		bti = m_fetcher.lower_bound(m_state.m_objectid);
+	}
+	if (!bti) {
+		BEESLOGINFO("Extent scan finished transid " << m_state.m_min_transid << ".." << m_state.m_max_transid);
+		m_finished = true;
+		return false;
+	}
+
+	// Make sure we advance
+	m_state.m_objectid = max(bti.extent_end(), m_state.m_objectid + 1);
+
+	if (!(bti.extent_flags() & BTRFS_EXTENT_FLAG_DATA)) {
+		BEESCOUNT(crawl_extent_tree_block);
+		return true;
+	}
+
+	const auto gen = bti.extent_generation();
+	if (gen < m_state.m_min_transid) {
+		BEESCOUNT(crawl_gen_low);
+		return true;
+	}
+	if (gen > m_state.m_max_transid) {
+		BEESCOUNT(crawl_gen_high);
+		return true;
+	}
+
+	const auto bytenr = bti.extent_begin();
+	const auto length = bti.extent_end() - bti.extent_begin();
+	const auto hold = m_progress.hold(m_state);
+	lock.unlock();
+
+	crawl_state_set_dirty();
+
+	const auto shared_ctx = ctx();
+	Task("extent_" + to_hex(bytenr), [shared_ctx, bytenr, length, gen, hold]() {
+		const auto share = shared_ctx->share()->start();
+		if (!share) {
+			return;
+		}
+		BEESNOTE("scanning extent " << to_hex(bytenr) << " length " << pretty(length));
+		scan_one_extent(shared_ctx, bytenr, length, gen);
+	}).run();
+	BEESCOUNT(crawl_extent);
+	return true;
+}
+
+void
+BeesScanModeExtent::scan_one_extent(const shared_ptr<BeesContext> &ctx, uint64_t bytenr, uint64_t length, uint64_t gen)
+{
+	BEESTRACE("extent scan " << to_hex(bytenr) << " length " << pretty(length));
+	// All refs of a compressed extent share one decompressed read
+	BeesExtentBufferScope extent_buffers;
+	const auto rar = ctx->resolve_addr(BeesAddress(bytenr));
+	if (rar.is_toxic()) {
+		BEESCOUNT(crawl_extent_toxic);
+		return;
+	}
+
+	// Any reference will do, so take the first one we can open.
+	// Refs in read-only subvols are only scanned as dedupe sources, so
+	// they are used only when the extent has no read-write ref.
+	const auto scan_first_ref = [&](const BeesResolveAddrResult &refs) -> bool {
+		bool have_rw_ref = !ctx->roots()->ro_sources();
+		if (!have_rw_ref) {
+			for (const auto &bior : refs.biors()) {
+				if (!ctx->roots()->is_root_ro(bior.m_root)) {
+					have_rw_ref = true;
+					break;
+				}
+			}
+		}
+		for (const auto &bior : refs.biors()) {
+			if (have_rw_ref && ctx->roots()->is_root_ro(bior.m_root)) {
+				BEESCOUNT(crawl_extent_ro);
+				continue;
+			}
+			if (ctx->roots()->is_file_excluded(BeesFileId(bior.m_root, bior.m_inum))) {
+				BEESCOUNT(crawl_extent_filtered);
+				continue;
+			}
+			// The extent was scanned through this ref after its file was closed
+			if (ctx->roots()->realtime_scanned(BeesFileId(bior.m_root, bior.m_inum), gen)) {
+				BEESCOUNT(realtime_skip);
+				return true;
+			}
+			if (!ctx->roots()->open_root_ino(bior.m_root, bior.m_inum)) {
+				continue;
+			}
+			const BeesFileRange bfr(BeesFileId(bior.m_root, bior.m_inum), bior.m_offset, bior.m_offset + length);
+			BEESCOUNT(crawl_push);
+			bool scan_again = false;
+			catch_all([&]() {
+				BEESNOTE("scan_forward " << bfr);
+				scan_again = ctx->scan_forward(bfr);
+			});
+			if (scan_again) {
+				// Another Task has the extent or inode locked, try again later
+				BEESCOUNT(crawl_again);
+				Task::current_task().run();
+			}
+			return true;
+		}
+		return false;
+	};
+	if (scan_first_ref(rar)) {
+		return;
+	}
+
+	// The first block of the extent may no longer be referenced,
+	// but refs to the rest of the extent can still be scanned
+	if (!rar.biors().empty()) {
+		BEESCOUNT(crawl_extent_noref);
+		return;
+	}
+	const auto all_refs = ctx->resolve_extent_refs(bytenr);
+	if (!all_refs.is_toxic() && scan_first_ref(all_refs)) {
+		BEESCOUNT(crawl_extent_ignore_offset);
+		return;
+	}
+	BEESCOUNT(crawl_extent_noref);
+}
+
 void
 BeesRoots::set_scan_mode(ScanMode mode)
 {
@@ -358,6 +827,18 @@ BeesRoots::set_scan_mode(ScanMode mode)
 			m_scanner = make_shared<BeesScanModeRecent>(shared_from_this());
 			break;
 		}
+		case SCAN_MODE_EXTENT: {
+			m_scanner = make_shared<BeesScanModeExtent>(shared_from_this());
+			break;
+		}
+		case SCAN_MODE_PARALLEL: {
+			m_scanner = make_shared<BeesScanModeParallel>(shared_from_this());
+			break;
+		}
+		case SCAN_MODE_PRIORITY: {
+			m_scanner = make_shared<BeesScanModePriority>(shared_from_this());
+			break;
+		}
 		case SCAN_MODE_COUNT:
 		default:
 			assert(false);
@@ -377,6 +858,36 @@ BeesRoots::set_workaround_btrfs_send(bool do_avoid)
 	}
 }
 
+void
+BeesRoots::set_ro_sources(bool ro_sources)
+{
+	m_ro_sources = ro_sources;
+	if (m_ro_sources) {
+		BEESLOGINFO("WORKAROUND: read-only subvols will be scanned as dedupe sources");
+	}
+}
+
+bool
+BeesRoots::ro_sources() const
+{
+	return m_ro_sources;
+}
+
+void
+BeesRoots::set_min_extent_size(uint64_t min_extent_size)
+{
+	m_min_extent_size = min_extent_size;
+	if (m_min_extent_size) {
+		BEESLOGINFO("Skipping extent refs smaller than " << pretty(m_min_extent_size) << " in the middle of files");
+	}
+}
+
+uint64_t
+BeesRoots::min_extent_size() const
+{
+	return m_min_extent_size;
+}
+
 string
 BeesRoots::crawl_state_filename() const
 {
@@ -399,47 +910,300 @@ BeesRoots::state_to_stream(ostream &ofs)
 			ofs << "start_ts "    << format_time(ibcs.m_started) << "\n";
 		}
 	}
+	if (m_scanner) {
+		m_scanner->state_to_stream(ofs);
+	}
 	return ofs;
 }
 
+map<uint64_t, BeesCrawlState>
+BeesRoots::state_current()
+{
+	// Must be called with m_mutex held.
+	// Same states as state_to_stream, with the extent scan state under BTRFS_EXTENT_TREE_OBJECTID.
+	map<uint64_t, BeesCrawlState> rv;
+	for (const auto &i : m_root_crawl_map) {
+		const auto ibcs = i.second->get_state_begin();
+		if (ibcs.m_max_transid) {
+			rv[i.first] = ibcs;
+		}
+	}
+	BeesCrawlState scanner_bcs;
+	if (m_scanner && m_scanner->state_get(scanner_bcs)) {
+		rv[BTRFS_EXTENT_TREE_OBJECTID] = scanner_bcs;
+	}
+	return rv;
+}
+
+string
+BeesRoots::crawl_journal_filename() const
+{
+	return "beescrawl.jnl";
+}
+
+// beescrawl.jnl layout:  fixed-size records, each a crawl state that changed
+// or was erased since the last beescrawl.dat write.  Integers are in host byte
+// order.  The file is emptied when beescrawl.dat is written.
+
+static const char BEES_CRAWL_JOURNAL_MAGIC[4] = { 'b', 'c', 'j', '1' };
+
+enum : uint32_t {
+	BEES_CRAWL_JOURNAL_SET = 1,
+	BEES_CRAWL_JOURNAL_ERASE = 2,
+};
+
+struct BeesCrawlJournalRecord {
+	char		r_magic[4];
+	uint32_t	r_type;
+	uint64_t	r_root;
+	uint64_t	r_objectid;
+	uint64_t	r_offset;
+	uint64_t	r_min_transid;
+	uint64_t	r_max_transid;
+	uint64_t	r_started;
+	uint64_t	r_crc;
+} __attribute__((packed));
+
+static
+void
+crawl_journal_append(string &records, uint32_t type, const BeesCrawlState &bcs)
+{
+	BeesCrawlJournalRecord record;
+	memset(&record, 0, sizeof(record));
+	memcpy(record.r_magic, BEES_CRAWL_JOURNAL_MAGIC, sizeof(record.r_magic));
+	record.r_type = type;
+	record.r_root = bcs.m_root;
+	record.r_objectid = bcs.m_objectid;
+	record.r_offset = bcs.m_offset;
+	record.r_min_transid = bcs.m_min_transid;
+	record.r_max_transid = bcs.m_max_transid;
+	record.r_started = bcs.m_started;
+	record.r_crc = Digest::CRC::crc64(&record, offsetof(BeesCrawlJournalRecord, r_crc));
+	records.append(reinterpret_cast<const char *>(&record), sizeof(record));
+}
+
 void
-BeesRoots::state_save()
+BeesRoots::state_journal()
 {
-	BEESNOTE("saving crawl state");
-	BEESLOGINFO("Saving crawl state");
-	BEESTOOLONG("Saving crawl state");
+	BEESNOTE("journaling crawl state");
+	BEESTOOLONG("Journaling crawl state");
 
-	Timer save_time;
+	if (!m_crawl_journal_fd) {
+		return;
+	}
+
+	// Hash table entries for everything crawled so far must be written
+	// first.  The writeback thread writes them at its own rate, so the
+	// crawl states are set aside here until it has passed them, and the
+	// journal never makes the hash table flush early.  The table is only
+	// synced at checkpoints, so after a power failure (but not a bees
+	// crash) the journal may be ahead of the table by the kernel's dirty
+	// page writeback delay.
+	const auto hash_table = m_ctx->hash_table();
+	if (!m_crawl_journal_mark) {
+		unique_lock<mutex> lock(m_mutex);
+		if (m_crawl_journaled == m_crawl_dirty) {
+			return;
+		}
+		m_crawl_journal_pending = state_current();
+		m_crawl_journal_pending_dirty = m_crawl_dirty;
+		lock.unlock();
+		m_crawl_journal_mark = hash_table->writeback_mark();
+	}
+	if (!hash_table->written_back(m_crawl_journal_mark)) {
+		BEESCOUNT(crawl_journal_wait);
+		return;
+	}
+	m_crawl_journal_mark = 0;
+	const auto &states = m_crawl_journal_pending;
+
+	// Only the crawls that moved since the last save or journal write
+	string records;
+	for (const auto &i : states) {
+		const auto found = m_crawl_journal_states.find(i.first);
+		if (found == m_crawl_journal_states.end() || found->second < i.second || i.second < found->second) {
+			crawl_journal_append(records, BEES_CRAWL_JOURNAL_SET, i.second);
+		}
+	}
+	for (const auto &i : m_crawl_journal_states) {
+		if (!states.count(i.first)) {
+			crawl_journal_append(records, BEES_CRAWL_JOURNAL_ERASE, i.second);
+		}
+	}
+
+	if (!records.empty()) {
+		// Records are written over a torn write that threw an exception
+		pwrite_or_die(m_crawl_journal_fd, records, m_crawl_journal_size);
+		m_crawl_journal_size += records.size();
+		BEESCOUNTADD(crawl_journal_write, records.size() / sizeof(BeesCrawlJournalRecord));
+	}
+	m_crawl_journal_states = states;
 
 	unique_lock<mutex> lock(m_mutex);
+	m_crawl_journaled = max(m_crawl_journaled, m_crawl_journal_pending_dirty);
+}
 
-	// We don't have ofstreamat or ofdstream in C++11, so we're building a string and writing it with raw syscalls.
-	ostringstream ofs;
+void
+BeesRoots::state_journal_replay(map<uint64_t, BeesCrawlState> &states)
+{
+	BEESNOTE("replaying crawl journal");
 
-	if (m_crawl_clean == m_crawl_dirty) {
-		BEESLOGINFO("Nothing to save");
+	const auto name = crawl_journal_filename();
+	m_crawl_journal_fd = openat(m_ctx->home_fd(), name.c_str(), FLAGS_OPEN_COMMON | O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (!m_crawl_journal_fd) {
+		BEESLOGWARN("Opening " << name << ": " << strerror(errno) << ", crawl state will only be saved every " << BEES_WRITEBACK_INTERVAL << "s");
 		return;
 	}
 
-	state_to_stream(ofs);
-	const auto crawl_saved = m_crawl_dirty;
+	const auto data = read_string(m_crawl_journal_fd, Stat(m_crawl_journal_fd).st_size);
+	size_t offset = 0;
+	size_t replayed = 0;
+	for (; offset + sizeof(BeesCrawlJournalRecord) <= data.size(); offset += sizeof(BeesCrawlJournalRecord)) {
+		BeesCrawlJournalRecord record;
+		memcpy(&record, data.data() + offset, sizeof(record));
+		if (memcmp(record.r_magic, BEES_CRAWL_JOURNAL_MAGIC, sizeof(record.r_magic))
+			|| record.r_crc != Digest::CRC::crc64(&record, offsetof(BeesCrawlJournalRecord, r_crc))) {
+			// Torn write at the end, or the file is not ours
+			break;
+		}
+		if (record.r_type == BEES_CRAWL_JOURNAL_ERASE) {
+			states.erase(record.r_root);
+		} else if (record.r_type == BEES_CRAWL_JOURNAL_SET) {
+			BeesCrawlState bcs;
+			bcs.m_root = record.r_root;
+			bcs.m_objectid = record.r_objectid;
+			bcs.m_offset = record.r_offset;
+			bcs.m_min_transid = record.r_min_transid;
+			bcs.m_max_transid = record.r_max_transid;
+			bcs.m_started = record.r_started;
+			// Crawls only move forward.  An older record can be left over
+			// if bees stopped after writing beescrawl.dat but before
+			// emptying the journal.
+			auto &state = states[bcs.m_root];
+			if (state < bcs) {
+				state = bcs;
+			}
+		} else {
+			break;
+		}
+		++replayed;
+	}
+	if (offset != data.size()) {
+		BEESLOGWARN("Ignoring " << data.size() - offset << " bytes at end of " << name);
+	}
+	BEESLOGINFO("Replayed " << replayed << " crawl journal records");
+	BEESCOUNTADD(crawl_journal_replay, replayed);
+
+	// Appends start after the last good record
+	DIE_IF_NON_ZERO(ftruncate(m_crawl_journal_fd, offset));
+	m_crawl_journal_size = offset;
+	m_crawl_journal_states = states;
+}
 
-	if (ofs.str().empty()) {
-		BEESLOGWARN("Crawl state empty!");
-		m_crawl_clean = crawl_saved;
-		return;
+/// Save the whole crawl state once the hash table writeback has written
+/// the hash table entries for it.  A writeback pass can take hours at a
+/// low flush rate, so unless wait is set, the state is set aside and false
+/// is returned until the pass is done, and the journal keeps recording
+/// progress meanwhile.
+bool
+BeesRoots::state_save(bool wait)
+{
+	BEESNOTE("saving crawl state");
+	BEESTOOLONG("Saving crawl state");
+
+	Timer save_time;
+
+	// A stop saves the current state, not one set aside earlier
+	if (wait) {
+		m_crawl_save_mark = 0;
 	}
 
-	lock.unlock();
+	const auto hash_table = m_ctx->hash_table();
+	if (!m_crawl_save_mark) {
+		BEESLOGINFO("Saving crawl state");
+
+		// Not tied to the crawl state, so save it even if the crawl state is clean
+		m_ctx->resolve_store()->save();
+
+		unique_lock<mutex> lock(m_mutex);
+
+		// We don't have ofstreamat or ofdstream in C++11, so we're building a string and writing it with raw syscalls.
+		ostringstream ofs;
+
+		if (m_crawl_clean == m_crawl_dirty) {
+			BEESLOGINFO("Nothing to save");
+			return true;
+		}
+
+		state_to_stream(ofs);
+
+		if (ofs.str().empty()) {
+			BEESLOGWARN("Crawl state empty!");
+			m_crawl_clean = m_crawl_dirty;
+			return true;
+		}
+
+		m_crawl_save_pending = ofs.str();
+		m_crawl_save_pending_states = state_current();
+		m_crawl_save_pending_dirty = m_crawl_dirty;
+		lock.unlock();
+		m_crawl_save_mark = hash_table->writeback_mark();
+	}
+
+	// Hash table entries for everything crawled so far must reach disk first
+	if (!wait && !hash_table->written_back(m_crawl_save_mark)) {
+		BEESCOUNT(crawl_save_wait);
+		return false;
+	}
+	const auto mark = m_crawl_save_mark;
+	m_crawl_save_mark = 0;
+	const auto &saved_states = m_crawl_save_pending_states;
+	const auto crawl_saved = m_crawl_save_pending_dirty;
+	hash_table->checkpoint(mark);
 
 	// This may throw an exception, so we didn't save the state we thought we did.
-	m_crawl_state_file.write(ofs.str());
+	m_crawl_state_file.write(m_crawl_save_pending);
+	m_crawl_save_timer.reset();
+
+	// Everything in the journal up to saved_states is in beescrawl.dat now
+	if (!!m_crawl_journal_fd) {
+		BEESNOTE("emptying crawl journal");
+		const auto journaled_states = m_crawl_journal_states;
+		DIE_IF_NON_ZERO(ftruncate(m_crawl_journal_fd, 0));
+		m_crawl_journal_size = 0;
+		m_crawl_journal_states = saved_states;
+
+		// Progress journaled after saved_states was set aside is
+		// already safe, so keep it.  Erased crawls will be erased
+		// again after a restart.
+		string records;
+		for (const auto &i : journaled_states) {
+			auto found = m_crawl_journal_states.find(i.first);
+			if (found != m_crawl_journal_states.end() && found->second < i.second) {
+				crawl_journal_append(records, BEES_CRAWL_JOURNAL_SET, i.second);
+				found->second = i.second;
+			}
+		}
+		if (!records.empty()) {
+			pwrite_or_die(m_crawl_journal_fd, records, m_crawl_journal_size);
+			m_crawl_journal_size += records.size();
+			BEESCOUNTADD(crawl_journal_write, records.size() / sizeof(BeesCrawlJournalRecord));
+		}
+
+		// An older pending journal write could erase crawls added since
+		if (m_crawl_journal_pending_dirty <= crawl_saved) {
+			m_crawl_journal_mark = 0;
+		}
+	}
 
 	BEESNOTE("relocking crawl state to update dirty/clean state");
-	lock.lock();
+	unique_lock<mutex> lock(m_mutex);
 	// This records the version of the crawl state we saved, which is not necessarily the current state
-	m_crawl_clean = crawl_saved;
+	m_crawl_clean = max(m_crawl_clean, crawl_saved);
+	// Anything newer than the save must be journaled again
+	m_crawl_journaled = crawl_saved;
 	BEESLOGINFO("Saved crawl state in " << save_time << "s");
+	return true;
 }
 
 void
@@ -464,6 +1228,10 @@ BeesRoots::crawl_state_erase(const BeesCrawlState &bcs)
 		m_root_crawl_map.erase(bcs.m_root);
 		++m_crawl_dirty;
 	}
+	lock.unlock();
+
+	unique_lock<mutex> lineage_lock(m_root_lineage_mutex);
+	m_root_lineage.erase(bcs.m_root);
 }
 
 uint64_t
@@ -480,8 +1248,10 @@ BeesRoots::transid_min()
 	for (auto i : m_root_crawl_map) {
 		// Do not count subvols that are isolated by btrfs send workaround.
 		// They will not advance until the workaround is removed or they are set read-write.
+		// Read-only subvols scanned as dedupe sources advance like the others.
+		// Subvols excluded by filters never advance.
 		catch_all([&](){
-			if (!is_root_ro(i.first)) {
+			if ((m_ro_sources || !is_root_ro(i.first)) && !is_root_excluded(i.first)) {
 				rv = min(rv, i.second->get_state_end().m_min_transid);
 			}
 		});
@@ -529,22 +1299,54 @@ struct BeesFileCrawl {
 	off_t						m_offset;
 	/// Btrfs file fetcher
 	BtrfsExtentDataFetcher				m_bedf;
+	/// Next extent ref, already fetched so it can be read ahead
+	BtrfsTreeItem					m_next_bti;
+	/// Last crawl_one_extent returned false because the inode was locked
+	bool						m_deferred;
+	/// Parallel scan mode budget, returned when the file crawl is destroyed
+	shared_ptr<Cleanup>				m_budget;
 
 	/// Method that does one unit of work for the Task
 	bool crawl_one_extent();
+	/// Start reading the extent behind a ref in the background
+	void readahead(const BtrfsTreeItem &bti);
 };
 
+void
+BeesFileCrawl::readahead(const BtrfsTreeItem &bti)
+{
+	if (!bti || bti.file_extent_type() != BTRFS_FILE_EXTENT_REG) {
+		return;
+	}
+	const auto gen = bti.file_extent_generation();
+	if (gen < m_state.m_min_transid || gen > m_state.m_max_transid) {
+		return;
+	}
+	if (!bti.file_extent_bytenr()) {
+		return;
+	}
+	const BeesFileId bfi(m_state.m_root, bti.objectid());
+	m_ctx->readahead_async(BeesFileRange(bfi, bti.offset(), bti.offset() + bti.file_extent_logical_bytes()));
+}
+
 bool
 BeesFileCrawl::crawl_one_extent()
 {
 	BEESNOTE("crawl_one_extent m_offset " << to_hex(m_offset) << " state " << m_state);
 	BEESTRACE("crawl_one_extent m_offset " << to_hex(m_offset) << " state " << m_state);
 
+	// Excluded files are never opened or read, so stop the crawl of the whole file here
+	if (m_roots->is_file_excluded(BeesFileId(m_state.m_root, m_bedf.objectid()))) {
+		BEESCOUNT(crawl_filtered);
+		return false;
+	}
+
 	// Only one thread can dedupe a file.  btrfs will lock others out.
 	// Inodes are usually full of shared extents, especially in the case of snapshots,
 	// so when we lock an inode, we'll lock the same inode number in all subvols at once.
 	auto inode_mutex = m_ctx->get_inode_mutex(m_bedf.objectid());
 	auto inode_lock = inode_mutex->try_lock(Task::current_task());
+	m_deferred = !inode_lock;
 	if (!inode_lock) {
 		BEESCOUNT(scanf_deferred_inode);
 		// Returning false here means we won't reschedule ourselves, but inode_mutex will do that
@@ -555,12 +1357,25 @@ BeesFileCrawl::crawl_one_extent()
 	// It will mean the file or subvol was deleted or there's metadata corruption,
 	// and we should stop trying to scan the inode in that case.
 	// The calling Task will be aborted.
-	const auto bti = m_bedf.lower_bound(m_offset);
+	// Use the ref we fetched last time for readahead if it's still ahead of us
+	BtrfsTreeItem bti;
+	{
+		BEESPHASE(search);
+		bti = (!!m_next_bti && m_next_bti.offset() >= static_cast<uint64_t>(m_offset)) ? m_next_bti : m_bedf.lower_bound(m_offset);
+	}
+	m_next_bti = BtrfsTreeItem();
 	if (!bti) {
 		return false;
 	}
 	// Make sure we advance
 	m_offset = max(bti.offset() + m_bedf.block_size(), bti.offset());
+
+	// Fetch the next ref now, so its data can be read while we scan this one
+	{
+		BEESPHASE(search);
+		m_next_bti = m_bedf.lower_bound(m_offset);
+	}
+	readahead(m_next_bti);
 	// Check extent item generation is in range
 	const auto gen = bti.file_extent_generation();
 	if (gen < m_state.m_min_transid) {
@@ -589,6 +1404,11 @@ BeesFileCrawl::crawl_one_extent()
 		// to new extents here.
 		return true;
 	}
+	if (m_roots->realtime_scanned(BeesFileId(m_state.m_root, bti.objectid()), gen)) {
+		// Already scanned after the file was closed
+		BEESCOUNT(realtime_skip);
+		return true;
+	}
 
 	const auto type = bti.file_extent_type();
 	switch (type) {
@@ -615,6 +1435,16 @@ BeesFileCrawl::crawl_one_extent()
 				BeesFileId bfi(m_state.m_root, bti.objectid());
 				if (m_ctx->is_blacklisted(bfi)) {
 					BEESCOUNT(crawl_blacklisted);
+				} else if (len < m_roots->min_extent_size() && bti.offset() && !!m_next_bti) {
+					// Tiny extents in the middle of a file cost more to read and hash
+					// than their dedupe can save.  The first and last extents are
+					// still scanned, so small files are deduped whole.
+					// Nothing is opened or read, but the crawl position moves past it.
+					BEESCOUNT(crawl_small);
+					auto bcs = m_state;
+					bcs.m_objectid = bti.objectid();
+					bcs.m_offset = bti.offset();
+					m_hold = m_crawl->hold_state(bcs);
 				} else {
 					BeesFileRange bfr(bfi, bti.offset(), bti.offset() + len);
 					BEESCOUNT(crawl_push);
@@ -622,10 +1452,24 @@ BeesFileCrawl::crawl_one_extent()
 					bcs.m_objectid = bfr.fid().ino();
 					bcs.m_offset = bfr.begin();
 					const auto new_holder = m_crawl->hold_state(bcs);
+					// A new file might be a copy of a file we have seen.
+					// If the whole file is deduped, there is nothing left to scan.
+					if (!bfr.begin()) {
+						bool whole_file = false;
+						catch_all([&]() {
+							BEESNOTE("dedup_whole_file " << bfi);
+							whole_file = m_ctx->dedup_whole_file(bfi);
+						});
+						if (whole_file) {
+							m_hold = new_holder;
+							return false;
+						}
+					}
 					// If we hit an exception here, ignore it.
 					// It might be corrupted data, the file might have been deleted or truncated,
 					// or we might hit some other recoverable error.  We'll try again with
 					// the next extent.
+					m_crawl->count_scan(bfr.size());
 					bool scan_again = false;
 					catch_all([&]() {
 						BEESNOTE("scan_forward " << bfr);
@@ -648,8 +1492,82 @@ BeesFileCrawl::crawl_one_extent()
 	return true;
 }
 
+struct BeesRealtimeScan {
+	shared_ptr<BeesContext>				m_ctx;
+	shared_ptr<BeesRoots>				m_roots;
+	/// File that was closed after a write
+	BeesFileId					m_fid;
+	/// Extents with generations in this range are scanned
+	uint64_t					m_min_transid;
+	uint64_t					m_max_transid;
+	/// Currently processed offset in file
+	off_t						m_offset;
+	/// Btrfs file fetcher
+	BtrfsExtentDataFetcher				m_bedf;
+
+	/// Method that does one unit of work for the Task
+	bool scan_one_extent();
+};
+
+bool
+BeesRealtimeScan::scan_one_extent()
+{
+	BEESNOTE("realtime scan " << m_fid << " offset " << to_hex(m_offset));
+	BEESTRACE("realtime scan " << m_fid << " offset " << to_hex(m_offset));
+
+	// Same inode locking as crawl_one_extent
+	auto inode_mutex = m_ctx->get_inode_mutex(m_fid.ino());
+	auto inode_lock = inode_mutex->try_lock(Task::current_task());
+	if (!inode_lock) {
+		BEESCOUNT(scanf_deferred_inode);
+		// inode_mutex will reschedule us
+		return false;
+	}
+
+	const auto bti = m_bedf.lower_bound(m_offset);
+	if (!bti) {
+		m_roots->realtime_scan_done(m_fid, m_max_transid);
+		return false;
+	}
+	const auto next_offset = max(bti.offset() + m_bedf.block_size(), bti.offset());
+
+	// Newer extents are scanned after the next close or by the crawl
+	const auto gen = bti.file_extent_generation();
+	const auto type = bti.file_extent_type();
+	if (gen < m_min_transid || gen > m_max_transid || !bti.file_extent_bytenr() ||
+		(type != BTRFS_FILE_EXTENT_REG && type != BTRFS_FILE_EXTENT_PREALLOC)) {
+		m_offset = next_offset;
+		return true;
+	}
+
+	const BeesFileRange bfr(m_fid, bti.offset(), bti.offset() + bti.file_extent_logical_bytes());
+	if (!bfr.begin()) {
+		bool whole_file = false;
+		catch_all([&]() {
+			BEESNOTE("dedup_whole_file " << m_fid);
+			whole_file = m_ctx->dedup_whole_file(m_fid);
+		});
+		if (whole_file) {
+			m_roots->realtime_scan_done(m_fid, m_max_transid);
+			return false;
+		}
+	}
+	bool scan_again = false;
+	catch_all([&]() {
+		BEESNOTE("scan_forward " << bfr);
+		scan_again = m_ctx->scan_forward(bfr);
+	});
+	if (scan_again) {
+		BEESCOUNT(realtime_again);
+	} else {
+		BEESCOUNT(realtime_extent);
+		m_offset = next_offset;
+	}
+	return true;
+}
+
 bool
-BeesRoots::crawl_batch(shared_ptr<BeesCrawl> this_crawl)
+BeesRoots::crawl_batch(shared_ptr<BeesCrawl> this_crawl, const shared_ptr<Cleanup> &budget)
 {
 	const auto this_state = this_crawl->get_state_end();
 	BEESNOTE("Crawling batch " << this_state);
@@ -660,9 +1578,8 @@ BeesRoots::crawl_batch(shared_ptr<BeesCrawl> this_crawl)
 	}
 	const auto subvol = this_range.fid().root();
 	const auto inode = this_range.fid().ino();
-	ostringstream oss;
-	oss << "crawl_" << subvol << "_" << inode;
-	const auto task_title = oss.str();
+	// This is once per file, keep it cheap
+	const auto task_title = "crawl_" + to_string(subvol) + "_" + to_string(inode);
 	const auto bfc = make_shared<BeesFileCrawl>((BeesFileCrawl) {
 		.m_ctx = m_ctx,
 		.m_crawl = this_crawl,
@@ -672,60 +1589,384 @@ BeesRoots::crawl_batch(shared_ptr<BeesCrawl> this_crawl)
 		.m_offset = this_range.begin(),
 		.m_bedf = BtrfsExtentDataFetcher(m_ctx->root_fd()),
 	});
+	bfc->m_budget = budget;
 	bfc->m_bedf.tree(subvol);
 	bfc->m_bedf.objectid(inode);
 	bfc->m_bedf.transid(this_state.m_min_transid);
-	BEESNOTE("Starting task " << this_range);
-	Task(task_title, [bfc]() {
-		BEESNOTE("crawl_batch " << bfc->m_hold->get());
-		if (bfc->crawl_one_extent()) {
-			// Append the current task to itself to make
-			// sure we keep a worker processing this file
-			Task::current_task().append(Task::current_task());
+	bfc->m_bedf.batch_size(BEES_FILE_CRAWL_SEARCH_SIZE);
+	unique_lock<mutex> lock(m_inode_crawl_mutex);
+	const auto found = m_inode_crawl_queue.find(inode);
+	if (found != m_inode_crawl_queue.end()) {
+		// Another subvol's crawl has this inode number.  Its Task will
+		// run this crawl next, and the workers are free for other inodes.
+		found->second.push_back(bfc);
+		BEESCOUNT(crawl_inode_queued);
+	} else {
+		m_inode_crawl_queue[inode];
+		BEESNOTE("Starting task " << this_range);
+		const auto current_bfc = make_shared<shared_ptr<BeesFileCrawl>>(bfc);
+		const auto roots = shared_from_this();
+		Task(task_title, [roots, inode, current_bfc]() {
+			const auto share = roots->m_ctx->share()->start();
+			if (!share) {
+				return;
+			}
+			auto &bfc = *current_bfc;
+			BEESNOTE("crawl_batch " << bfc->m_hold->get());
+			bool more = false;
+			catch_all([&]() {
+				more = bfc->crawl_one_extent();
+			});
+			if (more) {
+				// Append the current task to itself to make
+				// sure we keep a worker processing this file
+				Task::current_task().append(Task::current_task());
+				return;
+			}
+			if (bfc->m_deferred) {
+				// inode_mutex will reschedule us
+				return;
+			}
+			// Done with this file, continue with the same inode in the next subvol
+			bfc = roots->crawl_inode_next(inode);
+			if (bfc) {
+				Task::current_task().append(Task::current_task());
+			}
+		}).run();
+	}
+	lock.unlock();
+	auto next_state = this_state;
+	// Skip to EOF.  Will repeat up to 16 times if there happens to be an extent at 16EB,
+	// which would be a neat trick given that off64_t is signed.
+	next_state.m_offset = max(next_state.m_offset, numeric_limits<uint64_t>::max() - 65536 + 1);
+	this_crawl->set_state(next_state);
+	BEESCOUNT(crawl_scan);
+	return true;
+}
+
+shared_ptr<BeesFileCrawl>
+BeesRoots::crawl_inode_next(const uint64_t inode)
+{
+	unique_lock<mutex> lock(m_inode_crawl_mutex);
+	const auto found = m_inode_crawl_queue.find(inode);
+	THROW_CHECK1(runtime_error, inode, found != m_inode_crawl_queue.end());
+	if (found->second.empty()) {
+		m_inode_crawl_queue.erase(found);
+		return shared_ptr<BeesFileCrawl>();
+	}
+	const auto rv = found->second.front();
+	found->second.pop_front();
+	return rv;
+}
+
+bool
+BeesRoots::crawl_roots()
+{
+	BEESNOTE("Crawling roots");
+	BEESTRACE("Crawling roots");
+
+	unique_lock<mutex> lock(m_mutex);
+	const auto hold_scanner = m_scanner;
+	lock.unlock();
+
+	THROW_CHECK0(runtime_error, hold_scanner);
+
+	BEESNOTE("Scanning roots in " << hold_scanner->ntoa() << " mode");
+	BEESTRACE("scanning roots in " << hold_scanner->ntoa() << " mode");
+
+	if (hold_scanner->scan()) {
+		return true;
+	}
+
+	BEESCOUNT(crawl_done);
+
+	const auto ran_out_time = m_crawl_timer.lap();
+	BEESLOGINFO("crawl_more ran out of data after " << ran_out_time << "s");
+
+	// Do not run again
+	return false;
+}
+
+void
+BeesRoots::clear_caches()
+{
+	m_ctx->fd_cache()->clear();
+	m_ctx->resolve_cache_clear();
+}
+
+void
+BeesRoots::clear_caches(const set<uint64_t> &roots)
+{
+	// Resolve results are keyed by physical address, so there is
+	// no way to tell which subvols they came from
+	m_ctx->fd_cache()->clear_roots(roots);
+	m_ctx->resolve_cache_clear();
+}
+
+void
+BeesRoots::set_watch_writes(bool watch_writes)
+{
+	m_watch_writes = watch_writes;
+	BEESLOGINFO("watch writes: " << (m_watch_writes ? "enabled" : "disabled"));
+}
+
+bool
+BeesRoots::take_written_roots(set<uint64_t> &roots)
+{
+	unique_lock<mutex> lock(m_stop_mutex);
+	roots.clear();
+	swap(roots, m_written_roots);
+	const bool rv = m_write_watch_active && !m_write_overflow;
+	m_write_seen = false;
+	m_write_overflow = false;
+	return rv;
+}
+
+void
+BeesRoots::write_watch_thread()
+{
+	BEESNOTE("setting up fanotify");
+	Fd fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, FLAGS_OPEN_FANOTIFY);
+	if (!fan_fd) {
+		BEESLOGWARN("fanotify_init: " << strerror(errno) << ", polling for new transids");
+		return;
+	}
+#ifdef FAN_MARK_FILESYSTEM
+	// Writes through any mount of the filesystem
+	int rv = fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_MODIFY | FAN_CLOSE_WRITE, m_ctx->root_fd(), NULL);
+	if (rv) {
+		BEESLOGDEBUG("fanotify_mark FAN_MARK_FILESYSTEM: " << strerror(errno));
+	}
+#else
+	int rv = -1;
+#endif
+	if (rv) {
+		// Only writes through the mount bees is using
+		rv = fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_MODIFY | FAN_CLOSE_WRITE, m_ctx->root_fd(), NULL);
+	}
+	if (rv) {
+		BEESLOGWARN("fanotify_mark: " << strerror(errno) << ", polling for new transids");
+		return;
+	}
+
+	unique_lock<mutex> lock(m_stop_mutex);
+	m_write_watch_active = true;
+	lock.unlock();
+	BEESLOGINFO("Watching for writes with fanotify");
+
+	const auto self_pid = getpid();
+	vector<uint8_t> buf(64 * 1024);
+	while (true) {
+		lock.lock();
+		if (m_stop_requested) {
+			m_write_watch_active = false;
+			return;
+		}
+		lock.unlock();
+
+		BEESNOTE("waiting for fanotify events");
+		struct pollfd pfd = { .fd = fan_fd, .events = POLLIN, .revents = 0 };
+		if (poll(&pfd, 1, BEES_TRANSID_WRITE_POLL_INTERVAL * 1000) <= 0) {
+			continue;
+		}
+		const auto len = read(fan_fd, buf.data(), buf.size());
+		if (len <= 0) {
+			continue;
+		}
+
+		// Find the subvols of the written files.  The event FDs are
+		// opened by the kernel and have to be closed here.
+		BEESNOTE("reading fanotify events");
+		set<uint64_t> roots;
+		set<BeesFileId> closed_files;
+		bool overflow = false;
+		size_t events = 0;
+		for (size_t offset = 0; offset + sizeof(fanotify_event_metadata) <= size_t(len); ) {
+			fanotify_event_metadata md;
+			memcpy(&md, buf.data() + offset, sizeof(md));
+			if (md.event_len < sizeof(md) || offset + md.event_len > size_t(len)) {
+				break;
+			}
+			offset += md.event_len;
+			++events;
+			if (md.vers != FANOTIFY_METADATA_VERSION || (md.mask & FAN_Q_OVERFLOW)) {
+				overflow = true;
+			}
+			if (md.fd < 0) {
+				continue;
+			}
+			Fd event_fd(md.fd);
+			catch_all([&]() {
+				const auto root = btrfs_get_root_id(event_fd);
+				roots.insert(root);
+				// Skip bees's own temporary files
+				if (m_realtime_scan && (md.mask & FAN_CLOSE_WRITE) && md.pid != self_pid) {
+					closed_files.insert(BeesFileId(root, Stat(event_fd).st_ino));
+				}
+			});
+		}
+		BEESCOUNTADD(crawl_write_event, events);
+		if (overflow) {
+			BEESCOUNT(crawl_write_overflow);
+		}
+
+		// Wake up the crawl thread on the first write after a new transid
+		lock.lock();
+		m_written_roots.insert(roots.begin(), roots.end());
+		m_write_overflow |= overflow;
+		for (const auto &bfi : closed_files) {
+			if (m_closed_files.size() < BEES_REALTIME_SCAN_QUEUE_SIZE || m_closed_files.count(bfi)) {
+				m_closed_files.insert(bfi);
+			} else {
+				BEESCOUNT(realtime_drop);
+			}
 		}
-	}).run();
-	auto next_state = this_state;
-	// Skip to EOF.  Will repeat up to 16 times if there happens to be an extent at 16EB,
-	// which would be a neat trick given that off64_t is signed.
-	next_state.m_offset = max(next_state.m_offset, numeric_limits<uint64_t>::max() - 65536 + 1);
-	this_crawl->set_state(next_state);
-	BEESCOUNT(crawl_scan);
-	return true;
+		if (!m_write_seen) {
+			m_write_seen = true;
+			m_stop_condvar.notify_all();
+		}
+		lock.unlock();
+	}
 }
 
-bool
-BeesRoots::crawl_roots()
+void
+BeesRoots::crawl_hit(uint64_t root, uint64_t bytes)
 {
-	BEESNOTE("Crawling roots");
-	BEESTRACE("Crawling roots");
-
 	unique_lock<mutex> lock(m_mutex);
-	const auto hold_scanner = m_scanner;
-	lock.unlock();
+	const auto found = m_root_crawl_map.find(root);
+	if (found != m_root_crawl_map.end()) {
+		found->second->count_hit(bytes);
+	}
+}
 
-	THROW_CHECK0(runtime_error, hold_scanner);
+void
+BeesRoots::set_realtime_scan(bool realtime_scan)
+{
+	m_realtime_scan = realtime_scan;
+	BEESLOGINFO("realtime scan: " << (m_realtime_scan ? "enabled" : "disabled"));
+}
 
-	BEESNOTE("Scanning roots in " << hold_scanner->ntoa() << " mode");
-	BEESTRACE("scanning roots in " << hold_scanner->ntoa() << " mode");
+void
+BeesRoots::realtime_scan_done(const BeesFileId &bfi, uint64_t transid)
+{
+	unique_lock<mutex> lock(m_realtime_mutex);
+	const auto found = m_realtime_scanned.find(bfi);
+	if (found != m_realtime_scanned.end()) {
+		found->second = max(found->second, transid);
+	} else if (m_realtime_scanned.size() < BEES_REALTIME_SCAN_INDEX_SIZE) {
+		m_realtime_scanned.insert(make_pair(bfi, transid));
+	} else {
+		// The crawl will scan this file again, which is harmless
+		BEESCOUNT(realtime_full);
+	}
+}
 
-	if (hold_scanner->scan()) {
-		return true;
+bool
+BeesRoots::realtime_scanned(const BeesFileId &bfi, uint64_t gen)
+{
+	if (!m_realtime_scan) {
+		return false;
 	}
+	unique_lock<mutex> lock(m_realtime_mutex);
+	const auto found = m_realtime_scanned.find(bfi);
+	return found != m_realtime_scanned.end() && gen <= found->second;
+}
 
-	BEESCOUNT(crawl_done);
+size_t
+BeesRoots::ino_path_cache_size() const
+{
+	return m_ino_path_cache.size();
+}
 
-	const auto ran_out_time = m_crawl_timer.lap();
-	BEESLOGINFO("crawl_more ran out of data after " << ran_out_time << "s");
+void
+BeesRoots::set_ino_path_cache_scale(double scale)
+{
+	m_ino_path_cache.max_size(max(size_t(1), static_cast<size_t>(BEES_INO_PATH_CACHE_SIZE * scale)));
+}
 
-	// Do not run again
-	return false;
+void
+BeesRoots::realtime_scan_prune(const map<uint64_t, uint64_t> &min_transids)
+{
+	// Crawls don't look at extents older than their min_transid,
+	// so files scanned before then don't need to be remembered
+	unique_lock<mutex> lock(m_realtime_mutex);
+	for (auto i = m_realtime_scanned.begin(); i != m_realtime_scanned.end(); ) {
+		const auto found = min_transids.find(i->first.root());
+		if (found == min_transids.end() || i->second < found->second) {
+			i = m_realtime_scanned.erase(i);
+		} else {
+			++i;
+		}
+	}
 }
 
 void
-BeesRoots::clear_caches()
+BeesRoots::realtime_scan_start(uint64_t transid)
 {
-	m_ctx->fd_cache()->clear();
-	m_ctx->resolve_cache_clear();
+	if (!m_realtime_scan) {
+		return;
+	}
+
+	BEESNOTE("starting realtime scans for transid " << transid);
+	unique_lock<mutex> lock(m_stop_mutex);
+	set<BeesFileId> closed_files;
+	swap(closed_files, m_closed_files);
+	lock.unlock();
+
+	// Extents older than a crawl's min_transid were scanned in earlier crawl cycles
+	map<uint64_t, uint64_t> min_transids;
+	unique_lock<mutex> crawl_lock(m_mutex);
+	for (const auto &i : m_root_crawl_map) {
+		min_transids[i.first] = i.second->get_state_begin().m_min_transid;
+	}
+	crawl_lock.unlock();
+	realtime_scan_prune(min_transids);
+
+	for (const auto &bfi : closed_files) {
+		if (m_ctx->is_blacklisted(bfi) || is_file_excluded(bfi)) {
+			continue;
+		}
+		const auto found = min_transids.find(bfi.root());
+		auto min_transid = found == min_transids.end() ? 0 : found->second;
+		// Don't scan extents again that were scanned at the last close
+		unique_lock<mutex> realtime_lock(m_realtime_mutex);
+		const auto scanned = m_realtime_scanned.find(bfi);
+		if (scanned != m_realtime_scanned.end()) {
+			min_transid = max(min_transid, scanned->second + 1);
+		}
+		realtime_lock.unlock();
+		if (min_transid > transid) {
+			continue;
+		}
+
+		const auto brs = make_shared<BeesRealtimeScan>((BeesRealtimeScan) {
+			.m_ctx = m_ctx,
+			.m_roots = shared_from_this(),
+			.m_fid = bfi,
+			.m_min_transid = min_transid,
+			.m_max_transid = transid,
+			.m_offset = 0,
+			.m_bedf = BtrfsExtentDataFetcher(m_ctx->root_fd()),
+		});
+		brs->m_bedf.tree(bfi.root());
+		brs->m_bedf.objectid(bfi.ino());
+		brs->m_bedf.transid(min_transid);
+		brs->m_bedf.batch_size(BEES_FILE_CRAWL_SEARCH_SIZE);
+		Task("realtime_" + to_string(bfi.root()) + "_" + to_string(bfi.ino()), [brs]() {
+			const auto share = brs->m_ctx->share()->start();
+			if (!share) {
+				return;
+			}
+			bool more = false;
+			catch_all([&]() {
+				more = brs->scan_one_extent();
+			});
+			if (more) {
+				Task::current_task().append(Task::current_task());
+			}
+		}).run();
+		BEESCOUNT(realtime_file);
+	}
 }
 
 void
@@ -766,22 +2007,35 @@ BeesRoots::crawl_thread()
 			// cleaner_kthread just keeps skipping over the open dir and all its children.
 			// Even open files are a problem if they're big enough.
 			// Always run this even if we have no worker threads.
-			clear_caches();
+			// If fanotify saw every write, only the written subvols lose their file FDs.
+			set<uint64_t> written_roots;
+			if (take_written_roots(written_roots)) {
+				clear_caches(written_roots);
+			} else {
+				clear_caches();
+			}
 
 			// Insert new roots and restart crawl_more.
 			// Don't run this if we have no worker threads.
 			crawl_new.run();
+
+			// Scan files closed before this transid, they have new data now
+			catch_all([&]() {
+				realtime_scan_start(new_transid);
+			});
 		}
 		last_transid = new_transid;
 
-		const auto poll_time = max(BEES_TRANSID_POLL_INTERVAL, m_transid_re.seconds_for(1));
-		BEESLOGDEBUG("Polling " << poll_time << "s for next transid " << m_transid_re);
-		BEESNOTE("waiting " << poll_time << "s for next transid " << m_transid_re);
 		unique_lock<mutex> lock(m_stop_mutex);
 		if (m_stop_requested) {
 			BEESLOGDEBUG("Stop requested in crawl thread");
 			break;
 		}
+		// After a write, the next commit has new data, so look for it often.
+		// The write watch thread wakes us up on the first write.
+		const auto poll_time = m_write_seen ? BEES_TRANSID_WRITE_POLL_INTERVAL : max(BEES_TRANSID_POLL_INTERVAL, m_transid_re.seconds_for(1));
+		BEESLOGDEBUG("Polling " << poll_time << "s for next transid " << m_transid_re);
+		BEESNOTE("waiting " << poll_time << "s for next transid " << m_transid_re);
 		m_stop_condvar.wait_for(lock, chrono::duration<double>(poll_time));
 	}
 }
@@ -793,8 +2047,16 @@ BeesRoots::writeback_thread()
 		BEESNOTE("idle, " << (m_crawl_clean != m_crawl_dirty ? "dirty" : "clean"));
 
 		catch_all([&]() {
-			BEESNOTE("saving crawler state");
-			state_save();
+			// Write the whole crawl state now and then, and the changes in between
+			bool saved = false;
+			if (m_crawl_save_timer.age() >= BEES_WRITEBACK_INTERVAL || m_crawl_journal_size >= BEES_CRAWL_JOURNAL_SIZE) {
+				BEESNOTE("saving crawler state");
+				saved = state_save(false);
+			}
+			if (!saved) {
+				BEESNOTE("journaling crawler state");
+				state_journal();
+			}
 		});
 
 		unique_lock<mutex> lock(m_stop_mutex);
@@ -802,11 +2064,11 @@ BeesRoots::writeback_thread()
 			BEESLOGDEBUG("Stop requested in writeback thread");
 			catch_all([&]() {
 				BEESNOTE("flushing crawler state");
-				state_save();
+				state_save(true);
 			});
 			return;
 		}
-		m_stop_condvar.wait_for(lock, chrono::duration<double>(BEES_WRITEBACK_INTERVAL));
+		m_stop_condvar.wait_for(lock, chrono::duration<double>(BEES_CRAWL_JOURNAL_INTERVAL));
 	}
 }
 
@@ -885,6 +2147,33 @@ BeesRoots::state_load()
 	BEESNOTE("loading crawl state");
 	BEESLOGINFO("loading crawl state");
 
+	map<uint64_t, BeesCrawlState> loaded_states;
+	catch_all([&]() {
+		state_load_file(loaded_states);
+	});
+
+	// Changes since beescrawl.dat was written
+	catch_all([&]() {
+		state_journal_replay(loaded_states);
+	});
+
+	for (const auto &i : loaded_states) {
+		if (i.first == BTRFS_EXTENT_TREE_OBJECTID) {
+			BEESLOGDEBUG("loaded extent scan state " << i.second);
+			unique_lock<mutex> lock(m_mutex);
+			if (m_scanner) {
+				m_scanner->state_load(i.second);
+			}
+			continue;
+		}
+		BEESLOGDEBUG("loaded_state " << i.second);
+		insert_root(i.second);
+	}
+}
+
+void
+BeesRoots::state_load_file(map<uint64_t, BeesCrawlState> &loaded_states)
+{
 	string crawl_data = m_crawl_state_file.read();
 
 	for (auto line : split("\n", crawl_data)) {
@@ -902,6 +2191,18 @@ BeesRoots::state_load()
 			THROW_CHECK0(runtime_error, result.second);
 		}
 		BeesCrawlState loaded_state;
+		if (d.count("extent_bytenr")) {
+			// Extent tree scan state belongs to the scan mode, not a subvol
+			loaded_state.m_root        = BTRFS_EXTENT_TREE_OBJECTID;
+			loaded_state.m_objectid    = d.at("extent_bytenr");
+			loaded_state.m_min_transid = d.at("min_transid");
+			loaded_state.m_max_transid = d.at("max_transid");
+			if (d.count("started")) {
+				loaded_state.m_started = d.at("started");
+			}
+			loaded_states.insert(make_pair(loaded_state.m_root, loaded_state));
+			continue;
+		}
 		loaded_state.m_root        = d.at("root");
 		loaded_state.m_objectid    = d.at("objectid");
 		loaded_state.m_offset      = d.at("offset");
@@ -910,7 +2211,6 @@ BeesRoots::state_load()
 		if (d.count("started")) {
 			loaded_state.m_started = d.at("started");
 		}
-		BEESLOGDEBUG("loaded_state " << loaded_state);
 		if (loaded_state.m_min_transid == numeric_limits<uint64_t>::max()) {
 			BEESLOGWARN("WARNING: root " << loaded_state.m_root << ": bad min_transid " << loaded_state.m_min_transid << ", resetting to 0");
 			loaded_state.m_min_transid = 0;
@@ -921,7 +2221,7 @@ BeesRoots::state_load()
 			loaded_state.m_max_transid = loaded_state.m_min_transid;
 			BEESCOUNT(bug_bad_max_transid);
 		}
-		insert_root(loaded_state);
+		loaded_states.insert(make_pair(loaded_state.m_root, loaded_state));
 	}
 }
 
@@ -930,8 +2230,14 @@ BeesRoots::BeesRoots(shared_ptr<BeesContext> ctx) :
 	m_root_fetcher(ctx->root_fd()),
 	m_crawl_state_file(ctx->home_fd(), crawl_state_filename()),
 	m_crawl_thread("crawl_transid"),
-	m_writeback_thread("crawl_writeback")
+	m_writeback_thread("crawl_writeback"),
+	m_ino_path_cache([](uint64_t, uint64_t) { return string(); }, BEES_INO_PATH_CACHE_SIZE),
+	m_filter_cache([](uint64_t, uint64_t) { return false; }, BEES_FILTER_CACHE_SIZE),
+	m_write_watch_thread("crawl_fanotify")
 {
+	m_filter_cache.func([&](uint64_t root, uint64_t ino) -> bool {
+		return is_file_excluded_nocache(root, ino);
+	});
 }
 
 void
@@ -951,6 +2257,11 @@ BeesRoots::start()
 		m_writeback_thread.exec([&]() {
 			writeback_thread();
 		});
+		if (m_watch_writes) {
+			m_write_watch_thread.exec([&]() {
+				write_watch_thread();
+			});
+		}
 		crawl_thread();
 	});
 }
@@ -979,6 +2290,10 @@ BeesRoots::stop_wait()
 	BEESNOTE("waiting for crawl_thread thread");
 	m_crawl_thread.join();
 
+	BEESLOGDEBUG("Waiting for write watch thread");
+	BEESNOTE("waiting for crawl_fanotify thread");
+	m_write_watch_thread.join();
+
 	BEESLOGDEBUG("BeesRoots stopped");
 }
 
@@ -987,6 +2302,7 @@ BeesRoots::open_root_nocache(uint64_t rootid)
 {
 	BEESTRACE("open_root_nocache " << rootid);
 	BEESNOTE("open_root_nocache " << rootid);
+	BEESPHASE(open);
 
 	// Stop recursion at the root of the filesystem tree
 	if (rootid == BTRFS_FS_TREE_OBJECTID) {
@@ -1109,6 +2425,243 @@ BeesRoots::is_root_ro(uint64_t root)
 	return false;
 }
 
+void
+BeesFilter::add_inode_range(map<uint64_t, uint64_t> &ranges, uint64_t first, uint64_t last)
+{
+	THROW_CHECK2(invalid_argument, first, last, first <= last);
+	// Merge with every range that overlaps or touches this one
+	auto i = ranges.upper_bound(first);
+	if (i != ranges.begin()) {
+		const auto prev = std::prev(i);
+		if (prev->second >= first || prev->second + 1 == first) {
+			i = prev;
+		}
+	}
+	while (i != ranges.end() && (i->first <= last || i->first == last + 1)) {
+		first = min(first, i->first);
+		last = max(last, i->second);
+		i = ranges.erase(i);
+	}
+	ranges[first] = last;
+}
+
+bool
+BeesFilter::inode_match(const map<uint64_t, uint64_t> &ranges, uint64_t ino)
+{
+	auto i = ranges.upper_bound(ino);
+	if (i == ranges.begin()) {
+		return false;
+	}
+	--i;
+	return ino <= i->second;
+}
+
+void
+BeesFilter::add_path_prefix(vector<string> &prefixes, const string &prefix)
+{
+	// With a '/' after each prefix and the path, "a/b" matches "a/b" and
+	// "a/b/c" but not "a/bc", and no prefix in the list covers another
+	const string key = prefix + "/";
+	if (path_match(prefixes, prefix)) {
+		return;
+	}
+	auto i = lower_bound(prefixes.begin(), prefixes.end(), key);
+	auto j = i;
+	while (j != prefixes.end() && j->compare(0, key.size(), key) == 0) {
+		++j;
+	}
+	i = prefixes.erase(i, j);
+	prefixes.insert(i, key);
+}
+
+bool
+BeesFilter::path_match(const vector<string> &prefixes, const string &path)
+{
+	// The only prefix that can match is the last one not after the path
+	const string key = path + "/";
+	auto i = upper_bound(prefixes.begin(), prefixes.end(), key);
+	if (i == prefixes.begin()) {
+		return false;
+	}
+	--i;
+	return key.compare(0, i->size(), *i) == 0;
+}
+
+void
+BeesFilter::add_root(uint64_t root, bool include)
+{
+	(include ? m_include_roots : m_exclude_roots).insert(root);
+}
+
+void
+BeesFilter::add_inodes(uint64_t first, uint64_t last, bool include)
+{
+	add_inode_range(include ? m_include_inodes : m_exclude_inodes, first, last);
+}
+
+void
+BeesFilter::add_path(const string &prefix, bool include)
+{
+	THROW_CHECK1(invalid_argument, prefix, !prefix.empty());
+	add_path_prefix(include ? m_include_paths : m_exclude_paths, prefix);
+}
+
+bool
+BeesFilter::empty() const
+{
+	return m_exclude_roots.empty() && m_include_roots.empty()
+		&& m_exclude_inodes.empty() && m_include_inodes.empty()
+		&& m_exclude_paths.empty() && m_include_paths.empty();
+}
+
+bool
+BeesFilter::has_path_rules() const
+{
+	return !m_exclude_paths.empty() || !m_include_paths.empty();
+}
+
+bool
+BeesFilter::root_excluded(uint64_t root) const
+{
+	if (m_exclude_roots.count(root)) {
+		return true;
+	}
+	// Inode and path include rules can match a file in any subvol
+	if (m_include_roots.empty() || !m_include_inodes.empty() || !m_include_paths.empty()) {
+		return false;
+	}
+	return !m_include_roots.count(root);
+}
+
+bool
+BeesFilter::file_excluded(uint64_t root, uint64_t ino, const vector<string> &paths) const
+{
+	if (m_exclude_roots.count(root) || inode_match(m_exclude_inodes, ino)) {
+		return true;
+	}
+	for (const auto &path : paths) {
+		if (path_match(m_exclude_paths, path)) {
+			return true;
+		}
+	}
+	if (m_include_roots.empty() && m_include_inodes.empty() && m_include_paths.empty()) {
+		return false;
+	}
+	if (m_include_roots.count(root) || inode_match(m_include_inodes, ino)) {
+		return false;
+	}
+	for (const auto &path : paths) {
+		if (path_match(m_include_paths, path)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static
+uint64_t
+filter_number(const string &rule, const string &value)
+{
+	if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+		THROW_ERROR(invalid_argument, "expected a number in filter rule '" << rule << "'");
+	}
+	return stoull(value);
+}
+
+void
+BeesRoots::add_filter(const string &rule, bool include, bool skip_missing)
+{
+	const auto eq = rule.find('=');
+	if (eq == string::npos) {
+		THROW_ERROR(invalid_argument, "filter rule '" << rule << "' must be subvol=, ino=, or path=");
+	}
+	const auto kind = rule.substr(0, eq);
+	const auto value = rule.substr(eq + 1);
+	const char *const verb = include ? "include" : "exclude";
+	if (kind == "subvol") {
+		uint64_t root = 0;
+		if (!value.empty() && value.find_first_not_of("0123456789") == string::npos) {
+			root = stoull(value);
+		} else {
+			// A subvol name is a path from the filesystem root to the top of the subvol
+			BEESTRACE("opening subvol " << value);
+			const Fd subvol_fd = openat(m_ctx->root_fd(), value.c_str(), FLAGS_OPEN_DIR);
+			if (!subvol_fd && errno == ENOENT && skip_missing) {
+				BEESLOGINFO("Filter: no subvol '" << value << "' for rule '" << rule << "' on " << m_ctx->root_path());
+				return;
+			}
+			if (!subvol_fd) {
+				THROW_ERRNO("open subvol '" << value << "' in filter rule '" << rule << "'");
+			}
+			if (Stat(subvol_fd).st_ino != BTRFS_FIRST_FREE_OBJECTID) {
+				THROW_ERROR(invalid_argument, "'" << value << "' in filter rule '" << rule << "' is not a subvol");
+			}
+			root = btrfs_get_root_id(subvol_fd);
+		}
+		m_filter.add_root(root, include);
+		BEESLOGINFO("Filter: " << verb << " subvol " << root);
+	} else if (kind == "ino") {
+		const auto dash = value.find('-');
+		const auto first = filter_number(rule, value.substr(0, dash));
+		const auto last = dash == string::npos ? first : filter_number(rule, value.substr(dash + 1));
+		if (first > last) {
+			THROW_ERROR(invalid_argument, "empty inode range in filter rule '" << rule << "'");
+		}
+		m_filter.add_inodes(first, last, include);
+		BEESLOGINFO("Filter: " << verb << " inodes " << first << ".." << last);
+	} else if (kind == "path") {
+		// INO_PATHS returns paths relative to the subvol root, without leading '/'
+		const auto begin = value.find_first_not_of('/');
+		const auto end = value.find_last_not_of('/');
+		if (begin == string::npos) {
+			THROW_ERROR(invalid_argument, "empty path in filter rule '" << rule << "'");
+		}
+		const auto prefix = value.substr(begin, end + 1 - begin);
+		m_filter.add_path(prefix, include);
+		BEESLOGINFO("Filter: " << verb << " path " << prefix << " in every subvol");
+	} else {
+		THROW_ERROR(invalid_argument, "filter rule '" << rule << "' must be subvol=, ino=, or path=");
+	}
+}
+
+bool
+BeesRoots::is_root_excluded(uint64_t root) const
+{
+	return m_filter.root_excluded(root);
+}
+
+bool
+BeesRoots::is_file_excluded_nocache(uint64_t root, uint64_t ino)
+{
+	BEESNOTE("looking up paths for filter root " << root << " ino " << ino);
+	BEESTRACE("looking up paths for filter root " << root << " ino " << ino);
+	BEESCOUNT(filter_path_lookup);
+	vector<string> paths;
+	catch_all([&]() {
+		const auto root_fd = open_root(root);
+		if (!root_fd) {
+			return;
+		}
+		BtrfsIoctlInoPathArgs ipa(ino);
+		if (ipa.do_ioctl_nothrow(root_fd)) {
+			paths = ipa.m_paths;
+		}
+	});
+	return m_filter.file_excluded(root, ino, paths);
+}
+
+bool
+BeesRoots::is_file_excluded(const BeesFileId &bfi)
+{
+	if (m_filter.empty()) {
+		return false;
+	}
+	if (!m_filter.has_path_rules()) {
+		return m_filter.file_excluded(bfi.root(), bfi.ino(), vector<string>());
+	}
+	return m_filter_cache(bfi.root(), bfi.ino());
+}
+
 uint64_t
 BeesRoots::next_root(uint64_t root)
 {
@@ -1143,10 +2696,47 @@ BeesRoots::next_root(uint64_t root)
 	}
 }
 
+uint64_t
+BeesRoots::root_lineage(uint64_t root)
+{
+	unique_lock<mutex> lock(m_root_lineage_mutex);
+	const auto found = m_root_lineage.find(root);
+	if (found != m_root_lineage.end()) {
+		return found->second;
+	}
+	lock.unlock();
+
+	// Snapshots of a subvol have the subvol's UUID as their parent UUID.
+	// The subvol itself uses its own UUID, so it is in the same lineage.
+	// Subvols without UUIDs are their own lineage.
+	uint64_t rv = root;
+	catch_all([&]() {
+		BEESTRACE("looking up lineage of root " << root);
+		BtrfsRootFetcher root_fetcher(m_ctx->root_fd());
+		const auto item = root_fetcher.root(root);
+		if (!item) {
+			return;
+		}
+		const string no_uuid(BTRFS_UUID_SIZE, '\0');
+		auto uuid = item.root_parent_uuid();
+		if (uuid.empty() || uuid == no_uuid) {
+			uuid = item.root_uuid();
+		}
+		if (!uuid.empty() && uuid != no_uuid) {
+			memcpy(&rv, uuid.data(), sizeof(rv));
+		}
+	});
+
+	lock.lock();
+	m_root_lineage[root] = rv;
+	return rv;
+}
+
 Fd
 BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 {
 	BEESTRACE("opening root " << root << " ino " << ino);
+	BEESPHASE(open);
 
 	// Check the tmpfiles map first
 	{
@@ -1166,6 +2756,27 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 
 	BEESTOOLONG("open_root_ino(root " << root << ", ino " << ino << ")");
 
+	// Try the path that opened this inode number in a related subvol.
+	// It must pass the same checks as a path from INO_PATHS, but a
+	// failure is expected and quiet, and INO_PATHS is used instead.
+	const auto lineage = root_lineage(root);
+	const auto cached_path = m_ino_path_cache(lineage, ino);
+	if (!cached_path.empty()) {
+		BEESTRACE("trying cached path " << cached_path);
+		Fd cached_fd = openat(root_fd, cached_path.c_str(), FLAGS_OPEN_FILE);
+		if (!!cached_fd) {
+			Stat file_stat(cached_fd);
+			if (file_stat.st_ino == ino
+				&& btrfs_get_root_id(cached_fd) == root
+				&& Stat(root_fd).st_dev == file_stat.st_dev
+				&& !(ioctl_iflags_get(cached_fd) & FS_NOCOW_FL)) {
+				BEESCOUNT(open_path_cache_hit);
+				return cached_fd;
+			}
+		}
+		BEESCOUNT(open_path_cache_miss);
+	}
+
 	BEESTRACE("looking up ino " << ino);
 	BtrfsIoctlInoPathArgs ipa(ino);
 	if (!ipa.do_ioctl_nothrow(root_fd)) {
@@ -1263,6 +2874,7 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 			break;
 		}
 
+		m_ino_path_cache.insert(file_path, lineage, ino);
 		BEESCOUNT(open_hit);
 		return rv;
 	}
@@ -1350,6 +2962,7 @@ BeesCrawl::fetch_extents()
 {
 	BEESTRACE("fetch_extents " << get_state_end());
 	BEESNOTE("fetch_extents " << get_state_end());
+	BEESPHASE(search);
 	// insert_root will undefer us.  Until then, nothing.
 	if (m_deferred) {
 		return false;
@@ -1363,13 +2976,20 @@ BeesCrawl::fetch_extents()
 	}
 
 	// Check for btrfs send workaround: don't scan RO roots at all, pretend
-	// they are just empty.  We can't free any space there, and we
-	// don't have the necessary analysis logic to be able to use
-	// them as dedupe src extents (yet).
+	// they are just empty.  We can't free any space there.  With
+	// --ro-sources they are scanned, but scan_one_extent only uses
+	// their extents as dedupe src and never modifies them.
+	// Subvols excluded by filters are skipped the same way.
 	BEESTRACE("is_root_ro(" << old_state.m_root << ")");
-	if (m_ctx->is_root_ro(old_state.m_root)) {
-		BEESLOGDEBUG("WORKAROUND: skipping scan of RO root " << old_state.m_root);
-		BEESCOUNT(root_workaround_btrfs_send);
+	const bool root_excluded = m_ctx->roots()->is_root_excluded(old_state.m_root);
+	if (root_excluded || (!m_ctx->roots()->ro_sources() && m_ctx->is_root_ro(old_state.m_root))) {
+		if (root_excluded) {
+			BEESLOGDEBUG("Filter: skipping scan of excluded root " << old_state.m_root);
+			BEESCOUNT(root_filter_skip);
+		} else {
+			BEESLOGDEBUG("WORKAROUND: skipping scan of RO root " << old_state.m_root);
+			BEESCOUNT(root_workaround_btrfs_send);
+		}
 		// We would call next_transid() here, but we want to do a few things differently.
 		// We immediately defer further crawling on this subvol.
 		// We track max_transid if the subvol scan has never started.
@@ -1402,6 +3022,7 @@ BeesCrawl::fetch_extents()
 	BEESTRACE("looking for new objects " << old_state);
 	// Don't set max_transid to m_max_transid here.	 See crawl_one_extent.
 	m_btof.transid(old_state.m_min_transid);
+	Timer search_timer;
 	if (catch_all([&]() {
 		m_next_extent_data = m_btof.lower_bound(old_state.m_objectid);
 	})) {
@@ -1418,6 +3039,22 @@ BeesCrawl::fetch_extents()
 	new_state.m_objectid = max(m_next_extent_data.objectid() + 1, m_next_extent_data.objectid());
 	new_state.m_offset = 0;
 	set_state(new_state);
+
+	// A slow search means the metadata wasn't cached.  Run the next search
+	// in the background now, so its pages are cached when we get there.
+	if (search_timer.age() > BEES_CRAWL_PREFETCH_TIME && !m_prefetch_busy->exchange(true)) {
+		const auto busy = m_prefetch_busy;
+		const auto objectid = new_state.m_objectid;
+		auto btof = m_btof;
+		Task("crawl_prefetch_" + to_string(old_state.m_root), [busy, objectid, btof]() mutable {
+			BEESNOTE("crawl_prefetch objectid " << objectid);
+			catch_all([&]() {
+				btof.lower_bound(objectid);
+			});
+			BEESCOUNT(crawl_prefetch);
+			*busy = false;
+		}).run();
+	}
 	return true;
 }
 
@@ -1455,6 +3092,14 @@ BeesCrawl::peek_front()
 	return bti_to_bfr(m_next_extent_data);
 }
 
+BtrfsTreeItem
+BeesCrawl::peek_front_item()
+{
+	unique_lock<mutex> lock(m_mutex);
+	fetch_extents_harder();
+	return m_next_extent_data;
+}
+
 BeesFileRange
 BeesCrawl::pop_front()
 {
@@ -1490,6 +3135,28 @@ BeesCrawl::set_state(const BeesCrawlState &bcs)
 	m_ctx->roots()->crawl_state_set_dirty();
 }
 
+void
+BeesCrawl::count_scan(uint64_t bytes)
+{
+	m_scan_bytes += bytes;
+}
+
+void
+BeesCrawl::count_hit(uint64_t bytes)
+{
+	m_hit_bytes += bytes;
+}
+
+double
+BeesCrawl::hit_rate() const
+{
+	// A subvol with no history starts at 1/16, so it takes a few
+	// hundred MiB of scanning to learn much about it
+	const double prior_hit = 16 * 1024 * 1024;
+	const double prior_scan = 256 * 1024 * 1024;
+	return (m_hit_bytes + prior_hit) / (m_scan_bytes + prior_scan);
+}
+
 void
 BeesCrawl::deferred(bool def_setting)
 {
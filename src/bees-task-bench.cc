@@ -0,0 +1,371 @@
+#include "crucible/error.h"
+#include "crucible/process.h"
+#include "crucible/task.h"
+#include "crucible/time.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+using namespace crucible;
+using namespace std;
+
+// Task scheduling micro-benchmark.  Measures Task queue throughput,
+// start latency, worker fairness, Exclusion contention and Barrier
+// fan-in at a range of worker thread counts.
+
+namespace {
+
+	struct BenchConfig {
+		vector<size_t>	m_thread_counts { 1, 2, 4, 8, 16, 32, 64, 128 };
+		size_t		m_tasks = 100000;
+		size_t		m_wakeups = 1000;
+		size_t		m_exclusions = 16;
+		size_t		m_contenders = 20000;
+		double		m_work_us = 1;
+	};
+
+	uint64_t
+	now_ns()
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Busy work, so Tasks hold workers and locks for a realistic time
+	void
+	spin_us(double us)
+	{
+		const auto end = now_ns() + uint64_t(us * 1000);
+		while (now_ns() < end) {
+			// spin
+		}
+	}
+
+	double
+	percentile_us(vector<uint64_t> &v, double p)
+	{
+		if (v.empty()) {
+			return 0;
+		}
+		const size_t n = min(v.size() - 1, static_cast<size_t>(v.size() * p));
+		nth_element(v.begin(), v.begin() + n, v.end());
+		return v[n] / 1000.0;
+	}
+
+	uint64_t
+	context_switches()
+	{
+		struct rusage usage;
+		DIE_IF_MINUS_ONE(getrusage(RUSAGE_SELF, &usage));
+		return usage.ru_nvcsw + usage.ru_nivcsw;
+	}
+
+	/// Counts down to zero, then wakes up the main thread
+	class Countdown {
+		mutex			m_mutex;
+		condition_variable	m_cv;
+		size_t			m_count;
+	public:
+		Countdown(size_t count) : m_count(count) { }
+		void done()
+		{
+			unique_lock<mutex> lock(m_mutex);
+			THROW_CHECK0(runtime_error, m_count > 0);
+			if (!--m_count) {
+				m_cv.notify_all();
+			}
+		}
+		void wait()
+		{
+			unique_lock<mutex> lock(m_mutex);
+			while (m_count) {
+				m_cv.wait(lock);
+			}
+		}
+	};
+
+	/// Tasks run by each worker thread, to measure fairness
+	class WorkerCounts {
+		mutex			m_mutex;
+		map<pid_t, size_t>	m_counts;
+	public:
+		void count()
+		{
+			static thread_local pid_t tid = crucible::gettid();
+			unique_lock<mutex> lock(m_mutex);
+			++m_counts[tid];
+		}
+		string summary(size_t threads)
+		{
+			unique_lock<mutex> lock(m_mutex);
+			size_t lo = m_counts.size() < threads ? 0 : SIZE_MAX, hi = 0;
+			for (const auto &i : m_counts) {
+				lo = min(lo, i.second);
+				hi = max(hi, i.second);
+			}
+			ostringstream oss;
+			oss << m_counts.size() << "/" << threads << " " << lo << ".." << hi;
+			return oss.str();
+		}
+	};
+
+	/// Tasks submitted from a non-worker thread, all at once
+	void
+	bench_throughput(const BenchConfig &config, size_t threads)
+	{
+		vector<uint64_t> queued_ns(config.m_tasks);
+		vector<uint64_t> latency_ns(config.m_tasks);
+		Countdown countdown(config.m_tasks);
+		WorkerCounts worker_counts;
+
+		vector<Task> tasks;
+		tasks.reserve(config.m_tasks);
+		for (size_t i = 0; i < config.m_tasks; ++i) {
+			tasks.push_back(Task("bench_" + to_string(i), [&, i]() {
+				latency_ns[i] = now_ns() - queued_ns[i];
+				worker_counts.count();
+				spin_us(config.m_work_us);
+				countdown.done();
+			}));
+		}
+
+		const auto csw_before = context_switches();
+		Timer run_timer;
+		for (size_t i = 0; i < config.m_tasks; ++i) {
+			queued_ns[i] = now_ns();
+			tasks[i].run();
+		}
+		const double enqueue_time = run_timer.age();
+		countdown.wait();
+		const double run_time = run_timer.age();
+		const auto csw = context_switches() - csw_before;
+
+		cout << setw(8) << threads
+			<< setw(14) << fixed << setprecision(0) << config.m_tasks / enqueue_time
+			<< setw(14) << config.m_tasks / run_time
+			<< setw(12) << setprecision(1) << percentile_us(latency_ns, 0.50)
+			<< setw(12) << percentile_us(latency_ns, 0.99)
+			<< setw(12) << percentile_us(latency_ns, 0.999)
+			<< setw(10) << setprecision(3) << double(csw) / config.m_tasks
+			<< "  " << worker_counts.summary(threads) << endl;
+	}
+
+	/// One Task at a time on an idle pool
+	void
+	bench_wakeup(const BenchConfig &config, size_t threads)
+	{
+		vector<uint64_t> latency_ns;
+		latency_ns.reserve(config.m_wakeups);
+		const auto csw_before = context_switches();
+		for (size_t i = 0; i < config.m_wakeups; ++i) {
+			Countdown countdown(1);
+			uint64_t start_ns = 0;
+			Task task("bench_wakeup", [&]() {
+				latency_ns.push_back(now_ns() - start_ns);
+				countdown.done();
+			});
+			start_ns = now_ns();
+			task.run();
+			countdown.wait();
+		}
+		const auto csw = context_switches() - csw_before;
+		cout << setw(8) << threads
+			<< setw(12) << fixed << setprecision(1) << percentile_us(latency_ns, 0.50)
+			<< setw(12) << percentile_us(latency_ns, 0.99)
+			<< setw(12) << percentile_us(latency_ns, 0.999)
+			<< setw(10) << setprecision(3) << double(csw) / config.m_wakeups << endl;
+	}
+
+	/// Many Tasks contending for a few Exclusions, like crawl_one_extent's
+	/// inode locks with many snapshots of a few files.  A Task that can't
+	/// get its lock is appended to the owner and retried when it is released.
+	void
+	bench_exclusion(const BenchConfig &config, size_t threads)
+	{
+		vector<Exclusion> exclusions(config.m_exclusions);
+		Countdown countdown(config.m_contenders);
+		atomic<size_t> lock_fails(0);
+
+		vector<Task> tasks;
+		tasks.reserve(config.m_contenders);
+		for (size_t i = 0; i < config.m_contenders; ++i) {
+			auto &exclusion = exclusions[i % exclusions.size()];
+			tasks.push_back(Task("bench_lock_" + to_string(i), [&]() {
+				auto lock = exclusion.try_lock(Task::current_task());
+				if (!lock) {
+					++lock_fails;
+					return;
+				}
+				spin_us(config.m_work_us);
+				lock.release();
+				countdown.done();
+			}));
+		}
+
+		const auto csw_before = context_switches();
+		Timer run_timer;
+		for (auto &task : tasks) {
+			task.run();
+		}
+		countdown.wait();
+		const double run_time = run_timer.age();
+		const auto csw = context_switches() - csw_before;
+
+		// With one lock per Exclusion, the best case is one Exclusion per worker
+		const double ideal = config.m_contenders * config.m_work_us / 1e6 / min(threads, config.m_exclusions);
+		cout << setw(8) << threads
+			<< setw(14) << fixed << setprecision(0) << config.m_contenders / run_time
+			<< setw(12) << setprecision(3) << run_time
+			<< setw(12) << ideal
+			<< setw(12) << double(lock_fails) / config.m_contenders
+			<< setw(10) << double(csw) / config.m_contenders << endl;
+	}
+
+	/// Tasks that each hold a reference to a Barrier, which runs a final
+	/// Task when the last reference is released
+	void
+	bench_barrier(const BenchConfig &config, size_t threads)
+	{
+		Countdown countdown(1);
+		uint64_t last_release_ns = 0;
+		mutex release_mutex;
+		uint64_t done_ns = 0;
+
+		Barrier barrier;
+		barrier.insert_task(Task("bench_barrier_done", [&]() {
+			done_ns = now_ns();
+			countdown.done();
+		}));
+
+		Timer run_timer;
+		for (size_t i = 0; i < config.m_tasks; ++i) {
+			Barrier task_barrier = barrier;
+			Task("bench_barrier_" + to_string(i), [&, task_barrier]() mutable {
+				spin_us(config.m_work_us);
+				{
+					unique_lock<mutex> lock(release_mutex);
+					last_release_ns = now_ns();
+				}
+				task_barrier.release();
+			}).run();
+		}
+		barrier.release();
+		countdown.wait();
+		const double run_time = run_timer.age();
+
+		unique_lock<mutex> lock(release_mutex);
+		cout << setw(8) << threads
+			<< setw(14) << fixed << setprecision(0) << config.m_tasks / run_time
+			<< setw(16) << setprecision(1) << (done_ns - min(done_ns, last_release_ns)) / 1000.0 << endl;
+	}
+
+	vector<size_t>
+	parse_list(const string &s)
+	{
+		vector<size_t> rv;
+		istringstream iss(s);
+		string word;
+		while (getline(iss, word, ',')) {
+			rv.push_back(stoul(word));
+			THROW_CHECK1(invalid_argument, rv.back(), rv.back() > 0);
+		}
+		THROW_CHECK1(invalid_argument, s, !rv.empty());
+		return rv;
+	}
+
+	void
+	bench_usage(const char *argv0)
+	{
+		cerr << "Usage: " << argv0 << " [options]\n"
+			<< "    -t, --threads LIST       Comma-separated worker thread counts (default 1,2,4,8,16,32,64,128)\n"
+			<< "    -n, --tasks N            Tasks per throughput and barrier run (default 100000)\n"
+			<< "    -w, --wakeups N          Tasks run one at a time per wakeup run (default 1000)\n"
+			<< "    -x, --exclusions N       Exclusions shared by contending Tasks (default 16)\n"
+			<< "    -c, --contenders N       Tasks per Exclusion contention run (default 20000)\n"
+			<< "    -u, --work-us US         Busy work per Task in microseconds (default 1)\n";
+	}
+
+}
+
+int
+main(int argc, char *argv[])
+{
+	BenchConfig config;
+
+	static const struct option long_options[] = {
+		{ "contenders",  required_argument, NULL, 'c' },
+		{ "exclusions",  required_argument, NULL, 'x' },
+		{ "help",        no_argument,       NULL, 'h' },
+		{ "tasks",       required_argument, NULL, 'n' },
+		{ "threads",     required_argument, NULL, 't' },
+		{ "wakeups",     required_argument, NULL, 'w' },
+		{ "work-us",     required_argument, NULL, 'u' },
+		{ 0, 0, 0, 0 },
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "c:hn:t:u:w:x:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'c': config.m_contenders = stoul(optarg); break;
+			case 'n': config.m_tasks = stoul(optarg); break;
+			case 't': config.m_thread_counts = parse_list(optarg); break;
+			case 'u': config.m_work_us = stod(optarg); break;
+			case 'w': config.m_wakeups = stoul(optarg); break;
+			case 'x': config.m_exclusions = stoul(optarg); break;
+			case 'h':
+			default:
+				bench_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	THROW_CHECK1(invalid_argument, config.m_tasks, config.m_tasks > 0);
+	THROW_CHECK1(invalid_argument, config.m_wakeups, config.m_wakeups > 0);
+	THROW_CHECK1(invalid_argument, config.m_exclusions, config.m_exclusions > 0);
+	THROW_CHECK1(invalid_argument, config.m_contenders, config.m_contenders > 0);
+
+	cout << "throughput: " << config.m_tasks << " tasks queued at once, " << config.m_work_us << " us work each\n";
+	cout << setw(8) << "threads" << setw(14) << "enqueue/s" << setw(14) << "tasks/s"
+		<< setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "p99.9 us"
+		<< setw(10) << "csw/task" << "  workers used, tasks per worker" << endl;
+	for (const auto threads : config.m_thread_counts) {
+		TaskMaster::set_thread_count(threads);
+		bench_throughput(config, threads);
+	}
+
+	cout << "\nwakeup: " << config.m_wakeups << " tasks queued one at a time on an idle pool\n";
+	cout << setw(8) << "threads" << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "p99.9 us"
+		<< setw(10) << "csw/task" << endl;
+	for (const auto threads : config.m_thread_counts) {
+		TaskMaster::set_thread_count(threads);
+		bench_wakeup(config, threads);
+	}
+
+	cout << "\nexclusion: " << config.m_contenders << " tasks sharing " << config.m_exclusions << " exclusions\n";
+	cout << setw(8) << "threads" << setw(14) << "tasks/s" << setw(12) << "sec" << setw(12) << "ideal sec"
+		<< setw(12) << "fails/task" << setw(10) << "csw/task" << endl;
+	for (const auto threads : config.m_thread_counts) {
+		TaskMaster::set_thread_count(threads);
+		bench_exclusion(config, threads);
+	}
+
+	cout << "\nbarrier: " << config.m_tasks << " tasks holding one barrier\n";
+	cout << setw(8) << "threads" << setw(14) << "tasks/s" << setw(16) << "release us" << endl;
+	for (const auto threads : config.m_thread_counts) {
+		TaskMaster::set_thread_count(threads);
+		bench_barrier(config, threads);
+	}
+
+	TaskMaster::set_thread_count(0);
+	return EXIT_SUCCESS;
+}
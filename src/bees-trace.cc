@@ -32,7 +32,7 @@ BeesTracer::~BeesTracer()
 			tl_first = false;
 		}
 		try {
-			m_func();
+			m_fn(m_arg);
 		} catch (exception &e) {
 			BEESLOGNOTICE("Nested exception: " << e.what());
 		} catch (...) {
@@ -49,8 +49,8 @@ BeesTracer::~BeesTracer()
 	}
 }
 
-BeesTracer::BeesTracer(function<void()> f, bool silent) :
-	m_func(f)
+void
+BeesTracer::push(bool silent)
 {
 	m_next_tracer = tl_next_tracer;
 	tl_next_tracer = this;
@@ -63,7 +63,7 @@ BeesTracer::trace_now()
 	BeesTracer *tp = tl_next_tracer;
 	BEESLOGNOTICE("--- BEGIN TRACE ---");
 	while (tp) {
-		tp->m_func();
+		tp->m_fn(tp->m_arg);
 		tp = tp->m_next_tracer;
 	}
 	BEESLOGNOTICE("---  END  TRACE ---");
@@ -81,30 +81,61 @@ BeesTracer::set_silent()
 	tl_silent = true;
 }
 
-thread_local BeesNote *BeesNote::tl_next = nullptr;
 mutex BeesNote::s_mutex;
-map<pid_t, BeesNote*> BeesNote::s_status;
+set<BeesNote::Slot*> BeesNote::s_slots;
 thread_local string BeesNote::tl_name;
 
+struct BeesNote::SlotHolder {
+	Slot m_slot;
+	SlotHolder() {
+		m_slot.m_tid = crucible::gettid();
+		m_slot.m_pthread = pthread_self();
+		m_slot.m_name = tl_name;
+		unique_lock<mutex> lock(s_mutex);
+		s_slots.insert(&m_slot);
+	}
+	~SlotHolder() {
+		unique_lock<mutex> lock(s_mutex);
+		s_slots.erase(&m_slot);
+	}
+};
+
+BeesNote::Slot &
+BeesNote::slot()
+{
+	static thread_local SlotHolder tl_slot_holder;
+	return tl_slot_holder.m_slot;
+}
+
 BeesNote::~BeesNote()
 {
-	tl_next = m_prev;
-	unique_lock<mutex> lock(s_mutex);
-	if (tl_next) {
-		s_status[crucible::gettid()] = tl_next;
-	} else {
-		s_status.erase(crucible::gettid());
-	}
+	unique_lock<mutex> lock(m_slot->m_mutex);
+	m_slot->m_top = m_prev;
 }
 
-BeesNote::BeesNote(function<void(ostream &os)> f) :
-	m_func(f)
+void
+BeesNote::push()
 {
-	m_name = get_name();
-	m_prev = tl_next;
-	tl_next = this;
-	unique_lock<mutex> lock(s_mutex);
-	s_status[crucible::gettid()] = tl_next;
+	m_slot = &slot();
+	unique_lock<mutex> lock(m_slot->m_mutex);
+	m_prev = m_slot->m_top;
+	m_slot->m_top = this;
+}
+
+string
+BeesNote::name_locked() const
+{
+	// Same order as get_name(), but from another thread
+	if (!m_slot->m_name.empty()) {
+		return m_slot->m_name;
+	}
+	if (m_task) {
+		return m_task.title();
+	}
+	char buf[16] = { 0 };
+	pthread_getname_np(m_slot->m_pthread, buf, sizeof(buf));
+	buf[sizeof(buf) - 1] = '\0';
+	return buf;
 }
 
 void
@@ -112,6 +143,9 @@ BeesNote::set_name(const string &name)
 {
 	tl_name = name;
 	pthread_setname(name);
+	auto &s = slot();
+	unique_lock<mutex> lock(s.m_mutex);
+	s.m_name = name;
 }
 
 string
@@ -140,22 +174,89 @@ BeesNote::get_name()
 	return pthread_getname();
 }
 
+// Keep the words before the first one with a digit, path, quote or
+// bracket in it.  Semicolons separate frames in folded stacks.
+static
+string
+fold_note(const string &text)
+{
+	string rv;
+	istringstream iss(text);
+	string word;
+	while (iss >> word) {
+		if (word.find_first_of("0123456789/'\"[(<;=") != string::npos) {
+			break;
+		}
+		if (!rv.empty()) {
+			rv += ' ';
+		}
+		rv += word;
+	}
+	while (!rv.empty() && (rv.back() == ':' || rv.back() == ',')) {
+		rv.pop_back();
+	}
+	return rv.empty() ? "..." : rv;
+}
+
+// Task names like "crawl_257" become "crawl"
+static
+string
+fold_name(const string &name)
+{
+	string rv = name.substr(0, name.find_first_of("0123456789;"));
+	while (!rv.empty() && (rv.back() == '_' || rv.back() == '-' || rv.back() == ' ')) {
+		rv.pop_back();
+	}
+	return rv.empty() ? "..." : rv;
+}
+
+vector<string>
+BeesNote::get_folded_stacks()
+{
+	unique_lock<mutex> lock(s_mutex);
+	vector<string> rv;
+	for (auto s : s_slots) {
+		unique_lock<mutex> slot_lock(s->m_mutex);
+		if (!s->m_top) {
+			continue;
+		}
+		vector<string> frames;
+		for (auto note = s->m_top; note; note = note->m_prev) {
+			ostringstream oss;
+			note->m_fn(note->m_arg, oss);
+			frames.push_back(fold_note(oss.str()));
+		}
+		string stack = fold_name(s->m_top->name_locked());
+		for (auto i = frames.rbegin(); i != frames.rend(); ++i) {
+			stack += ';';
+			stack += *i;
+		}
+		rv.push_back(stack);
+	}
+	return rv;
+}
+
 BeesNote::ThreadStatusMap
 BeesNote::get_status()
 {
 	unique_lock<mutex> lock(s_mutex);
 	ThreadStatusMap rv;
-	for (auto t : s_status) {
+	for (auto s : s_slots) {
+		unique_lock<mutex> slot_lock(s->m_mutex);
+		const auto note = s->m_top;
+		if (!note) {
+			continue;
+		}
 		ostringstream oss;
-		if (!t.second->m_name.empty()) {
-			oss << t.second->m_name << ": ";
+		const auto name = note->name_locked();
+		if (!name.empty()) {
+			oss << name << ": ";
 		}
-		if (t.second->m_timer.age() > BEES_TOO_LONG) {
-			oss << "[" << t.second->m_timer << "s] ";
+		if (note->m_timer.age() > BEES_TOO_LONG) {
+			oss << "[" << note->m_timer << "s] ";
 		}
-		t.second->m_func(oss);
-		rv[t.first] = oss.str();
+		note->m_fn(note->m_arg, oss);
+		rv[s->m_tid] = oss.str();
 	}
 	return rv;
 }
-
@@ -326,11 +326,57 @@ BeesRangePair::operator<(const BeesRangePair &that) const
 	return tie(second, first) < tie(that.second, that.first);
 }
 
+// Data csums of the extent containing a file offset.  Matching
+// csums stand in for reading and comparing the dst block.  The
+// kernel compares the data again before it dedupes anything.
+class BeesCsumCursor {
+	shared_ptr<BeesContext>	m_ctx;
+	BtrfsExtentWalker	m_ew;
+	Extent			m_extent;
+	map<off_t, BeesHash>	m_sums;
+	bool			m_valid = false;
+public:
+	BeesCsumCursor(shared_ptr<BeesContext> ctx, Fd fd);
+	bool find(off_t p, BeesHash &hash);
+};
+
+BeesCsumCursor::BeesCsumCursor(shared_ptr<BeesContext> ctx, Fd fd) :
+	m_ctx(ctx),
+	m_ew(fd)
+{
+}
+
+bool
+BeesCsumCursor::find(off_t p, BeesHash &hash)
+{
+	if (!m_valid || p < m_extent.begin() || p >= m_extent.end()) {
+		m_valid = true;
+		m_sums.clear();
+		m_ew.seek(p);
+		m_extent = m_ew.current();
+		// Compressed extents have csums of the compressed data,
+		// and the others have no csums at all
+		const auto not_csummed = Extent::HOLE | Extent::PREALLOC | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE;
+		if (!(m_extent.flags() & not_csummed)) {
+			catch_all([&]() {
+				m_sums = m_ctx->get_csum_hashes(m_extent);
+			});
+		}
+	}
+	const auto found = m_sums.find(p);
+	if (found == m_sums.end()) {
+		return false;
+	}
+	hash = found->second;
+	return true;
+}
+
 bool
 BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 {
 	BEESTOOLONG("grow constrained = " << constrained << " *this = " << *this);
 	BEESTRACE("grow constrained = " << constrained << " *this = " << *this);
+	BEESPHASE(compare);
 	bool rv = false;
 	Timer grow_backward_timer;
 
@@ -348,8 +394,18 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 	Extent e_second = ew_second.current();
 	BEESTRACE("e_second " << e_second);
 
-	// Preread entire extent
-	bees_readahead(second.fd(), e_second.begin(), e_second.size());
+	// Blocks are compared by csum when both sides have one,
+	// so only src data has to be read for the hash and zero checks
+	BeesCsumCursor csums_first(ctx, first.fd());
+	BeesCsumCursor csums_second(ctx, second.fd());
+	BeesHash csum_probe;
+
+	// Preread entire extent, but skip dst data covered by csums
+	if (!csums_second.find(second.begin(), csum_probe)) {
+		if (!BeesExtentBufferScope::read_extent(second.fd(), e_second)) {
+			bees_readahead(second.fd(), e_second.begin(), e_second.size());
+		}
+	}
 	bees_readahead(first.fd(), e_second.begin() + first.begin() - second.begin(), e_second.size());
 
 	auto hash_table = ctx->hash_table();
@@ -414,6 +470,18 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 			break;
 		}
 
+		// Blocks with different csums cannot match
+		BeesHash first_csum, second_csum;
+		bool csum_equal = false;
+		if (csums_first.find(new_first.begin(), first_csum) && csums_second.find(new_second.begin(), second_csum)) {
+			if (first_csum != second_csum) {
+				BEESCOUNT(pairbackward_csum_miss);
+				break;
+			}
+			csum_equal = true;
+			BEESCOUNT(pairbackward_csum_hit);
+		}
+
 		BEESTRACE("first " << first << " new_first " << new_first);
 		BeesBlockData first_bbd(first.fd(), new_first.begin(), first.begin() - new_first.begin());
 		BEESTRACE("first_bbd " << first_bbd);
@@ -422,7 +490,7 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 		BEESTRACE("second_bbd " << second_bbd);
 
 		// Both blocks must have identical content
-		if (!first_bbd.is_data_equal(second_bbd)) {
+		if (!csum_equal && !first_bbd.is_data_equal(second_bbd)) {
 			BEESCOUNT(pairbackward_miss);
 			break;
 		}
@@ -478,7 +546,9 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 				BEESCOUNT(pairforward_hole);
 				break;
 			}
-			bees_readahead(second.fd(), e_second.begin(), e_second.size());
+			if (!csums_second.find(second.end(), csum_probe)) {
+				bees_readahead(second.fd(), e_second.begin(), e_second.size());
+			}
 		}
 		BEESCOUNT(pairforward_try);
 
@@ -525,6 +595,20 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 			break;
 		}
 
+		// Blocks with different csums cannot match.  A csum covers a
+		// whole block, so unaligned EOF blocks are compared by data.
+		BeesHash first_csum, second_csum;
+		bool csum_equal = false;
+		if (new_first.end() - first.end() == BLOCK_SIZE_SUMS &&
+		    csums_first.find(first.end(), first_csum) && csums_second.find(second.end(), second_csum)) {
+			if (first_csum != second_csum) {
+				BEESCOUNT(pairforward_csum_miss);
+				break;
+			}
+			csum_equal = true;
+			BEESCOUNT(pairforward_csum_hit);
+		}
+
 		BEESTRACE("first " << first << " new_first " << new_first);
 		BeesBlockData first_bbd(first.fd(), first.end(), new_first.end() - first.end());
 		BEESTRACE("first_bbd " << first_bbd);
@@ -533,7 +617,7 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 		BEESTRACE("second_bbd " << second_bbd);
 
 		// Both blocks must have identical content
-		if (!first_bbd.is_data_equal(second_bbd)) {
+		if (!csum_equal && !first_bbd.is_data_equal(second_bbd)) {
 			BEESCOUNT(pairforward_miss);
 			break;
 		}
@@ -877,6 +961,18 @@ BeesBlockData::BeesBlockData(Fd fd, off_t offset, size_t read_length) :
 	THROW_CHECK1(invalid_argument, m_offset, (m_offset % BLOCK_SIZE_SUMS) == 0);
 }
 
+BeesBlockData::BeesBlockData(Fd fd, off_t offset, const Blob &data) :
+	m_fd(fd),
+	m_offset(offset),
+	m_length(data.size()),
+	m_data(data)
+{
+	BEESTRACE("Constructing " << *this);
+	THROW_CHECK1(invalid_argument, m_length, m_length > 0);
+	THROW_CHECK1(invalid_argument, m_length, m_length <= BLOCK_SIZE_SUMS);
+	THROW_CHECK1(invalid_argument, m_offset, (m_offset % BLOCK_SIZE_SUMS) == 0);
+}
+
 BeesBlockData::BeesBlockData() :
 	m_offset(0),
 	m_length(0)
@@ -902,6 +998,9 @@ BeesBlockData::addr(const BeesAddress &a)
 const BeesBlockData::Blob &
 BeesBlockData::data() const
 {
+	if (m_data.empty() && BeesExtentBufferScope::find(m_fd, m_offset, size(), m_data)) {
+		BEESCOUNT(block_buffer_hit);
+	}
 	if (m_data.empty()) {
 		THROW_CHECK1(invalid_argument, size(), size() > 0);
 		BEESNOTE("Reading BeesBlockData " << *this);
@@ -930,6 +1029,17 @@ BeesBlockData::hash() const
 		m_hash = BeesHash(blob.data(), blob.size());
 		m_hash_done = true;
 		BEESCOUNT(block_hash);
+		// Most blocks are not zero, and the hash proves it without
+		// touching the data again.  Zero candidates are checked now,
+		// while the block is still in cache.
+		if (!m_zero_done) {
+			if (m_hash.may_be_zero(blob.size())) {
+				is_data_zero();
+			} else {
+				m_is_zero = false;
+				m_zero_done = true;
+			}
+		}
 	}
 
 	return m_hash;
@@ -938,19 +1048,16 @@ BeesBlockData::hash() const
 bool
 BeesBlockData::is_data_zero() const
 {
-	// The CRC64 of zero is zero, so skip some work if we already know the CRC
-	// ...but that doesn't work for any other hash function, and it
-	// saves us next to nothing.
-
-	// OK read block (maybe) and check every byte
-	for (auto c : data()) {
-		if (c != '\0') {
-			return false;
+	if (!m_zero_done) {
+		// OK read block (maybe) and check every byte
+		m_is_zero = data().is_zero();
+		m_zero_done = true;
+		if (m_is_zero) {
+			BEESCOUNT(block_zero);
 		}
 	}
 
-	BEESCOUNT(block_zero);
-	return true;
+	return m_is_zero;
 }
 
 bool
@@ -968,3 +1075,86 @@ BeesBlockData::is_data_equal(const BeesBlockData &that) const
 	return data() == that.data();
 }
 
+
+thread_local bool BeesExtentBufferScope::tl_active = false;
+thread_local deque<BeesExtentBufferScope::Entry> BeesExtentBufferScope::tl_entries;
+
+BeesExtentBufferScope::BeesExtentBufferScope() :
+	m_outer(!tl_active)
+{
+	tl_active = true;
+}
+
+BeesExtentBufferScope::~BeesExtentBufferScope()
+{
+	if (m_outer) {
+		tl_entries.clear();
+		tl_active = false;
+	}
+}
+
+void
+BeesExtentBufferScope::insert(const Fd &fd, const Extent &e, const ByteVector &data)
+{
+	if (data.empty()) {
+		return;
+	}
+	if (tl_entries.size() >= BEES_EXTENT_BUFFER_COUNT) {
+		tl_entries.pop_front();
+	}
+	tl_entries.push_back(Entry {
+		.m_fd = fd,
+		.m_begin = e.begin(),
+		.m_bytenr = e.bytenr(),
+		.m_extent_offset = e.offset(),
+		.m_data = data,
+	});
+}
+
+bool
+BeesExtentBufferScope::read_extent(const Fd &fd, const Extent &e)
+{
+	if (!tl_active || !e.compressed()) {
+		return false;
+	}
+	for (const auto &i : tl_entries) {
+		if (i.m_bytenr != e.bytenr() || i.m_extent_offset > e.offset()
+			|| e.offset() + e.size() > i.m_extent_offset + ranged_cast<off_t>(i.m_data.size())) {
+			continue;
+		}
+		if (int(i.m_fd) == int(fd) && i.m_begin == e.begin()) {
+			return true;
+		}
+		// Another reference to the same data, e.g. in a snapshot
+		BEESCOUNT(block_buffer_share);
+		insert(fd, e, i.m_data.at(e.offset() - i.m_extent_offset, e.size()));
+		return true;
+	}
+	BEESCOUNT(block_buffer_read);
+	insert(fd, e, bees_read_range(fd, e.begin(), e.size()));
+	return true;
+}
+
+void
+BeesExtentBufferScope::keep_extent(const Fd &fd, const Extent &e, const ByteVector &data)
+{
+	if (tl_active && e.compressed()) {
+		insert(fd, e, data);
+	}
+}
+
+bool
+BeesExtentBufferScope::find(const Fd &fd, off_t offset, size_t length, ByteVector &data)
+{
+	if (!tl_active) {
+		return false;
+	}
+	for (const auto &i : tl_entries) {
+		if (int(i.m_fd) == int(fd) && i.m_begin <= offset
+			&& offset + ranged_cast<off_t>(length) <= i.m_begin + ranged_cast<off_t>(i.m_data.size())) {
+			data = i.m_data.at(offset - i.m_begin, length);
+			return true;
+		}
+	}
+	return false;
+}
@@ -101,6 +101,14 @@ BeesStatTmpl<T>::at(string idx) const
 	return rv;
 }
 
+template <class T>
+map<string, T>
+BeesStatTmpl<T>::stats_map() const
+{
+	unique_lock<mutex> lock(m_mutex);
+	return m_stats_map;
+}
+
 template <class T>
 void
 BeesStatTmpl<T>::add_count(string idx, size_t amount)
@@ -133,7 +141,86 @@ BeesStatTmpl<T>::operator=(const BeesStatTmpl<T> &that)
 	return *this;
 }
 
-BeesStats BeesStats::s_global;
+BeesStatCounters BeesStats::s_global;
+
+mutex BeesStatCounters::s_mutex;
+map<string, size_t> BeesStatCounters::s_slot_map;
+vector<string> BeesStatCounters::s_slot_names;
+list<BeesStatCounters::Shard *> BeesStatCounters::s_shards;
+list<BeesStatCounters::Shard *> BeesStatCounters::s_free_shards;
+thread_local BeesStatCounters::ShardHolder BeesStatCounters::tl_shard;
+
+size_t
+BeesStatCounters::slot(const string &name)
+{
+	unique_lock<mutex> lock(s_mutex);
+	const auto found = s_slot_map.find(name);
+	if (found != s_slot_map.end()) {
+		return found->second;
+	}
+	const size_t rv = s_slot_names.size();
+	THROW_CHECK2(out_of_range, name, rv, rv < c_max_slots);
+	s_slot_names.push_back(name);
+	s_slot_map.insert(make_pair(name, rv));
+	return rv;
+}
+
+BeesStatCounters::Shard::Shard()
+{
+	for (auto &i : m_counts) {
+		i.store(0, memory_order_relaxed);
+	}
+}
+
+BeesStatCounters::ShardHolder::ShardHolder()
+{
+	unique_lock<mutex> lock(s_mutex);
+	if (s_free_shards.empty()) {
+		m_shard = new Shard;
+		s_shards.push_back(m_shard);
+	} else {
+		m_shard = s_free_shards.front();
+		s_free_shards.pop_front();
+	}
+}
+
+BeesStatCounters::ShardHolder::~ShardHolder()
+{
+	// Counts from exited threads stay in the total, so the shard
+	// is never deleted, only handed to the next new thread
+	unique_lock<mutex> lock(s_mutex);
+	s_free_shards.push_back(m_shard);
+}
+
+void
+BeesStatCounters::add_count(size_t slot, size_t amount)
+{
+	THROW_CHECK1(out_of_range, slot, slot < c_max_slots);
+	// Only this thread writes to this shard, so no atomic RMW is needed
+	auto &counter = tl_shard.m_shard->m_counts[slot];
+	counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void
+BeesStatCounters::add_count(const string &name, size_t amount)
+{
+	add_count(slot(name), amount);
+}
+
+BeesStats::BeesStats(const BeesStatCounters &)
+{
+	unique_lock<mutex> lock(BeesStatCounters::s_mutex);
+	const size_t slots = BeesStatCounters::s_slot_names.size();
+	vector<uint64_t> totals(slots, 0);
+	for (const auto &shard : BeesStatCounters::s_shards) {
+		for (size_t i = 0; i < slots; ++i) {
+			totals[i] += shard->m_counts[i].load(memory_order_relaxed);
+		}
+	}
+	for (size_t i = 0; i < slots; ++i) {
+		m_stats_map[BeesStatCounters::s_slot_names[i]] = totals[i];
+	}
+}
 
 BeesStats
 BeesStats::operator-(const BeesStats &that) const
@@ -180,25 +267,255 @@ BeesStats::operator bool() const
 	return false;
 }
 
-BeesTooLong::BeesTooLong(const string &s, double limit) :
-	m_limit(limit),
-	m_func([s](ostream &os) { os << s; })
+mutex BeesHistogram::s_mutex;
+map<string, BeesHistogram *> BeesHistogram::s_histograms;
+
+BeesHistogram::BeesHistogram()
+{
+	for (auto &i : m_buckets) {
+		i.store(0, memory_order_relaxed);
+	}
+	m_max.store(0, memory_order_relaxed);
+	m_sum.store(0, memory_order_relaxed);
+}
+
+BeesHistogram &
+BeesHistogram::get(const string &name)
+{
+	unique_lock<mutex> lock(s_mutex);
+	auto &rv = s_histograms[name];
+	if (!rv) {
+		rv = new BeesHistogram;
+	}
+	return *rv;
+}
+
+void
+BeesHistogram::for_each(const function<void(const string &name, const BeesHistogram &bh)> &f)
+{
+	unique_lock<mutex> lock(s_mutex);
+	for (const auto &i : s_histograms) {
+		if (!i.second->count()) {
+			continue;
+		}
+		f(i.first, *i.second);
+	}
+}
+
+void
+BeesHistogram::print_all(ostream &os)
+{
+	for_each([&](const string &name, const BeesHistogram &bh) {
+		os << "\t" << name << ": " << bh << "\n";
+	});
+}
+
+size_t
+BeesHistogram::bucket_of(uint64_t usec)
+{
+	// The first 2 * c_sub_buckets values have one bucket each
+	if (usec < 2 * c_sub_buckets) {
+		return usec;
+	}
+	// After that, each power of two has c_sub_buckets buckets
+	const size_t shift = (63 - __builtin_clzll(usec)) - c_sub_bits;
+	return shift * c_sub_buckets + (usec >> shift);
+}
+
+uint64_t
+BeesHistogram::bucket_max(size_t bucket)
+{
+	THROW_CHECK1(out_of_range, bucket, bucket < c_buckets);
+	if (bucket < 2 * c_sub_buckets) {
+		return bucket;
+	}
+	const size_t shift = bucket / c_sub_buckets - 1;
+	const uint64_t mantissa = bucket % c_sub_buckets + c_sub_buckets;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void
+BeesHistogram::add(double seconds)
+{
+	const uint64_t usec = seconds > 0 ? seconds * 1000000 : 0;
+	m_buckets[bucket_of(usec)].fetch_add(1, memory_order_relaxed);
+	m_sum.fetch_add(usec, memory_order_relaxed);
+	auto old_max = m_max.load(memory_order_relaxed);
+	while (usec > old_max && !m_max.compare_exchange_weak(old_max, usec, memory_order_relaxed)) {
+		// old_max was reloaded, try again
+	}
+}
+
+uint64_t
+BeesHistogram::count() const
+{
+	uint64_t rv = 0;
+	for (const auto &i : m_buckets) {
+		rv += i.load(memory_order_relaxed);
+	}
+	return rv;
+}
+
+uint64_t
+BeesHistogram::max_usec() const
+{
+	return m_max.load(memory_order_relaxed);
+}
+
+uint64_t
+BeesHistogram::sum_usec() const
+{
+	return m_sum.load(memory_order_relaxed);
+}
+
+uint64_t
+BeesHistogram::quantile_usec(double q) const
+{
+	// Buckets can change while we read them, so work from a copy
+	vector<uint64_t> counts;
+	uint64_t total = 0;
+	for (const auto &i : m_buckets) {
+		counts.push_back(i.load(memory_order_relaxed));
+		total += counts.back();
+	}
+	const uint64_t target = ceil(total * q);
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < counts.size(); ++bucket) {
+		seen += counts[bucket];
+		if (seen && seen >= target) {
+			// The max is exact, and no bucket can be above it
+			return min(bucket_max(bucket), max_usec());
+		}
+	}
+	return max_usec();
+}
+
+ostream &
+operator<<(ostream &os, const BeesHistogram &bh)
 {
+	const auto ms = [](uint64_t usec) { return usec / 1000.0; };
+	return os << "count=" << bh.count()
+		<< " p50=" << ms(bh.quantile_usec(0.50)) << "ms"
+		<< " p90=" << ms(bh.quantile_usec(0.90)) << "ms"
+		<< " p99=" << ms(bh.quantile_usec(0.99)) << "ms"
+		<< " max=" << ms(bh.max_usec()) << "ms";
 }
 
-BeesTooLong::BeesTooLong(const func_type &func, double limit) :
-	m_limit(limit),
-	m_func(func)
+thread_local BeesPhase *BeesPhase::tl_current = nullptr;
+mutex BeesPhase::s_mutex;
+map<string, BeesPhase::Totals *> BeesPhase::s_totals;
+
+BeesPhase::Totals::Totals() :
+	m_count(0),
+	m_wall_ns(0),
+	m_cpu_ns(0),
+	m_read_bytes(0)
 {
 }
 
+BeesPhase::Totals &
+BeesPhase::get(const string &name)
+{
+	unique_lock<mutex> lock(s_mutex);
+	auto &rv = s_totals[name];
+	if (!rv) {
+		rv = new Totals;
+	}
+	return *rv;
+}
+
+void
+BeesPhase::for_each(const function<void(const string &name, const Totals &totals)> &f)
+{
+	unique_lock<mutex> lock(s_mutex);
+	for (const auto &i : s_totals) {
+		f(i.first, *i.second);
+	}
+}
+
+void
+BeesPhase::print_all(ostream &os)
+{
+	for_each([&](const string &name, const Totals &totals) {
+		os << "\t" << name << ": count=" << totals.m_count
+			<< " wall=" << totals.m_wall_ns / 1000000000.0 << "s"
+			<< " cpu=" << totals.m_cpu_ns / 1000000000.0 << "s"
+			<< " read=" << pretty(totals.m_read_bytes) << "\n";
+	});
+}
+
+BeesPhase::Sample
+BeesPhase::Sample::now()
+{
+	// One getrusage call gives both CPU time and block input for this thread.
+	// It can't fail with these arguments, and this runs in a destructor.
+	struct rusage usage = { };
+	(void)getrusage(RUSAGE_THREAD, &usage);
+	const auto tv_ns = [](const timeval &tv) -> uint64_t {
+		return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+	};
+	return Sample {
+		.m_wall_ns = uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count()),
+		.m_cpu_ns = tv_ns(usage.ru_utime) + tv_ns(usage.ru_stime),
+		// ru_inblock is in 512-byte units
+		.m_read_bytes = uint64_t(usage.ru_inblock) * 512,
+	};
+}
+
+void
+BeesPhase::charge(const Sample &now)
+{
+	m_totals.m_wall_ns.fetch_add(now.m_wall_ns - m_last.m_wall_ns, memory_order_relaxed);
+	m_totals.m_cpu_ns.fetch_add(now.m_cpu_ns - m_last.m_cpu_ns, memory_order_relaxed);
+	m_totals.m_read_bytes.fetch_add(now.m_read_bytes - m_last.m_read_bytes, memory_order_relaxed);
+	m_last = now;
+}
+
+BeesPhase::BeesPhase(Totals &totals) :
+	m_totals(totals),
+	m_parent(tl_current),
+	m_last(Sample::now())
+{
+	m_totals.m_count.fetch_add(1, memory_order_relaxed);
+	if (m_parent) {
+		m_parent->charge(m_last);
+	}
+	tl_current = this;
+}
+
+BeesPhase::~BeesPhase()
+{
+	const auto now = Sample::now();
+	charge(now);
+	if (m_parent) {
+		m_parent->m_last = now;
+	}
+	tl_current = m_parent;
+}
+
+uint64_t
+BeesTooLong::now_ns()
+{
+	// Can't fail with these arguments, and this runs in a destructor
+	struct timespec ts = { };
+	(void)clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double
+BeesTooLong::age() const
+{
+	return (now_ns() - m_start_ns) / 1000000000.0;
+}
+
 void
 BeesTooLong::check() const
 {
-	if (age() > m_limit) {
+	const auto seconds = age();
+	if (seconds > m_limit) {
 		ostringstream oss;
-		m_func(oss);
-		BEESLOGWARN("PERFORMANCE: " << *this << " sec: " << oss.str());
+		m_fn(m_arg, oss);
+		BEESLOGWARN("PERFORMANCE: " << ceil(seconds * 1000) / 1000 << " sec: " << oss.str());
 	}
 }
 
@@ -207,17 +524,11 @@ BeesTooLong::~BeesTooLong()
 	check();
 }
 
-BeesTooLong &
-BeesTooLong::operator=(const func_type &f)
-{
-	m_func = f;
-	return *this;
-}
-
 void
 bees_readahead(int const fd, const off_t offset, const size_t size)
 {
 	Timer readahead_timer;
+	BEESPHASE(readahead);
 	BEESNOTE("readahead " << name_fd(fd) << " offset " << to_hex(offset) << " len " << pretty(size));
 	BEESTOOLONG("readahead " << name_fd(fd) << " offset " << to_hex(offset) << " len " << pretty(size));
 #if 0
@@ -247,6 +558,37 @@ bees_readahead(int const fd, const off_t offset, const size_t size)
 	}
 #endif
 	BEESCOUNTADD(readahead_ms, readahead_timer.age() * 1000);
+	BEESHISTOGRAM(readahead, readahead_timer.age());
+}
+
+ByteVector
+bees_read_range(int const fd, const off_t offset, const size_t size)
+{
+	Timer read_timer;
+	BEESNOTE("reading " << name_fd(fd) << " offset " << to_hex(offset) << " len " << pretty(size));
+	BEESTOOLONG("reading " << name_fd(fd) << " offset " << to_hex(offset) << " len " << pretty(size));
+	ByteVector rv(size);
+	size_t size_read = 0;
+	while (size_read < size) {
+		const ssize_t this_read = pread(fd, rv.data() + size_read, size - size_read, offset + size_read);
+		if (this_read < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			THROW_ERRNO("pread: " << size - size_read << " bytes at fd " << name_fd(fd) << " offset " << to_hex(offset + size_read));
+		}
+		if (!this_read) {
+			break;
+		}
+		size_read += this_read;
+	}
+	BEESCOUNT(block_range_read);
+	BEESCOUNTADD(block_bytes, size_read);
+	BEESCOUNTADD(block_ms, read_timer.age() * 1000);
+	if (size_read < size) {
+		return size_read ? ByteVector(rv, 0, size_read) : ByteVector();
+	}
+	return rv;
 }
 
 void
@@ -348,6 +690,7 @@ BeesTempFile::resize(off_t offset)
 	// Truncate
 	Timer resize_timer;
 	DIE_IF_NON_ZERO(ftruncate(m_fd, offset));
+	BtrfsExtentCache::invalidate(m_fd);
 	BEESCOUNT(tmp_resize);
 
 	// Success
@@ -364,6 +707,18 @@ BeesTempFile::reset()
 	resize(BLOCK_SIZE_CLONE);
 }
 
+void
+BeesTempFile::reuse()
+{
+	// Old copies are harmless until the file gets big.  Their extents
+	// are shared with the files they were deduped into, or were not
+	// duplicates after all.
+	if (m_end_offset >= BLOCK_SIZE_TEMP_FILE_RESET) {
+		BEESCOUNT(tmp_trunc);
+		reset();
+	}
+}
+
 
 BeesTempFile::~BeesTempFile()
 {
@@ -414,8 +769,9 @@ BeesTempFile::realign()
 {
 	if (m_end_offset & BLOCK_MASK_CLONE) {
 		// BEESTRACE("temporary file size " << to_hex(m_end_offset) << " not aligned");
+		// Skip to the next block.  The gap becomes a hole when the file is extended.
 		BEESCOUNT(tmp_realign);
-		reset();
+		m_end_offset = (m_end_offset + BLOCK_MASK_CLONE) & ~BLOCK_MASK_CLONE;
 		return;
 	}
 	// OK as is
@@ -462,33 +818,71 @@ BeesTempFile::make_copy(const BeesFileRange &src)
 
 	auto begin = m_end_offset;
 	auto end = m_end_offset + src.size();
-	resize(end);
+	// Reserve the range first, so a failed copy can't leave data
+	// where a later copy expects holes.  pwrite extends the file, so
+	// only a copy ending in zero blocks needs ftruncate.
+	m_end_offset = end;
+	off_t written_end = 0;
 
 	Timer copy_timer;
+	BEESPHASE(copy);
 	BeesFileRange rv(m_fd, begin, end);
 	BEESTRACE("copying to: " << rv);
 	BEESNOTE("copying " << src << " to " << rv);
 
+	// Read big chunks, then write each run of non-zero blocks with one pwrite.
+	// Zero blocks are left as holes.  copy_file_range is no use here:
+	// on btrfs it clones the src extent instead of writing a new one.
+	ByteVector buf(min(BLOCK_SIZE_MAX_COMPRESSED_EXTENT, src.size()));
 	auto src_p = src.begin();
 	auto dst_p = begin;
 
 	while (dst_p < end) {
-		auto len = min(BLOCK_SIZE_CLONE, end - dst_p);
-		BeesBlockData bbd(src.fd(), src_p, len);
-		// Don't fill in holes
-		if (bbd.is_data_zero()) {
-			BEESCOUNT(tmp_block_zero);
-		} else {
-			BEESNOTE("copying " << src << " to " << rv << "\n"
-				"\tpwrite " << bbd << " to " << name_fd(m_fd) << " offset " << to_hex(dst_p) << " len " << len);
-			pwrite_or_die(m_fd, bbd.data().data(), len, dst_p);
-			BEESCOUNT(tmp_block);
-			BEESCOUNTADD(tmp_bytes, len);
+		const auto chunk_len = min(off_t(buf.size()), end - dst_p);
+		BEESNOTE("copying " << src << " to " << rv << "\n"
+			"\tpread " << name_fd(src.fd()) << " offset " << to_hex(src_p) << " len " << chunk_len);
+		pread_or_die(src.fd(), buf.data(), chunk_len, src_p);
+		BEESCOUNT(tmp_read);
+		BEESCOUNTADD(tmp_read_bytes, chunk_len);
+
+		off_t run_begin = 0;
+		off_t run_end = 0;
+		const auto flush_run = [&]() {
+			if (run_end > run_begin) {
+				const auto run_len = run_end - run_begin;
+				BEESNOTE("copying " << src << " to " << rv << "\n"
+					"\tpwrite " << name_fd(m_fd) << " offset " << to_hex(dst_p + run_begin) << " len " << run_len);
+				pwrite_or_die(m_fd, buf.data() + run_begin, run_len, dst_p + run_begin);
+				written_end = dst_p + run_end;
+				BEESCOUNT(tmp_write);
+				BEESCOUNTADD(tmp_bytes, run_len);
+			}
+		};
+		for (off_t block_p = 0; block_p < chunk_len; block_p += BLOCK_SIZE_CLONE) {
+			const auto len = min(BLOCK_SIZE_CLONE, chunk_len - block_p);
+			const uint8_t *const p = buf.data() + block_p;
+			// Don't fill in holes
+			if (!p[0] && !memcmp(p, p + 1, len - 1)) {
+				BEESCOUNT(tmp_block_zero);
+				flush_run();
+				run_begin = run_end = block_p + len;
+			} else {
+				BEESCOUNT(tmp_block);
+				run_end = block_p + len;
+			}
 		}
-		src_p += len;
-		dst_p += len;
+		flush_run();
+
+		src_p += chunk_len;
+		dst_p += chunk_len;
+	}
+	if (written_end < end) {
+		resize(end);
+	} else {
+		BtrfsExtentCache::invalidate(m_fd);
 	}
 	BEESCOUNTADD(tmp_copy_ms, copy_timer.age() * 1000);
+	BEESHISTOGRAM(tmp_copy, copy_timer.age());
 
 	BEESCOUNT(tmp_copy);
 	return rv;
@@ -565,6 +959,16 @@ wait_for_term_signal()
 	BEESLOGDEBUG("Signal catcher exiting");
 }
 
+// Position of the ':' after the filesystem path in "FSPATH:kind=value",
+// or npos if the rule is for every filesystem
+static
+size_t
+filter_rule_scope_end(const string &rule)
+{
+	const auto eq = rule.find('=');
+	return eq == string::npos ? string::npos : rule.rfind(':', eq);
+}
+
 int
 bees_main(int argc, char *argv[])
 {
@@ -590,10 +994,6 @@ bees_main(int argc, char *argv[])
 	// so the threads will also have the signals blocked.
 	block_term_signal();
 
-	// Create a context so we can apply configuration to it
-	shared_ptr<BeesContext> bc = make_shared<BeesContext>();
-	BEESLOGDEBUG("context constructed");
-
 	string cwd(readlink_or_die("/proc/self/cwd"));
 
 	// Defaults
@@ -602,23 +1002,64 @@ bees_main(int argc, char *argv[])
 	unsigned thread_count = 0;
 	unsigned thread_min = 0;
 	double load_target = 0;
+	double cpu_pressure_target = 0;
+	double io_pressure_target = 0;
+	vector<double> fs_weights;
+	uint64_t memory_limit = 0;
 	bool workaround_btrfs_send = false;
+	bool ro_sources = false;
+	bool csum_scan = false;
+	bool watch_writes = false;
+	bool realtime_scan = false;
+	uint64_t min_extent_size = 0;
+	uint64_t min_dedupe_size = 0;
+	vector<pair<string, bool>> filter_rules;
+	BeesHash::Algorithm hash_algorithm = BeesHash::ALGO_CRC64;
+	off_t hash_table_size = 0;
+	unsigned hash_table_memory = BeesHashTable::MEM_DEFAULT;
 	BeesRoots::ScanMode root_scan_mode = BeesRoots::SCAN_MODE_INDEPENDENT;
 
+	// Long options without a short option
+	enum {
+		OPT_CPU_PRESSURE_TARGET = 0x100,
+		OPT_IO_PRESSURE_TARGET,
+		OPT_FS_WEIGHTS,
+		OPT_MEMORY_LIMIT,
+		OPT_RO_SOURCES,
+		OPT_MIN_DEDUPE_SIZE,
+		OPT_INCLUDE,
+		OPT_EXCLUDE,
+	};
+
 	// Configure getopt_long
 	static const struct option long_options[] = {
 		{ "thread-factor",         required_argument, NULL, 'C' },
 		{ "thread-min",            required_argument, NULL, 'G' },
+		{ "hash-algorithm",        required_argument, NULL, 'H' },
+		{ "hash-table-memory",     required_argument, NULL, 'M' },
 		{ "strip-paths",           no_argument,       NULL, 'P' },
+		{ "hash-table-size",       required_argument, NULL, 'S' },
 		{ "no-timestamps",         no_argument,       NULL, 'T' },
 		{ "workaround-btrfs-send", no_argument,       NULL, 'a' },
 		{ "thread-count",          required_argument, NULL, 'c' },
+		{ "min-extent-size",       required_argument, NULL, 'e' },
 		{ "loadavg-target",        required_argument, NULL, 'g' },
 		{ "help",                  no_argument,       NULL, 'h' },
 		{ "scan-mode",             required_argument, NULL, 'm' },
 		{ "absolute-paths",        no_argument,       NULL, 'p' },
+		{ "realtime-scan",         no_argument,       NULL, 'r' },
+		{ "scan-csum",             no_argument,       NULL, 's' },
 		{ "timestamps",            no_argument,       NULL, 't' },
 		{ "verbose",               required_argument, NULL, 'v' },
+		{ "watch-writes",          no_argument,       NULL, 'w' },
+		{ "cpu-pressure-target",   required_argument, NULL, OPT_CPU_PRESSURE_TARGET },
+		{ "io-pressure-target",    required_argument, NULL, OPT_IO_PRESSURE_TARGET },
+		{ "fs-weights",            required_argument, NULL, OPT_FS_WEIGHTS },
+		{ "memory-limit",          required_argument, NULL, OPT_MEMORY_LIMIT },
+		{ "ro-sources",            no_argument,       NULL, OPT_RO_SOURCES },
+		{ "min-dedupe-size",       required_argument, NULL, OPT_MIN_DEDUPE_SIZE },
+		{ "include",               required_argument, NULL, OPT_INCLUDE },
+		{ "exclude",               required_argument, NULL, OPT_EXCLUDE },
 		{ 0, 0, 0, 0 },
 	};
 
@@ -658,9 +1099,18 @@ bees_main(int argc, char *argv[])
 			case 'G':
 				thread_min = stoul(optarg);
 				break;
+			case 'H':
+				hash_algorithm = BeesHash::algorithm_from_name(optarg);
+				break;
+			case 'M':
+				hash_table_memory = BeesHashTable::memory_flags_from_names(optarg);
+				break;
 			case 'P':
 				crucible::set_relative_path(cwd);
 				break;
+			case 'S':
+				hash_table_size = stoull(optarg);
+				break;
 			case 'T':
 				chatter_prefix_timestamp = false;
 				break;
@@ -673,12 +1123,52 @@ bees_main(int argc, char *argv[])
 			case 'g':
 				load_target = stod(optarg);
 				break;
+			case OPT_CPU_PRESSURE_TARGET:
+				cpu_pressure_target = stod(optarg);
+				break;
+			case OPT_IO_PRESSURE_TARGET:
+				io_pressure_target = stod(optarg);
+				break;
+			case OPT_FS_WEIGHTS:
+				{
+					istringstream iss(optarg);
+					string word;
+					while (getline(iss, word, ',')) {
+						const double weight = stod(word);
+						THROW_CHECK1(out_of_range, weight, weight > 0);
+						fs_weights.push_back(weight);
+					}
+				}
+				break;
+			case OPT_MEMORY_LIMIT:
+				memory_limit = stoull(optarg);
+				break;
+			case OPT_RO_SOURCES:
+				// Only meaningful if RO snapshots are protected
+				workaround_btrfs_send = true;
+				ro_sources = true;
+				break;
+			case OPT_MIN_DEDUPE_SIZE:
+				min_dedupe_size = stoull(optarg);
+				break;
+			case OPT_INCLUDE:
+				filter_rules.push_back(make_pair(string(optarg), true));
+				break;
+			case OPT_EXCLUDE:
+				filter_rules.push_back(make_pair(string(optarg), false));
+				break;
+			case 'e':
+				min_extent_size = stoull(optarg);
+				break;
 			case 'm':
 				root_scan_mode = static_cast<BeesRoots::ScanMode>(stoul(optarg));
 				break;
 			case 'p':
 				crucible::set_relative_path("");
 				break;
+			case 's':
+				csum_scan = true;
+				break;
 			case 't':
 				chatter_prefix_timestamp = true;
 				break;
@@ -691,6 +1181,12 @@ bees_main(int argc, char *argv[])
 					BEESLOGNOTICE("log level set to " << bees_log_level);
 				}
 				break;
+			case 'w':
+				watch_writes = true;
+				break;
+			case 'r':
+				realtime_scan = true;
+				break;
 
 			case 'h':
 			default:
@@ -699,13 +1195,27 @@ bees_main(int argc, char *argv[])
 		}
 	}
 
-	if (optind + 1 != argc) {
-		BEESLOGERR("Only one filesystem path per bees process");
+	if (optind >= argc) {
+		BEESLOGERR("No filesystem path given");
+		return EXIT_FAILURE;
+	}
+	const vector<string> root_paths(argv + optind, argv + argc);
+	if (fs_weights.size() > root_paths.size()) {
+		BEESLOGERR("More --fs-weights than filesystem paths");
+		return EXIT_FAILURE;
+	}
+	fs_weights.resize(root_paths.size(), 1);
+	const char *home_charp = getenv("BEESHOME");
+	if (root_paths.size() > 1 && home_charp && home_charp[0] == '/') {
+		BEESLOGERR("BEESHOME must be relative to the filesystem roots when there is more than one filesystem");
 		return EXIT_FAILURE;
 	}
 
 	Chatter::enable_timestamp(chatter_prefix_timestamp);
 
+	// Don't let a slow log reader stall the workers
+	Chatter::enable_async(BEES_LOG_QUEUE_SIZE);
+
 	if (!relative_path().empty()) {
 		BEESLOGINFO("using relative path " << relative_path() << "\n");
 	}
@@ -732,56 +1242,117 @@ bees_main(int argc, char *argv[])
 
 	if (load_target != 0) {
 		BEESLOGNOTICE("setting load average target to " << load_target);
+	}
+	if (cpu_pressure_target != 0 || io_pressure_target != 0) {
+		BEESLOGNOTICE("setting pressure targets to cpu " << cpu_pressure_target << "% io " << io_pressure_target << "%");
+	}
+	if (load_target != 0 || cpu_pressure_target != 0 || io_pressure_target != 0) {
 		BEESLOGNOTICE("setting worker thread pool minimum size to " << thread_min);
 		TaskMaster::set_thread_min_count(thread_min);
 	}
 	TaskMaster::set_loadavg_target(load_target);
+	TaskMaster::set_pressure_target(cpu_pressure_target, io_pressure_target);
+
+	if (memory_limit != 0) {
+		BEESLOGNOTICE("setting memory limit to " << pretty(memory_limit));
+		BeesMemory::set_limit(memory_limit);
+	}
 
 	BEESLOGNOTICE("setting worker thread pool maximum size to " << thread_count);
 	TaskMaster::set_thread_count(thread_count);
 
-	// Set root path
-	string root_path = argv[optind++];
-	BEESLOGNOTICE("setting root path to '" << root_path << "'");
-	bc->set_root_path(root_path);
+	// One context per filesystem, all sharing the worker threads
+	vector<shared_ptr<BeesContext>> contexts;
+	vector<bool> filter_scope_used(filter_rules.size(), false);
+	for (size_t i = 0; i < root_paths.size(); ++i) {
+		const auto bc = make_shared<BeesContext>();
+		BEESLOGDEBUG("context constructed");
+
+		// Set root path
+		const string &root_path = root_paths[i];
+		BEESLOGNOTICE("setting root path to '" << root_path << "'");
+		bc->set_root_path(root_path);
+
+		// Workaround for btrfs send
+		bc->roots()->set_workaround_btrfs_send(workaround_btrfs_send);
+		bc->roots()->set_ro_sources(ro_sources);
+
+		// Set root scan mode
+		bc->roots()->set_scan_mode(root_scan_mode);
+
+		// Skip small extents in the middle of files
+		bc->roots()->set_min_extent_size(min_extent_size);
+
+		// Don't split extents for short dedupes
+		bc->set_min_dedupe_size(min_dedupe_size);
+
+		// Keep crawlers out of excluded subvols and files.  A rule may
+		// start with "FSPATH:" to apply to only one filesystem.  Other
+		// rules apply to all of them, so a subvol name need not exist
+		// on every one.
+		const Stat root_stat(bc->root_fd());
+		for (size_t r = 0; r < filter_rules.size(); ++r) {
+			string rule = filter_rules[r].first;
+			const auto colon = filter_rule_scope_end(rule);
+			if (colon != string::npos) {
+				const Stat scope_stat(open_or_die(rule.substr(0, colon), FLAGS_OPEN_DIR));
+				if (scope_stat.st_dev != root_stat.st_dev || scope_stat.st_ino != root_stat.st_ino) {
+					continue;
+				}
+				rule = rule.substr(colon + 1);
+				filter_scope_used[r] = true;
+			}
+			bc->roots()->add_filter(rule, filter_rules[r].second, colon == string::npos && root_paths.size() > 1);
+		}
+
+		// Look for new transids after writes.  Realtime scans need the same fanotify events.
+		bc->roots()->set_watch_writes(watch_writes || realtime_scan);
+		bc->roots()->set_realtime_scan(realtime_scan);
+
+		// Use btrfs csums as block hashes
+		bc->set_csum_scan(csum_scan);
 
-	// Workaround for btrfs send
-	bc->roots()->set_workaround_btrfs_send(workaround_btrfs_send);
+		// Hash algorithm for a new hash table
+		bc->set_hash_algorithm(hash_algorithm);
+
+		// Hash table size for a new hash table, or resize an existing one
+		bc->set_hash_table_size(hash_table_size);
+		bc->set_hash_table_memory(hash_table_memory);
+
+		// Share of the worker threads when there are several filesystems
+		bc->set_share_weight(fs_weights[i]);
+
+		contexts.push_back(bc);
+	}
+
+	for (size_t r = 0; r < filter_rules.size(); ++r) {
+		if (!filter_scope_used[r] && filter_rule_scope_end(filter_rules[r].first) != string::npos) {
+			BEESLOGERR("Filter rule '" << filter_rules[r].first << "' does not name the root of any filesystem path given");
+			return EXIT_FAILURE;
+		}
+	}
 
-	// Set root scan mode
-	bc->roots()->set_scan_mode(root_scan_mode);
+	// Open every hash table before any filesystem starts hashing,
+	// so a hash algorithm mismatch stops bees before it does anything
+	for (const auto &bc : contexts) {
+		bc->hash_table();
+	}
 
 	// Start crawlers
-	bc->start();
+	for (const auto &bc : contexts) {
+		bc->start();
+	}
 
 	// Now we just wait forever
 	wait_for_term_signal();
 
-	// Shut it down
-	bc->stop();
+	// Shut it down.  Stops every filesystem in the process.
+	contexts.front()->stop();
 
 	// That is all.
 	return EXIT_SUCCESS;
 }
 
-int
-main(int argc, char *argv[])
-{
-	cerr << "bees version " << BEES_VERSION << endl;
-
-	if (argc < 2) {
-		do_cmd_help(argv);
-		return EXIT_FAILURE;
-	}
-
-	int rv = EXIT_FAILURE;
-	catch_all([&]() {
-		rv = bees_main(argc, argv);
-	});
-	BEESLOGNOTICE("Exiting with status " << rv << " " << (rv ? "(failure)" : "(success)"));
-	return rv;
-}
-
 // instantiate templates for linkage ----------------------------------------
 
 template class BeesStatTmpl<uint64_t>;
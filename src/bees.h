@@ -4,6 +4,7 @@
 #include "crucible/btrfs-tree.h"
 #include "crucible/cache.h"
 #include "crucible/chatter.h"
+#include "crucible/cleanup.h"
 #include "crucible/error.h"
 #include "crucible/extentwalker.h"
 #include "crucible/fd.h"
@@ -15,6 +16,8 @@
 #include "crucible/time.h"
 #include "crucible/task.h"
 
+#include <atomic>
+#include <deque>
 #include <functional>
 #include <list>
 #include <mutex>
@@ -28,14 +31,19 @@
 using namespace crucible;
 using namespace std;
 
-// Block size for clone alignment (FIXME: should read this from /sys/fs/btrfs/<FS-UUID>/clone_alignment)
-const off_t BLOCK_SIZE_CLONE = 4096;
+// Filesystem data block size bees is built for (make BEES_BLOCK_SIZE=16384).
+// Must match the sectorsize of the filesystem, which is checked at startup.
+#ifndef BEES_BLOCK_SIZE
+#define BEES_BLOCK_SIZE 4096
+#endif
+static_assert(BEES_BLOCK_SIZE >= 4096 && BEES_BLOCK_SIZE <= 65536 && !(BEES_BLOCK_SIZE & (BEES_BLOCK_SIZE - 1)),
+	"BEES_BLOCK_SIZE must be a power of 2 from 4096 to 65536");
 
-// Block size for dedupe checksums (arbitrary, but must be a multiple of clone alignment)
-const off_t BLOCK_SIZE_SUMS = 4096;
+// Block size for clone alignment
+const off_t BLOCK_SIZE_CLONE = BEES_BLOCK_SIZE;
 
-// Block size for memory allocations and file mappings  (FIXME: should be CPU page size)
-const off_t BLOCK_SIZE_MMAP = 4096;
+// Block size for dedupe checksums (must be the filesystem sectorsize for csum scan)
+const off_t BLOCK_SIZE_SUMS = BEES_BLOCK_SIZE;
 
 // Maximum length parameter to extent-same ioctl (FIXME: hardcoded in kernel)
 const off_t BLOCK_SIZE_MAX_EXTENT_SAME = 4096 * 4096;
@@ -55,8 +63,12 @@ const off_t BLOCK_MASK_SUMS = BLOCK_SIZE_SUMS - 1;
 // Maximum temporary file size (maximum extent size for temporary copy)
 const off_t BLOCK_SIZE_MAX_TEMP_FILE = 1024 * 1024 * 1024;
 
-// Bucket size for hash table (size of one hash bucket)
-const off_t BLOCK_SIZE_HASHTAB_BUCKET = BLOCK_SIZE_MMAP;
+// Temporary files are truncated when reused past this size
+const off_t BLOCK_SIZE_TEMP_FILE_RESET = 128 * 1024 * 1024;
+
+// Bucket size for hash table (size of one hash bucket).  Part of the
+// beeshash.dat layout, so it does not follow the CPU page size.
+const off_t BLOCK_SIZE_HASHTAB_BUCKET = 4096;
 
 // Extent size for hash table (since the nocow file attribute does not seem to be working today)
 const off_t BLOCK_SIZE_HASHTAB_EXTENT = BLOCK_SIZE_MAX_COMPRESSED_EXTENT;
@@ -65,9 +77,30 @@ const off_t BLOCK_SIZE_HASHTAB_EXTENT = BLOCK_SIZE_MAX_COMPRESSED_EXTENT;
 // Optimistic sustained write rate for SD cards
 const double BEES_FLUSH_RATE = 128 * 1024;
 
+// Highest hash table flush rate when the device keeps up and the backlog is big
+const double BEES_FLUSH_RATE_MAX = 32 * 1024 * 1024;
+
+// Halve the flush rate when one extent write takes this long
+const double BEES_FLUSH_TARGET_TIME = 0.1;
+
+// Halve the flush rate when "full" io pressure (PSI avg10, percent) is above this
+const double BEES_FLUSH_IO_PRESSURE = 10;
+
+// Raise the flush rate while the dirty extents would take longer than this to write
+const double BEES_FLUSH_BACKLOG_TIME = 300;
+
 // Interval between writing crawl state to disk
 const int BEES_WRITEBACK_INTERVAL = 900;
 
+// Interval between appending crawl state changes to the crawl journal
+const int BEES_CRAWL_JOURNAL_INTERVAL = 30;
+
+// Write the whole crawl state when the crawl journal reaches this size
+const off_t BEES_CRAWL_JOURNAL_SIZE = 1024 * 1024;
+
+// Maximum number of files crawled at once in parallel scan mode
+const size_t BEES_CRAWL_PARALLEL_FILES = 256;
+
 // Statistics reports while scanning
 const int BEES_STATS_INTERVAL = 3600;
 
@@ -77,12 +110,56 @@ const int BEES_PROGRESS_INTERVAL = BEES_STATS_INTERVAL;
 // Status is output every freakin second.  Use a ramdisk.
 const int BEES_STATUS_INTERVAL = 1;
 
+// Thread note samples per second for $BEESPROFILE, unless $BEESPROFILERATE is set
+const double BEES_PROFILE_RATE = 100;
+
+// Interval between writing the sampled profile to $BEESPROFILE
+const int BEES_PROFILE_WRITE_INTERVAL = 60;
+
+// Log messages waiting to be written before new ones are dropped
+const size_t BEES_LOG_QUEUE_SIZE = 4096;
+
+// Trace records buffered in memory before they are written to $BEESRECORD
+const size_t BEES_RECORD_BUFFER_SIZE = 1024 * 1024;
+
 // Number of file FDs to cache when not in active use
 const size_t BEES_FILE_FD_CACHE_SIZE = 4096;
 
 // Number of root FDs to cache when not in active use
 const size_t BEES_ROOT_FD_CACHE_SIZE = 1024;
 
+// Number of inode paths to remember for opening the same inode in other snapshots
+const size_t BEES_INO_PATH_CACHE_SIZE = 65536;
+
+// Number of inode include/exclude decisions to remember for path filters
+const size_t BEES_FILTER_CACHE_SIZE = 65536;
+
+// Compressed extents buffered by each thread in one BeesExtentBufferScope
+const size_t BEES_EXTENT_BUFFER_COUNT = 32;
+
+// Number of LOGICAL_INO results to remember
+const size_t BEES_RESOLVE_CACHE_SIZE = 65536;
+
+// Estimated bytes used by one cached FD, inode path, or LOGICAL_INO result
+const size_t BEES_MEMORY_FD_ENTRY_BYTES = 256;
+const size_t BEES_MEMORY_PATH_ENTRY_BYTES = 256;
+const size_t BEES_MEMORY_RESOLVE_ENTRY_BYTES = 512;
+
+// Interval between memory governor samples
+const double BEES_MEMORY_INTERVAL = 5;
+
+// Memory pressure (percent of time some task stalls on memory) that shrinks the caches
+const double BEES_MEMORY_PRESSURE_TARGET = 10;
+
+// Fraction of the cgroup's memory.high that shrinks the caches
+const double BEES_MEMORY_HIGH_FRACTION = 0.9;
+
+// Smallest fraction of their normal size the caches shrink to
+const double BEES_MEMORY_SCALE_MIN = 1.0 / 64;
+
+// Fraction of their normal size the caches grow back by in each interval without pressure
+const double BEES_MEMORY_SCALE_STEP = 0.1;
+
 // Number of FDs to open (rlimit)
 const size_t BEES_OPEN_FILE_LIMIT = (BEES_FILE_FD_CACHE_SIZE + BEES_ROOT_FD_CACHE_SIZE) * 2 + 100;
 
@@ -95,18 +172,78 @@ const double BEES_TOO_LONG = 5.0;
 // Avoid any extent where LOGICAL_INO takes this much kernel CPU time
 const double BEES_TOXIC_SYS_DURATION = 0.1;
 
+// Shrink concurrent LOGICAL_INO calls when one takes this much kernel CPU time
+const double BEES_LOGICAL_INO_TARGET_SYS = BEES_TOXIC_SYS_DURATION / 10;
+
+// Shrink concurrent dedupe calls when one takes this long (including commit waits)
+const double BEES_DEDUPE_TARGET_TIME = 1.0;
+
+// Maximum number of extents remembered in beesresolve.dat
+const size_t BEES_RESOLVE_STORE_SIZE = 65536;
+
+// Search ahead of a subvol crawl in the background when a search takes this long
+const double BEES_CRAWL_PREFETCH_TIME = 0.01;
+
+// Search buffer for a file's extent refs, so one ioctl fetches hundreds of refs
+const size_t BEES_FILE_CRAWL_SEARCH_SIZE = 64 * 1024;
+
+// Grown dedupe candidates compared by replace_dst before choosing one
+const size_t BEES_DEDUPE_CANDIDATES_MAX = 8;
+
+// Files at least this big are matched whole by size and samples before block scan
+const off_t BEES_WHOLE_FILE_MIN_SIZE = 1024 * 1024;
+
+// Maximum number of files remembered for whole-file matching
+const size_t BEES_WHOLE_FILE_INDEX_SIZE = 65536;
+
 // Maximum number of refs to a single extent
 const size_t BEES_MAX_EXTENT_REF_COUNT = (16 * 1024 * 1024 / 24) - 1;
 
 // How long between hash table histograms
 const double BEES_HASH_TABLE_ANALYZE_INTERVAL = BEES_STATS_INTERVAL;
 
+// Hash table extents analyzed per histogram after the first full pass (32M)
+const size_t BEES_HASH_TABLE_ANALYZE_EXTENTS = 256;
+
+// Number of threads reading the hash table at startup
+const size_t BEES_HASH_PREFETCH_THREADS = 4;
+
+// Hash table extents read per request at startup (1M)
+const size_t BEES_HASH_PREFETCH_EXTENTS = 8;
+
+// Bits of lookup filter per hash table cell (memory is 1/16 of the table)
+const size_t BEES_HASH_FILTER_BITS_PER_CELL = 8;
+
+// Lock-free hash table probes tried before taking the extent lock
+const size_t BEES_HASH_PROBE_RETRIES = 4;
+
+// Number of extent refs opened and read ahead of the ref being chased (0 to disable)
+const size_t BEES_RESOLVE_PREFETCH_REFS = 8;
+
 // Wait at least this long for a new transid
 const double BEES_TRANSID_POLL_INTERVAL = 30.0;
 
+// Wait this long for a new transid after fanotify reports a write
+const double BEES_TRANSID_WRITE_POLL_INTERVAL = 1.0;
+
+// Close all cached file FDs at least this often, even in subvols with no writes seen
+const double BEES_FILE_FD_CACHE_MAX_AGE = 300.0;
+
+// Scan at most this many closed files per transid in realtime mode.  The rest wait for the crawl.
+const size_t BEES_REALTIME_SCAN_QUEUE_SIZE = 4096;
+
+// Remember this many files scanned in realtime mode, so the crawl can skip their extents
+const size_t BEES_REALTIME_SCAN_INDEX_SIZE = 65536;
+
 // Workaround for silly dedupe / ineffective readahead behavior
 const size_t BEES_READAHEAD_SIZE = 1024 * 1024;
 
+// Bytes of an extent read, hashed and looked up at a time by scan_one_extent
+const off_t BEES_SCAN_WINDOW_SIZE = 1024 * 1024;
+
+// Maximum number of file ranges waiting for background readahead
+const size_t BEES_READAHEAD_QUEUE_SIZE = 64;
+
 // Flags
 const int FLAGS_OPEN_COMMON   = O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | O_NOATIME | O_LARGEFILE | O_NOCTTY;
 const int FLAGS_OPEN_DIR      = FLAGS_OPEN_COMMON | O_RDONLY | O_DIRECTORY;
@@ -123,9 +260,12 @@ const int FLAGS_OPEN_FANOTIFY = O_RDWR | O_NOATIME | O_CLOEXEC | O_LARGEFILE;
 #define BEESLOG(lv,x)   do { if (lv < bees_log_level) { Chatter __chatter(lv, BeesNote::get_name()); __chatter << x; } } while (0)
 #define BEESLOGTRACE(x) do { BEESLOG(LOG_DEBUG, x); BeesTracer::trace_now(); } while (0)
 
-#define BEESTRACE(x)   BeesTracer  SRSLY_WTF_C(beesTracer_,  __LINE__) ([&]()                 { BEESLOG(LOG_ERR, x);   })
-#define BEESTOOLONG(x) BeesTooLong SRSLY_WTF_C(beesTooLong_, __LINE__) ([&](ostream &_btl_os) { _btl_os << x; })
-#define BEESNOTE(x)    BeesNote    SRSLY_WTF_C(beesNote_,    __LINE__) ([&](ostream &_btl_os) { _btl_os << x; })
+#define BEESTRACE(x)   const auto  SRSLY_WTF_C(beesTracerFn_,  __LINE__) =  [&]()                 { BEESLOG(LOG_ERR, x); }; \
+                       BeesTracer  SRSLY_WTF_C(beesTracer_,    __LINE__) (SRSLY_WTF_C(beesTracerFn_, __LINE__))
+#define BEESTOOLONG(x) const auto  SRSLY_WTF_C(beesTooLongFn_, __LINE__) =  [&](ostream &_btl_os) { _btl_os << x; }; \
+                       BeesTooLong SRSLY_WTF_C(beesTooLong_,   __LINE__) (SRSLY_WTF_C(beesTooLongFn_, __LINE__))
+#define BEESNOTE(x)    const auto  SRSLY_WTF_C(beesNoteFn_,  __LINE__) =  [&](ostream &_btl_os) { _btl_os << x; }; \
+                       BeesNote    SRSLY_WTF_C(beesNote_,    __LINE__) (SRSLY_WTF_C(beesNoteFn_, __LINE__))
 
 #define BEESLOGERR(x)    BEESLOG(LOG_ERR, x)
 #define BEESLOGWARN(x)   BEESLOG(LOG_WARNING, x)
@@ -134,13 +274,23 @@ const int FLAGS_OPEN_FANOTIFY = O_RDWR | O_NOATIME | O_CLOEXEC | O_LARGEFILE;
 #define BEESLOGDEBUG(x)  BEESLOG(LOG_DEBUG, x)
 
 #define BEESCOUNT(stat) do { \
-	BeesStats::s_global.add_count(#stat); \
+	static const size_t bees_stat_slot = BeesStatCounters::slot(#stat); \
+	BeesStats::s_global.add_count(bees_stat_slot); \
 } while (0)
 
 #define BEESCOUNTADD(stat, amount) do { \
-	BeesStats::s_global.add_count(#stat, (amount)); \
+	static const size_t bees_stat_slot = BeesStatCounters::slot(#stat); \
+	BeesStats::s_global.add_count(bees_stat_slot, (amount)); \
+} while (0)
+
+#define BEESHISTOGRAM(stat, seconds) do { \
+	static BeesHistogram &bees_histogram = BeesHistogram::get(#stat); \
+	bees_histogram.add(seconds); \
 } while (0)
 
+#define BEESPHASE(name) static BeesPhase::Totals &SRSLY_WTF_C(beesPhaseTotals_, __LINE__) = BeesPhase::get(#name); \
+                        BeesPhase SRSLY_WTF_C(beesPhase_, __LINE__) (SRSLY_WTF_C(beesPhaseTotals_, __LINE__))
+
 // ----------------------------------------
 
 template <class T> class BeesStatTmpl;
@@ -158,6 +308,7 @@ public:
 	BeesStatTmpl &operator=(const BeesStatTmpl &that);
 	void add_count(string idx, size_t amount = 1);
 	T at(string idx) const;
+	map<string, T> stats_map() const;
 
 friend ostream& operator<< <>(ostream &os, const BeesStatTmpl<T> &bs);
 friend struct BeesStats;
@@ -165,56 +316,220 @@ friend struct BeesStats;
 
 using BeesRates = BeesStatTmpl<double>;
 
+class BeesStatCounters;
+
 struct BeesStats : public BeesStatTmpl<uint64_t> {
-	static BeesStats s_global;
+	static BeesStatCounters s_global;
+
+	BeesStats() = default;
+	BeesStats(const BeesStatCounters &counters);
 
 	BeesStats operator-(const BeesStats &that) const;
 	BeesRates operator/(double d) const;
 	explicit operator bool() const;
 };
 
+/// Event counters without a shared lock.  Each stat name gets an integer
+/// slot on first use, and each thread adds to its own array of slots.
+/// Converting to BeesStats adds up the arrays of all threads.
+class BeesStatCounters {
+public:
+	static const size_t c_max_slots = 1024;
+
+	static size_t slot(const string &name);
+	void add_count(size_t slot, size_t amount = 1);
+	void add_count(const string &name, size_t amount = 1);
+
+private:
+	struct Shard {
+		atomic<uint64_t>	m_counts[c_max_slots];
+		// Keep the next thread's counters out of our cache lines
+		uint8_t			m_pad[64];
+		Shard();
+	};
+	struct ShardHolder {
+		Shard			*m_shard;
+		ShardHolder();
+		~ShardHolder();
+	};
+
+	static mutex			s_mutex;
+	static map<string, size_t>	s_slot_map;
+	static vector<string>		s_slot_names;
+	static list<Shard *>		s_shards;
+	static list<Shard *>		s_free_shards;
+
+	thread_local static ShardHolder	tl_shard;
+
+friend struct BeesStats;
+};
+
+/// Lock-free log-linear latency histogram in microseconds.  Each power
+/// of two is split into c_sub_buckets linear buckets, so quantiles are
+/// accurate to 1/c_sub_buckets of their value.  Histograms are created
+/// by name on first use and never destroyed.
+class BeesHistogram {
+public:
+	static const size_t c_sub_bits = 3;
+	static const size_t c_sub_buckets = 1 << c_sub_bits;
+	static const size_t c_buckets = (64 - c_sub_bits + 1) * c_sub_buckets;
+
+	static BeesHistogram &get(const string &name);
+	static void for_each(const function<void(const string &name, const BeesHistogram &bh)> &f);
+	static void print_all(ostream &os);
+
+	void add(double seconds);
+	uint64_t count() const;
+	uint64_t max_usec() const;
+	uint64_t sum_usec() const;
+	/// Upper bound of the bucket containing quantile q (0..1)
+	uint64_t quantile_usec(double q) const;
+
+	static size_t bucket_of(uint64_t usec);
+	static uint64_t bucket_max(size_t bucket);
+
+private:
+	atomic<uint64_t>	m_buckets[c_buckets];
+	atomic<uint64_t>	m_max;
+	atomic<uint64_t>	m_sum;
+	BeesHistogram();
+
+	static mutex				s_mutex;
+	static map<string, BeesHistogram *>	s_histograms;
+};
+
+ostream& operator<<(ostream &os, const BeesHistogram &bh);
+
+/// Time accounting for phases of the scan pipeline.  A phase is charged
+/// with wall time, thread CPU time and bytes read from disk while it is
+/// the innermost phase on its thread, so a nested phase pauses its parent
+/// and the phase totals add up to the time spent in all phases.
+class BeesPhase {
+public:
+	struct Totals {
+		atomic<uint64_t>	m_count;
+		atomic<uint64_t>	m_wall_ns;
+		atomic<uint64_t>	m_cpu_ns;
+		atomic<uint64_t>	m_read_bytes;
+		Totals();
+	};
+
+	static Totals &get(const string &name);
+	static void for_each(const function<void(const string &name, const Totals &totals)> &f);
+	static void print_all(ostream &os);
+
+	BeesPhase(Totals &totals);
+	~BeesPhase();
+
+private:
+	struct Sample {
+		uint64_t	m_wall_ns;
+		uint64_t	m_cpu_ns;
+		uint64_t	m_read_bytes;
+		static Sample now();
+	};
+
+	Totals		&m_totals;
+	BeesPhase	*m_parent;
+	Sample		m_last;
+
+	void charge(const Sample &now);
+
+	thread_local static BeesPhase	*tl_current;
+	static mutex			s_mutex;
+	static map<string, Totals *>	s_totals;
+};
+
 class BeesContext;
 class BeesBlockData;
 
 class BeesTracer {
-	function<void()> m_func;
+	using TraceFn = void (*)(const void *);
+
+	TraceFn m_fn;
+	const void *m_arg;
 	BeesTracer *m_next_tracer = 0;
 
 	thread_local static BeesTracer *tl_next_tracer;
 	thread_local static bool tl_silent;
 	thread_local static bool tl_first;
+
+	void push(bool silent);
 public:
-	BeesTracer(function<void()> f, bool silent = false);
+	// f must outlive the BeesTracer, see BEESTRACE
+	template <class F> BeesTracer(const F &f, bool silent = false);
 	~BeesTracer();
 	static void trace_now();
 	static bool get_silent();
 	static void set_silent();
 };
 
+template <class F>
+BeesTracer::BeesTracer(const F &f, bool silent) :
+	m_fn([](const void *arg) { (*static_cast<const F *>(arg))(); }),
+	m_arg(&f)
+{
+	push(silent);
+}
+
 class BeesNote {
-	function<void(ostream &)>	m_func;
+	// One per thread, registered on the thread's first note.
+	// m_mutex is only contended while get_status() runs.
+	struct Slot {
+		mutex		m_mutex;
+		BeesNote	*m_top = nullptr;
+		pid_t		m_tid;
+		pthread_t	m_pthread;
+		string		m_name;
+	};
+	struct SlotHolder;
+
+	using FormatFn = void (*)(const void *, ostream &);
+
+	FormatFn			m_fn;
+	const void			*m_arg;
 	BeesNote			*m_prev;
+	Slot				*m_slot;
 	Timer				m_timer;
-	string				m_name;
+	Task				m_task;
 
 	static mutex			s_mutex;
-	static map<pid_t, BeesNote*>	s_status;
+	static set<Slot*>		s_slots;
 
-	thread_local static BeesNote	*tl_next;
 	thread_local static string	tl_name;
 
+	static Slot &slot();
+	void push();
+	string name_locked() const;
+
 public:
-	BeesNote(function<void(ostream &)> f);
+	// f must outlive the BeesNote, see BEESNOTE
+	template <class F> BeesNote(const F &f);
 	~BeesNote();
 
 	using ThreadStatusMap = map<pid_t, string>;
 
 	static ThreadStatusMap get_status();
 
+	// One folded stack per thread with notes:  the thread name, then its
+	// notes from outermost to innermost, separated by ';'.  Numbers,
+	// paths and other variable parts are cut off, so equal stacks
+	// from different samples can be counted together.
+	static vector<string> get_folded_stacks();
+
 	static void set_name(const string &name);
 	static string get_name();
 };
 
+template <class F>
+BeesNote::BeesNote(const F &f) :
+	m_fn([](const void *arg, ostream &os) { (*static_cast<const F *>(arg))(os); }),
+	m_arg(&f),
+	m_task(Task::current_task())
+{
+	push();
+}
+
 // C++ threads dumbed down even further
 class BeesThread {
 	string			m_name;
@@ -334,7 +649,7 @@ public:
 	static const Type c_offset_min = 1;
 	static const Type c_offset_max = BLOCK_SIZE_MAX_COMPRESSED_EXTENT / BLOCK_SIZE_CLONE;
 
-	// if this isn't 0x3f we will have problems
+	// 0x3f with 4K blocks, fewer bits with larger blocks
 	static const Type c_offset_mask = (c_offset_max - 1) | (c_offset_max);
 
 	static const Type c_compressed_mask = 1 << 11;
@@ -342,6 +657,8 @@ public:
 	static const Type c_toxic_mask = 1 << 9;
 
 	static const Type c_all_mask = c_compressed_mask | c_eof_mask | c_offset_mask | c_toxic_mask;
+	static_assert(c_all_mask < static_cast<Type>(BLOCK_SIZE_CLONE), "address flags must fit below block alignment");
+	static_assert((c_offset_mask & (c_compressed_mask | c_eof_mask | c_toxic_mask)) == 0, "offset bits overlap address flags");
 
 	bool is_compressed() const { return m_addr >= MagicValue::LAST && (m_addr & c_compressed_mask); }
 	bool has_compressed_offset() const { return m_addr >= MagicValue::LAST && (m_addr & c_compressed_mask) && (m_addr & c_offset_mask); }
@@ -361,6 +678,13 @@ public:
 
 ostream & operator<<(ostream &os, const BeesAddress &ba);
 
+namespace std {
+	template <> struct hash<BeesAddress> {
+		// operator== ignores the offset bits when only one side has them
+		size_t operator()(const BeesAddress &ba) const { return hash<BeesAddress::Type>()(BeesAddress::Type(ba) & ~BeesAddress::c_offset_mask); }
+	};
+}
+
 class BeesStringFile {
 	Fd	m_dir_fd;
 	string	m_name;
@@ -394,6 +718,7 @@ public:
 private:
 	static const uint64_t c_cells_per_bucket = BLOCK_SIZE_HASHTAB_BUCKET / sizeof(Cell);
 	static const uint64_t c_buckets_per_extent = BLOCK_SIZE_HASHTAB_EXTENT / BLOCK_SIZE_HASHTAB_BUCKET;
+	static const uint64_t c_filter_words_per_bucket = c_cells_per_bucket * BEES_HASH_FILTER_BITS_PER_CELL / 64;
 
 public:
 	union Bucket {
@@ -406,22 +731,51 @@ public:
 		uint8_t	p_byte[BLOCK_SIZE_HASHTAB_EXTENT];
 	} __attribute__((packed));
 
-	BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t size = BLOCK_SIZE_HASHTAB_EXTENT);
+	// How the in-memory copy of the table is backed
+	enum MemoryFlags {
+		MEM_THP		= 1 << 0,	// madvise(MADV_HUGEPAGE)
+		MEM_HUGETLB	= 1 << 1,	// mmap(MAP_HUGETLB), falls back to MEM_THP
+		MEM_MLOCK	= 1 << 2,	// mlock after the table is loaded
+		MEM_INTERLEAVE	= 1 << 3,	// interleave pages across NUMA nodes
+		MEM_HANDOFF	= 1 << 4,	// memfd kept by the service manager across restarts
+		MEM_DEFAULT	= MEM_THP | MEM_MLOCK,
+	};
+	static unsigned memory_flags_from_names(const string &names);
+	static string memory_flags_names(unsigned flags);
+
+	// size 0 means use the existing size, or BLOCK_SIZE_HASHTAB_EXTENT for a new table.
+	// If an existing table has a different size, its contents are rehashed.
+	BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t size = 0);
 	~BeesHashTable();
 
 	void stop_request();
 	void stop_wait();
 
 	vector<Cell>	find_cell(HashType hash);
+	vector<vector<Cell>>	find_cells(const vector<HashType> &hashes);
 	bool		push_random_hash_addr(HashType hash, AddrType addr);
 	void		erase_hash_addr(HashType hash, AddrType addr);
 	bool		push_front_hash_addr(HashType hash, AddrType addr);
-	bool            flush_dirty_extent(uint64_t extent_index);
+	size_t          flush_dirty_extent(uint64_t extent_index);
+	void		adjust_flush_rate(double write_seconds, uint64_t dirty_extents);
+	void		checkpoint(uint64_t mark);
+	/// Changes to the table made before writeback_mark() are on their way
+	/// to disk when written_back() returns true for the mark
+	uint64_t	writeback_mark();
+	bool		written_back(uint64_t mark);
+	uint64_t	lock_wait_ns() const;
+	uint64_t	total_cells() const { return m_cells; }
+	/// Occupied cells in table order, one extent at a time
+	void		for_each_cell(const function<void(const Cell &)> &fn);
+	/// Occupied cells found by the last analysis pass, scaled up to the whole table
+	uint64_t	occupied_cells() const { return m_occupied_cells.load(); }
 
 private:
 	string		m_filename;
 	Fd		m_fd;
 	uint64_t	m_size;
+	uint64_t	m_map_size = 0;
+	Fd		m_handoff_fd;
 	union {
 		void	*m_void_ptr;	// Save some casting
 		uint8_t	*m_byte_ptr;	// for pointer arithmetic
@@ -442,8 +796,15 @@ private:
 	BeesThread  		m_writeback_thread;
 	BeesThread	        m_prefetch_thread;
 	RateLimiter		m_flush_rate_limit;
+	double			m_io_pressure = 0;
+	Timer			m_io_pressure_timer;
 	BeesStringFile		m_stats_file;
 
+	// Per-extent checksums of the on-disk table, saved with each checkpoint
+	BeesStringFile		m_checkpoint_file;
+	mutex			m_checkpoint_mutex;
+	uint64_t		m_checkpoint_generation = 0;
+
 	// Prefetch readahead hint
 	bool			m_prefetch_running = false;
 
@@ -452,29 +813,91 @@ private:
 	condition_variable	m_dirty_condvar;
 	bool			m_dirty = false;
 
+	// Writeback thread flush passes, also protected by m_dirty_mutex
+	condition_variable	m_flushed_condvar;
+	uint64_t		m_flush_pass_started = 0;
+	uint64_t		m_flush_pass_done = 0;
+	bool			m_writeback_idle = false;
+
 	// Mutex/condvar to stop
 	mutex			m_stop_mutex;
 	condition_variable	m_stop_condvar;
-	bool			m_stop_requested = false;
+	atomic<bool>		m_stop_requested;
+
+	// Total time spent waiting for contended extent locks
+	atomic<uint64_t>	m_lock_wait_ns;
+
+	// Result of the last analysis pass
+	atomic<uint64_t>	m_occupied_cells;
 
 	// Per-extent structures
 	struct ExtentMetaData {
 		shared_ptr<mutex> m_mutex_ptr;		// Access serializer
-		bool	m_dirty = false;	// Needs to be written back to disk
+		uint32_t	m_dirty_buckets = 0;	// Buckets that need to be written back to disk
 		bool	m_missing = true;	// Needs to be read from disk
+		uint64_t	m_generation = 0;	// Checkpoint of last write, 0 if checksum unknown
+		uint64_t	m_checksum = 0;		// crc64 of extent as last checkpointed or read
+		bool	m_checksum_stale = false;	// Written since m_checksum was computed
 		ExtentMetaData();
 	};
 	vector<ExtentMetaData>	m_extent_metadata;
 
+	// Old table to rehash into this one, if it is being resized
+	Fd			m_rehash_fd;
+	off_t			m_rehash_size = 0;
+
+	// One bit per extent with dirty buckets, so writeback can skip clean extents
+	vector<atomic<uint64_t>>	m_dirty_extent_bits;
+
+	// Blocked Bloom filter, one 64-bit word per probe, c_filter_words_per_bucket words per bucket.
+	// Only valid for extents with their bit set in m_filter_ready_bits.
+	vector<atomic<uint64_t>>	m_filter;
+	vector<atomic<uint64_t>>	m_filter_ready_bits;
+
+	// Seqlock per extent, odd while a writer holding the extent lock is
+	// changing its cells.  Lookups in extents with a ready filter probe
+	// without the lock and retry if the sequence changed.
+	vector<atomic<uint64_t>>	m_extent_seq;
+	class ExtentWriteSeq;
+
+	// 2-bit hit frequency per cell, 4 cells per byte.  Moves with the cell
+	// inside its bucket, protected by the extent lock.  Not saved on disk.
+	static const unsigned	c_freq_max = 3;
+	vector<uint8_t>		m_cell_freq;
+
 	void open_file();
+	void open_algorithm_file();
+	void load_checkpoint();
+	void verify_extent_checksum_locked(uint64_t extent_index);
+	void rehash_old_table();
+	bool rehash_insert(const Cell &cell, size_t rank);
 	void writeback_loop();
+	bool written_back_locked(uint64_t mark) const;
 	void prefetch_loop();
+	void prefetch_parallel();
+	void fetch_missing_extents(uint64_t first, uint64_t last);
 	void try_mmap_flags(int flags);
+	void map_table_memory();
+	void interleave_table_memory();
+	void map_handoff_memory(bool hugetlb);
+	void adopt_handoff();
+	void save_handoff();
 	pair<Cell *, Cell *> get_cell_range(HashType hash);
 	pair<uint8_t *, uint8_t *> get_extent_range(HashType hash);
 	void fetch_missing_extent_by_hash(HashType hash);
 	void fetch_missing_extent_by_index(uint64_t extent_index);
-	void set_extent_dirty_locked(uint64_t extent_index);
+	void fetch_missing_extent_locked(uint64_t extent_index);
+	void set_extent_dirty_locked(uint64_t extent_index, uint32_t bucket_mask = ~0U);
+	void set_hash_dirty_locked(HashType hash);
+	pair<uint64_t, uint64_t> filter_word_mask(HashType hash) const;
+	bool filter_may_contain(HashType hash) const;
+	bool probe_hash_cells_unlocked(HashType hash, vector<Cell> &rv);
+	void filter_insert_locked(HashType hash);
+	void filter_rebuild_extent_locked(uint64_t extent_index);
+	unsigned cell_freq_locked(const Cell *cell) const;
+	void set_cell_freq_locked(const Cell *cell, unsigned freq);
+	void shift_cells_locked(Cell *first, Cell *hole);
+	Cell *choose_victim_locked(Cell *first, Cell *last);
 	size_t flush_dirty_extents(bool slowly);
 
 	size_t			hash_to_extent_index(HashType ht);
@@ -512,6 +935,11 @@ class BeesCrawl {
 	ProgressTracker<BeesCrawlState>		m_state;
 
 	BtrfsTreeObjectFetcher			m_btof;
+	shared_ptr<atomic<bool>>		m_prefetch_busy { make_shared<atomic<bool>>(false) };
+
+	// Bytes submitted for scanning and bytes deduped in this subvol
+	atomic<uint64_t>			m_scan_bytes { 0 };
+	atomic<uint64_t>			m_hit_bytes { 0 };
 
 	bool fetch_extents();
 	void fetch_extents_harder();
@@ -521,15 +949,51 @@ class BeesCrawl {
 public:
 	BeesCrawl(shared_ptr<BeesContext> ctx, BeesCrawlState initial_state);
 	BeesFileRange peek_front();
+	BtrfsTreeItem peek_front_item();
 	BeesFileRange pop_front();
 	ProgressTracker<BeesCrawlState>::ProgressHolder hold_state(const BeesCrawlState &bcs);
 	BeesCrawlState get_state_begin();
 	BeesCrawlState get_state_end() const;
 	void set_state(const BeesCrawlState &bcs);
 	void deferred(bool def_setting);
+	void count_scan(uint64_t bytes);
+	void count_hit(uint64_t bytes);
+	double hit_rate() const;
+};
+
+// Include and exclude rules for subvols, inode number ranges, and path
+// prefixes relative to the subvol root.  A file is scanned if it matches
+// no exclude rule, and matches an include rule or there are none.
+class BeesFilter {
+	set<uint64_t>				m_exclude_roots;
+	set<uint64_t>				m_include_roots;
+	// Non-overlapping inode ranges, first -> last
+	map<uint64_t, uint64_t>			m_exclude_inodes;
+	map<uint64_t, uint64_t>			m_include_inodes;
+	// Sorted prefixes, none of which is covered by another
+	vector<string>				m_exclude_paths;
+	vector<string>				m_include_paths;
+
+	static void add_inode_range(map<uint64_t, uint64_t> &ranges, uint64_t first, uint64_t last);
+	static bool inode_match(const map<uint64_t, uint64_t> &ranges, uint64_t ino);
+	static void add_path_prefix(vector<string> &prefixes, const string &prefix);
+	static bool path_match(const vector<string> &prefixes, const string &path);
+
+public:
+	void add_root(uint64_t root, bool include);
+	void add_inodes(uint64_t first, uint64_t last, bool include);
+	void add_path(const string &prefix, bool include);
+
+	bool empty() const;
+	bool has_path_rules() const;
+	// True if no file in the subvol can be scanned
+	bool root_excluded(uint64_t root) const;
+	// paths are all the paths of the inode, only used by path rules
+	bool file_excluded(uint64_t root, uint64_t ino, const vector<string> &paths) const;
 };
 
 class BeesScanMode;
+struct BeesFileCrawl;
 
 class BeesRoots : public enable_shared_from_this<BeesRoots> {
 	shared_ptr<BeesContext>			m_ctx;
@@ -540,42 +1004,113 @@ class BeesRoots : public enable_shared_from_this<BeesRoots> {
 	mutex					m_mutex;
 	uint64_t				m_crawl_dirty = 0;
 	uint64_t				m_crawl_clean = 0;
+	uint64_t				m_crawl_journaled = 0;
 	Timer					m_crawl_timer;
 	BeesThread				m_crawl_thread;
 	BeesThread				m_writeback_thread;
 	RateEstimator				m_transid_re;
 	bool					m_workaround_btrfs_send = false;
+	bool					m_ro_sources = false;
+	uint64_t				m_min_extent_size = 0;
 
 	shared_ptr<BeesScanMode>		m_scanner;
 
 	mutex					m_tmpfiles_mutex;
 	map<BeesFileId, Fd>			m_tmpfiles;
 
+	// Snapshots of one subvol mostly have the same path for each inode number.
+	// Paths that opened an inode, by snapshot lineage and inode number.
+	// Not cleared with the FD caches, because every path is checked when it is used.
+	ShardedLRUCache<string, uint64_t, uint64_t>	m_ino_path_cache;
+	mutex					m_root_lineage_mutex;
+	map<uint64_t, uint64_t>			m_root_lineage;
+
+	// Include/exclude rules, fixed before start().  Path rules need an
+	// INO_PATHS lookup, so decisions are cached by root and inode number.
+	BeesFilter				m_filter;
+	ShardedLRUCache<bool, uint64_t, uint64_t>	m_filter_cache;
+
+	// Snapshots share inode numbers, and crawls of the same inode number
+	// exclude each other.  Each inode number has one Task crawling it, and
+	// crawls from other subvols wait here for that Task.
+	mutex					m_inode_crawl_mutex;
+	map<uint64_t, deque<shared_ptr<BeesFileCrawl>>>	m_inode_crawl_queue;
+
 	mutex					m_stop_mutex;
 	condition_variable			m_stop_condvar;
 	bool					m_stop_requested = false;
 
+	// Subvols written since the last new transid, from fanotify.
+	// Protected by m_stop_mutex, so the crawl thread can wait for writes.
+	bool					m_watch_writes = false;
+	BeesThread				m_write_watch_thread;
+	bool					m_write_watch_active = false;
+	bool					m_write_seen = false;
+	bool					m_write_overflow = false;
+	set<uint64_t>				m_written_roots;
+
+	// Files closed after writes since the last new transid, also
+	// protected by m_stop_mutex.  In realtime mode they are scanned
+	// as soon as the transid with their data is committed.
+	bool					m_realtime_scan = false;
+	set<BeesFileId>				m_closed_files;
+
+	// Transid up to which each file was scanned in realtime mode
+	mutex					m_realtime_mutex;
+	map<BeesFileId, uint64_t>		m_realtime_scanned;
+
+	// Crawl states as of the last crawl state save plus the journal.
+	// Only used by the writeback thread, after state_load.
+	Fd					m_crawl_journal_fd;
+	off_t					m_crawl_journal_size = 0;
+	map<uint64_t, BeesCrawlState>		m_crawl_journal_states;
+	// Crawl states to journal once the hash table writeback reaches
+	// m_crawl_journal_mark, or 0 if there are none
+	uint64_t				m_crawl_journal_mark = 0;
+	uint64_t				m_crawl_journal_pending_dirty = 0;
+	map<uint64_t, BeesCrawlState>		m_crawl_journal_pending;
+	// Crawl state to save once the hash table writeback reaches
+	// m_crawl_save_mark, or 0 if there is none
+	uint64_t				m_crawl_save_mark = 0;
+	uint64_t				m_crawl_save_pending_dirty = 0;
+	string					m_crawl_save_pending;
+	map<uint64_t, BeesCrawlState>		m_crawl_save_pending_states;
+	Timer					m_crawl_save_timer;
+
 	void insert_new_crawl();
 	void insert_root(const BeesCrawlState &bcs);
 	Fd open_root_nocache(uint64_t root);
 	Fd open_root_ino_nocache(uint64_t root, uint64_t ino);
+	bool is_file_excluded_nocache(uint64_t root, uint64_t ino);
+	uint64_t root_lineage(uint64_t root);
 	uint64_t transid_min();
 	uint64_t transid_max();
 	uint64_t transid_max_nocache();
 	void state_load();
+	void state_load_file(map<uint64_t, BeesCrawlState> &loaded_states);
 	ostream &state_to_stream(ostream &os);
-	void state_save();
+	map<uint64_t, BeesCrawlState> state_current();
+	bool state_save(bool wait);
+	void state_journal();
+	void state_journal_replay(map<uint64_t, BeesCrawlState> &states);
+	string crawl_journal_filename() const;
 	bool crawl_roots();
 	string crawl_state_filename() const;
 	void crawl_state_set_dirty();
 	void crawl_state_erase(const BeesCrawlState &bcs);
 	void crawl_thread();
 	void writeback_thread();
+	void write_watch_thread();
+	bool take_written_roots(set<uint64_t> &roots);
+	void realtime_scan_start(uint64_t transid);
+	void realtime_scan_prune(const map<uint64_t, uint64_t> &min_transids);
 	uint64_t next_root(uint64_t root = 0);
 	void current_state_set(const BeesCrawlState &bcs);
 	RateEstimator& transid_re();
-	bool crawl_batch(shared_ptr<BeesCrawl> crawl);
+	bool crawl_batch(shared_ptr<BeesCrawl> crawl, const shared_ptr<Cleanup> &budget = shared_ptr<Cleanup>());
+	shared_ptr<BeesFileCrawl> crawl_inode_next(uint64_t inode);
 	void clear_caches();
+	void clear_caches(const set<uint64_t> &roots);
 
 friend class BeesCrawl;
 friend class BeesFdCache;
@@ -590,22 +1125,41 @@ public:
 	void insert_tmpfile(Fd fd);
 	void erase_tmpfile(Fd fd);
 
+	void set_watch_writes(bool watch_writes);
+	void set_realtime_scan(bool realtime_scan);
+	void crawl_hit(uint64_t root, uint64_t bytes);
+	void realtime_scan_done(const BeesFileId &bfi, uint64_t transid);
+	bool realtime_scanned(const BeesFileId &bfi, uint64_t gen);
+
+	size_t ino_path_cache_size() const;
+	void set_ino_path_cache_scale(double scale);
+
 	Fd open_root(uint64_t root);
 	Fd open_root_ino(uint64_t root, uint64_t ino);
 	Fd open_root_ino(const BeesFileId &bfi) { return open_root_ino(bfi.root(), bfi.ino()); }
 	bool is_root_ro(uint64_t root);
 
-	// TODO:  do extent-tree scans instead
+	void add_filter(const string &rule, bool include, bool skip_missing = false);
+	bool is_root_excluded(uint64_t root) const;
+	bool is_file_excluded(const BeesFileId &bfi);
+
 	enum ScanMode {
 		SCAN_MODE_LOCKSTEP,
 		SCAN_MODE_INDEPENDENT,
 		SCAN_MODE_SEQUENTIAL,
 		SCAN_MODE_RECENT,
+		SCAN_MODE_EXTENT,
+		SCAN_MODE_PARALLEL,
+		SCAN_MODE_PRIORITY,
 		SCAN_MODE_COUNT, // must be last
 	};
 
 	void set_scan_mode(ScanMode new_mode);
 	void set_workaround_btrfs_send(bool do_avoid);
+	void set_ro_sources(bool ro_sources);
+	bool ro_sources() const;
+	void set_min_extent_size(uint64_t min_extent_size);
+	uint64_t min_extent_size() const;
 };
 
 struct BeesHash {
@@ -616,9 +1170,24 @@ struct BeesHash {
 	operator Type() const { return m_hash; }
 	BeesHash& operator=(const Type that) { m_hash = that; return *this; }
 	BeesHash(const uint8_t *ptr, size_t len);
+
+	// False if this is definitely not the hash of len zero bytes
+	bool may_be_zero(size_t len) const;
+
+	// Block hash function.  Fixed for the life of a hash table, and
+	// shared by every hash table in the process.
+	enum Algorithm {
+		ALGO_CRC64 = 0,
+		ALGO_CITY64 = 1,
+	};
+	static void set_algorithm(Algorithm algo);
+	static Algorithm algorithm();
+	static string algorithm_name(Algorithm algo);
+	static Algorithm algorithm_from_name(const string &name);
 private:
 	Type	m_hash;
-
+	static Algorithm s_algorithm;
+	static bool s_algorithm_set;
 };
 
 ostream & operator<<(ostream &os, const BeesHash &bh);
@@ -633,10 +1202,14 @@ class BeesBlockData {
 	mutable Blob		m_data;
 	mutable BeesHash	m_hash;
 	mutable bool		m_hash_done = false;
+	mutable bool		m_zero_done = false;
+	mutable bool		m_is_zero = false;
 
 public:
 	// Constructor with the immutable fields
 	BeesBlockData(Fd fd, off_t offset, size_t read_length = BLOCK_SIZE_SUMS);
+	// Block data already read, e.g. a view into a bees_read_range buffer
+	BeesBlockData(Fd fd, off_t offset, const Blob &data);
 	BeesBlockData();
 
 	// Non-lazy accessors
@@ -661,6 +1234,36 @@ public:
 friend ostream &operator<<(ostream &, const BeesBlockData &);
 };
 
+// Each block read from a compressed extent makes btrfs decompress the
+// whole extent again if it is no longer in page cache.  While a scope is
+// active on a thread, compressed extents are read once with one pread, and
+// BeesBlockData reads within them are views of that buffer.  The buffer is
+// found by bytenr, so other files referencing the same extent share it.
+// Scopes nest, and the buffers are released when the outermost one ends.
+class BeesExtentBufferScope {
+	struct Entry {
+		Fd		m_fd;
+		off_t		m_begin;
+		uint64_t	m_bytenr;
+		off_t		m_extent_offset;
+		ByteVector	m_data;
+	};
+	bool					m_outer;
+	thread_local static bool		tl_active;
+	thread_local static deque<Entry>	tl_entries;
+	static void insert(const Fd &fd, const Extent &e, const ByteVector &data);
+public:
+	BeesExtentBufferScope();
+	~BeesExtentBufferScope();
+	BeesExtentBufferScope(const BeesExtentBufferScope &) = delete;
+	/// Read e if it is compressed and not yet buffered.  False if e is not buffered.
+	static bool read_extent(const Fd &fd, const Extent &e);
+	/// Keep data, already read from the start of e
+	static void keep_extent(const Fd &fd, const Extent &e, const ByteVector &data);
+	/// View of a buffered range of fd, if there is one
+	static bool find(const Fd &fd, off_t offset, size_t length, ByteVector &data);
+};
+
 class BeesRangePair : public pair<BeesFileRange, BeesFileRange> {
 public:
 	BeesRangePair(const BeesFileRange &src, const BeesFileRange &dst);
@@ -685,12 +1288,13 @@ public:
 	BeesFileRange make_hole(off_t count);
 	BeesFileRange make_copy(const BeesFileRange &src);
 	void reset();
+	void reuse();
 };
 
 class BeesFdCache {
 	shared_ptr<BeesContext> 		m_ctx;
-	LRUCache<Fd, uint64_t>			m_root_cache;
-	LRUCache<Fd, uint64_t, uint64_t>	m_file_cache;
+	ShardedLRUCache<Fd, uint64_t>		m_root_cache;
+	ShardedLRUCache<Fd, uint64_t, uint64_t>	m_file_cache;
 	Timer					m_root_cache_timer;
 	Timer					m_file_cache_timer;
 
@@ -699,13 +1303,206 @@ public:
 	Fd open_root(uint64_t root);
 	Fd open_root_ino(uint64_t root, uint64_t ino);
 	void clear();
+	void clear_roots(const set<uint64_t> &roots);
+	void print_stats(ostream &os);
+	size_t size() const;
+	void set_scale(double scale);
 };
 
+using BeesInodeOffsetRoots = shared_ptr<const vector<BtrfsInodeOffsetRoot>>;
+
 struct BeesResolveAddrResult {
 	BeesResolveAddrResult();
-	vector<BtrfsInodeOffsetRoot> m_biors;
+	// Shared by the resolve cache and all its users, never modified after resolve
+	BeesInodeOffsetRoots m_biors;
 	bool m_is_toxic = false;
 	bool is_toxic() const { return m_is_toxic; }
+	const vector<BtrfsInodeOffsetRoot> &biors() const { return *m_biors; }
+};
+
+// Extents that LOGICAL_INO is known to be useless on (toxic or too many refs),
+// persisted in $BEESHOME so they aren't resolved again after restart
+class BeesResolveStore {
+	struct Entry {
+		uint64_t	m_end = 0;
+		uint64_t	m_generation = 0;
+		bool		m_toxic = false;
+		uint64_t	m_refs = 0;
+	};
+
+	shared_ptr<BeesContext>	m_ctx;
+	mutable mutex		m_mutex;
+	map<uint64_t, Entry>	m_extents;
+	BeesStringFile		m_file;
+	bool			m_dirty = false;
+
+	BtrfsTreeItem fetch_extent(uint64_t bytenr);
+	void load();
+public:
+	BeesResolveStore(shared_ptr<BeesContext> ctx);
+	bool lookup(uint64_t bytenr, BeesResolveAddrResult &rv);
+	void insert(uint64_t bytenr, bool toxic, uint64_t refs);
+	void save();
+	size_t size() const;
+};
+
+// Files by size and sampled content, so whole files can be matched
+// without going through the hash table one block at a time
+class BeesFileSizeIndex {
+	using Key = pair<off_t, uint64_t>;
+
+	mutable mutex		m_mutex;
+	map<Key, BeesFileId>	m_files;
+	deque<Key>		m_order;
+public:
+	// Returns the file already known with this size and sample,
+	// or remembers fid and returns an empty BeesFileId
+	BeesFileId find_or_insert(off_t size, uint64_t sample, const BeesFileId &fid);
+	void replace(off_t size, uint64_t sample, const BeesFileId &fid);
+	size_t size() const;
+};
+
+// AIMD limit on concurrent MultiLocker holders of one type
+class BeesLockLimit {
+	mutable mutex	m_mutex;
+	const string	m_type;
+	const double	m_target;
+	// 0 until the first sample:  no limit, as when there is no limiter
+	size_t		m_limit = 0;
+	size_t		m_good = 0;
+	size_t		m_since_cut = 0;
+public:
+	BeesLockLimit(const string &type, double target);
+	// Returns > 0 if the limit was raised, < 0 if it was cut
+	int sample(double seconds);
+	size_t limit() const;
+};
+
+// Divides the worker threads between the filesystems of one bees process
+// in proportion to their weights.  Scan Tasks call start() first.  If the
+// filesystem already has its share of the workers while other filesystems
+// have work, start() saves the current Task to run when a worker is free
+// and returns an empty pointer, and the Task returns without doing
+// anything.  Otherwise the worker counts against the filesystem until
+// the returned pointer is released.  With one filesystem, start() never
+// defers.
+class BeesShare : public enable_shared_from_this<BeesShare> {
+	weak_ptr<BeesContext>	m_ctx;
+	const double		m_weight;
+	size_t			m_running = 0;
+	deque<Task>		m_waiting;
+
+	static mutex				s_mutex;
+	static vector<shared_ptr<BeesShare>>	s_shares;
+
+	BeesShare(const shared_ptr<BeesContext> &ctx, double weight);
+	size_t quota_locked() const;
+	void release();
+public:
+	static shared_ptr<BeesShare> make(const shared_ptr<BeesContext> &ctx, double weight);
+	static vector<shared_ptr<BeesShare>> all();
+	shared_ptr<Cleanup> start();
+	shared_ptr<BeesContext> ctx() const { return m_ctx.lock(); }
+	double weight() const { return m_weight; }
+	size_t running() const;
+	size_t waiting() const;
+};
+
+// Memory used by the hash table and caches of all filesystems in the
+// process.  Each consumer reports its bytes, and the caches have a scale
+// applied to their normal sizes.  sample() halves the scale when the total
+// is over the limit, memory PSI is over BEES_MEMORY_PRESSURE_TARGET, or the
+// cgroup is near memory.high, and grows it back slowly otherwise.  Each
+// shrink bumps generation(), so threads release their LOGICAL_INO buffers.
+class BeesMemory {
+public:
+	using BytesFn = function<uint64_t()>;
+	using ScaleFn = function<void(double)>;
+	static void add(const string &name, BytesFn bytes_fn, ScaleFn scale_fn = ScaleFn());
+	static void set_limit(uint64_t bytes);
+	static void logical_ino_resize(size_t old_bytes, size_t new_bytes);
+	static uint64_t generation();
+	static void sample();
+	static void print(ostream &os);
+	static void write_metrics(ostream &os);
+private:
+	struct Consumer {
+		string		m_name;
+		BytesFn		m_bytes_fn;
+		ScaleFn		m_scale_fn;
+		uint64_t	m_bytes = 0;
+	};
+	static mutex			s_mutex;
+	static vector<Consumer>		s_consumers;
+	static uint64_t			s_limit;
+	static uint64_t			s_total;
+	static double			s_scale;
+	static atomic<uint64_t>		s_generation;
+	static atomic<uint64_t>		s_logical_ino_bytes;
+	static string			s_pressure_path;
+	static uint64_t			s_pressure_total;
+	static double			s_pressure;
+	static Timer			s_pressure_timer;
+	static uint64_t			s_cgroup_current;
+	static uint64_t			s_cgroup_high;
+	static map<string, uint64_t> bytes_locked();
+};
+
+// Binary trace of the extents and blocks seen by scan_one_extent and the
+// results of LOGICAL_INO, written to $BEESRECORD and read by bees-replay.
+// Records contain no file names or data, only ids, addresses and hashes.
+class BeesRecorder {
+public:
+	enum Type : uint64_t {
+		REC_EXTENT	= 1,	// offset, addr = bytenr, length and Extent flags of one extent
+		REC_BLOCK	= 2,	// offset, BeesAddress, length, hash and BLOCK_ flags of one block
+		REC_RESOLVE	= 3,	// physical addr, length = ref count, RESOLVE_ flags
+	};
+	enum Flags : uint64_t {
+		BLOCK_ZERO		= 1 << 0,	// block data is all zero
+		BLOCK_CSUM		= 1 << 1,	// hash is a btrfs csum, not a content hash
+		RESOLVE_TOXIC		= 1 << 0,	// LOGICAL_INO was too slow
+		RESOLVE_OVERFLOW	= 1 << 1,	// too many refs, treated as no refs
+	};
+	struct Record {
+		uint64_t	r_type;
+		uint64_t	r_flags;
+		uint64_t	r_root;
+		uint64_t	r_ino;
+		uint64_t	r_offset;
+		uint64_t	r_addr;
+		uint64_t	r_length;
+		uint64_t	r_hash;
+	} __attribute__((packed));
+	struct Header {
+		uint64_t	h_magic;
+		uint32_t	h_version;
+		uint32_t	h_record_size;
+	} __attribute__((packed));
+	static const uint64_t c_magic = 0x3143455253454542ULL;	// "BEESREC1"
+	static const uint32_t c_version = 1;
+
+	BeesRecorder(const string &filename);
+	~BeesRecorder();
+	// All records from one call are written together
+	void write(const vector<Record> &records);
+	void flush();
+private:
+	mutex		m_mutex;
+	Fd		m_fd;
+	string		m_buffer;
+	void flush_locked();
+};
+
+// Reads the records of a BeesRecorder trace in order
+class BeesRecordReader {
+	Fd				m_fd;
+	string				m_filename;
+	vector<BeesRecorder::Record>	m_buffer;
+	size_t				m_pos = 0;
+public:
+	BeesRecordReader(const string &filename);
+	bool next(BeesRecorder::Record &rec);
 };
 
 class BeesContext : public enable_shared_from_this<BeesContext> {
@@ -714,9 +1511,13 @@ class BeesContext : public enable_shared_from_this<BeesContext> {
 	shared_ptr<BeesFdCache>				m_fd_cache;
 	shared_ptr<BeesHashTable>			m_hash_table;
 	shared_ptr<BeesRoots>				m_roots;
+	shared_ptr<BeesResolveStore>			m_resolve_store;
+	shared_ptr<BeesRecorder>			m_recorder;
 	Pool<BeesTempFile>				m_tmpfile_pool;
+	mutex						m_worker_tmpfiles_mutex;
+	map<thread::id, shared_ptr<BeesTempFile>>	m_worker_tmpfiles;
 
-	LRUCache<BeesResolveAddrResult, BeesAddress>	m_resolve_cache;
+	ShardedLRUCache<BeesResolveAddrResult, BeesAddress>	m_resolve_cache;
 
 	string						m_root_path;
 	Fd						m_root_fd;
@@ -736,27 +1537,70 @@ class BeesContext : public enable_shared_from_this<BeesContext> {
 
 	shared_ptr<BeesThread>				m_progress_thread;
 	shared_ptr<BeesThread>				m_status_thread;
+	shared_ptr<BeesThread>				m_metrics_thread;
+	shared_ptr<BeesThread>				m_profile_thread;
+	shared_ptr<BeesThread>				m_memory_thread;
+	shared_ptr<BeesThread>				m_readahead_thread;
+
+	mutex						m_readahead_mutex;
+	condition_variable				m_readahead_condvar;
+	deque<BeesFileRange>				m_readahead_queue;
+
+	bool						m_csum_scan = false;
+	BeesHash::Algorithm				m_hash_algorithm = BeesHash::ALGO_CRC64;
+	off_t						m_hash_table_size = 0;
+	unsigned					m_hash_table_memory = BeesHashTable::MEM_DEFAULT;
+
+	// MultiLocker is process-wide, so every filesystem shares these
+	static BeesLockLimit				s_logical_ino_limit;
+	static BeesLockLimit				s_dedupe_limit;
+
+	double						m_share_weight = 1;
+	shared_ptr<BeesShare>				m_share;
+
+	off_t						m_min_dedupe_size = 0;
+
+	BeesFileSizeIndex				m_file_size_index;
 
 	void set_root_fd(Fd fd);
+	void readahead_loop();
+	void govern_memory();
+	void stop_request_scan();
+	void stop_wait_scan();
 
-	BeesResolveAddrResult resolve_addr_uncached(BeesAddress addr);
+	BeesResolveAddrResult resolve_addr_uncached(BeesAddress addr, uint64_t flags = 0);
+	void record_resolve(BeesAddress addr, size_t refs, bool toxic, bool overflow);
 
+	void sample_dedupe_time(double seconds);
 	BeesFileRange scan_one_extent(const BeesFileRange &bfr, const Extent &e);
-	void rewrite_file_range(const BeesFileRange &bfr);
+	void rewrite_file_range(const BeesFileRange &bfr, const map<off_t, BeesHash> &known_hashes = map<off_t, BeesHash>());
 
 public:
 
 	void set_root_path(string path);
+	map<off_t, BeesHash> get_csum_hashes(const Extent &e, set<off_t> *zero_csums = nullptr);
+	void set_csum_scan(bool csum_scan);
+	void set_hash_algorithm(BeesHash::Algorithm algo);
+	void set_hash_table_size(off_t size);
+	void set_hash_table_memory(unsigned flags);
+	void set_share_weight(double weight);
+	void set_min_dedupe_size(off_t size);
+	off_t min_dedupe_size() const { return m_min_dedupe_size; }
+	unsigned hash_table_memory() const { return m_hash_table_memory; }
+	BeesHash::Algorithm hash_algorithm() const { return m_hash_algorithm; }
 
 	Fd root_fd() const { return m_root_fd; }
 	Fd home_fd();
 	string root_path() const { return m_root_path; }
 
 	bool scan_forward(const BeesFileRange &bfr);
+	void readahead_async(const BeesFileRange &bfr);
 
 	bool is_root_ro(uint64_t root);
 	BeesRangePair dup_extent(const BeesFileRange &src, const shared_ptr<BeesTempFile> &tmpfile);
 	bool dedup(const BeesRangePair &brp);
+	vector<bool> dedup(const vector<BeesRangePair> &brps);
+	bool dedup_whole_file(const BeesFileId &fid);
 
 	void blacklist_insert(const BeesFileId &fid);
 	void blacklist_erase(const BeesFileId &fid);
@@ -765,10 +1609,14 @@ public:
 	shared_ptr<Exclusion> get_inode_mutex(uint64_t inode);
 
 	BeesResolveAddrResult resolve_addr(BeesAddress addr);
+	BeesResolveAddrResult resolve_extent_refs(uint64_t bytenr);
 	void invalidate_addr(BeesAddress addr);
 	void resolve_cache_clear();
 
 	void dump_status();
+	void serve_metrics();
+	void sample_profile();
+	void write_metrics(ostream &os);
 	void show_progress();
 
 	void start();
@@ -778,7 +1626,9 @@ public:
 	shared_ptr<BeesFdCache> fd_cache();
 	shared_ptr<BeesHashTable> hash_table();
 	shared_ptr<BeesRoots> roots();
+	shared_ptr<BeesResolveStore> resolve_store();
 	shared_ptr<BeesTempFile> tmpfile();
+	shared_ptr<BeesShare> share() const { return m_share; }
 
 	const Timer &total_timer() const { return m_total_timer; }
 };
@@ -786,10 +1636,14 @@ public:
 class BeesResolver {
 	shared_ptr<BeesContext>			m_ctx;
 	BeesAddress				m_addr;
-	vector<BtrfsInodeOffsetRoot>		m_biors;
+	BeesInodeOffsetRoots			m_biors;
 	set<BeesFileRange>			m_ranges;
 	size_t					m_bior_count;
 
+	// Files and subvols that could not be opened, so their other refs are skipped
+	set<BeesFileId>				m_no_fd_files;
+	set<uint64_t>				m_no_fd_roots;
+
 	// We found matching data, so we can dedupe
 	bool					m_found_data = false;
 
@@ -809,9 +1663,19 @@ class BeesResolver {
 	bool					m_is_toxic = false;
 
 	BeesFileRange chase_extent_ref(const BtrfsInodeOffsetRoot &bior, BeesBlockData &needle_bbd);
+	bool skip_extent_ref(const BtrfsInodeOffsetRoot &bior);
 	BeesBlockData adjust_offset(const BeesFileRange &haystack, const BeesBlockData &needle);
 	void find_matches(bool just_one, BeesBlockData &bbd);
 
+	// Ranks a grown dedupe candidate by the layout it leaves in dst
+	struct DstScore {
+		bool	m_whole_dst = false;	// every dst extent is replaced whole, none are split
+		off_t	m_size = 0;		// length of the deduped range
+		bool	m_whole_src = false;	// dst gets refs to whole src extents
+		bool operator<(const DstScore &that) const;
+	};
+	DstScore dst_score(const BeesRangePair &brp);
+
 	// FIXME: Do we need these?  We probably always have at least one BBD
 	BeesFileRange chase_extent_ref(const BtrfsInodeOffsetRoot &bior, BeesHash hash);
 	BeesBlockData adjust_offset(const BeesFileRange &haystack, bool inexact, BeesHash needle);
@@ -831,7 +1695,8 @@ public:
 	BeesFileRange find_one_match(BeesBlockData &bbd);
 	BeesFileRange find_one_match(BeesHash hash);
 
-	void replace_src(const BeesFileRange &src_bfr);
+	// With whole_dst_only, skip dst refs the grown range doesn't cover whole
+	void replace_src(const BeesFileRange &src_bfr, bool whole_dst_only = false);
 	BeesFileRange replace_dst(const BeesFileRange &dst_bfr);
 
 	bool found_addr() const { return m_found_addr; }
@@ -845,27 +1710,45 @@ public:
 	bool operator<(const BeesResolver &that) const;
 };
 
-class BeesTooLong : public Timer {
-	using func_type = function<void(ostream &)>;
+/// Warns when a scope takes longer than limit seconds.  The limit is
+/// seconds, so a coarse clock is precise enough and much cheaper.
+class BeesTooLong {
+	using FormatFn = void (*)(const void *, ostream &);
+
+	FormatFn m_fn;
+	const void *m_arg;
 	double m_limit;
-	func_type m_func;
+	uint64_t m_start_ns;
 
+	static uint64_t now_ns();
 public:
-	BeesTooLong(const func_type &func = [](ostream &os) { os << __PRETTY_FUNCTION__; }, double limit = BEES_TOO_LONG);
-	BeesTooLong(const string &s, double limit = BEES_TOO_LONG);
-	BeesTooLong &operator=(const func_type &s);
+	// f must outlive the BeesTooLong, see BEESTOOLONG
+	template <class F> BeesTooLong(const F &f, double limit = BEES_TOO_LONG);
 	~BeesTooLong();
+	double age() const;
 	void check() const;
-
 };
 
+template <class F>
+BeesTooLong::BeesTooLong(const F &f, double limit) :
+	m_fn([](const void *arg, ostream &os) { (*static_cast<const F *>(arg))(os); }),
+	m_arg(&f),
+	m_limit(limit),
+	m_start_ns(now_ns())
+{
+}
+
 // And now, a giant pile of extern declarations
 extern int bees_log_level;
+int bees_main(int argc, char *argv[]);
+void do_cmd_help(char *argv[]);
 extern const char *BEES_USAGE;
 extern const char *BEES_VERSION;
 extern thread_local default_random_engine bees_generator;
 string pretty(double d);
 void bees_readahead(int fd, off_t offset, size_t size);
+// Reads a range with one pread into one buffer, shorter than size at EOF
+ByteVector bees_read_range(int fd, off_t offset, size_t size);
 void bees_unreadahead(int fd, off_t offset, size_t size);
 string format_time(time_t t);
 
@@ -0,0 +1,97 @@
+#include "tests.h"
+#include "crucible/bytevector.h"
+
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace crucible;
+
+static
+void
+test_pool_reuse()
+{
+	// A freed buffer comes back for the next allocation of its size class
+	uint8_t *first = nullptr;
+	{
+		ByteVector bv(64 * 1024);
+		first = bv.data();
+		memset(bv.data(), 0x55, bv.size());
+	}
+	ByteVector bv(60 * 1024);
+	assert(bv.data() == first);
+	assert(bv.size() == 60 * 1024);
+}
+
+static
+void
+test_sizes()
+{
+	for (size_t size : { 1, 100, 2048, 2049, 4096, 4097, 65536, 128 * 1024 + 112, 1024 * 1024, 1024 * 1024 + 1 }) {
+		ByteVector bv(size);
+		assert(bv.size() == size);
+		memset(bv.data(), 0, size);
+		assert(bv.is_zero());
+		bv[size - 1] = 1;
+		assert(!bv.is_zero());
+		const auto view = bv.at(size - 1, 1);
+		assert(view.data() == bv.data() + size - 1);
+	}
+}
+
+static
+void
+test_shared_views()
+{
+	// Views keep the buffer out of the free list until the last one goes
+	ByteVector view;
+	{
+		ByteVector bv(4096);
+		memset(bv.data(), 7, bv.size());
+		view = bv.at(1024, 1024);
+	}
+	ByteVector other(4096);
+	memset(other.data(), 0, other.size());
+	assert(view.size() == 1024);
+	for (size_t i = 0; i < view.size(); ++i) {
+		assert(view[i] == 7);
+	}
+}
+
+static
+void
+test_cross_thread_free()
+{
+	// Buffers allocated in one thread and freed in others
+	std::vector<ByteVector> bvs;
+	for (size_t i = 0; i < 256; ++i) {
+		bvs.push_back(ByteVector(128 * 1024));
+	}
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 4; ++t) {
+		std::vector<ByteVector> mine(bvs.begin() + t * 64, bvs.begin() + (t + 1) * 64);
+		threads.emplace_back([mine]() mutable {
+			mine.clear();
+			for (size_t i = 0; i < 1000; ++i) {
+				ByteVector bv(4096 << (i % 8));
+				bv[0] = i;
+			}
+		});
+	}
+	bvs.clear();
+	for (auto &t : threads) {
+		t.join();
+	}
+}
+
+int
+main(int, char**)
+{
+	RUN_A_TEST(test_pool_reuse());
+	RUN_A_TEST(test_sizes());
+	RUN_A_TEST(test_shared_views());
+	RUN_A_TEST(test_cross_thread_free());
+
+	exit(EXIT_SUCCESS);
+}
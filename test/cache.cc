@@ -0,0 +1,162 @@
+#include "tests.h"
+
+#include "crucible/cache.h"
+#include "crucible/error.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+test_sharded_cache_basic()
+{
+	size_t calls = 0;
+	ShardedLRUCache<uint64_t, uint64_t, uint64_t> cache([&](uint64_t a, uint64_t b) -> uint64_t {
+		++calls;
+		return a * 1000 + b;
+	}, 64, 4);
+
+	THROW_CHECK1(runtime_error, cache(1, 2), cache(1, 2) == 1002);
+	THROW_CHECK1(runtime_error, calls, calls == 1);
+	THROW_CHECK1(runtime_error, cache.size(), cache.size() == 1);
+
+	cache.insert(42, 3, 4);
+	THROW_CHECK1(runtime_error, cache(3, 4), cache(3, 4) == 42);
+	THROW_CHECK1(runtime_error, calls, calls == 1);
+
+	cache.expire(3, 4);
+	THROW_CHECK1(runtime_error, cache(3, 4), cache(3, 4) == 3004);
+	THROW_CHECK1(runtime_error, calls, calls == 2);
+
+	THROW_CHECK1(runtime_error, cache.refresh(1, 2), cache.refresh(1, 2) == 1002);
+	THROW_CHECK1(runtime_error, calls, calls == 3);
+
+	const auto stats = cache.stats();
+	THROW_CHECK1(runtime_error, stats.misses, stats.misses == calls + 1);
+
+	cache.clear();
+	THROW_CHECK1(runtime_error, cache.size(), cache.size() == 0);
+}
+
+static
+void
+test_sharded_cache_eviction()
+{
+	ShardedLRUCache<uint64_t, uint64_t> cache([](uint64_t a) -> uint64_t { return a + 1; }, 64, 4);
+
+	// Keys are multiples of 4096 like the physical addresses bees uses
+	for (uint64_t i = 0; i < 10000; ++i) {
+		THROW_CHECK1(runtime_error, i, cache(i * 4096) == i * 4096 + 1);
+		THROW_CHECK1(runtime_error, cache.size(), cache.size() <= 64);
+	}
+	THROW_CHECK1(runtime_error, cache.stats().evictions, cache.stats().evictions >= 10000 - 64);
+
+	// Surviving entries must still be found after evictions shifted slots around.
+	// Newest first, so at least the last insert is still there.
+	size_t found = 0;
+	for (uint64_t i = 9999; i >= 10000 - 64; --i) {
+		const auto before = cache.stats().misses;
+		const auto rv = cache(i * 4096);
+		THROW_CHECK1(runtime_error, i, rv == i * 4096 + 1);
+		if (cache.stats().misses == before) {
+			++found;
+		}
+	}
+	THROW_CHECK1(runtime_error, found, found > 0);
+
+	// Shrinking evicts down to the new size
+	cache.max_size(8);
+	THROW_CHECK1(runtime_error, cache.size(), cache.size() <= 8);
+}
+
+static
+void
+test_sharded_cache_expire()
+{
+	// One shard with no evictions, so every hit or miss is predictable
+	ShardedLRUCache<uint64_t, uint64_t> cache([](uint64_t a) -> uint64_t { return a; }, 2048, 1);
+	for (uint64_t i = 0; i < 1000; ++i) {
+		cache(i * 4096);
+	}
+	for (uint64_t i = 0; i < 1000; i += 3) {
+		cache.expire(i * 4096);
+	}
+	THROW_CHECK1(runtime_error, cache.size(), cache.size() == 1000 - 334);
+	for (uint64_t i = 0; i < 1000; ++i) {
+		const auto before = cache.stats().misses;
+		cache(i * 4096);
+		const bool missed = cache.stats().misses != before;
+		THROW_CHECK2(runtime_error, i, missed, missed == (i % 3 == 0));
+	}
+	THROW_CHECK1(runtime_error, cache.stats().evictions, cache.stats().evictions == 0);
+}
+
+static
+void
+test_sharded_cache_expire_if()
+{
+	ShardedLRUCache<uint64_t, uint64_t, uint64_t> cache([](uint64_t a, uint64_t b) -> uint64_t { return a + b; }, 4096, 4);
+	for (uint64_t root = 0; root < 4; ++root) {
+		for (uint64_t ino = 0; ino < 500; ++ino) {
+			cache(root, ino * 4096);
+		}
+	}
+	const auto expired = cache.expire_if([](const tuple<uint64_t, uint64_t> &k) {
+		return get<0>(k) == 1 || get<0>(k) == 3;
+	});
+	THROW_CHECK1(runtime_error, expired, expired == 1000);
+	THROW_CHECK1(runtime_error, cache.size(), cache.size() == 1000);
+
+	// Everything left must still be found, and nothing expired may be
+	for (uint64_t root = 0; root < 4; ++root) {
+		for (uint64_t ino = 0; ino < 500; ++ino) {
+			const auto before = cache.stats().misses;
+			cache(root, ino * 4096);
+			const bool missed = cache.stats().misses != before;
+			THROW_CHECK3(runtime_error, root, ino, missed, missed == (root == 1 || root == 3));
+		}
+	}
+}
+
+static
+void
+test_sharded_cache_one_call_per_key()
+{
+	atomic<size_t> calls(0);
+	ShardedLRUCache<uint64_t, uint64_t> cache([&](uint64_t a) -> uint64_t {
+		++calls;
+		this_thread::sleep_for(chrono::milliseconds(10));
+		return a;
+	}, 1024, 4);
+
+	vector<thread> threads;
+	for (size_t t = 0; t < 8; ++t) {
+		threads.push_back(thread([&]() {
+			for (uint64_t i = 0; i < 16; ++i) {
+				THROW_CHECK1(runtime_error, i, cache(i) == i);
+			}
+		}));
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+
+	// The key lock allows only one computation per key
+	THROW_CHECK1(runtime_error, calls, calls == 16);
+}
+
+int
+main(int, char**)
+{
+	RUN_A_TEST(test_sharded_cache_basic());
+	RUN_A_TEST(test_sharded_cache_eviction());
+	RUN_A_TEST(test_sharded_cache_expire());
+	RUN_A_TEST(test_sharded_cache_expire_if());
+	RUN_A_TEST(test_sharded_cache_one_call_per_key());
+
+	exit(EXIT_SUCCESS);
+}
@@ -38,12 +38,42 @@ test_chatter_three()
 	c << "some \\ns";
 }
 
+static
+void
+test_chatter_async()
+{
+	ostringstream oss;
+	Chatter::enable_async(16);
+	size_t logged = 0;
+	for (size_t i = 0; i < 1000; ++i) {
+		Chatter c(LOG_INFO, "tca", oss);
+		c << "async line " << i;
+		++logged;
+	}
+	Chatter::flush_async();
+
+	// Every line was either written or dropped and counted
+	const string out = oss.str();
+	size_t written = 0;
+	for (auto p = out.find("async line "); p != string::npos; p = out.find("async line ", p + 1)) {
+		++written;
+	}
+	assert(written + Chatter::async_dropped() == logged);
+
+	// Errors wait until written, even when the queue is full
+	for (size_t i = 0; i < 100; ++i) {
+		Chatter(LOG_ERR, "tca", oss) << "error line " << i;
+		assert(oss.str().find("error line " + to_string(i)) != string::npos);
+	}
+}
+
 int
 main(int, char**)
 {
 	RUN_A_TEST(test_chatter_one());
 	RUN_A_TEST(test_chatter_two());
 	RUN_A_TEST(test_chatter_three());
+	RUN_A_TEST(test_chatter_async());
 
 	exit(EXIT_SUCCESS);
 }
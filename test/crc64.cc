@@ -2,6 +2,8 @@
 #include "crucible/crc64.h"
 
 #include <cassert>
+#include <cstdlib>
+#include <vector>
 
 using namespace crucible;
 
@@ -17,10 +19,29 @@ test_getcrc64_byte_arrays()
 	assert(Digest::CRC::crc64("\377\277\300\200", 4) == 15615382887346470912ULL);
 }
 
+static
+void
+test_crc64_dispatch_matches_portable()
+{
+	std::vector<unsigned char> buf(8192 + 64);
+	srandom(1);
+	for (auto &c : buf) {
+		c = random();
+	}
+	for (size_t offset = 0; offset < 16; ++offset) {
+		for (size_t len = 0; len + offset <= buf.size(); len += (len < 300 ? 1 : 61)) {
+			assert(Digest::CRC::crc64(buf.data() + offset, len) == Digest::CRC::crc64_portable(buf.data() + offset, len));
+		}
+	}
+	const std::vector<unsigned char> zero(4096);
+	assert(Digest::CRC::crc64(zero.data(), zero.size()) == Digest::CRC::crc64_portable(zero.data(), zero.size()));
+}
+
 int
 main(int, char**)
 {
 	RUN_A_TEST(test_getcrc64_byte_arrays());
+	RUN_A_TEST(test_crc64_dispatch_matches_portable());
 
 	exit(EXIT_SUCCESS);
 }
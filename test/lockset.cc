@@ -0,0 +1,91 @@
+#include "tests.h"
+#include "crucible/lockset.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+test_lockset_keys()
+{
+	// Waiters on other keys are not woken when one key is unlocked
+	LockSet<int> ls;
+	ls.lock(1);
+	ls.lock(2);
+	atomic<int> got(0);
+	thread t1([&]() { ls.lock(1); got |= 1; ls.unlock(1); });
+	thread t2([&]() { ls.lock(2); got |= 2; ls.unlock(2); });
+	while (ls.stats().waits < 2) {
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	ls.unlock(1);
+	t1.join();
+	assert(got == 1);
+	ls.unlock(2);
+	t2.join();
+	assert(got == 3);
+	assert(ls.stats().waits == 2);
+	assert(ls.stats().spurious == 0);
+	assert(ls.empty());
+}
+
+static
+void
+test_lockset_full()
+{
+	// Waiters for a full set are woken by any unlock
+	LockSet<int> ls;
+	ls.max_size(1);
+	ls.lock(1);
+	atomic<bool> got(false);
+	thread t([&]() { ls.lock(2); got = true; ls.unlock(2); });
+	while (!ls.stats().waits) {
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	assert(!got);
+	ls.unlock(1);
+	t.join();
+	assert(got);
+	assert(ls.empty());
+}
+
+static
+void
+test_lockset_threads()
+{
+	LockSet<int> ls;
+	vector<int> counts(4);
+	vector<thread> threads;
+	for (size_t t = 0; t < 8; ++t) {
+		threads.emplace_back([&, t]() {
+			for (size_t i = 0; i < 10000; ++i) {
+				const int k = (i + t) % counts.size();
+				auto lock = ls.make_lock(k);
+				++counts[k];
+			}
+		});
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	for (auto c : counts) {
+		assert(c == 20000);
+	}
+	assert(ls.empty());
+}
+
+int
+main(int, char**)
+{
+	RUN_A_TEST(test_lockset_keys());
+	RUN_A_TEST(test_lockset_full());
+	RUN_A_TEST(test_lockset_threads());
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,78 @@
+#include "tests.h"
+
+#include "crucible/error.h"
+#include "crucible/multilock.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+test_multilock_limit()
+{
+	MultiLocker::set_limit("limited", 2);
+
+	auto a = MultiLocker::get_lock("limited");
+	auto b = MultiLocker::get_lock("limited");
+
+	atomic<bool> got_c(false);
+	thread t([&]() {
+		auto c = MultiLocker::get_lock("limited");
+		got_c = true;
+	});
+
+	// Third holder must wait while the limit is reached
+	this_thread::sleep_for(chrono::milliseconds(100));
+	THROW_CHECK0(runtime_error, !got_c);
+
+	// Releasing one holder lets it through
+	a.reset();
+	t.join();
+	THROW_CHECK0(runtime_error, got_c);
+
+	// Raising the limit wakes up waiters
+	auto d = MultiLocker::get_lock("limited");
+	atomic<bool> got_e(false);
+	thread u([&]() {
+		auto e = MultiLocker::get_lock("limited");
+		got_e = true;
+	});
+	this_thread::sleep_for(chrono::milliseconds(100));
+	THROW_CHECK0(runtime_error, !got_e);
+	MultiLocker::set_limit("limited", 0);
+	u.join();
+	THROW_CHECK0(runtime_error, got_e);
+}
+
+static
+void
+test_multilock_exclusive_types()
+{
+	auto a = MultiLocker::get_lock("first");
+
+	atomic<bool> got_b(false);
+	thread t([&]() {
+		auto b = MultiLocker::get_lock("second");
+		got_b = true;
+	});
+
+	// Different types still exclude each other
+	this_thread::sleep_for(chrono::milliseconds(100));
+	THROW_CHECK0(runtime_error, !got_b);
+	a.reset();
+	t.join();
+	THROW_CHECK0(runtime_error, got_b);
+}
+
+int
+main(int, char**)
+{
+	RUN_A_TEST(test_multilock_limit());
+	RUN_A_TEST(test_multilock_exclusive_types());
+
+	exit(EXIT_SUCCESS);
+}
@@ -3,7 +3,10 @@
 #include "crucible/namedptr.h"
 
 #include <cassert>
+#include <atomic>
 #include <set>
+#include <thread>
+#include <vector>
 
 using namespace crucible;
 
@@ -67,6 +70,38 @@ test_namedptr()
 	d_2_7->check(2, 7);
 }
 
+static
+void
+test_namedptr_threads()
+{
+	// Keys in many shards, each created once while any pointer to it lives
+	NamedPtr<int, uint64_t> names;
+	atomic<size_t> created(0);
+	names.func([&](uint64_t k) -> shared_ptr<int> { ++created; return make_shared<int>(k); });
+	vector<shared_ptr<int>> held;
+	for (uint64_t k = 0; k < 256; ++k) {
+		held.push_back(names(k * 4096));
+	}
+	vector<thread> threads;
+	for (size_t t = 0; t < 8; ++t) {
+		threads.emplace_back([&, t]() {
+			for (size_t i = 0; i < 10000; ++i) {
+				const uint64_t k = (i * 7 + t) % 256;
+				const auto p = names(k * 4096);
+				THROW_CHECK2(runtime_error, *p, k, *p == int(k * 4096));
+				THROW_CHECK0(runtime_error, p == held[k]);
+			}
+		});
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	THROW_CHECK1(runtime_error, created, created == 256);
+	held.clear();
+	names(0);
+	THROW_CHECK1(runtime_error, created, created == 257);
+}
+
 static
 void
 test_leak()
@@ -78,6 +113,7 @@ int
 main(int, char**)
 {
 	RUN_A_TEST(test_namedptr());
+	RUN_A_TEST(test_namedptr_threads());
 	RUN_A_TEST(test_leak());
 
 	exit(EXIT_SUCCESS);
@@ -9,6 +9,9 @@
 #include <stdexcept>
 
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 using namespace crucible;
 using namespace std;
@@ -52,6 +55,83 @@ test_fork_return(int val, int val2)
 	assert(rv_status == val + val2);
 }
 
+static inline
+void
+test_listen_fd()
+{
+	unsetenv("LISTEN_PID");
+	assert(listen_fd("a") == -1);
+	setenv("LISTEN_PID", to_string(getpid()).c_str(), 1);
+	setenv("LISTEN_FDS", "3", 1);
+	setenv("LISTEN_FDNAMES", "a:bb:", 1);
+	assert(listen_fd("a") == 3);
+	assert(listen_fd("bb") == 4);
+	assert(listen_fd("") == 5);
+	assert(listen_fd("c") == -1);
+	setenv("LISTEN_PID", to_string(getpid() + 1).c_str(), 1);
+	assert(listen_fd("a") == -1);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+}
+
+static inline
+void
+test_service_notify()
+{
+	unsetenv("NOTIFY_SOCKET");
+	assert(!service_notify("READY=1"));
+
+	// Abstract socket, so nothing to clean up
+	const string socket_name = "@crucible-test-" + to_string(getpid());
+	const int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	assert(sock >= 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, socket_name.data(), socket_name.size());
+	addr.sun_path[0] = 0;
+	assert(!bind(sock, reinterpret_cast<sockaddr *>(&addr), offsetof(sockaddr_un, sun_path) + socket_name.size()));
+	setenv("NOTIFY_SOCKET", socket_name.c_str(), 1);
+
+	assert(service_notify("FDSTORE=1\nFDNAME=stdin", 0));
+
+	char buf[256];
+	iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	union {
+		cmsghdr	align;
+		char	buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	const ssize_t rv = recvmsg(sock, &msg, 0);
+	assert(rv > 0);
+	assert(string(buf, rv) == "FDSTORE=1\nFDNAME=stdin");
+	cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+	assert(cmsg && cmsg->cmsg_type == SCM_RIGHTS);
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	struct stat st0, st1;
+	assert(!fstat(0, &st0));
+	assert(!fstat(fd, &st1));
+	assert(st0.st_dev == st1.st_dev && st0.st_ino == st1.st_ino);
+	close(fd);
+
+	// No fd attached
+	assert(service_notify("READY=1"));
+	msg.msg_controllen = sizeof(control.buf);
+	assert(recvmsg(sock, &msg, 0) == 7);
+	assert(!CMSG_FIRSTHDR(&msg));
+	close(sock);
+	unsetenv("NOTIFY_SOCKET");
+}
+
 int
 main(int, char**)
 {
@@ -60,6 +140,8 @@ main(int, char**)
 	RUN_A_TEST(test_fork_return(9));
 	RUN_A_TEST(test_fork_return(2, 3));
 	RUN_A_TEST(test_fork_return(7, 9));
+	RUN_A_TEST(test_listen_fd());
+	RUN_A_TEST(test_service_notify());
 
 	exit(EXIT_SUCCESS);
 }
@@ -3,6 +3,8 @@
 #include "crucible/progress.h"
 
 #include <cassert>
+#include <thread>
+#include <vector>
 
 #include <unistd.h>
 
@@ -31,10 +33,62 @@ test_progress()
 	assert(pt.end() == 456);
 }
 
+void
+test_progress_out_of_order()
+{
+	// Holds from concurrent crawls don't arrive in value order
+	ProgressTracker<uint64_t> pt(100);
+	auto hold_500 = pt.hold(500);
+	auto hold_200 = pt.hold(200);
+	auto hold_300 = pt.hold(300);
+	assert(pt.end() == 500);
+	hold_500.reset();
+	assert(pt.begin() == 100);
+	hold_300.reset();
+	assert(pt.begin() == 100);
+	auto hold_250 = pt.hold(250);
+	hold_200.reset();
+	assert(pt.begin() == 200);
+	hold_250.reset();
+	assert(pt.begin() == 500);
+	assert(pt.end() == 500);
+}
+
+void
+test_progress_threads()
+{
+	// Concurrent holds and releases:  begin only moves forward, and
+	// catches up with end when every holder is gone
+	ProgressTracker<uint64_t> pt(0);
+	const size_t thread_count = 8;
+	const uint64_t loops = 10000;
+	vector<thread> threads;
+	for (size_t t = 0; t < thread_count; ++t) {
+		threads.emplace_back([&, t]() {
+			uint64_t last_begin = 0;
+			for (uint64_t i = 1; i <= loops; ++i) {
+				const auto v = i * thread_count + t;
+				auto hold = pt.hold(v);
+				const auto b = pt.begin();
+				assert(b >= last_begin);
+				assert(b <= pt.end());
+				last_begin = b;
+			}
+		});
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	assert(pt.begin() == pt.end());
+	assert(pt.end() == loops * thread_count + thread_count - 1);
+}
+
 int
 main(int, char**)
 {
 	RUN_A_TEST(test_progress());
+	RUN_A_TEST(test_progress_out_of_order());
+	RUN_A_TEST(test_progress_threads());
 
 	exit(EXIT_SUCCESS);
 }